@@ -0,0 +1,707 @@
+/*******************************************************************************
+ *
+ * Created by Daniel Carrasco at https://www.electrosoftcloud.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+#include <algorithm>
+#include <cinttypes>
+#include <filesystem>
+#include "chunk_store.h"
+
+chunk_store::chunk_store(std::string store_path, int32_t comp_level) {
+    path = store_path;
+    compression_level = comp_level;
+}
+
+// Destructor function that will call close()
+chunk_store::~chunk_store(void) {
+    close();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Open the store. If create is true, the store will be created if not exists
+//
+// Returns nonzero on error
+//
+int8_t chunk_store::open(bool create) {
+    std::error_code ec;
+    std::string index_filename = path + "/index.bin";
+
+    if (!std::filesystem::exists(index_filename, ec)) {
+        if (!create) {
+            fprintf(stderr, "The chunk store %s doesn't exists.\n", path.c_str());
+            return CSR_OPEN_ERROR;
+        }
+
+        // Create an empty store
+        std::filesystem::create_directories(path + "/packs", ec);
+        if (ec) {
+            fprintf(stderr, "There was an error creating the chunk store directory.\n");
+            return CSR_OPEN_ERROR;
+        }
+
+        std::vector<chunk_index_entry> entries;
+        if (index_rebuild(CHUNK_STORE_INDEX_SLOTS, entries)) {
+            return CSR_WRITE_ERROR;
+        }
+    }
+    else {
+        // Read the index header
+        index_file.open(index_filename.c_str(), std::ios::in|std::ios::out|std::ios::binary);
+        char magic[4];
+        index_file.read(magic, 4);
+        index_file.read(reinterpret_cast<char*>(&index_capacity), sizeof(index_capacity));
+        index_file.read(reinterpret_cast<char*>(&index_count), sizeof(index_count));
+        if (!index_file.good() || memcmp(magic, "ECMI", 4) || !index_capacity) {
+            fprintf(stderr, "The chunk store index is corrupted.\n");
+            return CSR_CORRUPTED;
+        }
+
+        // Read the bloom filter. If cannot be read, then will be rebuilt using the index
+        std::ifstream bloom_file((path + "/bloom.bin").c_str(), std::ios::binary);
+        uint64_t bloom_size = 0;
+        bloom_file.read(magic, 4);
+        bloom_file.read(reinterpret_cast<char*>(&bloom_size), sizeof(bloom_size));
+        if (bloom_file.good() && !memcmp(magic, "ECMB", 4)) {
+            bloom.resize(bloom_size);
+            bloom_file.read(reinterpret_cast<char*>(bloom.data()), bloom_size);
+        }
+        if (!bloom_file.good() || !bloom_size) {
+            bloom_reset(index_capacity);
+            chunk_index_entry entry;
+            for (uint64_t i = 0; i < index_capacity; i++) {
+                index_file.seekg(CHUNK_STORE_INDEX_HEADER + (i * sizeof(entry)), std::ios_base::beg);
+                index_file.read(reinterpret_cast<char*>(&entry), sizeof(entry));
+                if (entry.used) {
+                    bloom_add(entry.hash);
+                }
+            }
+        }
+    }
+
+    // Look for the last pack, where the new chunks will be appended. The numbering
+    // doesn't start at zero after a garbage collection.
+    std::vector<uint32_t> packs = pack_list();
+    current_pack = packs.empty() ? 0 : packs.back();
+
+    return CSR_OK;
+}
+
+
+int8_t chunk_store::close() {
+    int8_t return_code = CSR_OK;
+
+    if (index_file.is_open()) {
+        return_code = bloom_save();
+        index_file.close();
+    }
+    if (pack_file.is_open()) {
+        pack_file.close();
+    }
+
+    return return_code;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// 128 bits hash of a chunk (CRC64 + FNV-1a 64)
+//
+void chunk_store::hash(uint8_t* out, const uint8_t* data, size_t size) {
+    uint64_t crc = lzma_crc64(data, size, 0);
+    uint64_t fnv = 0xCBF29CE484222325llu;
+    for (size_t i = 0; i < size; i++) {
+        fnv ^= data[i];
+        fnv *= 0x100000001B3llu;
+    }
+
+    memcpy(out, &crc, 8);
+    memcpy(out + 8, &fnv, 8);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Store a chunk if not exists. The ref is filled with the chunk hash and size
+//
+// Returns nonzero on error
+//
+int8_t chunk_store::put(const uint8_t* data, uint32_t size, chunk_ref &ref, bool &new_chunk) {
+    chunk_index_entry entry;
+
+    hash(ref.hash, data, size);
+    ref.size = size;
+    new_chunk = false;
+
+    // The bloom filter says that the chunk is not in the store, so the index lookup is not required
+    if (bloom_check(ref.hash)) {
+        int8_t return_code = index_find(ref.hash, entry);
+        if (return_code == CSR_OK) {
+            return CSR_OK;
+        }
+        else if (return_code != CSR_NOT_FOUND) {
+            return return_code;
+        }
+    }
+
+    // Compress the chunk. If compression doesn't reduce the size, it will be stored as is
+    std::vector<uint8_t> compressed(compressBound(size));
+    uLongf compressed_size = compressed.size();
+    chunk_pack_header header;
+    memcpy(header.hash, ref.hash, 16);
+    header.size = size;
+    if (
+        compression_level &&
+        compress2(compressed.data(), &compressed_size, data, size, compression_level) == Z_OK &&
+        compressed_size < size
+    ) {
+        header.compression = 1;
+        header.stored_size = compressed_size;
+    }
+    else {
+        header.compression = 0;
+        header.stored_size = size;
+    }
+
+    // Open the last pack, or a new one if the current is full
+    if (!pack_file.is_open() && pack_open(current_pack)) {
+        return CSR_OPEN_ERROR;
+    }
+    if (current_pack_size && current_pack_size + sizeof(header) + header.stored_size > CHUNK_STORE_PACK_SIZE) {
+        if (pack_open(current_pack + 1)) {
+            return CSR_OPEN_ERROR;
+        }
+    }
+
+    // Append the chunk to the pack
+    entry.used = 1;
+    memcpy(entry.hash, ref.hash, 16);
+    entry.pack = current_pack;
+    entry.offset = current_pack_size;
+    entry.size = size;
+    entry.stored_size = header.stored_size;
+    entry.compression = header.compression;
+
+    pack_file.seekp(0, std::ios_base::end);
+    pack_file.write(reinterpret_cast<char*>(&header), sizeof(header));
+    pack_file.write(reinterpret_cast<const char*>(header.compression ? compressed.data() : data), header.stored_size);
+    if (!pack_file.good()) {
+        fprintf(stderr, "There was an error writting the chunk store pack.\n");
+        return CSR_WRITE_ERROR;
+    }
+    current_pack_size += sizeof(header) + header.stored_size;
+    stored_bytes += sizeof(header) + header.stored_size;
+
+    new_chunk = true;
+    return index_insert(entry);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Read a chunk from the store. The output buffer must have enought space for
+// the chunk size
+//
+// Returns nonzero on error
+//
+int8_t chunk_store::get(const chunk_ref &ref, uint8_t* out) {
+    chunk_index_entry entry;
+    chunk_pack_header header;
+    std::vector<uint8_t> data;
+
+    int8_t return_code = index_find(ref.hash, entry);
+    if (return_code) {
+        fprintf(stderr, "The required chunk was not found in the store.\n");
+        return return_code;
+    }
+
+    return_code = read_chunk(entry, data, header);
+    if (return_code) {
+        return return_code;
+    }
+
+    if (header.size != ref.size || memcmp(header.hash, ref.hash, 16)) {
+        fprintf(stderr, "The chunk stored in the pack doesn't match the index.\n");
+        return CSR_CORRUPTED;
+    }
+
+    if (header.compression) {
+        uLongf out_size = ref.size;
+        if (uncompress(out, &out_size, data.data(), header.stored_size) != Z_OK || out_size != ref.size) {
+            fprintf(stderr, "There was an error decompressing the chunk data.\n");
+            return CSR_CORRUPTED;
+        }
+    }
+    else {
+        memcpy(out, data.data(), ref.size);
+    }
+
+    return CSR_OK;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Remove all the chunks which are not in the live list. The live chunks are copied
+// to new packs, the index is replaced and only then the old packs are removed.
+//
+// Returns nonzero on error
+//
+int8_t chunk_store::garbage_collect(
+    std::unordered_set<std::string, chunk_hash_key> &live_chunks,
+    uint64_t &removed_chunks,
+    uint64_t &removed_bytes
+) {
+    std::vector<chunk_index_entry> live_entries;
+    chunk_index_entry entry;
+    chunk_pack_header header;
+    std::vector<uint8_t> data;
+    uint32_t old_packs = current_pack;
+    std::error_code ec;
+
+    removed_chunks = 0;
+    removed_bytes = 0;
+
+    // Start the new packs after the current ones
+    if (pack_open(current_pack + 1)) {
+        return CSR_OPEN_ERROR;
+    }
+
+    for (uint64_t i = 0; i < index_capacity; i++) {
+        index_file.seekg(CHUNK_STORE_INDEX_HEADER + (i * sizeof(entry)), std::ios_base::beg);
+        index_file.read(reinterpret_cast<char*>(&entry), sizeof(entry));
+        if (!index_file.good()) {
+            return CSR_READ_ERROR;
+        }
+        if (!entry.used) {
+            continue;
+        }
+
+        if (live_chunks.find(std::string((char *)entry.hash, 16)) == live_chunks.end()) {
+            removed_chunks++;
+            removed_bytes += sizeof(header) + entry.stored_size;
+            continue;
+        }
+
+        // Copy the chunk to the new packs
+        int8_t return_code = read_chunk(entry, data, header);
+        if (return_code) {
+            return return_code;
+        }
+        if (current_pack_size + sizeof(header) + header.stored_size > CHUNK_STORE_PACK_SIZE) {
+            if (pack_open(current_pack + 1)) {
+                return CSR_OPEN_ERROR;
+            }
+        }
+        entry.pack = current_pack;
+        entry.offset = current_pack_size;
+        pack_file.seekp(0, std::ios_base::end);
+        pack_file.write(reinterpret_cast<char*>(&header), sizeof(header));
+        pack_file.write(reinterpret_cast<char*>(data.data()), header.stored_size);
+        if (!pack_file.good()) {
+            return CSR_WRITE_ERROR;
+        }
+        current_pack_size += sizeof(header) + header.stored_size;
+        live_entries.push_back(entry);
+    }
+    pack_file.flush();
+
+    // Commit the new index before remove the old packs. The index is replaced
+    // atomically, so a crash before this point keeps the old packs and index, and
+    // a crash after it only leaves some stale packs which will be removed later.
+    uint64_t capacity = CHUNK_STORE_INDEX_SLOTS;
+    while (live_entries.size() > capacity * CHUNK_STORE_INDEX_MAX_LOAD) {
+        capacity *= 2;
+    }
+    if (index_rebuild(capacity, live_entries)) {
+        return CSR_WRITE_ERROR;
+    }
+
+    // Remove the old packs, including the ones left by an interrupted collection.
+    // The new packs keep their numbers.
+    std::vector<uint32_t> packs = pack_list();
+    for (uint32_t i = 0; i < packs.size() && packs[i] <= old_packs; i++) {
+        std::filesystem::remove(pack_filename(packs[i]), ec);
+        if (ec) {
+            fprintf(stderr, "There was an error removing the chunk store pack %u.\n", packs[i]);
+            return CSR_WRITE_ERROR;
+        }
+    }
+
+    return CSR_OK;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Offline integrity check. All the chunks in the index are readed and their
+// hash is compared with the stored one.
+//
+// Returns nonzero on error
+//
+int8_t chunk_store::check(uint64_t &checked_chunks, uint64_t &wrong_chunks) {
+    chunk_index_entry entry;
+    chunk_pack_header header;
+    std::vector<uint8_t> data;
+    std::vector<uint8_t> uncompressed;
+    uint8_t computed_hash[16];
+
+    checked_chunks = 0;
+    wrong_chunks = 0;
+
+    for (uint64_t i = 0; i < index_capacity; i++) {
+        index_file.seekg(CHUNK_STORE_INDEX_HEADER + (i * sizeof(entry)), std::ios_base::beg);
+        index_file.read(reinterpret_cast<char*>(&entry), sizeof(entry));
+        if (!index_file.good()) {
+            return CSR_READ_ERROR;
+        }
+        if (!entry.used) {
+            continue;
+        }
+        checked_chunks++;
+
+        // The bloom filter must contain all the indexed chunks
+        bool correct = bloom_check(entry.hash);
+
+        if (correct && read_chunk(entry, data, header) == CSR_OK) {
+            uncompressed.resize(header.size);
+            uLongf out_size = header.size;
+            if (header.compression) {
+                correct = uncompress(uncompressed.data(), &out_size, data.data(), header.stored_size) == Z_OK && out_size == header.size;
+            }
+            else {
+                memcpy(uncompressed.data(), data.data(), header.size);
+            }
+
+            if (correct) {
+                hash(computed_hash, uncompressed.data(), header.size);
+                correct = !memcmp(computed_hash, entry.hash, 16) && !memcmp(header.hash, entry.hash, 16);
+            }
+        }
+        else {
+            correct = false;
+        }
+
+        if (!correct) {
+            wrong_chunks++;
+            fprintf(stderr, "Wrong chunk in pack %u at offset %" PRIu64 "\n", entry.pack, entry.offset);
+        }
+    }
+
+    return CSR_OK;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Index management
+//
+int8_t chunk_store::index_find(const uint8_t* hash, chunk_index_entry &entry) {
+    uint64_t slot;
+    memcpy(&slot, hash, sizeof(slot));
+    slot %= index_capacity;
+
+    // Linear probing until an empty slot is found
+    for (uint64_t i = 0; i < index_capacity; i++) {
+        index_file.seekg(CHUNK_STORE_INDEX_HEADER + (((slot + i) % index_capacity) * sizeof(entry)), std::ios_base::beg);
+        index_file.read(reinterpret_cast<char*>(&entry), sizeof(entry));
+        if (!index_file.good()) {
+            return CSR_READ_ERROR;
+        }
+        if (!entry.used) {
+            return CSR_NOT_FOUND;
+        }
+        if (!memcmp(entry.hash, hash, 16)) {
+            return CSR_OK;
+        }
+    }
+
+    return CSR_NOT_FOUND;
+}
+
+
+int8_t chunk_store::index_insert(chunk_index_entry &entry) {
+    // Grow the index if is too full
+    if (index_count + 1 > index_capacity * CHUNK_STORE_INDEX_MAX_LOAD) {
+        std::vector<chunk_index_entry> entries;
+        chunk_index_entry current;
+        for (uint64_t i = 0; i < index_capacity; i++) {
+            index_file.seekg(CHUNK_STORE_INDEX_HEADER + (i * sizeof(current)), std::ios_base::beg);
+            index_file.read(reinterpret_cast<char*>(&current), sizeof(current));
+            if (current.used) {
+                entries.push_back(current);
+            }
+        }
+        if (index_rebuild(index_capacity * 2, entries)) {
+            return CSR_WRITE_ERROR;
+        }
+    }
+
+    uint64_t slot;
+    chunk_index_entry current;
+    memcpy(&slot, entry.hash, sizeof(slot));
+    slot %= index_capacity;
+
+    for (uint64_t i = 0; i < index_capacity; i++) {
+        uint64_t position = CHUNK_STORE_INDEX_HEADER + (((slot + i) % index_capacity) * sizeof(current));
+        index_file.seekg(position, std::ios_base::beg);
+        index_file.read(reinterpret_cast<char*>(&current), sizeof(current));
+        if (!current.used) {
+            index_file.seekp(position, std::ios_base::beg);
+            index_file.write(reinterpret_cast<char*>(&entry), sizeof(entry));
+            index_count++;
+            bloom_add(entry.hash);
+            return index_write_header();
+        }
+    }
+
+    return CSR_WRITE_ERROR;
+}
+
+
+// Write a new index file with the provided entries. The bloom filter is also rebuilt
+int8_t chunk_store::index_rebuild(uint64_t capacity, std::vector<chunk_index_entry> &entries) {
+    std::string index_filename = path + "/index.bin";
+    std::string tmp_filename = path + "/index.tmp";
+    std::error_code ec;
+
+    std::vector<chunk_index_entry> slots(capacity);
+    bloom_reset(capacity);
+    for (uint64_t i = 0; i < entries.size(); i++) {
+        uint64_t slot;
+        memcpy(&slot, entries[i].hash, sizeof(slot));
+        slot %= capacity;
+        while (slots[slot].used) {
+            slot = (slot + 1) % capacity;
+        }
+        slots[slot] = entries[i];
+        bloom_add(entries[i].hash);
+    }
+
+    {
+        std::ofstream tmp_file(tmp_filename.c_str(), std::ios::out|std::ios::trunc|std::ios::binary);
+        uint64_t count = entries.size();
+        tmp_file.write("ECMI", 4);
+        tmp_file.write(reinterpret_cast<char*>(&capacity), sizeof(capacity));
+        tmp_file.write(reinterpret_cast<char*>(&count), sizeof(count));
+        tmp_file.write(reinterpret_cast<char*>(slots.data()), capacity * sizeof(chunk_index_entry));
+        if (!tmp_file.good()) {
+            fprintf(stderr, "There was an error writting the chunk store index.\n");
+            return CSR_WRITE_ERROR;
+        }
+    }
+
+    if (index_file.is_open()) {
+        index_file.close();
+    }
+    std::filesystem::rename(tmp_filename, index_filename, ec);
+    if (ec) {
+        fprintf(stderr, "There was an error replacing the chunk store index.\n");
+        return CSR_WRITE_ERROR;
+    }
+
+    index_file.open(index_filename.c_str(), std::ios::in|std::ios::out|std::ios::binary);
+    index_capacity = capacity;
+    index_count = entries.size();
+
+    return bloom_save();
+}
+
+
+int8_t chunk_store::index_write_header() {
+    index_file.seekp(4, std::ios_base::beg);
+    index_file.write(reinterpret_cast<char*>(&index_capacity), sizeof(index_capacity));
+    index_file.write(reinterpret_cast<char*>(&index_count), sizeof(index_count));
+
+    return index_file.good() ? CSR_OK : CSR_WRITE_ERROR;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Bloom filter management. The hashes are derived from the chunk hash using
+// double hashing.
+//
+void chunk_store::bloom_add(const uint8_t* hash) {
+    uint64_t h1, h2;
+    uint64_t bits = bloom.size() * 8;
+    memcpy(&h1, hash, 8);
+    memcpy(&h2, hash + 8, 8);
+
+    for (uint8_t i = 0; i < CHUNK_STORE_BLOOM_HASHES; i++) {
+        uint64_t bit = (h1 + i * h2) % bits;
+        bloom[bit >> 3] |= 1 << (bit & 7);
+    }
+    bloom_changed = true;
+}
+
+
+bool chunk_store::bloom_check(const uint8_t* hash) {
+    uint64_t h1, h2;
+    uint64_t bits = bloom.size() * 8;
+    memcpy(&h1, hash, 8);
+    memcpy(&h2, hash + 8, 8);
+
+    for (uint8_t i = 0; i < CHUNK_STORE_BLOOM_HASHES; i++) {
+        uint64_t bit = (h1 + i * h2) % bits;
+        if (!(bloom[bit >> 3] & (1 << (bit & 7)))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+void chunk_store::bloom_reset(uint64_t slots) {
+    bloom.assign(((slots * CHUNK_STORE_BLOOM_BITS) + 7) / 8, 0);
+    bloom_changed = true;
+}
+
+
+int8_t chunk_store::bloom_save() {
+    if (!bloom_changed) {
+        return CSR_OK;
+    }
+
+    std::ofstream bloom_file((path + "/bloom.bin").c_str(), std::ios::out|std::ios::trunc|std::ios::binary);
+    uint64_t bloom_size = bloom.size();
+    bloom_file.write("ECMB", 4);
+    bloom_file.write(reinterpret_cast<char*>(&bloom_size), sizeof(bloom_size));
+    bloom_file.write(reinterpret_cast<char*>(bloom.data()), bloom_size);
+    if (!bloom_file.good()) {
+        fprintf(stderr, "There was an error writting the chunk store bloom filter.\n");
+        return CSR_WRITE_ERROR;
+    }
+    bloom_changed = false;
+
+    return CSR_OK;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Packs management
+//
+std::string chunk_store::pack_filename(uint32_t pack) {
+    char filename[32];
+    snprintf(filename, sizeof(filename), "/packs/pack_%06u.bin", pack);
+    return path + filename;
+}
+
+
+std::vector<uint32_t> chunk_store::pack_list() {
+    std::vector<uint32_t> packs;
+    std::error_code ec;
+
+    for (const auto &file : std::filesystem::directory_iterator(path + "/packs", ec)) {
+        uint32_t pack;
+        char tail;
+        if (sscanf(file.path().filename().string().c_str(), "pack_%6u.bi%c", &pack, &tail) == 2 && tail == 'n') {
+            packs.push_back(pack);
+        }
+    }
+    std::sort(packs.begin(), packs.end());
+
+    return packs;
+}
+
+
+int8_t chunk_store::pack_open(uint32_t pack) {
+    if (pack_file.is_open()) {
+        pack_file.close();
+    }
+
+    std::string filename = pack_filename(pack);
+    // Create the file if not exists
+    {
+        std::ofstream create_file(filename.c_str(), std::ios::out|std::ios::app|std::ios::binary);
+    }
+    pack_file.open(filename.c_str(), std::ios::in|std::ios::out|std::ios::binary);
+    if (!pack_file.good()) {
+        fprintf(stderr, "There was an error opening the chunk store pack %s.\n", filename.c_str());
+        return CSR_OPEN_ERROR;
+    }
+    pack_file.seekp(0, std::ios_base::end);
+    current_pack = pack;
+    current_pack_size = pack_file.tellp();
+
+    return CSR_OK;
+}
+
+
+int8_t chunk_store::read_chunk(chunk_index_entry &entry, std::vector<uint8_t> &data, chunk_pack_header &header) {
+    // The chunk can be in the current pack
+    std::fstream other_pack;
+    std::fstream *source = &pack_file;
+    if (!pack_file.is_open() || entry.pack != current_pack) {
+        other_pack.open(pack_filename(entry.pack).c_str(), std::ios::in|std::ios::binary);
+        source = &other_pack;
+    }
+    else {
+        pack_file.flush();
+    }
+
+    source->seekg(entry.offset, std::ios_base::beg);
+    source->read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!source->good() || header.stored_size != entry.stored_size) {
+        return CSR_READ_ERROR;
+    }
+    data.resize(header.stored_size);
+    source->read(reinterpret_cast<char*>(data.data()), header.stored_size);
+
+    return source->good() ? CSR_OK : CSR_READ_ERROR;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// chunk_reader
+//
+chunk_reader::chunk_reader(chunk_store *chunks_store, std::vector<chunk_ref> &refs) : chunks(refs) {
+    store = chunks_store;
+}
+
+
+int8_t chunk_reader::read(uint8_t* out, size_t size) {
+    while (size) {
+        // Read the next chunk if there is no data left in the buffer
+        if (buffer_position == buffer.size()) {
+            if (current_chunk >= chunks.size()) {
+                fprintf(stderr, "There are no more chunks in the manifest.\n");
+                return CSR_NOT_FOUND;
+            }
+            buffer.resize(chunks[current_chunk].size);
+            int8_t return_code = store->get(chunks[current_chunk], buffer.data());
+            if (return_code) {
+                return return_code;
+            }
+            buffer_position = 0;
+            current_chunk++;
+        }
+
+        size_t to_copy = std::min(size, buffer.size() - buffer_position);
+        memcpy(out, buffer.data() + buffer_position, to_copy);
+        buffer_position += to_copy;
+        out += to_copy;
+        size -= to_copy;
+    }
+
+    return CSR_OK;
+}
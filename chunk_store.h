@@ -0,0 +1,173 @@
+/*******************************************************************************
+ *
+ * Created by Daniel Carrasco at https://www.electrosoftcloud.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+
+//////////////////////////////////////////////////////////////////
+//
+// Chunk store class
+//
+// Content addressed storage shared by several ECM files. The cleaned
+// sectors data is splitted in chunks which are stored only once in the
+// store, and the ECM files just keep the list of chunks (manifest).
+//
+// Store directory layout:
+//   * packs/pack_XXXXXX.bin: Append only files with the chunks data.
+//                            Every chunk has a little header, so the packs
+//                            can be checked without the index.
+//   * index.bin: On disk hash table (open addressing) with the chunks location.
+//   * bloom.bin: Bloom filter used in front of the index to avoid disk
+//                lookups of the new chunks.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <unordered_set>
+#include "zlib.h"
+#include "lzma.h"
+
+// Chunks are stored in packs up to this size
+#define CHUNK_STORE_PACK_SIZE 0x40000000llu
+// Index header size (magic, capacity and count), initial slots and max load before grow it
+#define CHUNK_STORE_INDEX_HEADER 20
+#define CHUNK_STORE_INDEX_SLOTS 65536
+#define CHUNK_STORE_INDEX_MAX_LOAD 0.7
+// Bloom filter bits per index slot and number of hashes
+#define CHUNK_STORE_BLOOM_BITS 10
+#define CHUNK_STORE_BLOOM_HASHES 7
+
+//
+// Return codes of the class methods
+//
+enum chunk_store_returns : int8_t {
+    CSR_OK = 0,
+    CSR_OPEN_ERROR = -1,
+    CSR_READ_ERROR = -2,
+    CSR_WRITE_ERROR = -3,
+    CSR_NOT_FOUND = -4,
+    CSR_CORRUPTED = -5
+};
+
+#pragma pack(push, 1)
+// Chunk reference stored in the ECM files
+struct chunk_ref {
+    uint8_t hash[16];
+    uint32_t size;
+};
+
+// Index slot
+struct chunk_index_entry {
+    uint8_t used = 0;
+    uint8_t hash[16] = {};
+    uint32_t pack = 0;
+    uint64_t offset = 0;
+    uint32_t size = 0;
+    uint32_t stored_size = 0;
+    uint8_t compression = 0;
+};
+
+// Header of every chunk inside the packs
+struct chunk_pack_header {
+    uint8_t hash[16];
+    uint32_t size;
+    uint32_t stored_size;
+    uint8_t compression;
+};
+#pragma pack(pop)
+
+// Hash functor to use the chunks hashes in the std containers
+struct chunk_hash_key {
+    size_t operator()(const std::string &key) const {
+        size_t value;
+        memcpy(&value, key.data(), sizeof(value));
+        return value;
+    }
+};
+
+//
+// chunk_store Class
+//
+class chunk_store {
+    public:
+        // Public methods
+        chunk_store(std::string store_path, int32_t comp_level = 6);
+        ~chunk_store(void);
+
+        int8_t open(bool create);
+        int8_t close();
+        static void hash(uint8_t* out, const uint8_t* data, size_t size);
+        int8_t put(const uint8_t* data, uint32_t size, chunk_ref &ref, bool &new_chunk);
+        int8_t get(const chunk_ref &ref, uint8_t* out);
+        int8_t garbage_collect(
+            std::unordered_set<std::string, chunk_hash_key> &live_chunks,
+            uint64_t &removed_chunks,
+            uint64_t &removed_bytes
+        );
+        int8_t check(uint64_t &checked_chunks, uint64_t &wrong_chunks);
+
+        // Public attributes
+        uint64_t stored_bytes = 0;
+
+    private:
+        // Private methods
+        int8_t index_find(const uint8_t* hash, chunk_index_entry &entry);
+        int8_t index_insert(chunk_index_entry &entry);
+        int8_t index_rebuild(uint64_t capacity, std::vector<chunk_index_entry> &entries);
+        int8_t index_write_header();
+        void bloom_add(const uint8_t* hash);
+        bool bloom_check(const uint8_t* hash);
+        void bloom_reset(uint64_t slots);
+        int8_t bloom_save();
+        std::string pack_filename(uint32_t pack);
+        std::vector<uint32_t> pack_list();
+        int8_t pack_open(uint32_t pack);
+        int8_t read_chunk(chunk_index_entry &entry, std::vector<uint8_t> &data, chunk_pack_header &header);
+
+        // Private attributes
+        std::string path;
+        int32_t compression_level;
+        std::fstream index_file;
+        uint64_t index_capacity = 0;
+        uint64_t index_count = 0;
+        std::vector<uint8_t> bloom;
+        bool bloom_changed = false;
+        std::fstream pack_file;
+        uint32_t current_pack = 0;
+        uint64_t current_pack_size = 0;
+};
+
+//
+// chunk_reader Class
+//
+// Helper to read the data of a list of chunks as an unique stream
+//
+class chunk_reader {
+    public:
+        chunk_reader(chunk_store *store, std::vector<chunk_ref> &refs);
+        int8_t read(uint8_t* out, size_t size);
+
+    private:
+        chunk_store *store;
+        std::vector<chunk_ref> &chunks;
+        std::vector<uint8_t> buffer;
+        size_t buffer_position = 0;
+        size_t current_chunk = 0;
+};
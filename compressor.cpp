@@ -18,22 +18,100 @@
  ******************************************************************************/
 
 #include <stdexcept>
+#include <chrono>
+#include <cstddef>
+#include <stdlib.h>
+#include <string.h>
 #include "compressor.h"
 
-compressor::compressor(sector_tools_compression mode, bool is_compression, int32_t comp_level) {
+compressor::compressor(
+    sector_tools_compression mode,
+    bool is_compression,
+    int32_t comp_level,
+    uint8_t *dictionary,
+    size_t dictionary_size,
+    uint32_t threads
+) {
     comp_mode = mode;
     compression = is_compression;
     compression_level = comp_level;
+    threads_count = threads ? threads : 1;
+    dict = dictionary_size ? dictionary : NULL;
+    dict_size = dict ? dictionary_size : 0;
+    // The lzma stream must be initialized only once, so the encoder memory is reused on reset
+    strm_lzma = LZMA_STREAM_INIT;
+    init();
+}
+
+
+/**
+ * @brief Valid zstd level from the compressor level, without the extreme flag
+ */
+static int zstd_level(int32_t compression_level) {
+    int level = compression_level & ~COMPRESSOR_ZSTD_EXTREME;
+    if (level < 1) {
+        level = 1;
+    }
+    else if (level > ZSTD_maxCLevel()) {
+        level = ZSTD_maxCLevel();
+    }
+
+    return level;
+}
+
+
+/**
+ * @brief zlib allocator which counts the memory used by the codec context. The allocation size is stored
+ *        before the returned block, because zlib doesn't provide it on free.
+ */
+static voidpf zlib_counting_alloc(voidpf opaque, uInt items, uInt size) {
+    size_t bytes = (size_t)items * size;
+    uint8_t *block = (uint8_t *)malloc(sizeof(std::max_align_t) + bytes);
+    if (block == NULL) {
+        return Z_NULL;
+    }
+    memcpy(block, &bytes, sizeof(bytes));
+    *(size_t *)opaque += bytes;
+
+    return block + sizeof(std::max_align_t);
+}
+
+static void zlib_counting_free(voidpf opaque, voidpf address) {
+    uint8_t *block = (uint8_t *)address - sizeof(std::max_align_t);
+    size_t bytes;
+    memcpy(&bytes, block, sizeof(bytes));
+    *(size_t *)opaque -= bytes;
+    free(block);
+}
+
+
+/**
+ * @brief Initialize the codec context. Used by the constructor and to reinitialize the codecs
+ *        which can reuse their memory this way.
+ */
+void compressor::init() {
     int ret;
     // Class initialzer
-    switch(mode) {
+    switch(comp_mode) {
     case C_ZLIB:
-        strm_zlib.zalloc = Z_NULL;
-        strm_zlib.zfree = Z_NULL;
-        strm_zlib.opaque = Z_NULL;
-
-        if (is_compression) {
-            ret = deflateInit(&strm_zlib, comp_level);
+        strm_zlib.zalloc = zlib_counting_alloc;
+        strm_zlib.zfree = zlib_counting_free;
+        strm_zlib.opaque = &zlib_memory;
+
+        if (dict) {
+            // The raw deflate format allows to set the dictionary again on every seekable block
+            if (compression) {
+                ret = deflateInit2(&strm_zlib, compression_level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+            }
+            else {
+                ret = inflateInit2(&strm_zlib, -MAX_WBITS);
+            }
+            if (ret == Z_OK) {
+                ret = reset_dictionary();
+            }
+        }
+        else if (compression) {
+            ret = deflateInit(&strm_zlib, compression_level);
         }
         else {
             ret = inflateInit(&strm_zlib);
@@ -47,17 +125,44 @@ compressor::compressor(sector_tools_compression mode, bool is_compression, int32
         break;
 
     case C_LZMA:
-        strm_lzma = LZMA_STREAM_INIT;
-
-        if (is_compression) {
-            lzma_lzma_preset(&opt_lzma2, comp_level);
+        if (compression) {
+            lzma_lzma_preset(&opt_lzma2, compression_level);
 
+            // The branch filters are applied before the compression only to the executables streams
             lzma_filter filters[] = {
-                { LZMA_FILTER_X86, NULL },
                 { LZMA_FILTER_LZMA2, &opt_lzma2 },
                 { LZMA_VLI_UNKNOWN, NULL },
             };
-            ret = lzma_stream_encoder(&strm_lzma, filters, LZMA_CHECK_NONE); // CRC is already checked
+
+            if (threads_count > 1) {
+                // The data is splitted in blocks which are compressed in parallel. The default block size is
+                // bigger than a seekable block, and the seekable flushes are barriers which cut the blocks
+                // without stop the threads, so every seekable block is still an independent lzma block.
+                lzma_mt mt = {};
+                mt.filters = filters;
+                mt.check = LZMA_CHECK_NONE; // CRC is already checked
+                mt.threads = threads_count;
+                // Reduce the threads if the memory usage is too high (every thread has its own dictionary)
+                while (mt.threads > 1 && lzma_stream_encoder_mt_memusage(&mt) > lzma_physmem() / 2) {
+                    mt.threads--;
+                }
+                threads_count = mt.threads;
+                lzma_encoder_memory = lzma_stream_encoder_mt_memusage(&mt);
+                ret = lzma_stream_encoder_mt(&strm_lzma, &mt);
+            }
+            else {
+                lzma_encoder_memory = lzma_raw_encoder_memusage(filters);
+                ret = lzma_stream_encoder(&strm_lzma, filters, LZMA_CHECK_NONE); // CRC is already checked
+            }
+        }
+        else if (threads_count > 1) {
+            // The blocks created by the multithreaded encoder can be decompressed in parallel too
+            lzma_mt mt = {};
+            mt.flags = LZMA_IGNORE_CHECK;
+            mt.threads = threads_count;
+            mt.memlimit_threading = lzma_physmem() / 4;
+            mt.memlimit_stop = UINT64_MAX;
+            ret = lzma_stream_decoder_mt(&strm_lzma, &mt);
         }
         else {
             ret = lzma_stream_decoder(
@@ -76,9 +181,9 @@ compressor::compressor(sector_tools_compression mode, bool is_compression, int32
         break;
 
     case C_LZ4:
-        if (is_compression) {
+        if (compression) {
             // We will create blocks of 1Mb and data will not be splitted between blocks.
-            strm_lz4 = new lzlib4((size_t)1048576, LZLIB4_INPUT_NOSPLIT, (int8_t)(1.34 * comp_level));
+            strm_lz4 = new lzlib4((size_t)1048576, LZLIB4_INPUT_NOSPLIT, (int8_t)(1.34 * compression_level));
         }
         else {
             strm_lz4 = new lzlib4();
@@ -86,14 +191,56 @@ compressor::compressor(sector_tools_compression mode, bool is_compression, int32
         break;
 
     case C_FLAC:
-        if (is_compression) {
+        if (compression) {
             // We will create blocks of 1Mb and data will not be splitted between blocks.
-            strm_flac = new flaczlib(true, 2, 16, 44100, 0, comp_level);
+            strm_flac = new flaczlib(true, 2, 16, 44100, 0, compression_level);
         }
         else {
             strm_flac = new flaczlib(false);
         }
         break;
+
+    case C_ZSTD:
+        if (compression) {
+            strm_zstd_c = ZSTD_createCCtx();
+            if (!strm_zstd_c) {
+                fprintf(stderr, "There was an error initializing the ZSTD encoder\n");
+                break;
+            }
+
+            ZSTD_CCtx_setParameter(strm_zstd_c, ZSTD_c_compressionLevel, zstd_level(compression_level));
+            // The long distance matching finds the repeated data in big streams
+            ZSTD_CCtx_setParameter(strm_zstd_c, ZSTD_c_enableLongDistanceMatching, 1);
+            ZSTD_CCtx_setParameter(
+                strm_zstd_c,
+                ZSTD_c_windowLog,
+                (compression_level & COMPRESSOR_ZSTD_EXTREME) ? COMPRESSOR_ZSTD_EXTREME_WINDOW_LOG : COMPRESSOR_ZSTD_WINDOW_LOG
+            );
+            // CRC is already checked
+            ZSTD_CCtx_setParameter(strm_zstd_c, ZSTD_c_checksumFlag, 0);
+            // The dictionary is used in every frame, so the seekable blocks keep it
+            if (dict && ZSTD_isError(ZSTD_CCtx_loadDictionary(strm_zstd_c, dict, dict_size))) {
+                fprintf(stderr, "There was an error loading the ZSTD dictionary\n");
+            }
+            // Multithreaded compression. Will fail if the library was built without threads support,
+            // and then the compression is done in the current thread.
+            if (threads_count > 1) {
+                zstd_workers = !ZSTD_isError(ZSTD_CCtx_setParameter(strm_zstd_c, ZSTD_c_nbWorkers, threads_count));
+            }
+        }
+        else {
+            strm_zstd_d = ZSTD_createDCtx();
+            if (!strm_zstd_d) {
+                fprintf(stderr, "There was an error initializing the ZSTD decoder\n");
+                break;
+            }
+            // Allow the big windows used in the extreme mode
+            ZSTD_DCtx_setParameter(strm_zstd_d, ZSTD_d_windowLogMax, COMPRESSOR_ZSTD_MAX_WINDOW_LOG);
+            if (dict && ZSTD_isError(ZSTD_DCtx_loadDictionary(strm_zstd_d, dict, dict_size))) {
+                fprintf(stderr, "There was an error loading the ZSTD dictionary\n");
+            }
+        }
+        break;
     }
 }
 
@@ -131,6 +278,12 @@ int8_t compressor::set_input(uint8_t* in, size_t &in_size){
             strm_flac->strm->avail_in = in_size;
             strm_flac->strm->next_in = in;
 
+            return 0;
+            break;
+
+        case C_ZSTD:
+            zstd_in = {in, in_size, 0};
+
             return 0;
             break;
         }
@@ -172,6 +325,12 @@ int8_t compressor::set_output(uint8_t* out, size_t &out_size){
             strm_flac->strm->avail_out = out_size;
             strm_flac->strm->next_out = out;
 
+            return 0;
+            break;
+
+        case C_ZSTD:
+            zstd_out = {out, out_size, 0};
+
             return 0;
             break;
         }
@@ -213,12 +372,16 @@ int8_t compressor::compress(size_t &out_size, uint8_t* in, size_t in_size, uint8
             break;
 
         case C_LZMA:
-            strm_lzma.avail_in = in_size;
-            strm_lzma.next_in = in;
+            // A NULL input continues with the pending input data
+            if (in) {
+                strm_lzma.avail_in = in_size;
+                strm_lzma.next_in = in;
+            }
 
             switch (flush_mode) {
                 case Z_FULL_FLUSH:
-                    flushmode_lzma = LZMA_FULL_FLUSH;
+                    // The barrier finish the block but doesn't wait for the other threads
+                    flushmode_lzma = threads_count > 1 ? LZMA_FULL_BARRIER : LZMA_FULL_FLUSH;
                     break;
 
                 case Z_FINISH:
@@ -226,7 +389,16 @@ int8_t compressor::compress(size_t &out_size, uint8_t* in, size_t in_size, uint8
                     break;
             }
 
-            return_code = lzma_code(&strm_lzma, flushmode_lzma);
+            // The multithreaded encoder can keep the data in its threads, so the flushes are
+            // repeated until they are completed or the output buffer is full
+            do {
+                return_code = lzma_code(&strm_lzma, flushmode_lzma);
+            } while (
+                return_code == LZMA_OK &&
+                (strm_lzma.avail_in || flushmode_lzma != LZMA_RUN) &&
+                strm_lzma.avail_out
+            );
+            lzma_pending = return_code == LZMA_OK && (strm_lzma.avail_in || flushmode_lzma != LZMA_RUN);
             
             // If is the end of the stream, then is OK
             if (return_code == LZMA_STREAM_END) {
@@ -259,6 +431,44 @@ int8_t compressor::compress(size_t &out_size, uint8_t* in, size_t in_size, uint8
 
             out_size = strm_flac->strm->avail_out;
             break;
+
+        case C_ZSTD:
+            {
+                // Every full flush ends the frame, so the seekable blocks are independent frames
+                ZSTD_EndDirective flushmode_zstd = ZSTD_e_continue;
+                if (flush_mode == Z_FULL_FLUSH || flush_mode == Z_FINISH) {
+                    flushmode_zstd = ZSTD_e_end;
+                }
+                else if (flush_mode == Z_SYNC_FLUSH) {
+                    // Without workers zstd only applies a new level when a frame starts, so the frame is ended
+                    flushmode_zstd = zstd_new_level && !zstd_workers ? ZSTD_e_end : ZSTD_e_flush;
+                }
+
+                // A NULL input continues with the pending input data
+                if (in) {
+                    zstd_in = {in, in_size, 0};
+                }
+                do {
+                    zstd_pending = ZSTD_compressStream2(strm_zstd_c, &zstd_out, &zstd_in, flushmode_zstd);
+                    if (ZSTD_isError(zstd_pending)) {
+                        zstd_pending = 0;
+                        return -1;
+                    }
+                    // Stop if the output buffer is full. The pending data will be flushed with the next calls.
+                } while ((zstd_in.pos < zstd_in.size || (flushmode_zstd != ZSTD_e_continue && zstd_pending)) && zstd_out.pos < zstd_out.size);
+
+                if (flushmode_zstd == ZSTD_e_continue) {
+                    zstd_pending = 0;
+                }
+                // The new level is used by the data after the flush point
+                else if (zstd_new_level && !zstd_pending) {
+                    ZSTD_CCtx_setParameter(strm_zstd_c, ZSTD_c_compressionLevel, zstd_new_level);
+                    zstd_new_level = 0;
+                }
+
+                out_size = zstd_out.size - zstd_out.pos;
+                break;
+            }
         }
 
         return 0;
@@ -316,6 +526,24 @@ int8_t compressor::decompress(uint8_t* out, size_t &out_size, size_t &in_size, u
                 return return_code;
                 break;
             }
+
+        case C_ZSTD:
+            {
+                // The output is kept to know the space left, like the other codecs
+                zstd_out = {out, out_size, 0};
+                size_t zstd_return = 0;
+                // The frames are concatenated, so the decompression continues while there is space in the output
+                while (zstd_out.pos < zstd_out.size && zstd_in.pos < zstd_in.size) {
+                    zstd_return = ZSTD_decompressStream(strm_zstd_d, &zstd_out, &zstd_in);
+                    if (ZSTD_isError(zstd_return)) {
+                        return -1;
+                    }
+                }
+
+                in_size = zstd_in.size - zstd_in.pos;
+                return 0;
+                break;
+            }
         }
 
         return 0;
@@ -355,6 +583,18 @@ int8_t compressor::close(){
         delete strm_flac; //strm_lz4->close();
         return 0;
         break;
+
+    case C_ZSTD:
+        if (strm_zstd_c) {
+            ZSTD_freeCCtx(strm_zstd_c);
+            strm_zstd_c = NULL;
+        }
+        if (strm_zstd_d) {
+            ZSTD_freeDCtx(strm_zstd_d);
+            strm_zstd_d = NULL;
+        }
+        return 0;
+        break;
     }
 
     return -1;
@@ -375,6 +615,9 @@ size_t compressor::data_left_in() {
     case C_FLAC:
         return strm_flac->strm->avail_in;
         break;
+    case C_ZSTD:
+        return zstd_in.size - zstd_in.pos;
+        break;
     }
 
     return -1;
@@ -396,7 +639,300 @@ size_t compressor::data_left_out() {
     case C_FLAC:
         return strm_flac->strm->avail_out;
         break;
+    case C_ZSTD:
+        return zstd_out.size - zstd_out.pos;
+        break;
+    }
+
+    return -1;
+};
+
+/**
+ * @brief Check if the last compress call was not completed because the output buffer is full. The multithreaded
+ *        compressors can keep a lot of data pending, which must be processed calling again to compress
+ *        with the same flush mode and NULL input after set a new output buffer.
+ *
+ * @return true if there is data pending to be processed
+ */
+bool compressor::flush_pending() {
+    if (comp_mode == C_ZSTD) {
+        return zstd_pending > 0 || zstd_in.pos < zstd_in.size;
+    }
+    else if (comp_mode == C_LZMA) {
+        return lzma_pending;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Set the dictionary again as the compressor history. Must be called just after every seekable
+ *        block flush (and at the same point on decompression), because zlib clears the history on
+ *        every full flush. Other compressors keep the dictionary by themselves.
+ *
+ * @return int8_t: non zero on error
+ */
+int8_t compressor::reset_dictionary() {
+    if (comp_mode == C_ZLIB && dict) {
+        if (compression) {
+            return deflateSetDictionary(&strm_zlib, dict, dict_size);
+        }
+        else {
+            return inflateSetDictionary(&strm_zlib, dict, dict_size);
+        }
+    }
+
+    return 0;
+}
+/**
+ * @brief Reset the compressor to start a new stream with the same settings. The codec context and its
+ *        memory are reused when the codec allows it, which is faster than create a new compressor.
+ *
+ * @return int8_t: non zero on error
+ */
+int8_t compressor::reset() {
+    lzma_pending = false;
+    zstd_in = {NULL, 0, 0};
+    zstd_out = {NULL, 0, 0};
+    zstd_pending = 0;
+
+    switch(comp_mode) {
+    case C_ZLIB:
+        {
+            int ret = compression ? deflateReset(&strm_zlib) : inflateReset(&strm_zlib);
+            // The level changed by set_level is kept by the reset
+            if (ret == Z_OK && level_changed) {
+                ret = deflateParams(&strm_zlib, compression_level, Z_DEFAULT_STRATEGY);
+                level_changed = false;
+            }
+            if (ret == Z_OK) {
+                ret = reset_dictionary();
+            }
+            return ret;
+        }
+
+    case C_LZMA:
+        // liblzma reuses the coder memory when an already initialized stream is initialized again
+        init();
+        return 0;
+
+    case C_LZ4:
+        // lzlib4 has no reset method, so it is created again
+        delete strm_lz4;
+        strm_lz4 = NULL;
+        init();
+        return 0;
+
+    case C_FLAC:
+        // flaczlib has no reset method, so it is created again
+        delete strm_flac;
+        strm_flac = NULL;
+        init();
+        return 0;
+
+    case C_ZSTD:
+        // Only the session is reset. The parameters and the dictionary are kept, except the level changed by set_level.
+        if (compression) {
+            if (ZSTD_isError(ZSTD_CCtx_reset(strm_zstd_c, ZSTD_reset_session_only))) {
+                return -1;
+            }
+            zstd_new_level = 0;
+            if (level_changed) {
+                level_changed = false;
+                return ZSTD_isError(ZSTD_CCtx_setParameter(strm_zstd_c, ZSTD_c_compressionLevel, zstd_level(compression_level))) ? -1 : 0;
+            }
+            return 0;
+        }
+        else {
+            return ZSTD_isError(ZSTD_DCtx_reset(strm_zstd_d, ZSTD_reset_session_only)) ? -1 : 0;
+        }
     }
 
     return -1;
-};
\ No newline at end of file
+}
+
+
+/**
+ * @brief Change the compression level in the middle of the stream. zlib changes it at once, keeping the
+ *        compression history (the output buffer must have space for the pending block). zstd changes it after
+ *        the next Z_SYNC_FLUSH: with workers the frame continues with its history, but without them (-t 1, or
+ *        a libzstd without multithread support) the frame is ended and the next one starts without history,
+ *        because zstd only applies the new level at the frame start. The other codecs cannot change it.
+ *
+ * @param level The new compression level
+ * @return int8_t: non zero on error or if the codec cannot change the level
+ */
+int8_t compressor::set_level(int32_t level) {
+    if (!compression) {
+        return -1;
+    }
+
+    switch(comp_mode) {
+    case C_ZLIB:
+        level_changed = true;
+        return deflateParams(&strm_zlib, level, Z_DEFAULT_STRATEGY) == Z_OK ? 0 : -1;
+
+    case C_ZSTD:
+        level_changed = true;
+        zstd_new_level = zstd_level(level);
+        return 0;
+
+    default:
+        return -1;
+    }
+}
+
+
+/**
+ * @brief Get the memory used by the codec context. zlib is measured by its allocator, zstd and the lzma
+ *        decoder report their context size and the lzma encoder uses the liblzma estimation. lzlib4 and
+ *        flaczlib don't report it.
+ *
+ * @return size_t: the memory used in bytes, or 0 if it's unknown
+ */
+size_t compressor::memory_usage() {
+    switch(comp_mode) {
+    case C_ZLIB:
+        return zlib_memory;
+
+    case C_LZMA:
+        // The encoders memory usage is estimated by liblzma when they are initialized
+        return compression ? lzma_encoder_memory : lzma_memusage(&strm_lzma);
+
+    case C_ZSTD:
+        return compression ? ZSTD_sizeof_CCtx(strm_zstd_c) : ZSTD_sizeof_DCtx(strm_zstd_d);
+
+    default:
+        return 0;
+    }
+}
+
+
+// Destructor function that will free the pooled objects
+compressor_pool::~compressor_pool(void) {
+    for (size_t i = 0; i < idle_compressors.size(); i++) {
+        delete idle_compressors[i].compobj;
+    }
+    for (size_t i = 0; i < used_compressors.size(); i++) {
+        delete used_compressors[i].compobj;
+    }
+    for (size_t i = 0; i < idle_buffers.size(); i++) {
+        free(idle_buffers[i].buffer);
+    }
+    for (size_t i = 0; i < used_buffers.size(); i++) {
+        free(used_buffers[i].buffer);
+    }
+}
+
+/**
+ * @brief Get a compressor with the provided settings. A released compressor with the same settings
+ *        is reset and returned if available, otherwise a new one is created.
+ *
+ * @return compressor*: The compressor object, which must be returned to the pool with release
+ */
+compressor *compressor_pool::get(
+    sector_tools_compression mode,
+    bool is_compression,
+    int32_t comp_level,
+    uint8_t *dictionary,
+    size_t dictionary_size,
+    uint32_t threads
+) {
+    auto start = std::chrono::high_resolution_clock::now();
+    pool_compressor item = {mode, is_compression, comp_level, dictionary, dictionary_size, threads, NULL};
+
+    for (size_t i = 0; i < idle_compressors.size(); i++) {
+        pool_compressor &idle = idle_compressors[i];
+        if (
+            idle.mode == mode &&
+            idle.is_compression == is_compression &&
+            idle.comp_level == comp_level &&
+            idle.dictionary == dictionary &&
+            idle.dictionary_size == dictionary_size &&
+            idle.threads == threads
+        ) {
+            item.compobj = idle.compobj;
+            idle_compressors.erase(idle_compressors.begin() + i);
+
+            // A compressor which can't be reset is replaced by a new one
+            if (item.compobj->reset()) {
+                delete item.compobj;
+                item.compobj = NULL;
+            }
+            else {
+                stats.compressors_reused++;
+            }
+            break;
+        }
+    }
+
+    if (!item.compobj) {
+        item.compobj = new compressor(mode, is_compression, comp_level, dictionary, dictionary_size, threads);
+        stats.compressors_created++;
+    }
+    used_compressors.push_back(item);
+
+    stats.init_time += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+    return item.compobj;
+}
+
+/**
+ * @brief Return a compressor to the pool, to be reused by the next streams
+ *
+ * @param compobj The compressor returned by get
+ */
+void compressor_pool::release(compressor *compobj) {
+    for (size_t i = 0; i < used_compressors.size(); i++) {
+        if (used_compressors[i].compobj == compobj) {
+            idle_compressors.push_back(used_compressors[i]);
+            used_compressors.erase(used_compressors.begin() + i);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Get a buffer of the provided size. A released buffer of the same size is reused if available.
+ *
+ * @param size The buffer size
+ * @return uint8_t*: The buffer, or NULL if there is no memory. Must be returned with release_buffer.
+ */
+uint8_t *compressor_pool::get_buffer(size_t size) {
+    pool_buffer item = {size, NULL};
+
+    for (size_t i = 0; i < idle_buffers.size(); i++) {
+        if (idle_buffers[i].size == size) {
+            item.buffer = idle_buffers[i].buffer;
+            idle_buffers.erase(idle_buffers.begin() + i);
+            stats.buffers_reused++;
+            break;
+        }
+    }
+
+    if (!item.buffer) {
+        item.buffer = (uint8_t*) malloc(size);
+        if (!item.buffer) {
+            return NULL;
+        }
+        stats.buffers_allocated++;
+    }
+    used_buffers.push_back(item);
+
+    return item.buffer;
+}
+
+/**
+ * @brief Return a buffer to the pool, to be reused by the next streams
+ *
+ * @param buffer The buffer returned by get_buffer
+ */
+void compressor_pool::release_buffer(uint8_t *buffer) {
+    for (size_t i = 0; i < used_buffers.size(); i++) {
+        if (used_buffers[i].buffer == buffer) {
+            idle_buffers.push_back(used_buffers[i]);
+            used_buffers.erase(used_buffers.begin() + i);
+            return;
+        }
+    }
+}
@@ -20,11 +20,21 @@
 #define LZ4_HC_STATIC_LINKING_ONLY
 
 #include <stdint.h>
+#include <vector>
 #include "zlib.h"
 #include "lzma.h"
 #include "lz4hc.h"
 #include "lzlib4.h"
 #include "flaczlib.h"
+#include "zstd.h"
+
+// Zstandard window size (log2). Long distance matching is always enabled, and the extreme
+// compression uses a window big enough to cover a whole CD-ROM data stream.
+#define COMPRESSOR_ZSTD_WINDOW_LOG 27
+#define COMPRESSOR_ZSTD_EXTREME_WINDOW_LOG 30
+#define COMPRESSOR_ZSTD_MAX_WINDOW_LOG 31
+// Flag added to the compression level to enable the zstd extreme compression
+#define COMPRESSOR_ZSTD_EXTREME 0x80000000
 
 //
 // Stream types detectable by the class
@@ -34,7 +44,8 @@ enum sector_tools_compression : uint8_t {
     C_ZLIB,
     C_LZMA,
     C_LZ4,
-    C_FLAC
+    C_FLAC,
+    C_ZSTD
 };
     
 //
@@ -43,7 +54,14 @@ enum sector_tools_compression : uint8_t {
 class compressor {
     public:
     // Public methods
-        compressor(sector_tools_compression mode, bool is_compression, int32_t comp_level = 5);
+        compressor(
+            sector_tools_compression mode,
+            bool is_compression,
+            int32_t comp_level = 5,
+            uint8_t *dictionary = NULL,
+            size_t dictionary_size = 0,
+            uint32_t threads = 1
+        );
         ~compressor(void);
 
         int8_t set_input(uint8_t* in, size_t &in_size);
@@ -52,17 +70,99 @@ class compressor {
         int8_t decompress(uint8_t* out, size_t & out_size, size_t &in_size, uint8_t flusmode);
         size_t data_left_in();
         size_t data_left_out();
+        bool flush_pending();
+        int8_t reset_dictionary();
+        int8_t reset();
+        int8_t set_level(int32_t level);
+        size_t memory_usage();
 
         int8_t close();
 
     private:
+        // Private methods
+        void init();
+
         // zlib object
         z_stream strm_zlib;
+        size_t zlib_memory = 0;
         lzma_stream strm_lzma;
         lzma_options_lzma opt_lzma2;
+        bool lzma_pending = false;
+        uint64_t lzma_encoder_memory = 0;
         lzlib4 * strm_lz4 = NULL;
         flaczlib * strm_flac = NULL;
+        ZSTD_CCtx * strm_zstd_c = NULL;
+        ZSTD_DCtx * strm_zstd_d = NULL;
+        ZSTD_inBuffer zstd_in = {NULL, 0, 0};
+        ZSTD_outBuffer zstd_out = {NULL, 0, 0};
+        size_t zstd_pending = 0;
+        bool zstd_workers = false;
+        int32_t zstd_new_level = 0;
+        bool level_changed = false;
+        uint8_t *dict = NULL;
+        size_t dict_size = 0;
+        uint32_t threads_count = 1;
         sector_tools_compression comp_mode;
         bool compression;
         int32_t compression_level;
+};
+
+//
+// Stats of the compressors pool
+//
+struct compressor_pool_stats {
+    uint64_t compressors_created = 0;
+    uint64_t compressors_reused = 0;
+    uint64_t buffers_allocated = 0;
+    uint64_t buffers_reused = 0;
+    // Time used to create or reset the compressors, in seconds
+    double init_time = 0;
+};
+
+//
+// compressor_pool Class
+//
+// Keeps the released compressors and buffers to be reused in the next streams, so the codecs
+// contexts are reset instead of created again. It's not thread safe.
+//
+class compressor_pool {
+    public:
+        // Public methods
+        ~compressor_pool(void);
+
+        compressor *get(
+            sector_tools_compression mode,
+            bool is_compression,
+            int32_t comp_level = 5,
+            uint8_t *dictionary = NULL,
+            size_t dictionary_size = 0,
+            uint32_t threads = 1
+        );
+        void release(compressor *compobj);
+        uint8_t *get_buffer(size_t size);
+        void release_buffer(uint8_t *buffer);
+
+        // Public attributes
+        compressor_pool_stats stats;
+
+    private:
+        struct pool_compressor {
+            sector_tools_compression mode;
+            bool is_compression;
+            int32_t comp_level;
+            uint8_t *dictionary;
+            size_t dictionary_size;
+            uint32_t threads;
+            compressor *compobj;
+        };
+        struct pool_buffer {
+            size_t size;
+            uint8_t *buffer;
+        };
+
+        // Private attributes
+        std::vector<pool_compressor> idle_compressors;
+        std::vector<pool_compressor> used_compressors;
+        std::vector<pool_buffer> idle_buffers;
+        std::vector<pool_buffer> used_buffers;
 };
\ No newline at end of file
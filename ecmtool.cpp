@@ -19,13 +19,17 @@
 
 #include "ecmtool.h"
 
-#define ECM_FILE_VERSION 3
+#define ECM_FILE_VERSION 4
+// Last version with 32 bits streams and sectors TOCs. It can still be decoded.
+#define ECM_FILE_VERSION_V3 3
 
 // Some necessary variables
-static uint8_t mycounter_analyze = 0;
-static uint8_t mycounter_encode  = 0;
-static uint64_t mycounter_decode  = 0;
-static uint64_t mycounter_total   = 0;
+// The counters are per thread, so every profile of a multi-profile encode has its own progress
+static thread_local uint8_t mycounter_analyze = 0;
+static thread_local uint8_t mycounter_encode  = 0;
+static thread_local uint64_t mycounter_decode  = 0;
+static thread_local uint64_t mycounter_total   = 0;
+static thread_local bool mycounter_hidden = false;
 
 static struct option long_options[] = {
     {"input", required_argument, NULL, 'i'},
@@ -36,6 +40,34 @@ static struct option long_options[] = {
     {"extreme-compression", no_argument, NULL, 'e'},
     {"seekable", no_argument, NULL, 's'},
     {"sectors-per-block", required_argument, NULL, 'p'},
+    {"seekable-primer", required_argument, NULL, 'K'},
+    {"dedup", no_argument, NULL, 'D'},
+    {"store", required_argument, NULL, 'S'},
+    {"store-gc", no_argument, NULL, 'G'},
+    {"store-check", no_argument, NULL, 'C'},
+    {"reference", required_argument, NULL, 'r'},
+    {"append", no_argument, NULL, 'A'},
+    {"image", required_argument, NULL, 'n'},
+    {"delete", required_argument, NULL, 'x'},
+    {"compact", no_argument, NULL, 'Z'},
+    {"train-dict", required_argument, NULL, 'T'},
+    {"dictionary", required_argument, NULL, 'y'},
+    {"external-dictionary", no_argument, NULL, 'Y'},
+    {"threads", required_argument, NULL, 't'},
+    {"stats", no_argument, NULL, 'P'},
+    {"bench-codecs", required_argument, NULL, 'B'},
+    {"xa-compression", required_argument, NULL, 'X'},
+    {"vcompression", required_argument, NULL, 'v'},
+    {"xa-model", no_argument, NULL, 'M'},
+    {"codec", required_argument, NULL, 'O'},
+    {"auto-codec", required_argument, NULL, 'U'},
+    {"entropy-threshold", required_argument, NULL, 'E'},
+    {"second-pass", required_argument, NULL, 'R'},
+    {"target-speed", required_argument, NULL, 'w'},
+    {"solid", no_argument, NULL, 'L'},
+    {"profile", required_argument, NULL, 'm'},
+    {"verify", no_argument, NULL, 'V'},
+    {"group-files", no_argument, NULL, 'g'},
     {"force", required_argument, NULL, 'f'},
     {"keep-output", required_argument, NULL, 'k'},
     {NULL, 0, NULL, 0}
@@ -47,6 +79,10 @@ int main(int argc, char **argv) {
     // ECM processor options
     ecm_options options;
 
+    // Compressors and buffers reused by all the streams
+    compressor_pool codecs_pool;
+    options.codecs_pool = &codecs_pool;
+
     // Input file will be decoded
     bool decode = false;
 
@@ -63,11 +99,49 @@ int main(int argc, char **argv) {
     // Return code.
     int return_code = 0;
 
+    // The transcode command works over an ECM file, with the same codecs options than the encoder
+    if (argc > 1 && strcmp(argv[1], "transcode") == 0) {
+        options.transcode = true;
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+
     return_code = get_options(argc, argv, &options);
     if (return_code) {
         goto exit;
     }
 
+    // Chunk store maintenance doesn't need input or output files
+    if (options.store_gc || options.store_check) {
+        return store_maintenance(&options);
+    }
+
+    // Container maintenance works directly over the input file
+    if (options.delete_image >= 0 || options.compact) {
+        return container_maintenance(&options);
+    }
+
+    // The dictionary training uses the images passed as arguments
+    if (!options.train_dictionary_path.empty()) {
+        return train_dictionary(&options);
+    }
+
+    // The codecs benchmark only reads the image
+    if (!options.bench_codecs_path.empty()) {
+        return bench_codecs(&options);
+    }
+
+    // Load the compression dictionary
+    if (!options.dictionary_path.empty() && dictionary_load(&options)) {
+        return 1;
+    }
+
+    // The streams of an ECM file are compressed again with the new codecs
+    if (options.transcode) {
+        return transcode_file(&options);
+    }
+
     if (options.in_filename.empty()) {
         fprintf(stderr, "ERROR: input file is required.\n");
         print_help();
@@ -97,7 +171,7 @@ int main(int argc, char **argv) {
             file_format[2] == 'M'
         ) {
             // File is an ECM2 file, but we need to check the version
-            if (file_format[3] == ECM_FILE_VERSION) {
+            if (file_format[3] == ECM_FILE_VERSION || file_format[3] == ECM_FILE_VERSION_V3) {
                 fprintf(stdout, "An ECM2 file was detected... will be decoded\n");
                 decode = true;
             }
@@ -112,6 +186,20 @@ int main(int argc, char **argv) {
         }
     }
 
+    // Every profile is encoded to its own output file
+    if (!options.profiles.empty()) {
+        if (decode) {
+            fprintf(stderr, "ERROR: the profiles can only be used to encode a CD-ROM image.\n");
+            return_code = 1;
+            goto exit;
+        }
+        in_file.close();
+        return_code = profiles_encode(&options);
+        // The profiles remove their own output files on error
+        options.keep_output = true;
+        goto exit;
+    }
+
     // If no output filename was provided, generate it using the input filename
     if (options.out_filename.empty()) {
         // Input file will be decoded, so ecm2 extension must be removed (if exists)
@@ -133,8 +221,17 @@ int main(int argc, char **argv) {
         }
     }
 
+    // The images are appended to an existing ECM file, so it must not be removed or replaced
+    if (options.append) {
+        if (decode) {
+            fprintf(stderr, "ERROR: only a CD-ROM image can be appended to an ECM file.\n");
+            return_code = 1;
+            goto exit;
+        }
+        options.keep_output = true;
+    }
     // Check if output file exists only if force_rewrite is false
-    if (options.force_rewrite == false) {
+    else if (options.force_rewrite == false) {
         char dummy;
         out_file.open(options.out_filename.c_str(), std::ios::in|std::ios::binary);
         if (out_file.read(&dummy, 0)) {
@@ -146,8 +243,12 @@ int main(int argc, char **argv) {
         out_file.close();
     }
 
-    // Open the output file in replace mode
-    out_file.open(options.out_filename.c_str(), std::ios::out|std::ios::binary);
+    // Open the output file in replace mode (or update mode to append). The decoder also needs to read
+    // it back to rebuild the deduplicated sectors from the already written ones.
+    out_file.open(
+        options.out_filename.c_str(),
+        options.append ? std::ios::in|std::ios::out|std::ios::binary : std::ios::in|std::ios::out|std::ios::trunc|std::ios::binary
+    );
     // Check if file was oppened correctly.
     if (!out_file.good()) {
         fprintf(stderr, "ERROR: output file cannot be opened.\n");
@@ -157,73 +258,19 @@ int main(int argc, char **argv) {
 
     // Encoding process
     if (!decode) {
-        // Set output ECM header
-        out_file << "ECM" << char(ECM_FILE_VERSION);
-        // Dummy TOC position
-        uint64_t toc_position = 0;
-        out_file.write(reinterpret_cast<char*>(&toc_position), sizeof(toc_position));
-
-        // File TOC header
-        block_header toc_block_header = {ECMFILE_BLOCK_TYPE_TOC, 0, 0, 0};
-
-        // Add the ECM data TOC
-        file_blocks_toc.push_back(blocks_toc());
-        file_blocks_toc.back().type = ECMFILE_BLOCK_TYPE_ECM;
-        file_blocks_toc.back().start_position = out_file.tellp();
+        std::vector<uint64_t> sectors_type_sumary(13);
+        encode_summary encode_sumary;
+        uint64_t block_size = 0;
 
-        std::vector<uint32_t> sectors_type_sumary;
-        sectors_type_sumary.resize(13);
-        return_code = image_to_ecm_block(in_file, out_file, &options, &sectors_type_sumary);
+        return_code = image_to_ecm_file(in_file, out_file, &options, &sectors_type_sumary, &encode_sumary, block_size);
         if (return_code) {
-            fprintf(stderr, "\n\nERROR: there was an error processing the input file.\n\n");
-            return_code = 1;
             goto exit;
         }
-        else {
-            summary(
-                &sectors_type_sumary,
-                &options,
-                (uint64_t)out_file.tellp() - file_blocks_toc.back().start_position
-            );
-        }
-
-        // Write the Table of content
-        toc_position = out_file.tellp();
-        toc_block_header.real_block_size = file_blocks_toc.size() * sizeof(struct blocks_toc);
-        toc_block_header.block_size = toc_block_header.real_block_size;
-        // Write the Table of content header
-        out_file.write(reinterpret_cast<char*>(&toc_block_header), sizeof(toc_block_header));
-        // Write the Table of content data
-        out_file.write(reinterpret_cast<char*>(file_blocks_toc.data()), toc_block_header.block_size);
-        // Rewrite the Table of content position
-        out_file.seekp(4);
-        out_file.write(reinterpret_cast<char*>(&toc_position), sizeof(toc_position));
+        summary(&sectors_type_sumary, &encode_sumary, &options, block_size);
     }
     // Decoding process
     else {
-        // Variables
-        uint64_t toc_position = 0;
-        block_header toc_block_header;
-
-        in_file.seekg(4, std::ios_base::beg);
-        // Read TOC position
-        in_file.read(reinterpret_cast<char*>(&toc_position), sizeof(toc_position));
-
-        // Read the TOC block header
-        in_file.seekg(toc_position, std::ios_base::beg);
-        in_file.read(reinterpret_cast<char*>(&toc_block_header), sizeof(toc_block_header));
-
-        // Read the TOC
-        file_blocks_toc.resize(toc_block_header.real_block_size / sizeof(struct blocks_toc));
-        in_file.read(reinterpret_cast<char*>(file_blocks_toc.data()), toc_block_header.real_block_size);
-
-        for (int i = 0; i < file_blocks_toc.size(); i++) {
-            if (file_blocks_toc[i].type == ECMFILE_BLOCK_TYPE_ECM) {
-                in_file.seekg(file_blocks_toc[i].start_position, std::ios_base::beg);
-                return_code = ecm_block_to_image(in_file, out_file, &options);
-                if (return_code) { break; }
-            }
-        }
+        return_code = ecm_file_to_image(in_file, out_file, &options);
     }
 
     exit:
@@ -239,6 +286,16 @@ int main(int argc, char **argv) {
         auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - start);
         fprintf(stdout, "\n\nThe file was processed without any problem\n");
         fprintf(stdout, "Total execution time: %0.3fs\n\n", duration.count() / 1000.0F);
+
+        // The profiles stats are shown with their summaries
+        if (options.stats && options.profiles.empty()) {
+            fprintf(stdout, "Compressors stats:\n");
+            fprintf(stdout, "    Compressors created: %" PRIu64 "\n", codecs_pool.stats.compressors_created);
+            fprintf(stdout, "    Compressors reused: %" PRIu64 "\n", codecs_pool.stats.compressors_reused);
+            fprintf(stdout, "    Buffers allocated: %" PRIu64 "\n", codecs_pool.stats.buffers_allocated);
+            fprintf(stdout, "    Buffers reused: %" PRIu64 "\n", codecs_pool.stats.buffers_reused);
+            fprintf(stdout, "    Compressors initialization time: %0.3fs\n\n", codecs_pool.stats.init_time);
+        }
     }
     else {
         if (!options.keep_output) {
@@ -259,943 +316,5761 @@ int main(int argc, char **argv) {
 }
 
 
-int image_to_ecm_block(
+int ecm_file_to_image(
     std::ifstream &in_file,
     std::fstream &out_file,
-    ecm_options *options,
-    std::vector<uint32_t> *sectors_type_sumary
+    ecm_options *options
 ) {
-    // Input size
-    in_file.seekg(0, std::ios_base::end);
-    size_t in_total_size = in_file.tellg();
-    in_file.seekg(0, std::ios_base::beg);
-
-    // Stream script to the encode process
-    std::vector<stream_script> streams_script;
+    // Variables
+    uint64_t toc_position = 0;
+    std::vector<blocks_toc> file_blocks_toc;
+    int return_code = 0;
+    int32_t image = 0;
+    uint8_t file_version = 0;
 
-    // Sectors TOC
-    sector *sectors_toc = NULL;
-    sec_str_size sectors_toc_header = {C_NONE, 0, 0, 0};
-    uint8_t *sectors_toc_c_buffer;
+    return_code = read_file_toc(in_file, toc_position, file_blocks_toc, &file_version);
+    if (return_code) {
+        return return_code;
+    }
 
-    // Streams TOC
-    stream *streams_toc = NULL;
-    sec_str_size streams_toc_header = {C_NONE, 0, 0, 0};
-    uint8_t *streams_toc_c_buffer;
+    for (int i = 0; i < file_blocks_toc.size(); i++) {
+        if (file_blocks_toc[i].type == ECMFILE_BLOCK_TYPE_ECM) {
+            // Decode all the images or only the selected one
+            if (options->image_index < 0 || options->image_index == image) {
+                in_file.seekg(file_blocks_toc[i].start_position, std::ios_base::beg);
+                return_code = ecm_block_to_image(in_file, out_file, options, file_version);
+                if (return_code) { break; }
+            }
+            image++;
+        }
+    }
 
-    // Sector Tools object
-    sector_tools *sTools;
+    if (!return_code && options->image_index >= image) {
+        fprintf(stderr, "ERROR: the image %d doesn't exists in the input file.\n", options->image_index);
+        return_code = ECMTOOL_FILE_READ_ERROR;
+    }
 
-    // Return code
-    int return_code = 0;
+    return return_code;
+}
 
-    if (in_total_size % 2352) {
-        fprintf(stderr, "ERROR: The input file doesn't appear to be a CD-ROM image\n");
-        fprintf(stderr, "       This program only allows to process CD-ROM images\n");
 
-        return ECMTOOL_FILE_READ_ERROR;
+/**
+ * @brief Encodes the image into the output file. A new ECM file is created, or the image is added as a new
+ *        block to the existing file in append mode.
+ *
+ * @param in_file The input image
+ * @param out_file The output file, already opened
+ * @param options The encoding options
+ * @param sectors_type_sumary Output sectors of every type
+ * @param encode_sumary Output encoding summary
+ * @param block_size Output size of the ECM block
+ * @param job The profile with the shared analysis and reader, in a multi-profile encode
+ * @return int: non zero on error
+ */
+static int image_to_ecm_file(
+    std::ifstream &in_file,
+    std::fstream &out_file,
+    ecm_options *options,
+    std::vector<uint64_t> *sectors_type_sumary,
+    encode_summary *encode_sumary,
+    uint64_t &block_size,
+    profile_job *job
+) {
+    uint64_t toc_position = 0;
+    uint8_t file_version = 0;
+    std::vector<blocks_toc> file_blocks_toc;
+
+    if (options->append) {
+        // Read the current TOC. The new block will be written after it, and the old TOC will be marked as
+        // deleted, so the file is still valid until the new TOC position is written.
+        if (read_file_toc(out_file, toc_position, file_blocks_toc, &file_version)) {
+            fprintf(stderr, "ERROR: the output file is not a valid ECM file.\n");
+            return 1;
+        }
+        if (file_version != ECM_FILE_VERSION) {
+            fprintf(stderr, "ERROR: the output file uses an old ECM version. It must be decoded and encoded again to append images.\n");
+            return 1;
+        }
+        file_blocks_toc.push_back({ECMFILE_BLOCK_TYPE_DELETED, toc_position});
+        out_file.seekp(0, std::ios_base::end);
+    }
+    else {
+        // Set output ECM header
+        out_file << "ECM" << char(ECM_FILE_VERSION);
+        // Dummy TOC position
+        out_file.write(reinterpret_cast<char*>(&toc_position), sizeof(toc_position));
     }
 
-    // Reset the counters
-    resetcounter(in_total_size);
-
-    // Sector Tools object
-    sTools = new sector_tools();
-    // Block header with type 2 (ECM data), no compression, and no size for now
-    // Later will be completed when data is known
-    block_header ecm_block_header = {2, 0, 0, 0};
-    // ECM Header
-    ecm_header ecm_data_header = {
-        options->optimizations,
-        options->seekable ? options->sectors_per_block : (uint8_t)0,
-        0,
-        0,
-        0,
-        0,
-        0,
-        0,
-        "",
-        ""
-    };
-    // Struct size without the strings
-    uint32_t ecm_data_header_size = sizeof(ecm_data_header) - sizeof(ecm_data_header.title) - sizeof(ecm_data_header.id);
+    // Add the ECM data TOC
+    file_blocks_toc.push_back(blocks_toc());
+    file_blocks_toc.back().type = ECMFILE_BLOCK_TYPE_ECM;
+    file_blocks_toc.back().start_position = out_file.tellp();
 
-    // First blocks byte
-    uint64_t block_start_position = out_file.tellp();
-    // Will be setted later
-    uint64_t ecm_block_start_position = 0;
+    if (image_to_ecm_block(in_file, out_file, options, sectors_type_sumary, encode_sumary, job)) {
+        fprintf(stderr, "\n\nERROR: there was an error processing the input file.\n\n");
+        return 1;
+    }
+    block_size = (uint64_t)out_file.tellp() - file_blocks_toc.back().start_position;
 
-    // Write the "dummy" block header
-    return_code = write_block_header(out_file, &ecm_block_header);
-    if (return_code) {
-        goto exit;
+    // Write the Table of content
+    if (write_file_toc(out_file, file_blocks_toc)) {
+        fprintf(stderr, "ERROR: there was an error writting the output file TOC.\n");
+        return 1;
     }
 
-    // First ECM block byte
-    ecm_block_start_position = out_file.tellp();
+    // Remove the space left at the end of the file by the second pass
+    if (options->second_pass) {
+        uint64_t file_size = out_file.tellp();
+        out_file.close();
+        std::error_code resize_error;
+        std::filesystem::resize_file(options->out_filename, file_size, resize_error);
+        if (resize_error) {
+            fprintf(stderr, "ERROR: the output file cannot be truncated: %s\n", resize_error.message().c_str());
+            return 1;
+        }
+    }
 
-    // Analyze the disk to detect the sectors types
-    return_code = disk_analyzer (
-        sTools,
-        in_file,
-        in_total_size,
-        streams_script,
-        &ecm_data_header,
-        options
-    );
+    return 0;
+}
 
-    // Write the ECM dummy header
-    out_file.write(reinterpret_cast<char*>(&ecm_data_header), ecm_data_header_size);
-    if (!out_file.good()) {
-        return_code = 1;
-        goto exit;
-    }
-    out_file << ecm_data_header.title;
-    out_file << ecm_data_header.id;
 
-    //
-    // Now we will write the ECM data header
-    //
-    ecm_data_header.ecm_data_pos = (uint64_t)out_file.tellp() - ecm_block_start_position;
+/**
+ * @brief Encodes the image with several profiles in a single run. Every profile is a list of encoder options
+ *        over the main ones, with its own output file. The image is analyzed once, building the streams of
+ *        every profile with its codecs, and then a single reader reads and cleans every sector once and sends
+ *        the batches to the queue of every profile. The profiles are encoded in parallel, each one with its
+ *        own compressors and a part of the threads budget, and only do the steps which depend on their codecs
+ *        (automatic codec, entropy, primer and target speed). The options which change the sectors order or
+ *        the input are not allowed in the profiles.
+ *
+ * @param options Main options, with the input file and the profiles
+ * @return int: non zero on error
+ */
+static int profiles_encode(
+    ecm_options *options
+) {
+    std::vector<profile_job> jobs(options->profiles.size());
+    std::vector<std::thread> threads;
+    int return_code = 0;
 
-    //
-    // Convert the image to ECM data
-    //
-    return_code = disk_encode (
-        sTools,
-        in_file,
-        out_file,
-        streams_script,
-        options,
-        sectors_type_sumary,
-        ecm_data_header.ecm_data_pos
-    );
-    if (return_code) {
-        goto exit;
+    if (!options->out_filename.empty()) {
+        fprintf(stderr, "ERROR: the output file must be set in every profile.\n");
+        return 1;
     }
 
-    //
-    // Streams and Sectors TOC will be wrritten at the end because streams is modified
-    // during the encoding process with required data if compression was used.
-    //
-    //
-    // Time to write the streams header
-    //
-    ecm_data_header.streams_toc_pos = (uint64_t)out_file.tellp() - ecm_block_start_position;
-    return_code = task_to_streams_header (
-        streams_toc,
-        streams_toc_header,
-        streams_script
-    );
-    if (return_code) {
-        goto exit;
-    }
-    // Compress the streams header. Sectors count is base 0, so one will be added to the size calculation
-    {
-        // Compressed size will be the uncompressed size + 6 zlib header bytes + 5 zlib block headers for every 16k (plus two extra for security)
-        uint32_t compressed_size = streams_toc_header.uncompressed_size + 6 + (((streams_toc_header.uncompressed_size / 16.384) + 3) * 5);
-        streams_toc_c_buffer = (uint8_t *)malloc(compressed_size);
-        if(!streams_toc_c_buffer) {
-            fprintf(stderr, "Out of memory\n");
-            return_code = ECMTOOL_BUFFER_MEMORY_ERROR;
-            goto exit;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        profile_job &job = jobs[i];
+        job.options = *options;
+        job.options.profiles.clear();
+        job.options.input_files.clear();
+        job.options.codecs_pool = &job.codecs_pool;
+        job.options.threads = std::max(options->threads / (uint32_t)jobs.size(), 1u);
+        // Only the first profile shows the progress, or the lines will be mixed
+        job.show_progress = i == 0;
+
+        // Split the profile in arguments. The first one is the program name, which is skipped by the parser.
+        std::istringstream profile_stream(options->profiles[i]);
+        std::vector<std::string> arguments = {"ecmtool"};
+        std::string argument;
+        while (profile_stream >> argument) {
+            arguments.push_back(argument);
         }
-        if (compress_header(streams_toc_c_buffer, compressed_size, (uint8_t *)streams_toc, streams_toc_header.uncompressed_size, 9)) {
-            fprintf(stderr, "There was an error compressing the streams header.\n");
-            return_code = ECMTOOL_HEADER_COMPRESSION_ERROR;
-            goto exit;
+        std::vector<char *> profile_argv;
+        for (size_t j = 0; j < arguments.size(); j++) {
+            profile_argv.push_back(&arguments[j][0]);
         }
-        streams_toc_header.compressed_size = compressed_size;
-        streams_toc_header.compression = C_ZLIB;
-    }
-    // Write the compressed header
-    out_file.write(reinterpret_cast<char*>(&streams_toc_header), sizeof(streams_toc_header));
-    out_file.write(reinterpret_cast<char*>(streams_toc_c_buffer), streams_toc_header.compressed_size);
-    // Free the header memory
-    free(streams_toc);
-    streams_toc = NULL;
-    free(streams_toc_c_buffer);
-    streams_toc_c_buffer = NULL;
 
-    //
-    // Time to write the sectors header
-    //
-    ecm_data_header.sectors_toc_pos = (uint64_t)out_file.tellp() - ecm_block_start_position;
-    return_code = task_to_sectors_header (
-        sectors_toc,
-        sectors_toc_header,
-        streams_script
-    );
-    if (return_code) {
-        goto exit;
-    }
-    // Compress the sectors header.  Sectors count is base 0, so one will be added to the size calculation
-    {
-        // Compressed size will be the uncompressed size + 6 zlib header bytes + 5 zlib block headers for every 16k (plus two extra for security)
-        uint32_t compressed_size = sectors_toc_header.uncompressed_size + 6 + (((sectors_toc_header.uncompressed_size / 16.384) + 3) * 5);
-        sectors_toc_c_buffer = (uint8_t*) malloc(compressed_size);
-        if(!sectors_toc_c_buffer) {
-            fprintf(stderr, "Out of memory\n");
-            return_code = ECMTOOL_BUFFER_MEMORY_ERROR;
-            goto exit;
+        // Restart the parser, which was used to read the main options
+        optind = 0;
+        if (get_options(profile_argv.size(), profile_argv.data(), &job.options)) {
+            fprintf(stderr, "ERROR: the options of the profile %zu are not correct: %s\n", i + 1, options->profiles[i].c_str());
+            return 1;
         }
-        if (compress_header(sectors_toc_c_buffer, compressed_size, (uint8_t *)sectors_toc, sectors_toc_header.uncompressed_size, 9)) {
-            fprintf(stderr, "There was an error compressing the output sectors header.\n");
-            return_code = ECMTOOL_HEADER_COMPRESSION_ERROR;
-            goto exit;
+        if (!job.options.profiles.empty()) {
+            fprintf(stderr, "ERROR: the profiles cannot contain other profiles.\n");
+            return 1;
+        }
+        if (job.options.out_filename.empty()) {
+            fprintf(stderr, "ERROR: the profile %zu has no output file: %s\n", i + 1, options->profiles[i].c_str());
+            return 1;
+        }
+        for (size_t j = 0; j < i; j++) {
+            if (jobs[j].options.out_filename == job.options.out_filename) {
+                fprintf(stderr, "ERROR: the profiles %zu and %zu have the same output file.\n", j + 1, i + 1);
+                return 1;
+            }
+        }
+        // All the profiles use the same sectors, in the same order
+        if (job.options.in_filename != options->in_filename || job.options.group_files) {
+            fprintf(stderr, "ERROR: the profile %zu changes the input or its order (-i/-g), which are shared by all the profiles.\n", i + 1);
+            return 1;
+        }
+        if (job.options.dictionary_path != options->dictionary_path && dictionary_load(&job.options)) {
+            return 1;
         }
-        sectors_toc_header.compressed_size = compressed_size;
-        sectors_toc_header.compression = C_ZLIB;
     }
-    // Write the compressed header
-    out_file.write(reinterpret_cast<char*>(&sectors_toc_header), sizeof(sectors_toc_header));
-    if (!out_file.good()) {
-        return_code = 1;
-        goto exit;
+
+    // Analyze the image once for all the profiles
+    std::ifstream in_file(options->in_filename.c_str(), std::ios::binary);
+    if (!in_file.good()) {
+        fprintf(stderr, "ERROR: input file cannot be opened.\n");
+        return 1;
     }
-    out_file.write(reinterpret_cast<char*>(sectors_toc_c_buffer), sectors_toc_header.compressed_size);
-    if (!out_file.good()) {
-        return_code = 1;
-        goto exit;
+    in_file.seekg(0, std::ios_base::end);
+    size_t in_total_size = in_file.tellg();
+    if (in_total_size % 2352) {
+        fprintf(stderr, "ERROR: The input file doesn't appear to be a CD-ROM image\n");
+        fprintf(stderr, "       This program only allows to process CD-ROM images\n");
+        return 1;
     }
-    // Free the header memory
-    free(sectors_toc);
-    sectors_toc = NULL;
-    free(sectors_toc_c_buffer);
-    sectors_toc_c_buffer = NULL;
 
+    sector_tools sTools;
+    std::vector<stream_script> streams_script;
+    std::vector<dedup_run> sectors_order;
+    std::vector<float> blocks_entropy;
+    ecm_header analysis_header = {};
+    analysis_header.optimizations = options->optimizations;
 
-    // Set the block sizes. Both are equal because this block will not use compression
-    ecm_block_header.real_block_size = (uint64_t)out_file.tellp() - ecm_block_start_position;
+    resetcounter(in_total_size);
+    if (disk_analyzer(&sTools, in_file, in_total_size, streams_script, sectors_order, blocks_entropy, &analysis_header, options, &jobs)) {
+        return 1;
+    }
+    for (size_t i = 0; i < jobs.size(); i++) {
+        jobs[i].blocks_entropy = &blocks_entropy;
+        jobs[i].id = &analysis_header.id;
+    }
+
+    // The queue of every profile is stopped when its encoder returns, so the reader doesn't wait for it
+    for (size_t i = 0; i < jobs.size(); i++) {
+        threads.emplace_back([&jobs, i]() {
+            profile_encode(&jobs[i]);
+            sector_queue_stop(jobs[i].queue);
+        });
+    }
+    // The profiles fail without their sectors, so the reader error is reported for all of them
+    if (profiles_read(&sTools, in_file, streams_script, jobs, options) != ECMTOOL_OK) {
+        fprintf(stderr, "ERROR: the input image could not be read, so the profiles were not encoded.\n");
+        return_code = 1;
+    }
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+
+    for (size_t i = 0; i < jobs.size(); i++) {
+        fprintf(stdout, "\n\nProfile %zu: %s\n", i + 1, jobs[i].options.out_filename.c_str());
+        if (jobs[i].return_code) {
+            fprintf(stdout, "There was an error encoding the profile.\n");
+            return_code = 1;
+            continue;
+        }
+        summary(&jobs[i].sectors_type_sumary, &jobs[i].encode_sumary, &jobs[i].options, jobs[i].block_size);
+
+        if (options->stats) {
+            fprintf(stdout, "Compressors stats:\n");
+            fprintf(stdout, "    Compressors created: %" PRIu64 "\n", jobs[i].codecs_pool.stats.compressors_created);
+            fprintf(stdout, "    Compressors reused: %" PRIu64 "\n", jobs[i].codecs_pool.stats.compressors_reused);
+            fprintf(stdout, "    Buffers allocated: %" PRIu64 "\n", jobs[i].codecs_pool.stats.buffers_allocated);
+            fprintf(stdout, "    Buffers reused: %" PRIu64 "\n", jobs[i].codecs_pool.stats.buffers_reused);
+            fprintf(stdout, "    Compressors initialization time: %0.3fs\n", jobs[i].codecs_pool.stats.init_time);
+        }
+    }
+
+    return return_code;
+}
+
+
+/**
+ * @brief Encodes the input image with a profile. It runs in its own thread, and gets the cleaned sectors from
+ *        the shared reader. It opens its own output file and removes it on error like the main encoder. The
+ *        input file is only read again to take the automatic codec samples and to confirm the deduplicated sectors.
+ *
+ * @param job The profile to encode. The result and the summary data are stored in it.
+ */
+static void profile_encode(
+    profile_job *job
+) {
+    ecm_options *options = &job->options;
+    std::ifstream in_file;
+    std::fstream out_file;
+    // Only the first profile shows the progress
+    mycounter_hidden = !job->show_progress;
+
+    in_file.open(options->in_filename.c_str(), std::ios::binary);
+    if (!in_file.good()) {
+        fprintf(stderr, "ERROR: input file cannot be opened.\n");
+        job->return_code = 1;
+        return;
+    }
+
+    // The images are appended to an existing ECM file, so it must not be removed or replaced
+    if (options->append) {
+        options->keep_output = true;
+    }
+    // Check if output file exists only if force_rewrite is false
+    else if (options->force_rewrite == false) {
+        char dummy;
+        out_file.open(options->out_filename.c_str(), std::ios::in|std::ios::binary);
+        if (out_file.read(&dummy, 0)) {
+            fprintf(stderr, "ERROR: Cowardly refusing to replace the output file %s. Use the -f/--force-rewrite options to force it.\n", options->out_filename.c_str());
+            job->return_code = 1;
+            return;
+        }
+        out_file.close();
+    }
+
+    out_file.open(
+        options->out_filename.c_str(),
+        options->append ? std::ios::in|std::ios::out|std::ios::binary : std::ios::in|std::ios::out|std::ios::trunc|std::ios::binary
+    );
+    if (!out_file.good()) {
+        fprintf(stderr, "ERROR: output file %s cannot be opened.\n", options->out_filename.c_str());
+        job->return_code = 1;
+        return;
+    }
+
+    job->return_code = image_to_ecm_file(in_file, out_file, options, &job->sectors_type_sumary, &job->encode_sumary, job->block_size, job);
+
+    in_file.close();
+    if (out_file.is_open()) {
+        out_file.close();
+    }
+
+    // Something went wrong, so the output file must be removed if keep_output is false
+    if (job->return_code && !options->keep_output && remove(options->out_filename.c_str())) {
+        fprintf(stderr, "There was an error removing the output file %s... Please remove it manually.\n", options->out_filename.c_str());
+    }
+}
+
+
+/**
+ * @brief Reads and cleans the image sectors once for all the profiles. The sectors are cleaned in batches,
+ *        which are shared by the queues of all the profiles. The queues are closed at the end, or on error.
+ *
+ * @param sTools Sector tools object
+ * @param in_file The input image
+ * @param streams_script The streams of the shared analysis, with the sectors types
+ * @param jobs The profiles
+ * @param options The main options, with the optimizations used by all the profiles
+ * @return ecmtool_return_code
+ */
+static ecmtool_return_code profiles_read (
+    sector_tools *sTools,
+    std::ifstream &in_file,
+    std::vector<stream_script> &streams_script,
+    std::vector<profile_job> &jobs,
+    ecm_options *options
+) {
+    uint8_t in_sector[2352];
+    uint32_t input_edc = 0;
+    std::shared_ptr<sector_batch> batch;
+    ecmtool_return_code return_code = ECMTOOL_OK;
+
+    in_file.clear();
+    in_file.seekg(0, std::ios_base::beg);
+
+    for (size_t i = 0; i < streams_script.size() && return_code == ECMTOOL_OK; i++) {
+        for (size_t j = 0; j < streams_script[i].sectors_data.size() && return_code == ECMTOOL_OK; j++) {
+            for (uint64_t k = 0; k < streams_script[i].sectors_data[j].sector_count; k++) {
+                in_file.read(reinterpret_cast<char*>(in_sector), 2352);
+                if (!in_file.good()) {
+                    fprintf(stderr, "There was an error reading the input file.\n");
+                    return_code = ECMTOOL_FILE_READ_ERROR;
+                    break;
+                }
+                input_edc = sTools->edc_compute(input_edc, in_sector, 2352);
+
+                if (!batch) {
+                    batch = std::make_shared<sector_batch>();
+                    batch->data.reserve(ENCODE_BATCH_SECTORS * 2352);
+                }
+                size_t position = batch->data.size();
+                batch->data.resize(position + 2352);
+                uint16_t output_size = 0;
+                if (sTools->clean_sector(
+                    batch->data.data() + position,
+                    in_sector,
+                    (sector_tools_types)streams_script[i].sectors_data[j].mode,
+                    output_size,
+                    options->optimizations
+                )) {
+                    fprintf(stderr, "There was an error cleaning the sector\n");
+                    return_code = ECMTOOL_PROCESSING_ERROR;
+                    break;
+                }
+                batch->data.resize(position + output_size);
+                batch->sectors_size.push_back(output_size);
+
+                // The full batches are sent to all the profiles
+                if (batch->sectors_size.size() == ENCODE_BATCH_SECTORS) {
+                    batch->input_edc = input_edc;
+                    for (size_t l = 0; l < jobs.size(); l++) {
+                        sector_queue_push(jobs[l].queue, batch);
+                    }
+                    batch.reset();
+                }
+            }
+        }
+    }
+
+    if (batch && return_code == ECMTOOL_OK) {
+        batch->input_edc = input_edc;
+        for (size_t i = 0; i < jobs.size(); i++) {
+            sector_queue_push(jobs[i].queue, batch);
+        }
+    }
+    for (size_t i = 0; i < jobs.size(); i++) {
+        sector_queue_close(jobs[i].queue, return_code != ECMTOOL_OK);
+    }
+
+    return return_code;
+}
+
+
+/**
+ * @brief Sends a batch of cleaned sectors to a profile. It waits while the queue is full, unless the encoder
+ *        of the profile has stopped.
+ *
+ * @param queue The queue of the profile
+ * @param batch The batch of cleaned sectors
+ */
+static void sector_queue_push(
+    sector_queue &queue,
+    std::shared_ptr<const sector_batch> batch
+) {
+    std::unique_lock<std::mutex> lock(queue.mutex);
+    queue.changed.wait(lock, [&queue]() {
+        return queue.batches.size() < PROFILE_QUEUE_BATCHES || queue.stopped;
+    });
+    if (!queue.stopped) {
+        queue.batches.push_back(batch);
+        queue.changed.notify_all();
+    }
+}
+
+
+/**
+ * @brief Gets the next cleaned sector of a profile, waiting for the reader if the queue is empty
+ *
+ * @param queue The queue of the profile
+ * @param sector_data Output buffer for the cleaned sector
+ * @param output_size Output size of the cleaned sector
+ * @param input_edc Output input CRC up to the end of the current batch
+ * @param waited Output time waiting for the reader
+ * @return ecmtool_return_code: error if the reader failed or there are no more sectors
+ */
+static ecmtool_return_code sector_queue_pop(
+    sector_queue &queue,
+    uint8_t *sector_data,
+    uint16_t &output_size,
+    uint32_t &input_edc,
+    std::chrono::high_resolution_clock::duration &waited
+) {
+    if (!queue.current || queue.sector_index == queue.current->sectors_size.size()) {
+        auto wait_start = std::chrono::high_resolution_clock::now();
+        std::unique_lock<std::mutex> lock(queue.mutex);
+        queue.changed.wait(lock, [&queue]() {
+            return queue.batches.size() || queue.finished;
+        });
+        waited = std::chrono::high_resolution_clock::now() - wait_start;
+
+        // The reader already reported its error
+        if (queue.batches.empty()) {
+            if (!queue.failed) {
+                fprintf(stderr, "Unexpected EOF detected.\n");
+            }
+            return ECMTOOL_FILE_READ_ERROR;
+        }
+        queue.current = queue.batches.front();
+        queue.batches.pop_front();
+        queue.sector_index = 0;
+        queue.data_position = 0;
+        queue.changed.notify_all();
+    }
+
+    output_size = queue.current->sectors_size[queue.sector_index++];
+    memcpy(sector_data, queue.current->data.data() + queue.data_position, output_size);
+    queue.data_position += output_size;
+    input_edc = queue.current->input_edc;
+
+    return ECMTOOL_OK;
+}
+
+
+/**
+ * @brief Marks the queue of a profile as finished after the last batch
+ *
+ * @param queue The queue of the profile
+ * @param failed The reader failed, so the sectors are incomplete
+ */
+static void sector_queue_close(
+    sector_queue &queue,
+    bool failed
+) {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.finished = true;
+    queue.failed = failed;
+    queue.changed.notify_all();
+}
+
+
+/**
+ * @brief Marks the queue of a profile as stopped when its encoder returns, and drops the pending batches
+ *
+ * @param queue The queue of the profile
+ */
+static void sector_queue_stop(
+    sector_queue &queue
+) {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.stopped = true;
+    queue.batches.clear();
+    queue.current.reset();
+    queue.changed.notify_all();
+}
+
+
+/**
+ * @brief Read the file TOC (blocks list)
+ *
+ * @param in_file ECM file
+ * @param toc_position Output TOC block position
+ * @param file_blocks_toc Output blocks list
+ * @param file_version Output file version (optional)
+ * @return ecmtool_return_code
+ */
+static ecmtool_return_code read_file_toc (
+    std::istream &in_file,
+    uint64_t &toc_position,
+    std::vector<blocks_toc> &file_blocks_toc,
+    uint8_t *file_version
+) {
+    block_header toc_block_header;
+    char file_format[4];
+
+    in_file.seekg(0, std::ios_base::beg);
+    in_file.read(file_format, 4);
+    if (
+        !in_file.good() || file_format[0] != 'E' || file_format[1] != 'C' || file_format[2] != 'M' ||
+        (file_format[3] != ECM_FILE_VERSION && file_format[3] != ECM_FILE_VERSION_V3)
+    ) {
+        return ECMTOOL_FILE_READ_ERROR;
+    }
+    if (file_version) {
+        *file_version = file_format[3];
+    }
+
+    // Read TOC position
+    in_file.read(reinterpret_cast<char*>(&toc_position), sizeof(toc_position));
+
+    // Read the TOC block header
+    in_file.seekg(toc_position, std::ios_base::beg);
+    in_file.read(reinterpret_cast<char*>(&toc_block_header), sizeof(toc_block_header));
+
+    // Read the TOC
+    file_blocks_toc.resize(toc_block_header.real_block_size / sizeof(struct blocks_toc));
+    in_file.read(reinterpret_cast<char*>(file_blocks_toc.data()), toc_block_header.real_block_size);
+    if (!in_file.good() || toc_block_header.type != ECMFILE_BLOCK_TYPE_TOC) {
+        return ECMTOOL_FILE_READ_ERROR;
+    }
+
+    return ECMTOOL_OK;
+}
+
+
+/**
+ * @brief Write the file TOC (blocks list) at the current position and update the TOC position in the file header.
+ *        The position is updated at last, so the file keeps the previous TOC until the new one is completely written.
+ *        The output position is left at the end of the TOC.
+ *
+ * @param out_file ECM file
+ * @param file_blocks_toc Blocks list
+ * @return ecmtool_return_code
+ */
+static ecmtool_return_code write_file_toc (
+    std::iostream &out_file,
+    std::vector<blocks_toc> &file_blocks_toc
+) {
+    block_header toc_block_header = {ECMFILE_BLOCK_TYPE_TOC, 0, 0, 0};
+    uint64_t toc_position = out_file.tellp();
+
+    toc_block_header.real_block_size = file_blocks_toc.size() * sizeof(struct blocks_toc);
+    toc_block_header.block_size = toc_block_header.real_block_size;
+    // Write the Table of content header
+    out_file.write(reinterpret_cast<char*>(&toc_block_header), sizeof(toc_block_header));
+    // Write the Table of content data
+    out_file.write(reinterpret_cast<char*>(file_blocks_toc.data()), toc_block_header.block_size);
+    out_file.flush();
+    uint64_t toc_end_position = out_file.tellp();
+    // Rewrite the Table of content position
+    out_file.seekp(4);
+    out_file.write(reinterpret_cast<char*>(&toc_position), sizeof(toc_position));
+    out_file.flush();
+    out_file.seekp(toc_end_position);
+
+    if (!out_file.good()) {
+        return ECMTOOL_FILE_WRITE_ERROR;
+    }
+
+    return ECMTOOL_OK;
+}
+
+
+/**
+ * @brief Container maintenance tasks: Delete an image (just marks the block as deleted) and compact the file
+ *        to reclaim the deleted blocks space. The compaction copies the blocks to a new file using big sequential
+ *        copies, so nothing is encoded again, and then replaces the original file.
+ *
+ * @param options Program options with the input file and the task to do
+ * @return int: non zero on error
+ */
+static int container_maintenance(
+    ecm_options *options
+) {
+    std::fstream ecm_file;
+    uint64_t toc_position = 0;
+    std::vector<blocks_toc> file_blocks_toc;
+    uint8_t file_version = 0;
+
+    if (options->in_filename.empty()) {
+        fprintf(stderr, "ERROR: input file is required.\n");
+        print_help();
+        return 1;
+    }
+
+    ecm_file.open(options->in_filename.c_str(), std::ios::in|std::ios::out|std::ios::binary);
+    if (!ecm_file.good() || read_file_toc(ecm_file, toc_position, file_blocks_toc, &file_version)) {
+        fprintf(stderr, "ERROR: input file cannot be opened or is not a valid ECM file.\n");
+        return 1;
+    }
+    // The old versions streams positions depends on the block position, so their blocks cannot be moved
+    if (file_version != ECM_FILE_VERSION) {
+        fprintf(stderr, "ERROR: the input file uses an old ECM version. It must be decoded and encoded again.\n");
+        return 1;
+    }
+
+    if (options->delete_image >= 0) {
+        int32_t image = 0;
+        size_t i = 0;
+        for (; i < file_blocks_toc.size(); i++) {
+            if (file_blocks_toc[i].type == ECMFILE_BLOCK_TYPE_ECM && image++ == options->delete_image) {
+                break;
+            }
+        }
+        if (i == file_blocks_toc.size()) {
+            fprintf(stderr, "ERROR: the image %d doesn't exists in the input file.\n", options->delete_image);
+            return 1;
+        }
+
+        // Mark the block as deleted in the block header and in the TOC, which has the same size and can be rewritten in place
+        uint8_t deleted_type = ECMFILE_BLOCK_TYPE_DELETED;
+        file_blocks_toc[i].type = ECMFILE_BLOCK_TYPE_DELETED;
+        ecm_file.seekp(file_blocks_toc[i].start_position, std::ios_base::beg);
+        ecm_file.write(reinterpret_cast<char*>(&deleted_type), sizeof(deleted_type));
+        ecm_file.seekp(toc_position + sizeof(block_header), std::ios_base::beg);
+        ecm_file.write(reinterpret_cast<char*>(file_blocks_toc.data()), file_blocks_toc.size() * sizeof(struct blocks_toc));
+        if (!ecm_file.good()) {
+            fprintf(stderr, "ERROR: there was an error writting the input file TOC.\n");
+            return 1;
+        }
+
+        fprintf(stdout, "The image %d was marked as deleted\n", options->delete_image);
+    }
+
+    if (options->compact) {
+        std::vector<blocks_toc> new_blocks_toc;
+        std::vector<uint8_t> buffer(BUFFER_SIZE);
+        std::string tmp_filename = options->in_filename + ".tmp";
+        std::fstream tmp_file;
+        uint64_t original_size = 0;
+
+        ecm_file.seekg(0, std::ios_base::end);
+        original_size = ecm_file.tellg();
+
+        // The blocks are copied to a temporal file which replaces the original at the end, so
+        // the original file is still valid if the process is interrupted or fails
+        tmp_file.open(tmp_filename.c_str(), std::ios::in|std::ios::out|std::ios::trunc|std::ios::binary);
+        if (!tmp_file.good()) {
+            fprintf(stderr, "ERROR: the temporal file %s cannot be created.\n", tmp_filename.c_str());
+            return 1;
+        }
+        // ECM header and the dummy TOC position
+        toc_position = 0;
+        tmp_file << "ECM" << char(ECM_FILE_VERSION);
+        tmp_file.write(reinterpret_cast<char*>(&toc_position), sizeof(toc_position));
+
+        // Keep the blocks order
+        std::sort(file_blocks_toc.begin(), file_blocks_toc.end(), [](const blocks_toc &a, const blocks_toc &b) {
+            return a.start_position < b.start_position;
+        });
+
+        bool copy_error = false;
+        for (size_t i = 0; i < file_blocks_toc.size() && !copy_error; i++) {
+            if (file_blocks_toc[i].type == ECMFILE_BLOCK_TYPE_DELETED || file_blocks_toc[i].type == ECMFILE_BLOCK_TYPE_TOC) {
+                continue;
+            }
+
+            block_header data_block_header;
+            ecm_file.seekg(file_blocks_toc[i].start_position, std::ios_base::beg);
+            ecm_file.read(reinterpret_cast<char*>(&data_block_header), sizeof(data_block_header));
+            if (!ecm_file.good()) {
+                fprintf(stderr, "ERROR: there was an error reading the block header.\n");
+                copy_error = true;
+                break;
+            }
+
+            new_blocks_toc.push_back({file_blocks_toc[i].type, (uint64_t)tmp_file.tellp()});
+            uint64_t block_size = sizeof(data_block_header) + data_block_header.block_size;
+            ecm_file.seekg(file_blocks_toc[i].start_position, std::ios_base::beg);
+            for (uint64_t copied = 0; copied < block_size;) {
+                size_t to_copy = std::min((uint64_t)buffer.size(), block_size - copied);
+                ecm_file.read(reinterpret_cast<char*>(buffer.data()), to_copy);
+                tmp_file.write(reinterpret_cast<char*>(buffer.data()), to_copy);
+                if (!ecm_file.good() || !tmp_file.good()) {
+                    fprintf(stderr, "ERROR: there was an error copying the file blocks.\n");
+                    copy_error = true;
+                    break;
+                }
+                copied += to_copy;
+            }
+        }
+
+        if (!copy_error && write_file_toc(tmp_file, new_blocks_toc)) {
+            fprintf(stderr, "ERROR: there was an error writting the compacted file TOC.\n");
+            copy_error = true;
+        }
+        uint64_t compacted_size = tmp_file.tellp();
+        tmp_file.close();
+        ecm_file.close();
+
+        std::error_code rename_error;
+        if (!copy_error) {
+            std::filesystem::rename(tmp_filename, options->in_filename, rename_error);
+            if (rename_error) {
+                fprintf(stderr, "ERROR: the input file cannot be replaced: %s\n", rename_error.message().c_str());
+            }
+        }
+        if (copy_error || rename_error) {
+            std::error_code remove_error;
+            std::filesystem::remove(tmp_filename, remove_error);
+            return 1;
+        }
+
+        fprintf(stdout, "Reclaimed size ......................... %3.2fMB\n", MB(original_size - compacted_size));
+    }
+
+    return 0;
+}
+
+
+/**
+ * @brief Transcode an ECM file to other codecs or levels. The cleaned sectors data of every stream is decompressed
+ *        and compressed again with the new options, and the TOCs, the optimizations and the CRC are copied, so
+ *        the sectors are not regenerated. The CRC is only checked if the verification is requested, by decoding
+ *        the new file to a temporal image.
+ *
+ * @param options Program options with the input and output files, and the new codecs
+ * @return int: non zero on error
+ */
+static int transcode_file(
+    ecm_options *options
+) {
+    std::ifstream in_file;
+    std::fstream out_file;
+    uint64_t toc_position = 0;
+    std::vector<blocks_toc> file_blocks_toc;
+    std::vector<blocks_toc> new_blocks_toc;
+    uint8_t file_version = 0;
+    transcode_summary transcode_sumary;
+    int return_code = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+
+    if (options->in_filename.empty() || options->out_filename.empty()) {
+        fprintf(stderr, "ERROR: the input and output files are required to transcode.\n");
+        print_help();
+        return 1;
+    }
+    if (options->in_filename == options->out_filename) {
+        fprintf(stderr, "ERROR: the output file must be different than the input file.\n");
+        return 1;
+    }
+
+    in_file.open(options->in_filename.c_str(), std::ios::binary);
+    if (!in_file.good() || read_file_toc(in_file, toc_position, file_blocks_toc, &file_version)) {
+        fprintf(stderr, "ERROR: input file cannot be opened or is not a valid ECM file.\n");
+        return 1;
+    }
+    // The old version streams positions depends on the block position
+    if (file_version != ECM_FILE_VERSION) {
+        fprintf(stderr, "ERROR: the input file uses an old ECM version. It must be decoded and encoded again.\n");
+        return 1;
+    }
+
+    // Check if output file exists only if force_rewrite is false
+    if (options->force_rewrite == false) {
+        char dummy;
+        out_file.open(options->out_filename.c_str(), std::ios::in|std::ios::binary);
+        if (out_file.read(&dummy, 0)) {
+            fprintf(stderr, "ERROR: Cowardly refusing to replace output file. Use the -f/--force-rewrite options to force it.\n");
+            return 1;
+        }
+        out_file.close();
+    }
+
+    out_file.open(options->out_filename.c_str(), std::ios::in|std::ios::out|std::ios::trunc|std::ios::binary);
+    if (!out_file.good()) {
+        fprintf(stderr, "ERROR: output file cannot be opened.\n");
+        return 1;
+    }
+
+    // Set output ECM header and the dummy TOC position
+    toc_position = 0;
+    out_file << "ECM" << char(ECM_FILE_VERSION);
+    out_file.write(reinterpret_cast<char*>(&toc_position), sizeof(toc_position));
+
+    // The deleted blocks are not copied, so the new file is also compacted
+    for (size_t i = 0; i < file_blocks_toc.size() && !return_code; i++) {
+        if (file_blocks_toc[i].type == ECMFILE_BLOCK_TYPE_DELETED || file_blocks_toc[i].type == ECMFILE_BLOCK_TYPE_TOC) {
+            continue;
+        }
+
+        new_blocks_toc.push_back({file_blocks_toc[i].type, (uint64_t)out_file.tellp()});
+        in_file.seekg(file_blocks_toc[i].start_position, std::ios_base::beg);
+        if (file_blocks_toc[i].type == ECMFILE_BLOCK_TYPE_ECM) {
+            // Every image is decoded with its own optimizations
+            ecm_options block_options = *options;
+            return_code = transcode_block(in_file, out_file, &block_options, &transcode_sumary);
+            continue;
+        }
+
+        // Other blocks are copied as they are
+        block_header data_block_header;
+        in_file.read(reinterpret_cast<char*>(&data_block_header), sizeof(data_block_header));
+        std::vector<uint8_t> block_data(data_block_header.block_size);
+        in_file.read(reinterpret_cast<char*>(block_data.data()), block_data.size());
+        out_file.write(reinterpret_cast<char*>(&data_block_header), sizeof(data_block_header));
+        out_file.write(reinterpret_cast<char*>(block_data.data()), block_data.size());
+        if (!in_file.good() || !out_file.good()) {
+            fprintf(stderr, "ERROR: there was an error copying the file blocks.\n");
+            return_code = 1;
+        }
+    }
+
+    if (!return_code && write_file_toc(out_file, new_blocks_toc)) {
+        fprintf(stderr, "ERROR: there was an error writting the output file TOC.\n");
+        return_code = 1;
+    }
+    in_file.close();
+    out_file.close();
+
+    // Decode the new file to check the stored CRC of every image
+    if (!return_code && options->verify) {
+        std::string verify_filename = options->out_filename + ".verify";
+        std::ifstream verify_in_file(options->out_filename.c_str(), std::ios::binary);
+        std::fstream verify_out_file(verify_filename.c_str(), std::ios::in|std::ios::out|std::ios::trunc|std::ios::binary);
+        ecm_options verify_options = *options;
+        verify_options.image_index = -1;
+        if (!verify_out_file.good()) {
+            fprintf(stderr, "ERROR: the verification image %s cannot be created.\n", verify_filename.c_str());
+            return_code = 1;
+        }
+        else if (ecm_file_to_image(verify_in_file, verify_out_file, &verify_options)) {
+            fprintf(stderr, "ERROR: the transcoded file verification has failed.\n");
+            return_code = 1;
+        }
+        verify_in_file.close();
+        verify_out_file.close();
+        remove(verify_filename.c_str());
+    }
+
+    if (return_code) {
+        if (!options->keep_output) {
+            fprintf(stderr, "\n\nERROR: there was an error transcoding the input file.\n\n");
+            remove(options->out_filename.c_str());
+        }
+        return 1;
+    }
+
+    auto stop = std::chrono::high_resolution_clock::now();
+    fprintf(stdout, "\n\n Transcode Sumary\n");
+    fprintf(stdout, "-------------------------------------------------------------\n");
+    fprintf(stdout, "Images ................................. %6" PRIu64 "\n", transcode_sumary.images);
+    fprintf(stdout, "Streams ................................ %6" PRIu64 "\n", transcode_sumary.streams);
+    fprintf(stdout, "Streams data size (input) .............. %6.2fMB\n", MB(transcode_sumary.in_size));
+    fprintf(stdout, "Streams data size (output) ............. %6.2fMB\n", MB(transcode_sumary.out_size));
+    fprintf(stdout, "Verified ............................... %6s\n", options->verify ? "yes" : "no");
+    fprintf(stdout, "Total execution time: %0.3fs\n\n", std::chrono::duration<double>(stop - start).count());
+
+    return 0;
+}
+
+
+int image_to_ecm_block(
+    std::ifstream &in_file,
+    std::fstream &out_file,
+    ecm_options *options,
+    std::vector<uint64_t> *sectors_type_sumary,
+    encode_summary *encode_sumary,
+    profile_job *job
+) {
+    // Input size
+    in_file.seekg(0, std::ios_base::end);
+    size_t in_total_size = in_file.tellg();
+    in_file.seekg(0, std::ios_base::beg);
+
+    // Stream script to the encode process
+    std::vector<stream_script> streams_script;
+
+    // Sectors TOC
+    sector *sectors_toc = NULL;
+    sec_str_size sectors_toc_header = {C_NONE, 0, 0, 0};
+
+    // Streams TOC
+    stream *streams_toc = NULL;
+    sec_str_size streams_toc_header = {C_NONE, 0, 0, 0};
+
+    // Deduplicated sectors TOC
+    std::vector<dedup_run> dedup_runs;
+
+    // Chunk store and the chunks TOC (manifest)
+    chunk_store *store = NULL;
+    std::vector<chunk_ref> chunk_refs;
+
+    // Reference (base) image and the reference sectors TOC
+    std::fstream base_file;
+    std::string base_filename;
+    std::vector<dedup_run> reference_runs;
+
+    // Encoding order of the image sectors when the files are grouped
+    std::vector<dedup_run> sectors_order;
+
+    // Estimated entropy of every block of sectors
+    std::vector<float> blocks_entropy;
+
+    // Compression level controller used with a target speed. The analysis time is part of the time budget.
+    speed_controller controller;
+    controller.target_speed = options->target_speed;
+    controller.total_bytes = in_total_size;
+    controller.start_time = std::chrono::high_resolution_clock::now();
+
+    // Sector Tools object
+    sector_tools *sTools;
+
+    // Return code
+    int return_code = 0;
+
+    if (in_total_size % 2352) {
+        fprintf(stderr, "ERROR: The input file doesn't appear to be a CD-ROM image\n");
+        fprintf(stderr, "       This program only allows to process CD-ROM images\n");
+
+        return ECMTOOL_FILE_READ_ERROR;
+    }
+
+    // Sector Tools object
+    sTools = new sector_tools();
+    // Block header with type 2 (ECM data), no compression, and no size for now
+    // Later will be completed when data is known
+    block_header ecm_block_header = {2, 0, 0, 0};
+    // ECM Header
+    ecm_header ecm_data_header = {
+        options->optimizations,
+        options->seekable ? options->sectors_per_block : (uint8_t)0,
+        0,
+        0,
+        0,
+        0,
+        0,
+        0,
+        0,
+        0,
+        0,
+        options->dictionary.size() ? options->dictionary_id : 0,
+        0,
+        0,
+        0,
+        0,
+        0,
+        "",
+        ""
+    };
+    // Struct size without the strings
+    uint32_t ecm_data_header_size = sizeof(ecm_data_header) - sizeof(ecm_data_header.title) - sizeof(ecm_data_header.id);
+
+    // First blocks byte
+    uint64_t block_start_position = out_file.tellp();
+    // Will be setted later
+    uint64_t ecm_block_start_position = 0;
+
+    // Decode the reference image, which will be used to store only the modified sectors
+    if (!options->reference_path.empty()) {
+        return_code = reference_open(
+            options,
+            base_file,
+            base_filename,
+            ecm_data_header.reference_edc,
+            ecm_data_header.reference_sectors
+        );
+        if (return_code) {
+            goto exit;
+        }
+    }
+
+    // Reset the counters
+    resetcounter(in_total_size);
+
+    // Open the chunk store if the data will be stored on it
+    if (!options->store_path.empty()) {
+        store = new chunk_store(options->store_path, options->compression_level);
+        if (store->open(true)) {
+            return_code = ECMTOOL_FILE_WRITE_ERROR;
+            goto exit;
+        }
+    }
+
+    // Write the "dummy" block header
+    return_code = write_block_header(out_file, &ecm_block_header);
+    if (return_code) {
+        goto exit;
+    }
+
+    // First ECM block byte
+    ecm_block_start_position = out_file.tellp();
+
+    if (job) {
+        // The profiles share the analysis, which already built their streams, so only the steps which depend
+        // on the profile codecs are done here
+        streams_script.swap(job->streams_script);
+        blocks_entropy = *job->blocks_entropy;
+        ecm_data_header.id = *job->id;
+        ecm_data_header.id_length = job->id->length();
+        setcounter_analyze(in_total_size);
+    }
+    else {
+        // Group the ISO9660 files by type. The images without a filesystem are processed in the original order.
+        if (options->group_files) {
+            return_code = files_order(in_file, in_total_size / 2352, sectors_order, encode_sumary);
+            if (return_code) {
+                goto exit;
+            }
+        }
+
+        // Analyze the disk to detect the sectors types
+        return_code = disk_analyzer (
+            sTools,
+            in_file,
+            in_total_size,
+            streams_script,
+            sectors_order,
+            blocks_entropy,
+            &ecm_data_header,
+            options
+        );
+    }
+
+    // Choose the codec of every stream class by compressing some samples
+    if (!return_code && options->auto_codec) {
+        return_code = auto_codec_select(sTools, in_file, streams_script, sectors_order, options, encode_sumary);
+        if (return_code) {
+            goto exit;
+        }
+    }
+
+    // Store without compression the blocks which are already compressed
+    if (!return_code && options->entropy_threshold > 0) {
+        entropy_split(streams_script, blocks_entropy, options, encode_sumary);
+    }
+
+    // Split the primer of the seekable streams
+    if (!return_code && options->seekable_primer) {
+        primer_split(streams_script, options, encode_sumary);
+    }
+
+    // Write the ECM dummy header
+    out_file.write(reinterpret_cast<char*>(&ecm_data_header), ecm_data_header_size);
+    if (!out_file.good()) {
+        return_code = 1;
+        goto exit;
+    }
+    out_file << ecm_data_header.title;
+    out_file << ecm_data_header.id;
+
+    //
+    // Now we will write the ECM data header
+    //
+    ecm_data_header.ecm_data_pos = (uint64_t)out_file.tellp() - ecm_block_start_position;
+
+    //
+    // Convert the image to ECM data
+    //
+    return_code = disk_encode (
+        sTools,
+        in_file,
+        out_file,
+        streams_script,
+        dedup_runs,
+        chunk_refs,
+        store,
+        reference_runs,
+        sectors_order,
+        base_file.is_open() ? &base_file : NULL,
+        ecm_data_header.reference_sectors,
+        options,
+        sectors_type_sumary,
+        encode_sumary,
+        options->target_speed > 0 ? &controller : NULL,
+        ecm_block_start_position,
+        job ? &job->queue : NULL
+    );
+    if (return_code) {
+        goto exit;
+    }
+    encode_sumary->speed_time = std::chrono::duration<double>(
+        std::chrono::high_resolution_clock::now() - controller.start_time
+    ).count();
+
+    // Compress again the biggest streams with the strongest settings
+    if (options->second_pass) {
+        return_code = second_pass(out_file, streams_script, options, encode_sumary, ecm_block_start_position, ecm_data_header.ecm_data_pos);
+        if (return_code) {
+            goto exit;
+        }
+    }
+
+    //
+    // Streams and Sectors TOC will be wrritten at the end because streams is modified
+    // during the encoding process with required data if compression was used.
+    //
+    //
+    // Time to write the streams header
+    //
+    ecm_data_header.streams_toc_pos = (uint64_t)out_file.tellp() - ecm_block_start_position;
+    return_code = task_to_streams_header (
+        streams_toc,
+        streams_toc_header,
+        streams_script
+    );
+    if (return_code) {
+        goto exit;
+    }
+    // Compress and write the streams header
+    return_code = write_toc(out_file, (uint8_t *)streams_toc, streams_toc_header.count, sizeof(struct stream));
+    if (return_code) {
+        goto exit;
+    }
+    // Free the header memory
+    free(streams_toc);
+    streams_toc = NULL;
+
+    //
+    // Time to write the sectors header
+    //
+    ecm_data_header.sectors_toc_pos = (uint64_t)out_file.tellp() - ecm_block_start_position;
+    return_code = task_to_sectors_header (
+        sectors_toc,
+        sectors_toc_header,
+        streams_script
+    );
+    if (return_code) {
+        goto exit;
+    }
+    // Compress and write the sectors header. Sectors count is base 0, so one extra entry is written
+    return_code = write_toc(out_file, (uint8_t *)sectors_toc, sectors_toc_header.count, sizeof(struct sector));
+    if (return_code) {
+        goto exit;
+    }
+    // Free the header memory
+    free(sectors_toc);
+    sectors_toc = NULL;
+
+    //
+    // Write the deduplicated sectors header if there are duplicated sectors
+    //
+    if (dedup_runs.size()) {
+        ecm_data_header.dedup_toc_pos = (uint64_t)out_file.tellp() - ecm_block_start_position;
+        return_code = write_toc(out_file, (uint8_t *)dedup_runs.data(), dedup_runs.size(), sizeof(struct dedup_run));
+        if (return_code) {
+            goto exit;
+        }
+    }
+
+    //
+    // Write the reference sectors header if the reference image was used
+    //
+    if (base_file.is_open()) {
+        ecm_data_header.reference_toc_pos = (uint64_t)out_file.tellp() - ecm_block_start_position;
+        return_code = write_toc(out_file, (uint8_t *)reference_runs.data(), reference_runs.size(), sizeof(struct dedup_run));
+        if (return_code) {
+            goto exit;
+        }
+    }
+
+    //
+    // Write the chunks header (manifest) if the data was sent to the chunk store
+    //
+    if (store) {
+        ecm_data_header.chunks_toc_pos = (uint64_t)out_file.tellp() - ecm_block_start_position;
+        return_code = write_toc(out_file, (uint8_t *)chunk_refs.data(), chunk_refs.size(), sizeof(struct chunk_ref));
+        if (return_code) {
+            goto exit;
+        }
+    }
+
+    //
+    // Embed the compression dictionary, unless it is an external shared dictionary
+    //
+    if (options->dictionary.size() && !options->dictionary_external) {
+        ecm_data_header.dictionary_toc_pos = (uint64_t)out_file.tellp() - ecm_block_start_position;
+        return_code = write_toc(out_file, options->dictionary.data(), options->dictionary.size(), 1);
+        if (return_code) {
+            goto exit;
+        }
+    }
+
+    //
+    // Write the sectors order if the files were grouped
+    //
+    if (sectors_order.size()) {
+        ecm_data_header.order_toc_pos = (uint64_t)out_file.tellp() - ecm_block_start_position;
+        return_code = write_toc(out_file, (uint8_t *)sectors_order.data(), sectors_order.size(), sizeof(struct dedup_run));
+        if (return_code) {
+            goto exit;
+        }
+    }
+
+    //
+    // Write the levels changed by the target speed controller inside the streams
+    //
+    if (controller.level_changes.size()) {
+        ecm_data_header.levels_toc_pos = (uint64_t)out_file.tellp() - ecm_block_start_position;
+        return_code = write_toc(out_file, (uint8_t *)controller.level_changes.data(), controller.level_changes.size(), sizeof(struct level_change));
+        if (return_code) {
+            goto exit;
+        }
+    }
+
+
+    // Set the block sizes. Both are equal because this block will not use compression
+    ecm_block_header.real_block_size = (uint64_t)out_file.tellp() - ecm_block_start_position;
     ecm_block_header.block_size = (uint64_t)out_file.tellp() - ecm_block_start_position;
 
-    // Write the new block heeader
-    out_file.seekp(block_start_position);
-    out_file.write(reinterpret_cast<char*>(&ecm_block_header), sizeof(ecm_block_header));
-    if (!out_file.good()) {
-        return_code = 1;
+    // Write the new block heeader
+    out_file.seekp(block_start_position);
+    out_file.write(reinterpret_cast<char*>(&ecm_block_header), sizeof(ecm_block_header));
+    if (!out_file.good()) {
+        return_code = 1;
+        goto exit;
+    }
+
+    // Finally, write the ecm data block header
+    out_file.write(reinterpret_cast<char*>(&ecm_data_header), ecm_data_header_size);
+    if (!out_file.good()) {
+        return_code = 1;
+        goto exit;
+    }
+    // The block end is not the file end if the second pass moved the streams data
+    out_file.seekp(ecm_block_start_position + ecm_block_header.block_size, std::ios_base::beg);
+
+    exit:
+    // Free the reserved memory for objects
+    if (sTools) {
+        delete sTools;
+    }
+    if (store) {
+        delete store;
+    }
+    if (base_file.is_open()) {
+        base_file.close();
+        remove(base_filename.c_str());
+    }
+    if (streams_toc) {
+        free(streams_toc);
+    }
+    if (sectors_toc) {
+        free(sectors_toc);
+    }
+
+    return return_code;
+}
+
+int ecm_block_to_image(
+    std::ifstream &in_file,
+    std::fstream &out_file,
+    ecm_options *options,
+    uint8_t file_version
+) {
+    // CRC calculation to check the decoded stream
+    uint32_t output_edc = 0;
+
+    // Stream script to the encode process
+    std::vector<stream_script> streams_script;
+
+    // ECM headers
+    block_header ecm_block_header;
+    ecm_header ecm_data_header;
+    // Struct size without the strings
+    uint32_t ecm_data_header_size = sizeof(ecm_data_header) - sizeof(ecm_data_header.title) - sizeof(ecm_data_header.id);
+
+    // Will be setted later
+    uint64_t ecm_block_start_position;
+
+    // Sectors TOC
+    std::vector<sector> sectors_toc;
+    sec_str_size sectors_toc_header = {C_NONE, 0, 0, 0};
+
+    // Streams TOC
+    std::vector<stream> streams_toc;
+    sec_str_size streams_toc_header = {C_NONE, 0, 0, 0};
+
+    // Deduplicated sectors TOC
+    std::vector<dedup_run> dedup_runs;
+
+    // Chunk store and the chunks TOC (manifest)
+    chunk_store *store = NULL;
+    chunk_reader *store_reader = NULL;
+    std::vector<chunk_ref> chunk_refs;
+
+    // Reference (base) image and the reference sectors TOC
+    std::fstream base_file;
+    std::string base_filename;
+    std::vector<dedup_run> reference_runs;
+
+    // Image position of the decoded sectors when the files were grouped
+    std::vector<dedup_run> sectors_order;
+
+    // Compression dictionary (embedded or the external one)
+    std::vector<uint8_t> dictionary;
+
+    // Sector Tools object
+    sector_tools *sTools = new sector_tools();
+
+    // Return code
+    int return_code = 0;
+
+    // Read the block header
+    return_code = read_block_header(in_file, &ecm_block_header);
+    if (return_code) {
+        goto exit;
+    }
+
+    // First ECM block byte
+    ecm_block_start_position = in_file.tellg();
+
+    // Read the ECM data header. The old version header is converted to the current one.
+    if (file_version == ECM_FILE_VERSION_V3) {
+        ecm_header_v3 ecm_data_header_v3;
+        in_file.read(reinterpret_cast<char*>(&ecm_data_header_v3), sizeof(ecm_data_header_v3));
+        ecm_data_header = {
+            ecm_data_header_v3.optimizations,
+            ecm_data_header_v3.sectors_per_block,
+            ecm_data_header_v3.crc_mode,
+            ecm_data_header_v3.streams_toc_pos,
+            ecm_data_header_v3.sectors_toc_pos,
+            ecm_data_header_v3.ecm_data_pos,
+            0,
+            0,
+            0,
+            0,
+            0,
+            0,
+            0,
+            0,
+            0,
+            ecm_data_header_v3.title_length,
+            ecm_data_header_v3.id_length,
+            "",
+            ""
+        };
+    }
+    else {
+        in_file.read(reinterpret_cast<char*>(&ecm_data_header), ecm_data_header_size);
+    }
+    if (!in_file.good()) {
+        return_code = 1;
+        goto exit;
+    }
+
+    // Read the title stored in file if exists
+    if (ecm_data_header.title_length) {
+        ecm_data_header.title.resize(ecm_data_header.title_length);
+        in_file.read((char *)ecm_data_header.title.data(), ecm_data_header.title_length);
+        if (!in_file.good()) {
+            return_code = 1;
+            goto exit;
+        }
+    }
+
+    // Read the ID stored in file if exists
+    if (ecm_data_header.id_length) {
+        ecm_data_header.id.resize(ecm_data_header.id_length);
+        in_file.read((char *)ecm_data_header.id.data(), ecm_data_header.id_length);
+        if (!in_file.good()) {
+            return_code = 1;
+            goto exit;
+        }
+    }
+
+    // Set the optimization and seekable options used in file
+    options->optimizations = (optimization_options)ecm_data_header.optimizations;
+    options->seekable = ecm_data_header.sectors_per_block != 0;
+    options->sectors_per_block = ecm_data_header.sectors_per_block;
+
+    // Reset the counters
+    resetcounter(ecm_block_header.block_size);
+
+    //
+    // Read the streams toc
+    {
+        std::vector<uint8_t> toc_data;
+        in_file.seekg(ecm_data_header.streams_toc_pos + ecm_block_start_position, std::ios_base::beg);
+        if (file_version == ECM_FILE_VERSION_V3) {
+            return_code = read_toc(in_file, toc_data, streams_toc_header.count, sizeof(struct stream_v3), file_version);
+            if (return_code) {
+                goto exit;
+            }
+            // The old version streams end positions are relative to the ECM data position
+            stream_v3 *streams_toc_v3 = (stream_v3 *)toc_data.data();
+            streams_toc.resize(streams_toc_header.count);
+            for (uint64_t i = 0; i < streams_toc_header.count; i++) {
+                streams_toc[i].type = streams_toc_v3[i].type ? STSC_DATA : STSC_CDDA;
+                streams_toc[i].compression = streams_toc_v3[i].compression;
+                streams_toc[i].filter = F_NONE;
+                streams_toc[i].end_sector = streams_toc_v3[i].end_sector;
+                streams_toc[i].out_end_position = streams_toc_v3[i].out_end_position + ecm_data_header.ecm_data_pos - ecm_block_start_position;
+            }
+        }
+        else {
+            return_code = read_toc(in_file, toc_data, streams_toc_header.count, sizeof(struct stream), file_version);
+            if (return_code) {
+                goto exit;
+            }
+            streams_toc.resize(streams_toc_header.count);
+            memcpy(streams_toc.data(), toc_data.data(), toc_data.size());
+        }
+    }
+
+    //
+    // Read the sectors toc
+    {
+        std::vector<uint8_t> toc_data;
+        in_file.seekg(ecm_data_header.sectors_toc_pos + ecm_block_start_position, std::ios_base::beg);
+        if (file_version == ECM_FILE_VERSION_V3) {
+            return_code = read_toc(in_file, toc_data, sectors_toc_header.count, sizeof(struct sector_v3), file_version);
+            if (return_code) {
+                goto exit;
+            }
+            sector_v3 *sectors_toc_v3 = (sector_v3 *)toc_data.data();
+            sectors_toc.resize(sectors_toc_header.count);
+            for (uint64_t i = 0; i < sectors_toc_header.count; i++) {
+                sectors_toc[i].mode = sectors_toc_v3[i].mode;
+                sectors_toc[i].sector_count = sectors_toc_v3[i].sector_count;
+            }
+        }
+        else {
+            return_code = read_toc(in_file, toc_data, sectors_toc_header.count, sizeof(struct sector), file_version);
+            if (return_code) {
+                goto exit;
+            }
+            sectors_toc.resize(sectors_toc_header.count);
+            memcpy(sectors_toc.data(), toc_data.data(), toc_data.size());
+        }
+    }
+
+    //
+    // Read the deduplicated sectors toc if the image contains duplicated sectors
+    if (ecm_data_header.dedup_toc_pos) {
+        std::vector<uint8_t> toc_data;
+        uint64_t toc_count = 0;
+        in_file.seekg(ecm_data_header.dedup_toc_pos + ecm_block_start_position, std::ios_base::beg);
+        return_code = read_toc(in_file, toc_data, toc_count, sizeof(struct dedup_run), file_version);
+        if (return_code) {
+            goto exit;
+        }
+        dedup_runs.resize(toc_count);
+        memcpy(dedup_runs.data(), toc_data.data(), toc_data.size());
+    }
+
+    //
+    // Read the reference sectors toc and decode the reference image if it was used
+    if (ecm_data_header.reference_toc_pos) {
+        std::vector<uint8_t> toc_data;
+        uint64_t toc_count = 0;
+        in_file.seekg(ecm_data_header.reference_toc_pos + ecm_block_start_position, std::ios_base::beg);
+        return_code = read_toc(in_file, toc_data, toc_count, sizeof(struct dedup_run), file_version);
+        if (return_code) {
+            goto exit;
+        }
+        reference_runs.resize(toc_count);
+        memcpy(reference_runs.data(), toc_data.data(), toc_data.size());
+
+        if (options->reference_path.empty()) {
+            fprintf(stderr, "The file was encoded using a reference image. Use the --reference option to set the reference ECM file.\n");
+            return_code = ECMTOOL_FILE_READ_ERROR;
+            goto exit;
+        }
+
+        uint32_t base_edc = 0;
+        uint64_t base_sectors = 0;
+        return_code = reference_open(options, base_file, base_filename, base_edc, base_sectors);
+        if (return_code) {
+            goto exit;
+        }
+        if (base_edc != ecm_data_header.reference_edc || base_sectors != ecm_data_header.reference_sectors) {
+            fprintf(stderr, "The provided reference image is not the one used to encode the file.\n");
+            return_code = ECMTOOL_FILE_READ_ERROR;
+            goto exit;
+        }
+
+        // The reference decoding has changed the counters
+        resetcounter(ecm_block_header.block_size);
+    }
+
+    //
+    // Read the chunks toc if the sectors data is in a chunk store
+    if (ecm_data_header.chunks_toc_pos) {
+        std::vector<uint8_t> toc_data;
+        uint64_t toc_count = 0;
+        in_file.seekg(ecm_data_header.chunks_toc_pos + ecm_block_start_position, std::ios_base::beg);
+        return_code = read_toc(in_file, toc_data, toc_count, sizeof(struct chunk_ref), file_version);
+        if (return_code) {
+            goto exit;
+        }
+        chunk_refs.resize(toc_count);
+        memcpy(chunk_refs.data(), toc_data.data(), toc_data.size());
+
+        if (options->store_path.empty()) {
+            fprintf(stderr, "The file data is in a chunk store. Use the --store option to set the store path.\n");
+            return_code = ECMTOOL_FILE_READ_ERROR;
+            goto exit;
+        }
+        store = new chunk_store(options->store_path);
+        if (store->open(false)) {
+            return_code = ECMTOOL_FILE_READ_ERROR;
+            goto exit;
+        }
+        store_reader = new chunk_reader(store, chunk_refs);
+    }
+
+    //
+    // Read the embedded compression dictionary, or check that the external dictionary is the right one
+    if (ecm_data_header.dictionary_toc_pos) {
+        uint64_t toc_count = 0;
+        in_file.seekg(ecm_data_header.dictionary_toc_pos + ecm_block_start_position, std::ios_base::beg);
+        return_code = read_toc(in_file, dictionary, toc_count, 1, file_version);
+        if (return_code) {
+            goto exit;
+        }
+    }
+    else if (ecm_data_header.dictionary_id) {
+        if (options->dictionary.empty()) {
+            fprintf(stderr, "The file was encoded using an external dictionary. Use the --dictionary option to set the dictionary file.\n");
+            return_code = ECMTOOL_FILE_READ_ERROR;
+            goto exit;
+        }
+        if (options->dictionary_id != ecm_data_header.dictionary_id) {
+            fprintf(stderr, "The provided dictionary is not the one used to encode the file.\n");
+            return_code = ECMTOOL_FILE_READ_ERROR;
+            goto exit;
+        }
+        dictionary = options->dictionary;
+    }
+
+    //
+    // Read the sectors order if the files were grouped
+    if (ecm_data_header.order_toc_pos) {
+        std::vector<uint8_t> toc_data;
+        uint64_t toc_count = 0;
+        in_file.seekg(ecm_data_header.order_toc_pos + ecm_block_start_position, std::ios_base::beg);
+        return_code = read_toc(in_file, toc_data, toc_count, sizeof(struct dedup_run), file_version);
+        if (return_code) {
+            goto exit;
+        }
+        sectors_order.resize(toc_count);
+        memcpy(sectors_order.data(), toc_data.data(), toc_data.size());
+    }
+
+    // Convert the headers to an script to be followed
+    return_code = task_maker (
+        streams_toc.data(),
+        streams_toc_header,
+        sectors_toc.data(),
+        sectors_toc_header,
+        streams_script
+    );
+    if (return_code) {
+        return_code = ECMTOOL_CORRUPTED_STREAM;
+        goto exit;
+    }
+
+    in_file.seekg(ecm_data_header.ecm_data_pos + ecm_block_start_position, std::ios_base::beg);
+    return_code = disk_decode (
+        sTools,
+        in_file,
+        out_file,
+        streams_script,
+        dedup_runs,
+        store_reader,
+        reference_runs,
+        sectors_order,
+        base_file.is_open() ? &base_file : NULL,
+        dictionary,
+        options,
+        ecm_block_start_position
+    );
+
+    exit:
+    if (sTools) {
+        delete sTools;
+    }
+    if (store_reader) {
+        delete store_reader;
+    }
+    if (store) {
+        delete store;
+    }
+    if (base_file.is_open()) {
+        base_file.close();
+        remove(base_filename.c_str());
+    }
+
+    return return_code;
+}
+
+
+int write_block_header(
+    std::fstream &out_file,
+    block_header *block_header_data
+) {
+    if (out_file.good()) {
+        // Write the header data
+        out_file.write(reinterpret_cast<char*>(block_header_data), sizeof(*block_header_data));
+
+        if (out_file.good()) {
+            return 0;
+        }
+        else {
+            return 1;
+        }
+    }
+    else {
+        fprintf(stderr, "Error writting the header because the output file is not correct\n.");
+        return 1;
+    }
+
+    return 0;
+}
+
+
+int read_block_header(
+    std::ifstream &in_file,
+    block_header *block_header_data
+) {
+    if (in_file.good()) {
+        // Write the header data
+        in_file.read(reinterpret_cast<char*>(block_header_data), sizeof(*block_header_data));
+
+        if (in_file.good()) {
+            return 0;
+        }
+        else {
+            return 1;
+        }
+    }
+    else {
+        fprintf(stderr, "Error reading the header because the input file is not correct\n.");
+        return 1;
+    }
+
+    return 0;
+}
+
+
+static ecmtool_return_code disk_analyzer (
+    sector_tools *sTools,
+    std::ifstream &in_file,
+    size_t image_file_size,
+    std::vector<stream_script> &streams_script,
+    std::vector<dedup_run> &sectors_order,
+    std::vector<float> &blocks_entropy,
+    ecm_header *ecm_data_header,
+    ecm_options *options,
+    std::vector<profile_job> *jobs
+) {
+    // Sector count
+    size_t sectors_count = image_file_size / 2352;
+
+    // Bytes histogram of the current entropy block
+    uint32_t block_histogram[256] = {};
+    uint64_t block_bytes = 0;
+
+    // Sector buffer
+    uint8_t in_sector[2352];
+
+    // Sector counter
+    uint64_t current_sector = 0;
+
+    // Seek to the begin
+    in_file.seekg(0, std::ios_base::beg);
+
+    // ID Detection
+    std::string id;
+    int id_detection_return = -1;
+
+    // Branch filter of the last detected executable, and the sector where the executable ends
+    executable_tracker executable;
+
+    // The entropy is estimated if it's used by the options or by any profile
+    bool entropy_blocks = options->entropy_threshold > 0;
+    if (jobs) {
+        for (size_t i = 0; i < jobs->size(); i++) {
+            entropy_blocks = entropy_blocks || (*jobs)[i].options.entropy_threshold > 0;
+        }
+    }
+
+    // Position of the current sector in the image, which is different if the files are grouped
+    uint64_t current_order_run = 0;
+    uint64_t image_sector = 0;
+
+    // Loop through all the sectors
+    for (size_t i = 0; i < sectors_count; i++) {
+        // Read a sector. With the files grouped, the image is only seeked at the start of every run.
+        if (sectors_order.size()) {
+            uint64_t previous_image_sector = image_sector;
+            run_lookup(sectors_order, current_order_run, current_sector, image_sector);
+            if (!current_sector || image_sector != previous_image_sector + 1) {
+                in_file.seekg(image_sector * 2352, std::ios_base::beg);
+            }
+        }
+        else {
+            image_sector = current_sector;
+        }
+        in_file.read(reinterpret_cast<char*>(in_sector), 2352);
+        if (in_file.good()) {
+            // Update the input file position
+            setcounter_analyze((current_sector + 1) * 2352);
+
+            sector_tools_types detected_type = sTools->detect(in_sector);
+            //printf("Current sector: %d -> Type: %d\n", current_sector, detected_type);
+
+            // Estimate the entropy (bits per byte) of the user data in every block
+            if (entropy_blocks) {
+                block_bytes += sTools->payload_histogram(in_sector, detected_type, block_histogram);
+                if ((current_sector + 1) % ENTROPY_BLOCK_SECTORS == 0 || current_sector + 1 == sectors_count) {
+                    float entropy = 0;
+                    for (uint16_t j = 0; j < 256; j++) {
+                        if (block_histogram[j]) {
+                            double probability = (double)block_histogram[j] / block_bytes;
+                            entropy -= probability * log2(probability);
+                        }
+                    }
+                    blocks_entropy.push_back(entropy);
+                    memset(block_histogram, 0, sizeof(block_histogram));
+                    block_bytes = 0;
+                }
+            }
+
+            // Try to detect the game ID to add it to header
+            if (id_detection_return != 0) {
+                id_detection_return = detect_id_psx(id, in_sector, 2352);
+                if (id_detection_return == 0) {
+                    ecm_data_header->id = id;
+                    ecm_data_header->id_length = id.length();
+                }
+            }            
+
+            //printf("Detected sector type: %d\n", detected_type);
+
+            // Only check the sector info in data sectors
+            if (detected_type != STT_CDDA && detected_type != STT_CDDA_GAP) {
+                // Check if MSF can be regenerated (libcrypt protection)
+                uint8_t time_data[3];
+                sTools->sector_to_time(time_data, image_sector + 0x96);
+                if (
+                    ecm_data_header->optimizations & OO_REMOVE_MSF &&
+                    (time_data[0] != in_sector[0x0C] ||
+                    time_data[1] != in_sector[0x0D] ||
+                    time_data[2] != in_sector[0x0E])
+                ) {
+                    // Sector contains wrong MSF, so it cannot be recovered in a lossless way
+                    // To avoid this problem, we will disable the sector MSF optimization
+                    ecm_data_header->optimizations = (optimization_options)(ecm_data_header->optimizations & ~OO_REMOVE_MSF);
+                    //printf("Disabled MSF optimization. current_sector: %d, %d\n\n", current_sector, ecm_data_header->optimizations);
+                }
+
+                // Check if redundant FLAG can be regenerated (Only Mode 2 XA modes)
+                if (
+                    (
+                        detected_type == STT_MODE2_1 ||
+                        detected_type == STT_MODE2_1_GAP ||
+                        detected_type == STT_MODE2_2 ||
+                        detected_type == STT_MODE2_2_GAP
+                    ) &&
+                    ecm_data_header->optimizations & OO_REMOVE_REDUNDANT_FLAG &&
+                    (
+                        in_sector[0x10] != in_sector[0x14] ||
+                        in_sector[0x11] != in_sector[0x15] ||
+                        in_sector[0x12] != in_sector[0x16] ||
+                        in_sector[0x13] != in_sector[0x17]
+                    )
+                ) {
+                    // Sector contains wrong subheader redundancy, so it cannot be recovered in a lossless way
+                    // To avoid this problem, we will disable the sector redundant FLAG removal
+                    //printf("Disabled redundant FLAG. current_sector: %d\n\n", current_sector);
+                    ecm_data_header->optimizations = (optimization_options)(ecm_data_header->optimizations & ~OO_REMOVE_REDUNDANT_FLAG);
+                }
+            }
+
+            // Replace the current optimization options to match the header optimizations
+            options->optimizations = (optimization_options)ecm_data_header->optimizations;
+
+            // Compression of the sector class
+            sector_tools_stream_classes sector_class = sTools->detect_stream_class(in_sector, detected_type);
+            analyzer_sector_add(sTools, streams_script, executable, in_sector, detected_type, sector_class, current_sector, options);
+
+            // The profiles build their own streams with their codecs from the same analysis
+            if (jobs) {
+                for (size_t j = 0; j < jobs->size(); j++) {
+                    profile_job &job = (*jobs)[j];
+                    job.options.optimizations = options->optimizations;
+                    analyzer_sector_add(sTools, job.streams_script, job.executable, in_sector, detected_type, sector_class, current_sector, &job.options);
+                }
+            }
+        }
+        else {
+            // There was an eror reading the new sector
+            fprintf(stderr, "There was an error reading the input file.\n");
+            return ECMTOOL_FILE_READ_ERROR;
+        }
+
+        current_sector++;
+    }
+
+    analyzer_streams_join(streams_script, options);
+    if (jobs) {
+        for (size_t i = 0; i < jobs->size(); i++) {
+            analyzer_streams_join((*jobs)[i].streams_script, &(*jobs)[i].options);
+        }
+    }
+
+    return ECMTOOL_OK;
+}
+
+
+/**
+ * @brief Adds an analyzed sector to the streams, with the codec of its class in the options. A new stream is
+ *        started when the audio/data type, the codec or the filter changes, or when a new FLAC segment is required.
+ *
+ * @param sTools Sector tools object
+ * @param streams_script The streams generated by the analyzer
+ * @param executable The executable which is being detected in these streams
+ * @param in_sector The sector data
+ * @param detected_type The sector type
+ * @param sector_class The sector stream class
+ * @param current_sector The sector position in the encoding order
+ * @param options The encoding options with the codecs
+ */
+static void analyzer_sector_add (
+    sector_tools *sTools,
+    std::vector<stream_script> &streams_script,
+    executable_tracker &executable,
+    uint8_t *in_sector,
+    sector_tools_types detected_type,
+    sector_tools_stream_classes sector_class,
+    uint64_t current_sector,
+    ecm_options *options
+) {
+    class_codec sector_codec = class_policy(sector_class, options);
+
+    // Long FLAC streams are splitted in segments, preferably at the tracks gaps. The segments
+    // don't depend on the threads number, so the output is the same with any threads number.
+    bool new_segment = false;
+    if (
+        streams_script.size() &&
+        streams_script.back().stream_data.type == STSC_CDDA &&
+        sector_class == STSC_CDDA &&
+        streams_script.back().stream_data.compression == C_FLAC
+    ) {
+        uint64_t segment_start = 0;
+        if (streams_script.size() > 1) {
+            segment_start = streams_script[streams_script.size() - 2].stream_data.end_sector;
+        }
+        uint64_t segment_sectors = streams_script.back().stream_data.end_sector - segment_start;
+
+        new_segment = (
+            segment_sectors >= AUDIO_SEGMENT_MIN_SECTORS &&
+            detected_type == STT_CDDA_GAP &&
+            streams_script.back().sectors_data.back().mode != STT_CDDA_GAP
+        ) || (
+            segment_sectors >= AUDIO_SEGMENT_MAX_SECTORS &&
+            (!options->seekable || !(current_sector % options->sectors_per_block))
+        );
+    }
+
+    // The filters are only useful if the data is compressed (and never with FLAC). By default the
+    // executables are stored in their own streams with the branch filter of their architecture.
+    sector_tools_filter sector_filter = F_NONE;
+    if (sector_codec.compression == C_NONE || sector_codec.compression == C_FLAC) {
+        sector_filter = F_NONE;
+    }
+    else if (sector_codec.filter >= 0) {
+        sector_filter = (sector_tools_filter)sector_codec.filter;
+    }
+    else if (sector_class == STSC_XA_AUDIO) {
+        if (options->xa_model) {
+            sector_filter = F_XA_ADPCM;
+        }
+    }
+    else if (sector_class != STSC_CDDA && sector_class != STSC_VIDEO) {
+        uint64_t executable_size = 0;
+        sector_tools_filter detected_filter = sTools->detect_executable(in_sector, detected_type, executable_size);
+        if (detected_filter != F_NONE) {
+            executable.filter = detected_filter;
+            executable.end_sector = current_sector + (executable_size + 0x7FF) / 0x800;
+        }
+        if (current_sector < executable.end_sector) {
+            sector_filter = executable.filter;
+        }
+    }
+
+    // If there are no streams, the audio/data type, the compression or the filter is different or a
+    // new segment is required, create a new streams entry.
+    if (
+        streams_script.size() == 0 ||
+        (streams_script.back().stream_data.type == STSC_CDDA) != (sector_class == STSC_CDDA) ||
+        streams_script.back().stream_data.compression != sector_codec.compression ||
+        streams_script.back().compression_level != sector_codec.level ||
+        streams_script.back().stream_data.filter != sector_filter ||
+        new_segment ||
+        (options->auto_codec && streams_script.back().stream_data.type != sector_class)
+    ) {
+        // Push the new element to the end
+        streams_script.push_back(stream_script());
+
+        // Set the element data
+        streams_script.back().stream_data.type = sector_class;
+        streams_script.back().stream_data.filter = sector_filter;
+        streams_script.back().stream_data.compression = sector_codec.compression;
+        streams_script.back().compression_level = sector_codec.level;
+
+        if (streams_script.size() > 1) {
+            streams_script.back().stream_data.end_sector = streams_script[streams_script.size() - 2].stream_data.end_sector;
+        }
+        else {
+            streams_script.back().stream_data.end_sector = 0;
+        }
+    }
+    else if (streams_script.back().stream_data.type != sector_class) {
+        // The data classes with the same compression are stored together
+        streams_script.back().stream_data.type = STSC_DATA;
+    }
+
+    if (
+        streams_script.back().sectors_data.size() == 0 ||
+        streams_script.back().sectors_data.back().mode != detected_type
+    ) {
+        // Push the new element to the end
+        streams_script.back().sectors_data.push_back(sector());
+
+        // Set the element data
+        streams_script.back().sectors_data.back().mode = detected_type;
+        streams_script.back().sectors_data.back().sector_count = 0;
+    }
+
+    streams_script.back().stream_data.end_sector++;
+    streams_script.back().sectors_data.back().sector_count++;
+}
+
+
+/**
+ * @brief Joins the short XA audio streams to the streams around them, once all the sectors are analyzed
+ *
+ * @param streams_script The streams generated by the analyzer
+ * @param options The encoding options with the codecs
+ */
+static void analyzer_streams_join (
+    std::vector<stream_script> &streams_script,
+    ecm_options *options
+) {
+    // The short XA audio streams are moved to the class of the video streams around them (the STR files
+    // interleave the video and the audio), or returned to the data streams, and joined with them
+    std::vector<stream_script> joined_streams;
+    uint64_t stream_start = 0;
+    for (size_t i = 0; i < streams_script.size(); i++) {
+        stream_script &current = streams_script[i];
+        if (
+            current.stream_data.type == STSC_XA_AUDIO &&
+            current.stream_data.end_sector - stream_start < XA_STREAM_MIN_SECTORS
+        ) {
+            sector_tools_stream_classes joined_class = STSC_FORM2;
+            if (
+                (joined_streams.size() && joined_streams.back().stream_data.type == STSC_VIDEO) ||
+                (i + 1 < streams_script.size() && streams_script[i + 1].stream_data.type == STSC_VIDEO)
+            ) {
+                joined_class = STSC_VIDEO;
+            }
+            class_codec joined_codec = class_policy(joined_class, options);
+            current.stream_data.type = joined_class;
+            current.stream_data.compression = joined_codec.compression;
+            current.compression_level = joined_codec.level;
+            current.stream_data.filter = F_NONE;
+            if (joined_codec.filter >= 0 && joined_codec.compression != C_NONE) {
+                current.stream_data.filter = joined_codec.filter;
+            }
+        }
+        stream_start = current.stream_data.end_sector;
+
+        if (
+            joined_streams.size() &&
+            joined_streams.back().stream_data.type != STSC_CDDA &&
+            current.stream_data.type != STSC_CDDA &&
+            joined_streams.back().stream_data.compression == current.stream_data.compression &&
+            joined_streams.back().compression_level == current.compression_level &&
+            joined_streams.back().stream_data.filter == current.stream_data.filter &&
+            (!options->auto_codec || joined_streams.back().stream_data.type == current.stream_data.type)
+        ) {
+            stream_script &previous = joined_streams.back();
+            if (previous.stream_data.type != current.stream_data.type) {
+                previous.stream_data.type = STSC_DATA;
+            }
+            for (size_t j = 0; j < current.sectors_data.size(); j++) {
+                if (previous.sectors_data.back().mode == current.sectors_data[j].mode) {
+                    previous.sectors_data.back().sector_count += current.sectors_data[j].sector_count;
+                }
+                else {
+                    previous.sectors_data.push_back(current.sectors_data[j]);
+                }
+            }
+            previous.stream_data.end_sector = current.stream_data.end_sector;
+        }
+        else {
+            joined_streams.push_back(current);
+        }
+    }
+    streams_script.swap(joined_streams);
+}
+
+
+/**
+ * @brief Splits the compressed streams to store without compression the blocks with an entropy over the
+ *        threshold (usually data which is already compressed, like videos or packed files). The raw streams
+ *        are copied as they are by the decoder.
+ *
+ * @param streams_script The streams generated by the analyzer
+ * @param blocks_entropy The estimated entropy of every block of sectors
+ * @param options The encoding options with the entropy threshold
+ * @param encode_data The summary data
+ */
+static void entropy_split (
+    std::vector<stream_script> &streams_script,
+    std::vector<float> &blocks_entropy,
+    ecm_options *options,
+    encode_summary *encode_data
+) {
+    std::vector<stream_script> splitted_streams;
+    uint64_t stream_start = 0;
+    for (size_t i = 0; i < streams_script.size(); i++) {
+        stream_script &current = streams_script[i];
+        uint64_t stream_end = current.stream_data.end_sector;
+
+        // Parts of the stream (end sector and if it will be stored raw). FLAC is not affected.
+        std::vector<std::pair<uint64_t, bool>> parts;
+        if (current.stream_data.compression != C_NONE && current.stream_data.compression != C_FLAC) {
+            for (uint64_t sector = stream_start; sector < stream_end;) {
+                uint64_t block = sector / ENTROPY_BLOCK_SECTORS;
+                uint64_t block_end = std::min((block + 1) * ENTROPY_BLOCK_SECTORS, stream_end);
+                bool raw = block < blocks_entropy.size() && blocks_entropy[block] >= options->entropy_threshold;
+                if (parts.size() && parts.back().second == raw) {
+                    parts.back().first = block_end;
+                }
+                else {
+                    parts.push_back({block_end, raw});
+                }
+                sector = block_end;
+            }
+
+            // The short raw parts are compressed with the parts around them
+            std::vector<std::pair<uint64_t, bool>> joined_parts;
+            uint64_t part_start = stream_start;
+            for (size_t j = 0; j < parts.size(); j++) {
+                bool raw = parts[j].second && parts[j].first - part_start >= ENTROPY_MIN_SECTORS;
+                if (joined_parts.size() && joined_parts.back().second == raw) {
+                    joined_parts.back().first = parts[j].first;
+                }
+                else {
+                    joined_parts.push_back({parts[j].first, raw});
+                }
+                part_start = parts[j].first;
+            }
+            parts.swap(joined_parts);
+        }
+        else {
+            parts.push_back({stream_end, false});
+        }
+
+        // Split the sectors runs between the parts
+        size_t run = 0;
+        uint64_t run_used = 0;
+        uint64_t part_start = stream_start;
+        for (size_t j = 0; j < parts.size(); j++) {
+            stream_script part;
+            part.stream_data = current.stream_data;
+            part.stream_data.end_sector = parts[j].first;
+            part.compression_level = current.compression_level;
+            if (parts[j].second) {
+                part.stream_data.compression = C_NONE;
+                part.stream_data.filter = F_NONE;
+                part.compression_level = 0;
+                encode_data->raw_streams++;
+                encode_data->raw_sectors += parts[j].first - part_start;
+            }
+
+            uint64_t part_sectors = parts[j].first - part_start;
+            while (part_sectors) {
+                uint64_t run_sectors = std::min(part_sectors, current.sectors_data[run].sector_count - run_used);
+                part.sectors_data.push_back(current.sectors_data[run]);
+                part.sectors_data.back().sector_count = run_sectors;
+
+                part_sectors -= run_sectors;
+                run_used += run_sectors;
+                if (run_used == current.sectors_data[run].sector_count) {
+                    run++;
+                    run_used = 0;
+                }
+            }
+
+            splitted_streams.push_back(part);
+            part_start = parts[j].first;
+        }
+
+        stream_start = stream_end;
+    }
+    streams_script.swap(splitted_streams);
+}
+
+
+/**
+ * @brief Splits the first sectors of the seekable streams in their own stream (the primer). The rest of the
+ *        stream uses the primer data as compression dictionary, so every seekable block starts with that history
+ *        instead of an empty window. Only zlib and zstd allow to use a dictionary in every block.
+ *
+ * @param streams_script The streams to split
+ * @param options The encoding options with the primer size in KB
+ * @param encode_data The summary data
+ */
+static void primer_split (
+    std::vector<stream_script> &streams_script,
+    ecm_options *options,
+    encode_summary *encode_data
+) {
+    // The primer size is aproximated with the Mode 1 sectors size
+    uint64_t primer_sectors = ((uint64_t)options->seekable_primer * 1024 + 2047) / 2048;
+
+    std::vector<stream_script> splitted_streams;
+    uint64_t stream_start = 0;
+    for (size_t i = 0; i < streams_script.size(); i++) {
+        stream_script &current = streams_script[i];
+        uint64_t stream_end = current.stream_data.end_sector;
+
+        // The short streams are not worth it
+        if (
+            (current.stream_data.compression != C_ZLIB && current.stream_data.compression != C_ZSTD) ||
+            stream_end - stream_start < primer_sectors * 2
+        ) {
+            splitted_streams.push_back(current);
+            stream_start = stream_end;
+            continue;
+        }
+
+        // Split the sectors runs between the primer and the rest of the stream
+        size_t run = 0;
+        uint64_t run_used = 0;
+        uint64_t part_start = stream_start;
+        for (uint8_t j = 0; j < 2; j++) {
+            stream_script part;
+            part.stream_data = current.stream_data;
+            part.stream_data.end_sector = j ? stream_end : stream_start + primer_sectors;
+            part.stream_data.primed = j;
+            part.compression_level = current.compression_level;
+
+            uint64_t part_sectors = part.stream_data.end_sector - part_start;
+            while (part_sectors) {
+                uint64_t run_sectors = std::min(part_sectors, current.sectors_data[run].sector_count - run_used);
+                part.sectors_data.push_back(current.sectors_data[run]);
+                part.sectors_data.back().sector_count = run_sectors;
+
+                part_sectors -= run_sectors;
+                run_used += run_sectors;
+                if (run_used == current.sectors_data[run].sector_count) {
+                    run++;
+                    run_used = 0;
+                }
+            }
+
+            splitted_streams.push_back(part);
+            part_start = part.stream_data.end_sector;
+        }
+        encode_data->primed_streams++;
+
+        stream_start = stream_end;
+    }
+    streams_script.swap(splitted_streams);
+}
+
+
+/**
+ * @brief Levels range of a codec used by the target speed controller. The zstd levels above 19 are not used
+ *        because their memory usage is too high.
+ *
+ * @param compression The codec
+ * @param min_level Output fastest level
+ * @param max_level Output strongest level
+ */
+static void speed_level_range (
+    sector_tools_compression compression,
+    int8_t &min_level,
+    int8_t &max_level
+) {
+    min_level = compression == C_LZMA ? 0 : 1;
+    max_level = compression == C_ZSTD ? 19 : 9;
+}
+
+
+/**
+ * @brief Gets the codec and the compression level of the next block using the target speed controller state.
+ *        The first block of every codec uses the configured level.
+ *
+ * @param controller The target speed controller
+ * @param compression The stream codec
+ * @param configured_level The level configured for the stream
+ * @param block_compression Output codec of the block, which is LZ4 if the stream codec is too slow
+ * @param block_level Output level of the block
+ */
+static void speed_control_level (
+    speed_controller *controller,
+    sector_tools_compression compression,
+    uint8_t configured_level,
+    sector_tools_compression &block_compression,
+    uint8_t &block_level
+) {
+    block_compression = compression;
+    block_level = configured_level;
+    if (compression == C_NONE || compression == C_FLAC) {
+        return;
+    }
+
+    int8_t min_level = 0;
+    int8_t max_level = 0;
+    speed_level_range(compression, min_level, max_level);
+    if (controller->level[compression] < 0) {
+        controller->level[compression] = std::clamp((int8_t)std::min(configured_level, (uint8_t)127), min_level, max_level);
+    }
+
+    if (controller->fallback[compression]) {
+        block_compression = C_LZ4;
+        block_level = 1;
+    }
+    else {
+        block_level = controller->level[compression];
+    }
+}
+
+
+/**
+ * @brief Adds a block encoded with the target speed controller to the summary
+ *
+ * @param encode_data The summary data
+ * @param fallback The block uses LZ4 because the stream codec is too slow
+ * @param level The block compression level
+ */
+static void speed_control_count (
+    encode_summary *encode_data,
+    bool fallback,
+    uint8_t level
+) {
+    encode_data->speed_blocks++;
+    if (fallback) {
+        encode_data->speed_fallback_blocks++;
+    }
+    encode_data->speed_min_level = std::min(encode_data->speed_min_level, level);
+    encode_data->speed_max_level = std::max(encode_data->speed_max_level, level);
+}
+
+
+/**
+ * @brief Updates the target speed controller with the speed of the last block. The speed required to encode
+ *        the rest of the image in the time left is computed, and the codec level is lowered if the block
+ *        was slower, or raised if it was a lot faster. Below the fastest level the codec is replaced by LZ4.
+ *
+ * @param controller The target speed controller
+ * @param compression The codec of the block before the controller changes
+ * @param block_bytes The block input size
+ * @param block_time The block encoding time
+ * @param encode_data The summary data
+ */
+static void speed_control_update (
+    speed_controller *controller,
+    sector_tools_compression compression,
+    uint64_t block_bytes,
+    double block_time,
+    encode_summary *encode_data
+) {
+    controller->done_bytes += block_bytes;
+    if (
+        compression == C_NONE ||
+        compression == C_FLAC ||
+        controller->level[compression] < 0 ||
+        controller->done_bytes >= controller->total_bytes ||
+        !block_bytes ||
+        block_time <= 0
+    ) {
+        return;
+    }
+
+    // Without time left the fastest settings are used
+    double elapsed_time = std::chrono::duration<double>(
+        std::chrono::high_resolution_clock::now() - controller->start_time
+    ).count();
+    double left_time = MB(controller->total_bytes) / controller->target_speed - elapsed_time;
+    double required_speed = left_time > 0 ? MB(controller->total_bytes - controller->done_bytes) / left_time : INFINITY;
+    double block_speed = MB(block_bytes) / block_time;
+
+    int8_t step = 0;
+    if (block_speed < required_speed * 0.5) {
+        step = -2;
+    }
+    else if (block_speed < required_speed) {
+        step = -1;
+    }
+    else if (block_speed > required_speed * 1.5) {
+        step = 1;
+    }
+
+    int8_t min_level = 0;
+    int8_t max_level = 0;
+    speed_level_range(compression, min_level, max_level);
+    if (controller->fallback[compression]) {
+        // The codec is used again with its fastest level
+        if (step > 0) {
+            controller->fallback[compression] = false;
+            encode_data->speed_level_changes++;
+        }
+    }
+    else if (step < 0 && controller->level[compression] == min_level && compression != C_LZ4) {
+        controller->fallback[compression] = true;
+        encode_data->speed_level_changes++;
+    }
+    else {
+        int8_t new_level = std::clamp((int8_t)(controller->level[compression] + step), min_level, max_level);
+        if (new_level != controller->level[compression]) {
+            controller->level[compression] = new_level;
+            encode_data->speed_level_changes++;
+        }
+    }
+}
+
+
+/**
+ * @brief Reads the ISO9660 directory tree and builds the encoding order of the image sectors, with
+ *        the files grouped by their extension. The sectors which are not part of any file (system area,
+ *        directories, audio tracks...) are kept first in their original order.
+ *
+ * @param in_file Image file
+ * @param sectors_count Image sectors
+ * @param sectors_order Output runs of sectors in the encoding order. Empty if the order doesn't change.
+ * @param encode_data Summary counters
+ * @return ecmtool_return_code
+ */
+static ecmtool_return_code files_order (
+    std::ifstream &in_file,
+    uint64_t sectors_count,
+    std::vector<dedup_run> &sectors_order,
+    encode_summary *encode_data
+) {
+    sectors_order.clear();
+
+    iso9660 filesystem(in_file, sectors_count);
+    if (filesystem.read()) {
+        in_file.clear();
+        in_file.seekg(0, std::ios_base::beg);
+        fprintf(stderr, "WARNING: The ISO9660 filesystem cannot be read. The files will not be grouped.\n");
+        return ECMTOOL_OK;
+    }
+
+    // Files of the same type together, in their image order
+    std::stable_sort(
+        filesystem.files.begin(),
+        filesystem.files.end(),
+        [](const iso9660_file &a, const iso9660_file &b) {
+            if (a.extension != b.extension) {
+                return a.extension < b.extension;
+            }
+            return a.start_sector < b.start_sector;
+        }
+    );
+
+    // Every sector is assigned to the first file which contains it, because some images have files
+    // sharing the same sectors
+    std::vector<bool> assigned(sectors_count, false);
+    std::vector<std::pair<uint64_t, uint64_t>> files_runs;
+    for (size_t i = 0; i < filesystem.files.size(); i++) {
+        for (uint64_t j = 0; j < filesystem.files[i].sector_count; j++) {
+            uint64_t sector = filesystem.files[i].start_sector + j;
+            if (assigned[sector]) {
+                continue;
+            }
+            assigned[sector] = true;
+            if (files_runs.size() && files_runs.back().first + files_runs.back().second == sector) {
+                files_runs.back().second++;
+            }
+            else {
+                files_runs.push_back({sector, 1});
+            }
+        }
+        encode_data->grouped_files++;
+    }
+
+    // Adds a run of image sectors to the encoding order, joined with the previous one if it's consecutive
+    uint64_t order_sectors = 0;
+    auto add_run = [&](uint64_t image_sector, uint64_t sector_count) {
+        if (
+            sectors_order.size() &&
+            sectors_order.back().reference_sector + sectors_order.back().sector_count == image_sector
+        ) {
+            sectors_order.back().sector_count += sector_count;
+        }
+        else {
+            sectors_order.push_back({order_sectors, sector_count, image_sector});
+        }
+        order_sectors += sector_count;
+    };
+
+    for (uint64_t i = 0; i < sectors_count; i++) {
+        if (!assigned[i]) {
+            add_run(i, 1);
+        }
+    }
+    for (size_t i = 0; i < files_runs.size(); i++) {
+        add_run(files_runs[i].first, files_runs[i].second);
+    }
+
+    // The order is not stored if the files are already grouped
+    if (sectors_order.size() == 1) {
+        sectors_order.clear();
+    }
+    encode_data->order_runs = sectors_order.size();
+
+    return ECMTOOL_OK;
+}
+
+
+/**
+ * @brief Gets the compression of a stream class, from its own settings or from the general options
+ *
+ * @param stream_class Stream class
+ * @param options Encoding options
+ * @return class_codec with the compression, the level and the filter of the class
+ */
+static class_codec class_policy (
+    sector_tools_stream_classes stream_class,
+    ecm_options *options
+) {
+    class_codec policy = options->class_codecs[stream_class];
+
+    // With the automatic selection, the classes are analyzed as compressed (to detect the filters and
+    // the audio segments) and their codec is chosen later
+    if (!policy.enabled && options->auto_codec) {
+        policy.compression = stream_class == STSC_CDDA ? C_FLAC : C_ZSTD;
+    }
+    else if (!policy.enabled) {
+        switch (stream_class) {
+            case STSC_CDDA:
+                policy.compression = options->audio_compression;
+                break;
+
+            case STSC_XA_AUDIO:
+                policy.compression = options->xa_compression;
+                break;
+
+            case STSC_VIDEO:
+                policy.compression = options->video_compression;
+                break;
+
+            default:
+                policy.compression = options->data_compression;
+                break;
+        }
+    }
+
+    if (policy.level < 0) {
+        policy.level = options->compression_level;
+    }
+
+    // The chunk store compress the chunks by itself
+    if (!options->store_path.empty()) {
+        policy.compression = C_NONE;
+    }
+
+    // The level of the uncompressed streams doesn't matter, so they are not splitted by it
+    if (policy.compression == C_NONE) {
+        policy.level = 0;
+    }
+
+    return policy;
+}
+
+
+static uint8_t summary_class (
+    stream &stream_data
+) {
+    // Streams written with an old version don't have the class
+    if (stream_data.type >= STSC_COUNT) {
+        return STSC_DATA;
+    }
+
+    return stream_data.type;
+}
+
+
+/**
+ * @brief Flushes the compressor with the provided mode and writes all its output, leaving the buffer empty
+ *
+ * @param compobj The compressor
+ * @param comp_buffer The compressor output buffer of BUFFER_SIZE bytes
+ * @param out_file The output file
+ * @param flush_mode The flush mode
+ * @return ecmtool_return_code
+ */
+static ecmtool_return_code compress_flush (
+    compressor *compobj,
+    uint8_t *comp_buffer,
+    std::fstream &out_file,
+    uint8_t flush_mode
+) {
+    size_t compress_buffer_left = 0;
+    int8_t res = compobj -> compress(compress_buffer_left, NULL, 0, flush_mode);
+    while (true) {
+        if (res != 0) {
+            fprintf(stderr, "There was an error compressing the stream: %d.\n", res);
+            return ECMTOOL_PROCESSING_ERROR;
+        }
+
+        out_file.write(reinterpret_cast<char*>(comp_buffer), BUFFER_SIZE - compress_buffer_left);
+        if (!out_file.good()) {
+            fprintf(stderr, "\nThere was an error writting the output file");
+            return ECMTOOL_FILE_WRITE_ERROR;
+        }
+        size_t output_size = BUFFER_SIZE;
+        compobj -> set_output(comp_buffer, output_size);
+
+        if (!compobj -> flush_pending()) {
+            return ECMTOOL_OK;
+        }
+        res = compobj -> compress(compress_buffer_left, NULL, 0, flush_mode);
+    }
+}
+
+
+static ecmtool_return_code disk_encode (
+    sector_tools *sTools,
+    std::ifstream &in_file,
+    std::fstream &out_file,
+    std::vector<stream_script> &streams_script,
+    std::vector<dedup_run> &dedup_runs,
+    std::vector<chunk_ref> &chunk_refs,
+    chunk_store *store,
+    std::vector<dedup_run> &reference_runs,
+    std::vector<dedup_run> &sectors_order,
+    std::fstream *base_file,
+    uint64_t base_sectors,
+    ecm_options *options,
+    std::vector<uint64_t> *sectors_type,
+    encode_summary *encode_data,
+    speed_controller *controller,
+    uint64_t ecm_block_start_position,
+    sector_queue *queue
+) {
+    // Sectors buffers
+    uint8_t in_sector[2352];
+    uint8_t out_sector[2352];
+
+    // Hash
+    uint32_t input_edc = 0;
+    uint8_t buffer_edc[4];
+
+    // Reference to sectors_type
+    std::vector<uint64_t>& sectors_type_ref = *sectors_type;
+
+    // Deduplication index. The key is the cleaned sector hash, size and mode, and the value
+    // is the first sector with that key. Matches are confirmed byte by byte before use.
+    std::unordered_map<uint64_t, uint64_t> dedup_index;
+
+    // Sectors read and the position of the last one in the image, which is different if the files are grouped
+    uint64_t read_sectors = 0;
+    uint64_t current_order_run = 0;
+    uint64_t image_sector = 0;
+
+    // Chunk buffer used when the data is sent to the chunk store
+    std::vector<uint8_t> chunk_buffer;
+    uint32_t chunk_sectors = 0;
+
+    // Reference image index (same key than the deduplication index) and the distance between
+    // the current sector and the last matched reference sector, to follow it in lockstep
+    std::unordered_map<uint64_t, uint64_t> reference_index;
+    int64_t reference_offset = 0;
+
+    // FLAC segments waiting to be compressed in parallel
+    std::vector<audio_segment> audio_segments;
+
+    // Data of the primer stream, and the dictionary of the primed stream which follows it
+    std::vector<uint8_t> primer;
+    std::vector<uint8_t> primed_dictionary;
+
+    if (base_file) {
+        base_file->seekg(0, std::ios_base::beg);
+        for (uint64_t i = 0; i < base_sectors; i++) {
+            base_file->read(reinterpret_cast<char*>(in_sector), 2352);
+            if (!base_file->good()) {
+                fprintf(stderr, "There was an error reading the reference image.\n");
+                return ECMTOOL_FILE_READ_ERROR;
+            }
+
+            sector_tools_types base_type = sTools->detect(in_sector);
+            uint16_t base_size = 0;
+            sTools->clean_sector(out_sector, in_sector, base_type, base_size, options->optimizations);
+            if (base_size) {
+                uint64_t base_key = ((uint64_t)base_type << 48) |
+                                    ((uint64_t)base_size << 32) |
+                                    sTools->edc_compute(0, out_sector, base_size);
+                // Keep the first sector with that key
+                reference_index.emplace(base_key, i);
+            }
+        }
+    }
+
+    // Seek to the begin
+    in_file.seekg(0, std::ios_base::beg);
+
+    // Start of the streams data, to compute the output size of every stream
+    uint64_t streams_start_position = (uint64_t)out_file.tellp() - ecm_block_start_position;
+
+    // In solid mode the compressed streams of the same class and codec share a compression context, if there
+    // are more than one. FLAC is not affected because its frames don't use the previous data.
+    std::vector<solid_context> solid_contexts;
+    std::unordered_map<uint16_t, size_t> solid_index;
+    if (options->solid) {
+        std::unordered_map<uint16_t, uint32_t> class_streams;
+        for (uint32_t i = 0; i < streams_script.size(); i++) {
+            if (streams_script[i].stream_data.compression != C_NONE && streams_script[i].stream_data.compression != C_FLAC) {
+                class_streams[(streams_script[i].stream_data.type << 8) | streams_script[i].stream_data.compression]++;
+            }
+        }
+        for (uint32_t i = 0; i < streams_script.size(); i++) {
+            uint16_t key = (streams_script[i].stream_data.type << 8) | streams_script[i].stream_data.compression;
+            auto class_found = class_streams.find(key);
+            if (class_found == class_streams.end() || class_found->second < 2) {
+                continue;
+            }
+
+            // The contexts are stored in the order of their first stream
+            if (solid_index.find(key) == solid_index.end()) {
+                solid_index[key] = solid_contexts.size();
+                solid_contexts.push_back(solid_context());
+            }
+            solid_contexts[solid_index[key]].last_stream = i;
+            streams_script[i].stream_data.solid = 1;
+            encode_data->solid_streams++;
+        }
+        encode_data->solid_contexts = solid_contexts.size();
+    }
+
+    // Stream processing
+    for (uint32_t i = 0; i < streams_script.size(); i++) {
+        // The encoding time is added to the stream class in the summary
+        auto stream_start_time = std::chrono::high_resolution_clock::now();
+        // Compressor object
+        compressor *compobj = NULL;
+        // Buffer object
+        uint8_t *comp_buffer = NULL;
+        // Batch buffer. The sectors are cleaned directly into it, and it's sent to the compressor
+        // in one call at the flush points or when it is full
+        uint8_t *batch_buffer = NULL;
+        size_t batch_size = 0;
+        uint32_t batch_sectors = 0;
+        // Position of the next data in the stream, used by the branch filters
+        uint64_t filter_position = 0;
+        // Context shared with the other streams of the class in solid mode
+        solid_context *context = NULL;
+        if (streams_script[i].stream_data.solid) {
+            context = &solid_contexts[solid_index[(streams_script[i].stream_data.type << 8) | streams_script[i].stream_data.compression]];
+        }
+
+        // The target speed controller chooses the level at the stream start, and changes it after every block
+        sector_tools_compression stream_compression = (sector_tools_compression)streams_script[i].stream_data.compression;
+        uint64_t speed_block_sectors = 0;
+        auto speed_block_start_time = stream_start_time;
+        if (controller) {
+            sector_tools_compression block_compression = stream_compression;
+            uint8_t block_level = 0;
+            speed_control_level(controller, stream_compression, streams_script[i].compression_level, block_compression, block_level);
+            if (stream_compression != C_NONE && stream_compression != C_FLAC) {
+                streams_script[i].stream_data.compression = block_compression;
+                streams_script[i].compression_level = block_level;
+                speed_control_count(encode_data, block_compression != stream_compression, block_level);
+            }
+        }
+
+        // Initialize the compressor and the buffer if required
+        if (streams_script[i].stream_data.compression) {
+            // Set compression level with extreme option if compression is LZMA
+            int32_t compression_option = streams_script[i].compression_level;
+            // Only zstd supports levels above 9
+            if ((sector_tools_compression)streams_script[i].stream_data.compression != C_ZSTD && compression_option > 9) {
+                compression_option = 9;
+            }
+            streams_script[i].stream_data.level = compression_option;
+            if (options->extreme_compression) {
+                if ((sector_tools_compression)streams_script[i].stream_data.compression == C_LZMA) {
+                    compression_option |= LZMA_PRESET_EXTREME;
+                }
+                else if ((sector_tools_compression)streams_script[i].stream_data.compression == C_FLAC) {
+                    compression_option |= FLACZLIB_EXTREME_COMPRESSION;
+                }
+                else if ((sector_tools_compression)streams_script[i].stream_data.compression == C_ZSTD) {
+                    compression_option |= COMPRESSOR_ZSTD_EXTREME;
+                }
+            }
+            // The FLAC streams are compressed later with the next segments
+            if ((sector_tools_compression)streams_script[i].stream_data.compression == C_FLAC) {
+                audio_segments.push_back(audio_segment());
+                audio_segments.back().stream_index = i;
+                audio_segments.back().compression_level = compression_option;
+            }
+            // The solid streams continue the context of the first stream of their class
+            else if (context && context->compobj) {
+                compobj = context->compobj;
+                comp_buffer = context->buffer;
+                streams_script[i].stream_data.level = context->level;
+            }
+            // The primed streams use their own dictionary, so their compressors are not shared with the pool
+            else if (streams_script[i].stream_data.primed) {
+                primed_dictionary = options->dictionary;
+                primed_dictionary.insert(primed_dictionary.end(), primer.begin(), primer.end());
+                compobj = new compressor(
+                    (sector_tools_compression)streams_script[i].stream_data.compression,
+                    true,
+                    compression_option,
+                    primed_dictionary.data(),
+                    primed_dictionary.size(),
+                    options->threads
+                );
+            }
+            else {
+                compobj = options->codecs_pool->get(
+                    (sector_tools_compression)streams_script[i].stream_data.compression,
+                    true,
+                    compression_option,
+                    options->dictionary.data(),
+                    options->dictionary.size(),
+                    options->threads
+                );
+            }
+        }
+
+        // The data sent to the compressor is kept if the next stream uses it as dictionary
+        bool primer_stream = i + 1 < streams_script.size() && streams_script[i + 1].stream_data.primed;
+        primer.clear();
+
+        // The primer streams are short and must be kept as they are, because the next stream uses them
+        bool speed_control = controller && compobj && !primer_stream;
+
+        if (compobj) {
+            if (!comp_buffer) {
+                // Initialize the compressor buffer
+                comp_buffer = options->codecs_pool->get_buffer(BUFFER_SIZE);
+                if(!comp_buffer) {
+                    fprintf(stderr, "Out of memory\n");
+                    return ECMTOOL_BUFFER_MEMORY_ERROR;
+                }
+
+                // Set the compressor buffer as output
+                size_t output_size = BUFFER_SIZE;
+                compobj -> set_output(comp_buffer, output_size);
+
+                if (context) {
+                    context->compobj = compobj;
+                    context->buffer = comp_buffer;
+                    context->level = streams_script[i].stream_data.level;
+                }
+            }
+
+            // Initialize the batch buffer
+            batch_buffer = options->codecs_pool->get_buffer(ENCODE_BATCH_SECTORS * 2352);
+            if(!batch_buffer) {
+                fprintf(stderr, "Out of memory\n");
+                return ECMTOOL_BUFFER_MEMORY_ERROR;
+            }
+        }
+
+        // Walk through all the sector types in stream
+        for (uint32_t j = 0; j < streams_script[i].sectors_data.size(); j++) {
+            // Process the number of sectors of every type
+            for (uint64_t k = 0; k < streams_script[i].sectors_data[j].sector_count; k++) {
+                // Compressed sectors are cleaned directly into the batch buffer or the audio segment
+                uint8_t *sector_data = out_sector;
+                if (batch_buffer) {
+                    sector_data = batch_buffer + batch_size;
+                }
+                else if (streams_script[i].stream_data.compression == C_FLAC) {
+                    size_t segment_size = audio_segments.back().data.size();
+                    audio_segments.back().data.resize(segment_size + 2352);
+                    sector_data = audio_segments.back().data.data() + segment_size;
+                }
+
+                uint16_t output_size = 0;
+                int8_t res = 0;
+                if (queue) {
+                    // The profiles get the sectors already cleaned by the shared reader
+                    std::chrono::high_resolution_clock::duration waited(0);
+                    if (sector_queue_pop(*queue, sector_data, output_size, input_edc, waited)) {
+                        return ECMTOOL_FILE_READ_ERROR;
+                    }
+                    // The time waiting for the slowest profile is not counted by the target speed controller
+                    if (controller) {
+                        controller->start_time += waited;
+                        speed_block_start_time += waited;
+                    }
+                }
+                else {
+                    if (in_file.eof()){
+                        fprintf(stderr, "Unexpected EOF detected.\n");
+                        return ECMTOOL_FILE_READ_ERROR;
+                    }
+
+                    // With the files grouped, the image is only seeked at the start of every run
+                    if (sectors_order.size()) {
+                        uint64_t previous_image_sector = image_sector;
+                        run_lookup(sectors_order, current_order_run, read_sectors, image_sector);
+                        if (!read_sectors || image_sector != previous_image_sector + 1) {
+                            in_file.seekg(image_sector * 2352, std::ios_base::beg);
+                        }
+                    }
+
+                    in_file.read(reinterpret_cast<char*>(in_sector), 2352);
+                    // Compute the crc of the readed data 
+                    input_edc = sTools->edc_compute(
+                        input_edc,
+                        in_sector,
+                        2352
+                    );
+
+                    // We will clean the sector to keep only the data that we want
+                    res = sTools->clean_sector(
+                        sector_data,
+                        in_sector,
+                        (sector_tools_types)streams_script[i].sectors_data[j].mode,
+                        output_size,
+                        options->optimizations
+                    );
+                }
+
+                // Current sector (base 1)
+                uint64_t current_sector = ++read_sectors;
+
+                if (res) {
+                    fprintf(stderr, "There was an error cleaning the sector\n");
+                    return ECMTOOL_PROCESSING_ERROR;
+                }
+
+                sectors_type_ref[streams_script[i].sectors_data[j].mode]++;
+
+                uint64_t sector_key = 0;
+                if ((options->dedup || base_file) && output_size) {
+                    sector_key = ((uint64_t)streams_script[i].sectors_data[j].mode << 48) |
+                                 ((uint64_t)output_size << 32) |
+                                 sTools->edc_compute(0, sector_data, output_size);
+                }
+
+                // Replace the sector by a reference to the reference image if it was not modified. The sector
+                // following the last match is checked first, and the index is used to find the moved data.
+                if (base_file && output_size) {
+                    bool reference_found = false;
+                    uint64_t reference_sector = current_sector - 1 + reference_offset;
+                    if (reference_sector < base_sectors) {
+                        reference_found = dedup_confirm(
+                            sTools,
+                            *base_file,
+                            reference_sector,
+                            (sector_tools_types)streams_script[i].sectors_data[j].mode,
+                            sector_data,
+                            output_size,
+                            options
+                        );
+                    }
+                    if (!reference_found) {
+                        auto reference_index_found = reference_index.find(sector_key);
+                        if (reference_index_found != reference_index.end() && reference_index_found->second != reference_sector) {
+                            reference_sector = reference_index_found->second;
+                            reference_found = dedup_confirm(
+                                sTools,
+                                *base_file,
+                                reference_sector,
+                                (sector_tools_types)streams_script[i].sectors_data[j].mode,
+                                sector_data,
+                                output_size,
+                                options
+                            );
+                        }
+                    }
+
+                    if (reference_found) {
+                        // Extend the last run if both the sector and the reference are contiguous
+                        if (
+                            reference_runs.size() &&
+                            reference_runs.back().start_sector + reference_runs.back().sector_count == current_sector - 1 &&
+                            reference_runs.back().reference_sector + reference_runs.back().sector_count == reference_sector
+                        ) {
+                            reference_runs.back().sector_count++;
+                        }
+                        else {
+                            reference_runs.push_back({current_sector - 1, 1, reference_sector});
+                        }
+                        reference_offset = (int64_t)reference_sector - (current_sector - 1);
+
+                        encode_data->reference_sectors++;
+                        encode_data->reference_bytes += output_size;
+                        // Nothing will be written
+                        output_size = 0;
+                    }
+                }
+
+                // Replace the sector by a reference if it was already stored. Sectors without data
+                // (GAPs) are not deduplicated because there is nothing to save.
+                if (options->dedup && output_size) {
+                    uint64_t dedup_key = sector_key;
+                    auto dedup_found = dedup_index.find(dedup_key);
+
+                    if (dedup_found == dedup_index.end()) {
+                        dedup_index[dedup_key] = current_sector - 1;
+                    }
+                    else if (
+                        dedup_confirm(
+                            sTools,
+                            in_file,
+                            dedup_found->second,
+                            (sector_tools_types)streams_script[i].sectors_data[j].mode,
+                            sector_data,
+                            output_size,
+                            options
+                        )
+                    ) {
+                        // Extend the last run if both the sector and the reference are contiguous
+                        if (
+                            dedup_runs.size() &&
+                            dedup_runs.back().start_sector + dedup_runs.back().sector_count == current_sector - 1 &&
+                            dedup_runs.back().reference_sector + dedup_runs.back().sector_count == dedup_found->second
+                        ) {
+                            dedup_runs.back().sector_count++;
+                        }
+                        else {
+                            dedup_runs.push_back({current_sector - 1, 1, dedup_found->second});
+                        }
+
+                        encode_data->dedup_sectors++;
+                        encode_data->dedup_bytes += output_size;
+                        // Nothing will be written. The compressor is still called to keep the flush points.
+                        output_size = 0;
+                    }
+                }
+
+                uint8_t flush_mode = Z_NO_FLUSH;
+                // Current sector is the last stream sector. The solid context is only finished with its last stream.
+                bool stream_end = current_sector == streams_script[i].stream_data.end_sector;
+                if (stream_end && (!context || context->last_stream == i)) {
+                    flush_mode = Z_FINISH;
+                }
+                else if (options->seekable && (options->sectors_per_block == 1 || !((current_sector + 1) % options->sectors_per_block))) {
+                    // A new compressor block is required
+                    flush_mode = Z_FULL_FLUSH;
+                }
+
+                // Compress the sector using the selected compression (or none)
+                switch (streams_script[i].stream_data.compression) {
+                // No compression
+                case C_NONE:
+                    if (store) {
+                        // Add the data to the current chunk and cut it in a content defined point, so the
+                        // same data will generate the same chunks even if it is moved in another image
+                        chunk_buffer.insert(chunk_buffer.end(), sector_data, sector_data + output_size);
+                        chunk_sectors++;
+                        if (
+                            chunk_buffer.size() && (
+                                current_sector == streams_script[i].stream_data.end_sector ||
+                                chunk_sectors >= STORE_CHUNK_MAX_SECTORS ||
+                                (
+                                    chunk_sectors >= STORE_CHUNK_MIN_SECTORS &&
+                                    output_size &&
+                                    (sTools->edc_compute(0, sector_data, output_size) & STORE_CHUNK_CUT_MASK) == 0
+                                )
+                            )
+                        ) {
+                            chunk_ref ref;
+                            bool new_chunk = false;
+                            if (store->put(chunk_buffer.data(), chunk_buffer.size(), ref, new_chunk)) {
+                                fprintf(stderr, "\nThere was an error writting the chunk to the store.\n");
+                                return ECMTOOL_FILE_WRITE_ERROR;
+                            }
+                            chunk_refs.push_back(ref);
+
+                            encode_data->store_chunks++;
+                            encode_data->store_bytes += chunk_buffer.size();
+                            if (new_chunk) {
+                                encode_data->store_new_chunks++;
+                                encode_data->store_new_bytes += chunk_buffer.size();
+                            }
+
+                            chunk_buffer.clear();
+                            chunk_sectors = 0;
+                        }
+                        break;
+                    }
+
+                    out_file.write(reinterpret_cast<char*>(sector_data), output_size);
+                    if (!out_file.good()) {
+                        fprintf(stderr, "\nThere was an error writting the output file");
+                        return ECMTOOL_FILE_WRITE_ERROR;
+                    }
+                    break;
+
+                // FLAC compression. The segment data is kept until it is compressed
+                case C_FLAC:
+                    // Drop the unused sector space (or the whole sector if it was deduplicated)
+                    audio_segments.back().data.resize(audio_segments.back().data.size() - 2352 + output_size);
+                    audio_segments.back().sectors_size.push_back(output_size);
+                    audio_segments.back().flush_modes.push_back(flush_mode);
+                    break;
+
+                // Zlib compression
+                case C_ZLIB:
+                case C_LZMA:
+                case C_LZ4:
+                case C_ZSTD:
+                    size_t compress_buffer_left = 0;
+                    streams_script[i].data_size += output_size;
+                    // The executables branches are converted before compress them
+                    if (streams_script[i].stream_data.filter) {
+                        sTools->filter_encode(
+                            (sector_tools_filter)streams_script[i].stream_data.filter,
+                            sector_data,
+                            output_size,
+                            filter_position,
+                            options->optimizations
+                        );
+                        filter_position += output_size;
+                    }
+                    if (primer_stream) {
+                        primer.insert(primer.end(), sector_data, sector_data + output_size);
+                    }
+
+                    // The sector stays in the batch until a flush point is reached, the batch is full, the stream ends
+                    // or the target speed block ends
+                    batch_size += output_size;
+                    batch_sectors++;
+                    bool speed_block_end = speed_control && ++speed_block_sectors == TARGET_SPEED_BLOCK_SECTORS && !stream_end;
+                    if (flush_mode == Z_NO_FLUSH && batch_sectors < ENCODE_BATCH_SECTORS && !stream_end && !speed_block_end) {
+                        break;
+                    }
+
+                    res = compobj -> compress(compress_buffer_left, batch_buffer, batch_size, flush_mode);
+                    batch_size = 0;
+                    batch_sectors = 0;
+
+                    if (res != 0) {
+                        fprintf(stderr, "There was an error compressing the stream: %d.\n", res);
+                        return ECMTOOL_PROCESSING_ERROR;
+                    }
+
+                    // The flush didn't fit in the buffer, so the buffer is written and the flush is continued
+                    while (compobj -> flush_pending()) {
+                        if (context) {
+                            context->output.insert(context->output.end(), comp_buffer, comp_buffer + BUFFER_SIZE - compress_buffer_left);
+                        }
+                        else {
+                            out_file.write(reinterpret_cast<char*>(comp_buffer), BUFFER_SIZE - compress_buffer_left);
+                        }
+                        if (!out_file.good()) {
+                            fprintf(stderr, "\nThere was an error writting the output file");
+                            return ECMTOOL_FILE_WRITE_ERROR;
+                        }
+                        size_t output_size = BUFFER_SIZE;
+                        compobj -> set_output(comp_buffer, output_size);
+                        res = compobj -> compress(compress_buffer_left, NULL, 0, flush_mode);
+                        if (res != 0) {
+                            fprintf(stderr, "There was an error compressing the stream: %d.\n", res);
+                            return ECMTOOL_PROCESSING_ERROR;
+                        }
+                    }
+
+                    // The new block starts with the dictionary as history
+                    if (flush_mode == Z_FULL_FLUSH && compobj -> reset_dictionary()) {
+                        fprintf(stderr, "There was an error setting the compression dictionary.\n");
+                        return ECMTOOL_PROCESSING_ERROR;
+                    }
+
+                    // If buffer is above 75% or is the last sector, write the data to the output and reset the state
+                    if (compress_buffer_left < (BUFFER_SIZE * 0.25) || stream_end) {
+                        if (context) {
+                            context->output.insert(context->output.end(), comp_buffer, comp_buffer + BUFFER_SIZE - compress_buffer_left);
+                        }
+                        else {
+                            out_file.write(reinterpret_cast<char*>(comp_buffer), BUFFER_SIZE - compress_buffer_left);
+                        }
+                        if (!out_file.good()) {
+                            fprintf(stderr, "\nThere was an error writting the output file");
+                            return ECMTOOL_FILE_WRITE_ERROR;
+                        }
+                        size_t output_size = BUFFER_SIZE;
+                        compobj -> set_output(comp_buffer, output_size);
+                    }
+
+                    if (speed_block_end) {
+                        auto now = std::chrono::high_resolution_clock::now();
+                        speed_control_update(
+                            controller,
+                            stream_compression,
+                            speed_block_sectors * 2352,
+                            std::chrono::duration<double>(now - speed_block_start_time).count(),
+                            encode_data
+                        );
+                        speed_block_sectors = 0;
+                        speed_block_start_time = now;
+
+                        sector_tools_compression block_compression = stream_compression;
+                        uint8_t block_level = 0;
+                        speed_control_level(controller, stream_compression, streams_script[i].compression_level, block_compression, block_level);
+                        if (block_compression == streams_script[i].stream_data.compression && block_level == streams_script[i].compression_level) {
+                            speed_control_count(encode_data, block_compression != stream_compression, block_level);
+                            break;
+                        }
+
+                        // The zlib and zstd levels are changed in place, inside the same stream. zstd without workers
+                        // ends the frame to apply the level, so the history is restarted but the stream is kept.
+                        if (block_compression == streams_script[i].stream_data.compression && !compobj -> set_level(block_level)) {
+                            ecmtool_return_code return_code = compress_flush(compobj, comp_buffer, out_file, Z_SYNC_FLUSH);
+                            if (return_code != ECMTOOL_OK) {
+                                return return_code;
+                            }
+                            streams_script[i].compression_level = block_level;
+                            controller->level_changes.push_back({current_sector, block_level});
+                            speed_control_count(encode_data, block_compression != stream_compression, block_level);
+                            break;
+                        }
+
+                        // The codec changes or cannot change its level, so the stream ends here and the rest of its
+                        // sectors are moved to a new stream, which will get the new settings when it starts
+                        ecmtool_return_code return_code = compress_flush(compobj, comp_buffer, out_file, Z_FINISH);
+                        if (return_code != ECMTOOL_OK) {
+                            return return_code;
+                        }
+                        stream_script rest;
+                        rest.stream_data = streams_script[i].stream_data;
+                        rest.stream_data.compression = stream_compression;
+                        rest.stream_data.primed = 0;
+                        rest.compression_level = streams_script[i].compression_level;
+                        if (k + 1 < streams_script[i].sectors_data[j].sector_count) {
+                            rest.sectors_data.push_back(streams_script[i].sectors_data[j]);
+                            rest.sectors_data.back().sector_count -= k + 1;
+                        }
+                        rest.sectors_data.insert(
+                            rest.sectors_data.end(),
+                            streams_script[i].sectors_data.begin() + j + 1,
+                            streams_script[i].sectors_data.end()
+                        );
+                        streams_script[i].sectors_data.resize(j + 1);
+                        streams_script[i].sectors_data[j].sector_count = k + 1;
+                        streams_script[i].stream_data.end_sector = current_sector;
+                        streams_script.insert(streams_script.begin() + i + 1, rest);
+                    }
+                    break;
+                }
+
+                setcounter_encode(current_sector * 2352);
+            }
+        }
+
+        // The solid contexts are released with their last stream
+        if (compobj && streams_script[i].stream_data.primed) {
+            delete compobj;
+            compobj = NULL;
+        }
+        else if (compobj && (!context || context->last_stream == i)) {
+            options->codecs_pool->release(compobj);
+            compobj = NULL;
+        }
+        if (comp_buffer && (!context || context->last_stream == i)) {
+            options->codecs_pool->release_buffer(comp_buffer);
+        }
+        if (batch_buffer) {
+            options->codecs_pool->release_buffer(batch_buffer);
+        }
+
+        if (audio_segments.size() && audio_segments.back().stream_index == i) {
+            // Compress the pending segments when there are enough to use all the threads, or before the next stream
+            if (
+                audio_segments.size() >= options->threads ||
+                i + 1 == streams_script.size() ||
+                streams_script[i + 1].stream_data.compression != C_FLAC
+            ) {
+                ecmtool_return_code return_code = audio_segments_write(
+                    out_file,
+                    audio_segments,
+                    streams_script,
+                    options->codecs_pool,
+                    ecm_block_start_position
+                );
+                if (return_code != ECMTOOL_OK) {
+                    return return_code;
+                }
+            }
+        }
+        else {
+            streams_script[i].stream_data.out_end_position = (uint64_t)out_file.tellp() - ecm_block_start_position;
+        }
+
+        // The FLAC segments are compressed together, so their time is added to the stream which writes them
+        double stream_time = std::chrono::duration<double>(
+            std::chrono::high_resolution_clock::now() - stream_start_time
+        ).count();
+        encode_data->class_time[summary_class(streams_script[i].stream_data)] += stream_time;
+
+        // The last block of the stream
+        if (controller) {
+            if (!speed_control) {
+                speed_block_sectors = streams_script[i].stream_data.end_sector - (i ? streams_script[i - 1].stream_data.end_sector : 0);
+            }
+            speed_control_update(
+                controller,
+                stream_compression,
+                speed_block_sectors * 2352,
+                std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - speed_block_start_time).count(),
+                encode_data
+            );
+        }
+    }
+
+    // The solid contexts are written after the other streams. The solid streams end position is the context end.
+    uint64_t contexts_start_position = (uint64_t)out_file.tellp() - ecm_block_start_position;
+    for (size_t i = 0; i < solid_contexts.size(); i++) {
+        out_file.write(reinterpret_cast<char*>(solid_contexts[i].output.data()), solid_contexts[i].output.size());
+        if (!out_file.good()) {
+            fprintf(stderr, "\nThere was an error writting the output file");
+            return ECMTOOL_FILE_WRITE_ERROR;
+        }
+        std::vector<uint8_t>().swap(solid_contexts[i].output);
+        solid_contexts[i].position = (uint64_t)out_file.tellp() - ecm_block_start_position;
+    }
+
+    // Sectors and output size of every stream class. The output positions are known when all the streams are written.
+    uint64_t stream_start_sector = 0;
+    for (uint32_t i = 0; i < streams_script.size(); i++) {
+        uint8_t stream_summary_class = summary_class(streams_script[i].stream_data);
+        encode_data->class_sectors[stream_summary_class] += streams_script[i].stream_data.end_sector - stream_start_sector;
+        stream_start_sector = streams_script[i].stream_data.end_sector;
+        if (streams_script[i].stream_data.solid) {
+            streams_script[i].stream_data.out_end_position = solid_contexts[
+                solid_index[(streams_script[i].stream_data.type << 8) | streams_script[i].stream_data.compression]
+            ].position;
+            continue;
+        }
+        encode_data->class_bytes[stream_summary_class] += streams_script[i].stream_data.out_end_position - streams_start_position;
+        streams_start_position = streams_script[i].stream_data.out_end_position;
+    }
+    for (size_t i = 0; i < solid_contexts.size(); i++) {
+        encode_data->class_bytes[summary_class(streams_script[solid_contexts[i].last_stream].stream_data)] +=
+            solid_contexts[i].position - contexts_start_position;
+        contexts_start_position = solid_contexts[i].position;
+    }
+
+    // Write the CRC
+    sTools->put32lsb(buffer_edc, input_edc);
+    out_file.write(reinterpret_cast<char*>(buffer_edc), 4);
+
+    return ECMTOOL_OK;
+}
+
+
+static ecmtool_return_code disk_decode (
+    sector_tools *sTools,
+    std::ifstream &in_file,
+    std::fstream &out_file,
+    std::vector<stream_script> &streams_script,
+    std::vector<dedup_run> &dedup_runs,
+    chunk_reader *store_reader,
+    std::vector<dedup_run> &reference_runs,
+    std::vector<dedup_run> &sectors_order,
+    std::fstream *base_file,
+    std::vector<uint8_t> &dictionary,
+    ecm_options *options,
+    uint64_t ecm_block_start_position
+) {
+    // Sectors buffers
+    uint8_t in_sector[2352];
+    uint8_t out_sector[2352];
+
+    // Sector counter
+    uint64_t current_sector = 0;
+
+    // Deduplicated sectors are rebuilt from the already written image sectors
+    uint64_t image_start_position = out_file.tellp();
+    uint64_t current_dedup_run = 0;
+    uint64_t current_reference_run = 0;
+
+    // Position of the current sector in the image, which is different if the files were grouped
+    uint64_t current_order_run = 0;
+    uint64_t image_sector = 0;
+
+    // CRC calculator
+    uint32_t original_edc = 0;
+    uint32_t output_edc = 0;
+
+    // Data of the primer stream, and the dictionary of the primed stream which follows it
+    std::vector<uint8_t> primer;
+    std::vector<uint8_t> primed_dictionary;
+
+    // Start of the next stream and end of the streams data. The solid contexts are stored after the other
+    // streams in the order of their first stream, and the end of the solid streams is the end of their context.
+    uint64_t streams_position = (uint64_t)in_file.tellg() - ecm_block_start_position;
+    uint64_t data_end_position = streams_position;
+    std::vector<solid_context> solid_contexts;
+    std::unordered_map<uint16_t, size_t> solid_index;
+    for (uint32_t i = 0; i < streams_script.size(); i++) {
+        if (!streams_script[i].stream_data.solid) {
+            data_end_position = streams_script[i].stream_data.out_end_position;
+        }
+    }
+    for (uint32_t i = 0; i < streams_script.size(); i++) {
+        if (streams_script[i].stream_data.solid) {
+            uint16_t key = (streams_script[i].stream_data.type << 8) | streams_script[i].stream_data.compression;
+            if (solid_index.find(key) == solid_index.end()) {
+                solid_index[key] = solid_contexts.size();
+                solid_contexts.push_back(solid_context());
+                solid_contexts.back().position = data_end_position;
+                data_end_position = streams_script[i].stream_data.out_end_position;
+            }
+            solid_contexts[solid_index[key]].last_stream = i;
+        }
+    }
+
+    // Stream processing
+    for (uint32_t i = 0; i < streams_script.size(); i++) {
+        // Compressor object
+        compressor *decompobj = NULL;
+        // Buffer object
+        uint8_t *decomp_buffer = NULL;
+        // Position of the next data in the stream, used by the branch filters
+        uint64_t filter_position = 0;
+        // Context shared with the other streams of the class in solid mode
+        solid_context *context = NULL;
+        if (streams_script[i].stream_data.solid) {
+            context = &solid_contexts[solid_index[(streams_script[i].stream_data.type << 8) | streams_script[i].stream_data.compression]];
+        }
+        in_file.seekg(ecm_block_start_position + (context ? context->position : streams_position), std::ios_base::beg);
+
+        // The solid streams continue the decompression of the previous stream of their class
+        if (context && context->compobj) {
+            decompobj = context->compobj;
+            decomp_buffer = context->buffer;
+        }
+        // Initialize the compressor and the buffer if required
+        else if (streams_script[i].stream_data.compression) {
+            // Create the decompression buffer
+            decomp_buffer = options->codecs_pool->get_buffer(BUFFER_SIZE);
+            if(!decomp_buffer) {
+                fprintf(stderr, "Out of memory\n");
+                return ECMTOOL_BUFFER_MEMORY_ERROR;
+            }
+            // Check if stream size is smaller than the buffer size and use the smaller size as "to_read"
+            size_t to_read = BUFFER_SIZE;
+            size_t stream_size = streams_script[i].stream_data.out_end_position - ((uint64_t)in_file.tellg() - ecm_block_start_position);
+            if (to_read > stream_size) {
+                to_read = stream_size;
+            }
+            // Read the data into the buffer
+            in_file.read(reinterpret_cast<char*>(decomp_buffer), to_read);
+            // Create a new decompressor object. The primed streams use the primer data after the dictionary.
+            if (streams_script[i].stream_data.primed) {
+                primed_dictionary = dictionary;
+                primed_dictionary.insert(primed_dictionary.end(), primer.begin(), primer.end());
+                decompobj = new compressor(
+                    (sector_tools_compression)streams_script[i].stream_data.compression,
+                    false,
+                    0,
+                    primed_dictionary.data(),
+                    primed_dictionary.size(),
+                    options->threads
+                );
+            }
+            else {
+                decompobj = options->codecs_pool->get(
+                    (sector_tools_compression)streams_script[i].stream_data.compression,
+                    false,
+                    0,
+                    dictionary.data(),
+                    dictionary.size(),
+                    options->threads
+                );
+            }
+            // Set the input buffer position as "input" in decompressor object
+            decompobj -> set_input(decomp_buffer, to_read);
+
+            if (context) {
+                context->compobj = decompobj;
+                context->buffer = decomp_buffer;
+            }
+        }
+
+        // The decompressed data is kept if the next stream uses it as dictionary
+        bool primer_stream = i + 1 < streams_script.size() && streams_script[i + 1].stream_data.primed;
+        primer.clear();
+
+        // Walk through all the sector types in stream
+        for (uint32_t j = 0; j < streams_script[i].sectors_data.size(); j++) {
+            // Process the number of sectors of every type
+            for (uint64_t k = 0; k < streams_script[i].sectors_data[j].sector_count; k++) {
+                if (in_file.eof()){
+                    fprintf(stderr, "Unexpected EOF detected.\n");
+                    return ECMTOOL_FILE_READ_ERROR;
+                }
+
+                size_t bytes_to_read = 0;
+                // Getting the sector size prior to read, to read the real sector size and avoid to fseek every time
+                sTools->encoded_sector_size(
+                    (sector_tools_types)streams_script[i].sectors_data[j].mode,
+                    bytes_to_read,
+                    options->optimizations
+                );
+
+                // Check if the sector is a copy of a reference image sector or of a previous sector
+                uint64_t reference_sector = 0;
+                bool from_reference = run_lookup(reference_runs, current_reference_run, current_sector, reference_sector);
+                if (from_reference || run_lookup(dedup_runs, current_dedup_run, current_sector, reference_sector)) {
+                    // Read the reference sector and clean it again to get the stored data
+                    if (from_reference) {
+                        base_file->seekg((uint64_t)reference_sector * 2352, std::ios_base::beg);
+                        base_file->read(reinterpret_cast<char*>(out_sector), 2352);
+                        if (!base_file->good()) {
+                            fprintf(stderr, "\nThere was an error reading the reference image sector.\n");
+                            return ECMTOOL_FILE_READ_ERROR;
+                        }
+                    }
+                    else {
+                        out_file.seekg(image_start_position + ((uint64_t)reference_sector * 2352), std::ios_base::beg);
+                        out_file.read(reinterpret_cast<char*>(out_sector), 2352);
+                        if (!out_file.good()) {
+                            fprintf(stderr, "\nThere was an error reading the deduplicated sector reference.\n");
+                            return ECMTOOL_FILE_READ_ERROR;
+                        }
+                        out_file.seekp(image_start_position + ((uint64_t)current_sector * 2352), std::ios_base::beg);
+                    }
+
+                    uint16_t reference_size = 0;
+                    sTools->clean_sector(
+                        in_sector,
+                        out_sector,
+                        (sector_tools_types)streams_script[i].sectors_data[j].mode,
+                        reference_size,
+                        options->optimizations
+                    );
+                    // No data was stored for this sector
+                    bytes_to_read = 0;
+                }
+
+                size_t decompress_buffer_left = 0;
+                // Sectors without stored data (GAPs and deduplicated sectors) are not decompressed
+                switch (bytes_to_read ? streams_script[i].stream_data.compression : C_NONE) {
+                // No compression
+                case C_NONE:
+                    if (store_reader) {
+                        if (bytes_to_read && store_reader->read(in_sector, bytes_to_read)) {
+                            fprintf(stderr, "\nThere was an error reading the data from the chunk store.\n");
+                            return ECMTOOL_FILE_READ_ERROR;
+                        }
+                        break;
+                    }
+                    in_file.read(reinterpret_cast<char*>(in_sector), bytes_to_read);
+                    setcounter_decode((uint64_t)in_file.tellg() - ecm_block_start_position);
+                    break;
+
+                // Zlib/LZMA/LZ4 compression
+                case C_ZLIB:
+                case C_LZMA:
+                case C_LZ4:
+                case C_FLAC:
+                case C_ZSTD:
+                    // Decompress the sector data
+                    decompobj -> decompress(in_sector, bytes_to_read, decompress_buffer_left, Z_SYNC_FLUSH);
+                    if (primer_stream) {
+                        primer.insert(primer.end(), in_sector, in_sector + bytes_to_read);
+                    }
+
+                    // Restore the executables branches
+                    if (streams_script[i].stream_data.filter) {
+                        sTools->filter_decode(
+                            (sector_tools_filter)streams_script[i].stream_data.filter,
+                            in_sector,
+                            bytes_to_read,
+                            filter_position,
+                            options->optimizations
+                        );
+                        filter_position += bytes_to_read;
+                    }
+
+                    // Set the current position in file
+                    setcounter_decode((uint64_t)in_file.tellg() - decompress_buffer_left - ecm_block_start_position); 
+
+                    // If not in end of stream and buffer is below 25%, read more data
+                    // To keep the buffer always ready
+                    if (streams_script[i].stream_data.out_end_position > ((uint64_t)in_file.tellg() - ecm_block_start_position) && decompress_buffer_left < (BUFFER_SIZE * 0.25)) {
+                        // Move the left data to first bytes
+                        size_t position = BUFFER_SIZE - decompress_buffer_left;
+                        memmove(decomp_buffer, decomp_buffer + position, decompress_buffer_left);
+
+                        // Calculate how much data can be readed
+                        size_t to_read = BUFFER_SIZE - decompress_buffer_left;
+                        // If available space is bigger than data in stream, read only the stream data
+                        size_t stream_size = streams_script[i].stream_data.out_end_position - ((uint64_t)in_file.tellg() - ecm_block_start_position);
+                        if (to_read > stream_size) {
+                            to_read = stream_size;  
+                            // If left data is less than buffer space, then end_of_stream is reached
+                        }
+                        // Fill the buffer with the stream data
+                        in_file.read(reinterpret_cast<char*>(decomp_buffer + decompress_buffer_left), to_read);
+                        // Set again the input position to first byte in decomp_buffer and set the buffer size
+                        size_t input_size = decompress_buffer_left + to_read;
+                        decompobj -> set_input(decomp_buffer, input_size);
+                    }
+                }
+
+                // The grouped files sectors are written at their image position
+                if (sectors_order.size()) {
+                    uint64_t previous_image_sector = image_sector;
+                    run_lookup(sectors_order, current_order_run, current_sector, image_sector);
+                    if (!current_sector || image_sector != previous_image_sector + 1) {
+                        out_file.seekp(image_start_position + (image_sector * 2352), std::ios_base::beg);
+                    }
+                }
+                else {
+                    image_sector = current_sector;
+                }
+
+                // Regenerating the sector data
+                uint16_t bytes_readed = 0;
+                sTools->regenerate_sector(
+                    out_sector,
+                    in_sector,
+                    (sector_tools_types)streams_script[i].sectors_data[j].mode,
+                    image_sector + 0x96, // 0x96 is the first sector "time", equivalent to 00:02:00
+                    bytes_readed,
+                    options->optimizations
+                );
+
+                // Set the dictionary at the same seekable blocks boundaries than the encoder
+                if (
+                    decompobj &&
+                    options->seekable &&
+                    current_sector + 1 != streams_script[i].stream_data.end_sector &&
+                    (options->sectors_per_block == 1 || !((current_sector + 2) % options->sectors_per_block)) &&
+                    decompobj -> reset_dictionary()
+                ) {
+                    fprintf(stderr, "\nThere was an error setting the compression dictionary.\n");
+                    return ECMTOOL_PROCESSING_ERROR;
+                }
+
+                // Writting the sector to output file
+                out_file.write(reinterpret_cast<char*>(out_sector), 2352);
+                // Compute the crc of the written data 
+                output_edc = sTools->edc_compute(
+                    output_edc,
+                    out_sector,
+                    2352
+                );
+
+                current_sector++;
+            }
+        }
+
+        // Seek to the next stream start position:
+        //fseeko(ecm_in, streams_script[i].stream_data.out_end_position, SEEK_SET);
+        if (context) {
+            context->position = (uint64_t)in_file.tellg() - ecm_block_start_position;
+        }
+        else {
+            streams_position = streams_script[i].stream_data.out_end_position;
+        }
+
+        // The solid contexts are released with their last stream
+        if (decompobj && streams_script[i].stream_data.primed) {
+            delete decompobj;
+            decompobj = NULL;
+        }
+        else if (decompobj && (!context || context->last_stream == i)) {
+            options->codecs_pool->release(decompobj);
+            decompobj = NULL;
+        }
+        if (decomp_buffer && (!context || context->last_stream == i)) {
+            options->codecs_pool->release_buffer(decomp_buffer);
+        }
+    }
+
+    // Set the decode position to 100%
+    setcounter_decode((uint64_t)in_file.tellg());
+
+    // The last written sector is not the last image sector if the files were grouped
+    if (sectors_order.size()) {
+        out_file.seekp(image_start_position + (current_sector * 2352), std::ios_base::beg);
+    }
+
+    // There is no more data in header. Next 4 bytes might be the CRC
+    // Reading it...
+    in_file.seekg(ecm_block_start_position + data_end_position, std::ios_base::beg);
+    uint8_t buffer_edc[4];
+    in_file.read(reinterpret_cast<char*>(buffer_edc), 4);
+    original_edc = sTools->get32lsb(buffer_edc);
+
+    if (original_edc == output_edc) {
+        return ECMTOOL_OK;
+    }
+    else {
+        fprintf(stderr, "\n\nWrong CRC!... Maybe the input file is damaged.\n");
+        return ECMTOOL_PROCESSING_ERROR;
+    }
+}
+
+
+/**
+ * @brief Compress an audio segment using its own FLAC compressor. The output is stored in the segment.
+ *
+ * @param segment The segment with the cleaned data (or the shared input), the flush points, the compressor
+ *                and its buffer
+ */
+static void audio_segment_compress (
+    audio_segment *segment
+) {
+    compressor *compobj = segment->compobj;
+    uint8_t *comp_buffer = segment->comp_buffer;
+
+    size_t output_size = BUFFER_SIZE;
+    compobj -> set_output(comp_buffer, output_size);
+
+    // The shared input is only read by the compressors
+    uint8_t *data = segment->input ? const_cast<uint8_t *>(segment->input) : segment->data.data();
+    size_t batch_size = 0;
+    uint32_t batch_sectors = 0;
+    for (size_t i = 0; i < segment->sectors_size.size(); i++) {
+        // The sectors are sent in batches, until a flush point is reached or the batch is full
+        batch_size += segment->sectors_size[i];
+        batch_sectors++;
+        if (segment->flush_modes[i] == Z_NO_FLUSH && batch_sectors < ENCODE_BATCH_SECTORS) {
+            continue;
+        }
+
+        size_t compress_buffer_left = 0;
+        segment->result = compobj -> compress(compress_buffer_left, data, batch_size, segment->flush_modes[i]);
+        data += batch_size;
+        batch_size = 0;
+        batch_sectors = 0;
+
+        // The flush didn't fit in the buffer, so the buffer is stored and the flush is continued
+        while (!segment->result && compobj -> flush_pending()) {
+            segment->output.insert(segment->output.end(), comp_buffer, comp_buffer + BUFFER_SIZE - compress_buffer_left);
+            output_size = BUFFER_SIZE;
+            compobj -> set_output(comp_buffer, output_size);
+            segment->result = compobj -> compress(compress_buffer_left, NULL, 0, segment->flush_modes[i]);
+        }
+        // The new seekable block starts with the dictionary as history
+        if (!segment->result && segment->flush_modes[i] == Z_FULL_FLUSH) {
+            segment->result = compobj -> reset_dictionary();
+        }
+        if (segment->result) {
+            break;
+        }
+
+        // If buffer is above 75% or is the last sector, store the data and reset the buffer
+        if (compress_buffer_left < (BUFFER_SIZE * 0.25) || i + 1 == segment->sectors_size.size()) {
+            segment->output.insert(segment->output.end(), comp_buffer, comp_buffer + BUFFER_SIZE - compress_buffer_left);
+            output_size = BUFFER_SIZE;
+            compobj -> set_output(comp_buffer, output_size);
+        }
+    }
+
+    // The input data is not required anymore
+    std::vector<uint8_t>().swap(segment->data);
+}
+
+
+/**
+ * @brief Compress the pending audio segments in parallel and write them to the output file in order.
+ *
+ * @param out_file The output file
+ * @param segments The pending segments. The vector is cleared after write them.
+ * @param streams_script The streams script, to set the segments streams end position
+ * @param codecs_pool The pool used to get the segments compressors and buffers
+ * @param ecm_block_start_position The ECM block position in the output file
+ * @return ecmtool_return_code
+ */
+static ecmtool_return_code audio_segments_write (
+    std::fstream &out_file,
+    std::vector<audio_segment> &segments,
+    std::vector<stream_script> &streams_script,
+    compressor_pool *codecs_pool,
+    uint64_t ecm_block_start_position
+) {
+    // The pool is not thread safe, so the compressors are taken before start the workers
+    for (size_t i = 0; i < segments.size(); i++) {
+        segments[i].compobj = codecs_pool->get(C_FLAC, true, segments[i].compression_level);
+        segments[i].comp_buffer = codecs_pool->get_buffer(BUFFER_SIZE);
+        if (!segments[i].comp_buffer) {
+            fprintf(stderr, "Out of memory\n");
+            return ECMTOOL_BUFFER_MEMORY_ERROR;
+        }
+    }
+
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < segments.size(); i++) {
+        workers.push_back(std::thread(audio_segment_compress, &segments[i]));
+    }
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+
+    for (size_t i = 0; i < segments.size(); i++) {
+        codecs_pool->release(segments[i].compobj);
+        codecs_pool->release_buffer(segments[i].comp_buffer);
+    }
+
+    for (size_t i = 0; i < segments.size(); i++) {
+        if (segments[i].result != 0) {
+            fprintf(stderr, "There was an error compressing the stream: %d.\n", segments[i].result);
+            return ECMTOOL_PROCESSING_ERROR;
+        }
+
+        out_file.write(reinterpret_cast<char*>(segments[i].output.data()), segments[i].output.size());
+        if (!out_file.good()) {
+            fprintf(stderr, "\nThere was an error writting the output file");
+            return ECMTOOL_FILE_WRITE_ERROR;
+        }
+        streams_script[segments[i].stream_index].stream_data.out_end_position = (uint64_t)out_file.tellp() - ecm_block_start_position;
+    }
+    segments.clear();
+
+    return ECMTOOL_OK;
+}
+
+
+/**
+ * @brief Second pass over the encoded streams. The compressed streams with the biggest estimated gain are
+ *        decompressed from the output file and compressed again with the strongest settings (LZMA and zstd
+ *        extreme) in parallel. The smaller outputs replace the original streams, and the data after them is
+ *        moved to fill the free space. The streams which cannot be fully decoded are kept as they are.
+ *
+ * @param out_file The output file, placed after the encoded data
+ * @param streams_script The encoded streams
+ * @param options The encoding options with the number of streams to recompress
+ * @param encode_data The summary data
+ * @param ecm_block_start_position The ECM block position in the output file
+ * @param streams_start_position The streams data position in the ECM block
+ * @return ecmtool_return_code
+ */
+static ecmtool_return_code second_pass (
+    std::fstream &out_file,
+    std::vector<stream_script> &streams_script,
+    ecm_options *options,
+    encode_summary *encode_data,
+    uint64_t ecm_block_start_position,
+    uint64_t streams_start_position
+) {
+    const sector_tools_compression candidate_modes[] = {C_LZMA, C_ZSTD};
+    const int32_t candidate_levels[] = {9 | (int32_t)LZMA_PRESET_EXTREME, 22 | (int32_t)COMPRESSOR_ZSTD_EXTREME};
+    const uint8_t candidates_count = sizeof(candidate_modes) / sizeof(candidate_modes[0]);
+    // The streams data is followed by the CRC, which is moved with it
+    uint64_t data_end_position = (uint64_t)out_file.tellp() - ecm_block_start_position;
+    uint64_t streams_end_position = streams_script.back().stream_data.out_end_position;
+
+    std::vector<uint64_t> streams_start(streams_script.size());
+    for (size_t i = 0; i < streams_script.size(); i++) {
+        streams_start[i] = i ? streams_script[i - 1].stream_data.out_end_position : streams_start_position;
+    }
+
+    // The streams with the biggest estimated gain are selected. The gain is estimated as the compressed size
+    // weighted by the space saved by the current codec, so the streams which are almost incompressible are not
+    // selected before smaller streams which compress well. FLAC has no stronger settings to try.
+    std::vector<size_t> selected_streams;
+    std::vector<double> estimated_gain(streams_script.size());
+    for (size_t i = 0; i < streams_script.size(); i++) {
+        if (
+            streams_script[i].data_size &&
+            streams_script[i].stream_data.compression != C_NONE &&
+            streams_script[i].stream_data.compression != C_FLAC
+        ) {
+            double compressed_size = streams_script[i].stream_data.out_end_position - streams_start[i];
+            double ratio = std::min(compressed_size / streams_script[i].data_size, 1.0);
+            estimated_gain[i] = compressed_size * (1 - ratio);
+            selected_streams.push_back(i);
+        }
+    }
+    std::stable_sort(selected_streams.begin(), selected_streams.end(), [&](size_t a, size_t b) {
+        return estimated_gain[a] > estimated_gain[b];
+    });
+    if (selected_streams.size() > options->second_pass) {
+        selected_streams.resize(options->second_pass);
+    }
+
+    // New data of the improved streams
+    std::vector<std::vector<uint8_t>> streams_output(streams_script.size());
+    uint32_t candidate_threads = std::max(options->threads / candidates_count, 1u);
+    for (size_t i = 0; i < selected_streams.size(); i++) {
+        stream_script &current = streams_script[selected_streams[i]];
+        uint64_t current_size = current.stream_data.out_end_position - streams_start[selected_streams[i]];
+
+        // Read and decompress the stream
+        std::vector<uint8_t> compressed(current_size);
+        out_file.seekg(ecm_block_start_position + streams_start[selected_streams[i]], std::ios_base::beg);
+        out_file.read(reinterpret_cast<char*>(compressed.data()), current_size);
+        if (!out_file.good()) {
+            fprintf(stderr, "There was an error reading the output file.\n");
+            return ECMTOOL_FILE_READ_ERROR;
+        }
+
+        std::vector<uint8_t> data(current.data_size);
+        compressor *decompobj = options->codecs_pool->get(
+            (sector_tools_compression)current.stream_data.compression,
+            false,
+            0,
+            options->dictionary.data(),
+            options->dictionary.size(),
+            options->threads
+        );
+        size_t input_size = compressed.size();
+        decompobj -> set_input(compressed.data(), input_size);
+        // The whole stream must be decoded, or it's kept as it is. LZMA and zlib report the stream end.
+        auto decode_result = [&current](int8_t result) {
+            return result == 0 ||
+                   (current.stream_data.compression == C_ZLIB && result == Z_STREAM_END) ||
+                   (current.stream_data.compression == C_LZMA && result == LZMA_STREAM_END);
+        };
+        size_t output_size = data.size();
+        size_t decompress_buffer_left = 0;
+        bool decoded = decode_result(decompobj -> decompress(data.data(), output_size, decompress_buffer_left, Z_SYNC_FLUSH)) &&
+                       !decompobj -> data_left_out();
+        // The output can be full before the end of the stream (like the zlib and LZMA checks) is read, but
+        // nothing else must be decoded
+        if (decoded && decompress_buffer_left) {
+            uint8_t end_byte = 0;
+            size_t end_size = 1;
+            decoded = decode_result(decompobj -> decompress(&end_byte, end_size, decompress_buffer_left, Z_SYNC_FLUSH)) &&
+                      decompobj -> data_left_out() == 1 &&
+                      !decompress_buffer_left;
+        }
+        options->codecs_pool->release(decompobj);
+        std::vector<uint8_t>().swap(compressed);
+        if (!decoded) {
+            continue;
+        }
+
+        // Compress the data with every candidate. The workers used by the audio segments are reused here, and
+        // all of them read the same decompressed data.
+        std::vector<audio_segment> candidates(candidates_count);
+        for (uint8_t j = 0; j < candidates_count; j++) {
+            candidates[j].input = data.data();
+            for (uint64_t position = 0; position < data.size(); position += 2352) {
+                candidates[j].sectors_size.push_back(std::min((uint64_t)2352, data.size() - position));
+                candidates[j].flush_modes.push_back(position + 2352 >= data.size() ? Z_FINISH : Z_NO_FLUSH);
+            }
+            candidates[j].compobj = options->codecs_pool->get(
+                candidate_modes[j],
+                true,
+                candidate_levels[j],
+                options->dictionary.data(),
+                options->dictionary.size(),
+                candidate_threads
+            );
+            candidates[j].comp_buffer = options->codecs_pool->get_buffer(BUFFER_SIZE);
+            if (!candidates[j].comp_buffer) {
+                fprintf(stderr, "Out of memory\n");
+                return ECMTOOL_BUFFER_MEMORY_ERROR;
+            }
+        }
+
+        std::vector<std::thread> workers;
+        for (uint8_t j = 0; j < candidates_count; j++) {
+            workers.push_back(std::thread(audio_segment_compress, &candidates[j]));
+        }
+        for (size_t j = 0; j < workers.size(); j++) {
+            workers[j].join();
+        }
+        std::vector<uint8_t>().swap(data);
+
+        for (uint8_t j = 0; j < candidates_count; j++) {
+            options->codecs_pool->release(candidates[j].compobj);
+            options->codecs_pool->release_buffer(candidates[j].comp_buffer);
+            if (candidates[j].result != 0) {
+                fprintf(stderr, "There was an error compressing the stream: %d.\n", candidates[j].result);
+                return ECMTOOL_PROCESSING_ERROR;
+            }
+
+            // Keep the smallest output, if it is smaller than the current one
+            uint64_t best_size = streams_output[selected_streams[i]].size() ? streams_output[selected_streams[i]].size() : current_size;
+            if (candidates[j].output.size() < best_size) {
+                streams_output[selected_streams[i]].swap(candidates[j].output);
+                current.stream_data.compression = candidate_modes[j];
+                current.stream_data.level = candidate_levels[j] & 0xFF;
+            }
+        }
+    }
+
+    // Write the new streams and move the data after them. The new streams are smaller, so the data is always
+    // moved to a previous position and it's not overwritten before read it.
+    std::vector<uint8_t> buffer(BUFFER_SIZE);
+    uint64_t write_position = 0;
+    bool moving = false;
+    for (size_t i = 0; i <= streams_script.size(); i++) {
+        // The last "stream" is the CRC
+        uint64_t start = i < streams_script.size() ? streams_start[i] : streams_end_position;
+        uint64_t end = i < streams_script.size() ? streams_script[i].stream_data.out_end_position : data_end_position;
+
+        if (i < streams_script.size() && streams_output[i].size()) {
+            if (!moving) {
+                moving = true;
+                write_position = start;
+            }
+            out_file.seekp(ecm_block_start_position + write_position, std::ios_base::beg);
+            out_file.write(reinterpret_cast<char*>(streams_output[i].data()), streams_output[i].size());
+            if (!out_file.good()) {
+                fprintf(stderr, "\nThere was an error writting the output file");
+                return ECMTOOL_FILE_WRITE_ERROR;
+            }
+
+            encode_data->second_pass_streams++;
+            encode_data->second_pass_bytes += (end - start) - streams_output[i].size();
+            encode_data->class_bytes[summary_class(streams_script[i].stream_data)] -= (end - start) - streams_output[i].size();
+            write_position += streams_output[i].size();
+            std::vector<uint8_t>().swap(streams_output[i]);
+        }
+        else if (moving) {
+            for (uint64_t copied = 0; copied < end - start;) {
+                size_t to_copy = std::min((uint64_t)buffer.size(), end - start - copied);
+                out_file.seekg(ecm_block_start_position + start + copied, std::ios_base::beg);
+                out_file.read(reinterpret_cast<char*>(buffer.data()), to_copy);
+                out_file.seekp(ecm_block_start_position + write_position + copied, std::ios_base::beg);
+                out_file.write(reinterpret_cast<char*>(buffer.data()), to_copy);
+                if (!out_file.good()) {
+                    fprintf(stderr, "\nThere was an error moving the streams data");
+                    return ECMTOOL_FILE_WRITE_ERROR;
+                }
+                copied += to_copy;
+            }
+            write_position += end - start;
+        }
+
+        if (i < streams_script.size() && moving) {
+            streams_script[i].stream_data.out_end_position = write_position;
+        }
+    }
+
+    // Continue after the CRC
+    out_file.seekp(ecm_block_start_position + (moving ? write_position : data_end_position), std::ios_base::beg);
+
+    return ECMTOOL_OK;
+}
+
+
+/**
+ * @brief Transcode an ECM block (image). The streams are decompressed in order, and compressed again with the
+ *        codecs and levels of the new options in parallel, one stream per thread. The seekable blocks, the
+ *        solid contexts, the primers and the filters of the original streams are kept when the new codec
+ *        allows them. The sectors, deduplication, reference, dictionary and order TOCs are copied.
+ *
+ * @param in_file The input ECM file, placed at the block start
+ * @param out_file The output ECM file, placed at the new block position
+ * @param options The transcode options. The optimizations of the image are set on it.
+ * @param transcode_sumary The summary data
+ * @return ecmtool_return_code
+ */
+static ecmtool_return_code transcode_block (
+    std::ifstream &in_file,
+    std::fstream &out_file,
+    ecm_options *options,
+    transcode_summary *transcode_sumary
+) {
+    // ECM headers
+    block_header ecm_block_header;
+    ecm_header ecm_data_header;
+    // Struct size without the strings
+    uint32_t ecm_data_header_size = sizeof(ecm_data_header) - sizeof(ecm_data_header.title) - sizeof(ecm_data_header.id);
+    uint64_t in_block_start_position = 0;
+    uint64_t block_start_position = out_file.tellp();
+    uint64_t ecm_block_start_position = 0;
+
+    // TOCs data
+    std::vector<stream> streams_toc;
+    sec_str_size streams_toc_header = {C_NONE, 0, 0, 0};
+    std::vector<sector> sectors_toc;
+    sec_str_size sectors_toc_header = {C_NONE, 0, 0, 0};
+    std::vector<dedup_run> dedup_runs;
+    std::vector<dedup_run> reference_runs;
+    std::vector<dedup_run> sectors_order;
+    std::vector<uint8_t> dictionary;
+    std::vector<stream_script> streams_script;
+    stream *new_streams_toc = NULL;
+    sec_str_size new_streams_toc_header = {C_NONE, 0, 0, 0};
+
+    // Decompressors of the solid contexts, and the streams waiting to be compressed
+    std::unordered_map<uint16_t, transcode_input> solid_inputs;
+    std::unordered_map<uint16_t, size_t> solid_index;
+    std::vector<transcode_job> solid_jobs;
+    std::vector<transcode_job> pending_jobs;
+    uint32_t pending_compressed = 0;
+
+    // Data of the primer streams, and the dictionaries of the primed streams which follow them
+    std::vector<uint8_t> in_primer;
+    std::vector<uint8_t> out_primer;
+    std::vector<uint8_t> primed_dictionary;
+
+    uint64_t current_sector = 0;
+    uint64_t current_dedup_run = 0;
+    uint64_t current_reference_run = 0;
+    sector_tools *sTools = new sector_tools();
+    ecmtool_return_code return_code = ECMTOOL_OK;
+
+    // Read the block and the ECM data headers
+    if (read_block_header(in_file, &ecm_block_header)) {
+        delete sTools;
+        return ECMTOOL_FILE_READ_ERROR;
+    }
+    in_block_start_position = in_file.tellg();
+    in_file.read(reinterpret_cast<char*>(&ecm_data_header), ecm_data_header_size);
+    ecm_data_header.title.resize(ecm_data_header.title_length);
+    in_file.read((char *)ecm_data_header.title.data(), ecm_data_header.title_length);
+    ecm_data_header.id.resize(ecm_data_header.id_length);
+    in_file.read((char *)ecm_data_header.id.data(), ecm_data_header.id_length);
+    if (!in_file.good()) {
+        delete sTools;
+        return ECMTOOL_FILE_READ_ERROR;
+    }
+
+    // The chunk store compress the chunks by itself
+    if (ecm_data_header.chunks_toc_pos) {
+        fprintf(stderr, "ERROR: the images stored in a chunk store cannot be transcoded.\n");
+        delete sTools;
+        return ECMTOOL_PROCESSING_ERROR;
+    }
+
+    // The cleaned sectors sizes depend on the image optimizations
+    options->optimizations = (optimization_options)ecm_data_header.optimizations;
+    options->seekable = ecm_data_header.sectors_per_block != 0;
+    options->sectors_per_block = ecm_data_header.sectors_per_block;
+
+    //
+    // Read the TOCs
+    {
+        std::vector<uint8_t> toc_data;
+        uint64_t toc_count = 0;
+
+        in_file.seekg(ecm_data_header.streams_toc_pos + in_block_start_position, std::ios_base::beg);
+        return_code = read_toc(in_file, toc_data, streams_toc_header.count, sizeof(struct stream), ECM_FILE_VERSION);
+        if (return_code) {
+            goto exit;
+        }
+        streams_toc.resize(streams_toc_header.count);
+        memcpy(streams_toc.data(), toc_data.data(), toc_data.size());
+
+        in_file.seekg(ecm_data_header.sectors_toc_pos + in_block_start_position, std::ios_base::beg);
+        return_code = read_toc(in_file, toc_data, sectors_toc_header.count, sizeof(struct sector), ECM_FILE_VERSION);
+        if (return_code) {
+            goto exit;
+        }
+        sectors_toc.resize(sectors_toc_header.count);
+        memcpy(sectors_toc.data(), toc_data.data(), toc_data.size());
+
+        if (ecm_data_header.dedup_toc_pos) {
+            in_file.seekg(ecm_data_header.dedup_toc_pos + in_block_start_position, std::ios_base::beg);
+            return_code = read_toc(in_file, toc_data, toc_count, sizeof(struct dedup_run), ECM_FILE_VERSION);
+            if (return_code) {
+                goto exit;
+            }
+            dedup_runs.resize(toc_count);
+            memcpy(dedup_runs.data(), toc_data.data(), toc_data.size());
+        }
+
+        // Only the runs are needed, the reference sectors are not stored in the streams
+        if (ecm_data_header.reference_toc_pos) {
+            in_file.seekg(ecm_data_header.reference_toc_pos + in_block_start_position, std::ios_base::beg);
+            return_code = read_toc(in_file, toc_data, toc_count, sizeof(struct dedup_run), ECM_FILE_VERSION);
+            if (return_code) {
+                goto exit;
+            }
+            reference_runs.resize(toc_count);
+            memcpy(reference_runs.data(), toc_data.data(), toc_data.size());
+        }
+
+        if (ecm_data_header.dictionary_toc_pos) {
+            in_file.seekg(ecm_data_header.dictionary_toc_pos + in_block_start_position, std::ios_base::beg);
+            return_code = read_toc(in_file, dictionary, toc_count, 1, ECM_FILE_VERSION);
+            if (return_code) {
+                goto exit;
+            }
+        }
+        else if (ecm_data_header.dictionary_id) {
+            if (options->dictionary.empty() || options->dictionary_id != ecm_data_header.dictionary_id) {
+                fprintf(stderr, "The file was encoded using an external dictionary. Use the --dictionary option to set the same dictionary file.\n");
+                return_code = ECMTOOL_FILE_READ_ERROR;
+                goto exit;
+            }
+            dictionary = options->dictionary;
+        }
+
+        if (ecm_data_header.order_toc_pos) {
+            in_file.seekg(ecm_data_header.order_toc_pos + in_block_start_position, std::ios_base::beg);
+            return_code = read_toc(in_file, toc_data, toc_count, sizeof(struct dedup_run), ECM_FILE_VERSION);
+            if (return_code) {
+                goto exit;
+            }
+            sectors_order.resize(toc_count);
+            memcpy(sectors_order.data(), toc_data.data(), toc_data.size());
+        }
+    }
+
+    // Convert the headers to an script to be followed. The script streams are changed to the new ones.
+    return_code = task_maker(streams_toc.data(), streams_toc_header, sectors_toc.data(), sectors_toc_header, streams_script);
+    if (return_code) {
+        return_code = ECMTOOL_CORRUPTED_STREAM;
+        goto exit;
+    }
+
+    // Write the dummy block header and the ECM header, which will be rewritten with the new positions
+    return_code = (ecmtool_return_code)write_block_header(out_file, &ecm_block_header);
+    if (return_code) {
+        goto exit;
+    }
+    ecm_block_start_position = out_file.tellp();
+    out_file.write(reinterpret_cast<char*>(&ecm_data_header), ecm_data_header_size);
+    out_file << ecm_data_header.title;
+    out_file << ecm_data_header.id;
+    if (!out_file.good()) {
+        return_code = ECMTOOL_FILE_WRITE_ERROR;
+        goto exit;
+    }
+
+    {
+        // Input position of every stream. The solid contexts are stored after the other streams in the order of
+        // their first stream, and the CRC is after all of them.
+        std::vector<uint64_t> streams_start(streams_toc.size());
+        std::unordered_map<uint16_t, uint64_t> contexts_start;
+        uint64_t data_end_position = ecm_data_header.ecm_data_pos;
+        for (size_t i = 0; i < streams_toc.size(); i++) {
+            if (!streams_toc[i].solid) {
+                streams_start[i] = data_end_position;
+                data_end_position = streams_toc[i].out_end_position;
+            }
+        }
+        for (size_t i = 0; i < streams_toc.size(); i++) {
+            if (streams_toc[i].solid) {
+                uint16_t key = (streams_toc[i].type << 8) | streams_toc[i].compression;
+                if (contexts_start.find(key) == contexts_start.end()) {
+                    contexts_start[key] = data_end_position;
+                    data_end_position = streams_toc[i].out_end_position;
+                }
+                streams_start[i] = contexts_start[key];
+            }
+        }
+        transcode_sumary->in_size += data_end_position - ecm_data_header.ecm_data_pos;
+        ecm_data_header.ecm_data_pos = (uint64_t)out_file.tellp() - ecm_block_start_position;
+
+        resetcounter(sectors_toc.size() ? streams_toc.back().end_sector : 0);
+
+        for (uint32_t i = 0; i < streams_script.size(); i++) {
+            stream &in_stream = streams_toc[i];
+            stream &out_stream = streams_script[i].stream_data;
+            bool in_compressed = in_stream.compression != C_NONE;
+
+            // Prepare the decompressor. The solid streams continue the decompression of their context.
+            transcode_input stream_input;
+            transcode_input *input = &stream_input;
+            if (in_stream.solid) {
+                input = &solid_inputs[(in_stream.type << 8) | in_stream.compression];
+            }
+            if (in_compressed && !input->decompobj) {
+                input->data.resize(in_stream.out_end_position - streams_start[i]);
+                in_file.seekg(in_block_start_position + streams_start[i], std::ios_base::beg);
+                in_file.read(reinterpret_cast<char*>(input->data.data()), input->data.size());
+                if (!in_file.good()) {
+                    fprintf(stderr, "There was an error reading the input file.\n");
+                    return_code = ECMTOOL_FILE_READ_ERROR;
+                    goto exit;
+                }
+                if (in_stream.primed) {
+                    primed_dictionary = dictionary;
+                    primed_dictionary.insert(primed_dictionary.end(), in_primer.begin(), in_primer.end());
+                    input->decompobj = new compressor(
+                        (sector_tools_compression)in_stream.compression,
+                        false,
+                        0,
+                        primed_dictionary.data(),
+                        primed_dictionary.size(),
+                        options->threads
+                    );
+                    input->primed = true;
+                }
+                else {
+                    input->decompobj = options->codecs_pool->get(
+                        (sector_tools_compression)in_stream.compression,
+                        false,
+                        0,
+                        dictionary.data(),
+                        dictionary.size(),
+                        options->threads
+                    );
+                }
+                size_t input_size = input->data.size();
+                input->decompobj -> set_input(input->data.data(), input_size);
+            }
+            else if (!in_compressed) {
+                in_file.seekg(in_block_start_position + streams_start[i], std::ios_base::beg);
+            }
+
+            // New codec of the stream class. The filters, solid contexts and primers are kept if the codec allows them.
+            class_codec policy = class_policy((sector_tools_stream_classes)summary_class(in_stream), options);
+            bool out_compressed = policy.compression != C_NONE && policy.compression != C_FLAC;
+            bool out_dictionary = policy.compression == C_ZLIB || policy.compression == C_ZSTD;
+            int32_t compression_option = policy.level;
+            if (policy.compression != C_ZSTD && compression_option > 9) {
+                compression_option = 9;
+            }
+            out_stream.compression = policy.compression;
+            out_stream.level = compression_option;
+            out_stream.filter = out_compressed ? in_stream.filter : F_NONE;
+            out_stream.solid = in_stream.solid && out_compressed;
+            out_stream.primed = in_stream.primed && out_dictionary;
+            if (options->extreme_compression) {
+                if (policy.compression == C_LZMA) {
+                    compression_option |= LZMA_PRESET_EXTREME;
+                }
+                else if (policy.compression == C_FLAC) {
+                    compression_option |= FLACZLIB_EXTREME_COMPRESSION;
+                }
+                else if (policy.compression == C_ZSTD) {
+                    compression_option |= COMPRESSOR_ZSTD_EXTREME;
+                }
+            }
+
+            // The decompressed data is kept if the next stream uses it as dictionary
+            bool in_primer_stream = i + 1 < streams_toc.size() && streams_toc[i + 1].primed;
+            bool out_primer_stream = in_primer_stream && out_dictionary;
+            in_primer.clear();
+
+            // Read the cleaned data of every sector, without the filters
+            transcode_job job;
+            job.compression = policy.compression;
+            job.primed = out_stream.primed;
+            job.streams.push_back(i);
+            job.segment.stream_index = i;
+            job.segment.compression_level = compression_option;
+            audio_segment &segment = job.segment;
+            uint64_t filter_position = 0;
+            for (uint32_t j = 0; j < streams_script[i].sectors_data.size(); j++) {
+                for (uint64_t k = 0; k < streams_script[i].sectors_data[j].sector_count; k++) {
+                    size_t sector_size = 0;
+                    sTools->encoded_sector_size(
+                        (sector_tools_types)streams_script[i].sectors_data[j].mode,
+                        sector_size,
+                        options->optimizations
+                    );
+                    // No data was stored for the copies of the reference image or of a previous sector
+                    uint64_t reference_sector = 0;
+                    if (
+                        run_lookup(reference_runs, current_reference_run, current_sector, reference_sector) ||
+                        run_lookup(dedup_runs, current_dedup_run, current_sector, reference_sector)
+                    ) {
+                        sector_size = 0;
+                    }
+
+                    size_t segment_size = segment.data.size();
+                    segment.data.resize(segment_size + sector_size);
+                    uint8_t *sector_data = segment.data.data() + segment_size;
+                    if (sector_size && !in_compressed) {
+                        in_file.read(reinterpret_cast<char*>(sector_data), sector_size);
+                        if (!in_file.good()) {
+                            fprintf(stderr, "There was an error reading the input file.\n");
+                            return_code = ECMTOOL_FILE_READ_ERROR;
+                            goto exit;
+                        }
+                    }
+                    else if (sector_size) {
+                        size_t decompress_buffer_left = 0;
+                        size_t decompress_size = sector_size;
+                        input->decompobj -> decompress(sector_data, decompress_size, decompress_buffer_left, Z_SYNC_FLUSH);
+                        if (in_primer_stream) {
+                            in_primer.insert(in_primer.end(), sector_data, sector_data + sector_size);
+                        }
+                        if (in_stream.filter) {
+                            sTools->filter_decode(
+                                (sector_tools_filter)in_stream.filter,
+                                sector_data,
+                                sector_size,
+                                filter_position,
+                                options->optimizations
+                            );
+                            filter_position += sector_size;
+                        }
+                    }
+
+                    // Set the dictionary at the same seekable blocks boundaries than the encoder
+                    if (
+                        in_compressed &&
+                        options->seekable &&
+                        current_sector + 1 != in_stream.end_sector &&
+                        (options->sectors_per_block == 1 || !((current_sector + 2) % options->sectors_per_block)) &&
+                        input->decompobj -> reset_dictionary()
+                    ) {
+                        fprintf(stderr, "\nThere was an error setting the compression dictionary.\n");
+                        return_code = ECMTOOL_PROCESSING_ERROR;
+                        goto exit;
+                    }
+
+                    // The same flush points than the encoder. The solid context is finished with its last stream.
+                    uint8_t flush_mode = Z_NO_FLUSH;
+                    if (current_sector + 1 == in_stream.end_sector && !out_stream.solid) {
+                        flush_mode = Z_FINISH;
+                    }
+                    else if (options->seekable && (options->sectors_per_block == 1 || !((current_sector + 2) % options->sectors_per_block))) {
+                        flush_mode = Z_FULL_FLUSH;
+                    }
+                    segment.sectors_size.push_back(sector_size);
+                    segment.flush_modes.push_back(flush_mode);
+
+                    current_sector++;
+                    setcounter_transcode(current_sector);
+                }
+            }
+
+            // Release the decompressor, unless the solid context continues in other stream
+            bool context_end = true;
+            for (uint32_t j = i + 1; in_stream.solid && j < streams_toc.size(); j++) {
+                if (streams_toc[j].solid && streams_toc[j].type == in_stream.type && streams_toc[j].compression == in_stream.compression) {
+                    context_end = false;
+                    break;
+                }
+            }
+            if (input->decompobj && context_end) {
+                if (input->primed) {
+                    delete input->decompobj;
+                }
+                else {
+                    options->codecs_pool->release(input->decompobj);
+                }
+                input->decompobj = NULL;
+                std::vector<uint8_t>().swap(input->data);
+            }
+
+            // Apply the filter of the new stream, and keep the data if the next stream uses it as dictionary
+            if (out_stream.filter) {
+                filter_position = 0;
+                uint8_t *sector_data = segment.data.data();
+                for (size_t j = 0; j < segment.sectors_size.size(); j++) {
+                    sTools->filter_encode(
+                        (sector_tools_filter)out_stream.filter,
+                        sector_data,
+                        segment.sectors_size[j],
+                        filter_position,
+                        options->optimizations
+                    );
+                    filter_position += segment.sectors_size[j];
+                    sector_data += segment.sectors_size[j];
+                }
+            }
+            if (out_stream.primed) {
+                job.dictionary = dictionary;
+                job.dictionary.insert(job.dictionary.end(), out_primer.begin(), out_primer.end());
+            }
+            out_primer.clear();
+            if (out_primer_stream) {
+                out_primer = segment.data;
+            }
+            transcode_sumary->streams++;
+
+            // The solid streams are added to their context, which is compressed and written after the other streams
+            if (out_stream.solid) {
+                uint16_t key = (out_stream.type << 8) | out_stream.compression;
+                if (solid_index.find(key) == solid_index.end()) {
+                    solid_index[key] = solid_jobs.size();
+                    solid_jobs.push_back(transcode_job());
+                    solid_jobs.back().compression = job.compression;
+                    solid_jobs.back().segment.stream_index = i;
+                    solid_jobs.back().segment.compression_level = compression_option;
+                }
+                transcode_job &context = solid_jobs[solid_index[key]];
+                context.streams.push_back(i);
+                context.segment.data.insert(context.segment.data.end(), segment.data.begin(), segment.data.end());
+                context.segment.sectors_size.insert(context.segment.sectors_size.end(), segment.sectors_size.begin(), segment.sectors_size.end());
+                context.segment.flush_modes.insert(context.segment.flush_modes.end(), segment.flush_modes.begin(), segment.flush_modes.end());
+                continue;
+            }
+
+            // Compress the pending streams when there are enough to use all the threads
+            pending_jobs.push_back(std::move(job));
+            if (pending_jobs.back().compression != C_NONE) {
+                pending_compressed++;
+            }
+            if (pending_compressed >= options->threads) {
+                return_code = transcode_jobs_write(out_file, pending_jobs, streams_script, dictionary, options, ecm_block_start_position);
+                if (return_code) {
+                    goto exit;
+                }
+                pending_compressed = 0;
+            }
+        }
+
+        // Write the pending streams and the solid contexts. The solid streams end position is the context end.
+        for (size_t i = 0; i < solid_jobs.size(); i++) {
+            solid_jobs[i].segment.flush_modes.back() = Z_FINISH;
+        }
+        return_code = transcode_jobs_write(out_file, pending_jobs, streams_script, dictionary, options, ecm_block_start_position);
+        if (!return_code) {
+            return_code = transcode_jobs_write(out_file, solid_jobs, streams_script, dictionary, options, ecm_block_start_position);
+        }
+        if (return_code) {
+            goto exit;
+        }
+        transcode_sumary->out_size += (uint64_t)out_file.tellp() - ecm_block_start_position - ecm_data_header.ecm_data_pos;
+
+        // Copy the CRC
+        uint8_t buffer_edc[4];
+        in_file.seekg(in_block_start_position + data_end_position, std::ios_base::beg);
+        in_file.read(reinterpret_cast<char*>(buffer_edc), 4);
+        out_file.write(reinterpret_cast<char*>(buffer_edc), 4);
+        if (!in_file.good() || !out_file.good()) {
+            fprintf(stderr, "There was an error copying the image CRC.\n");
+            return_code = ECMTOOL_FILE_WRITE_ERROR;
+            goto exit;
+        }
+    }
+
+    //
+    // Write the new streams TOC and copy the other TOCs
+    //
+    ecm_data_header.streams_toc_pos = (uint64_t)out_file.tellp() - ecm_block_start_position;
+    return_code = task_to_streams_header(new_streams_toc, new_streams_toc_header, streams_script);
+    if (return_code) {
+        goto exit;
+    }
+    return_code = write_toc(out_file, (uint8_t *)new_streams_toc, new_streams_toc_header.count, sizeof(struct stream));
+    if (return_code) {
+        goto exit;
+    }
+
+    ecm_data_header.sectors_toc_pos = (uint64_t)out_file.tellp() - ecm_block_start_position;
+    return_code = write_toc(out_file, (uint8_t *)sectors_toc.data(), sectors_toc.size(), sizeof(struct sector));
+    if (return_code) {
         goto exit;
     }
 
-    // Finally, write the ecm data block header
+    if (ecm_data_header.dedup_toc_pos) {
+        ecm_data_header.dedup_toc_pos = (uint64_t)out_file.tellp() - ecm_block_start_position;
+        return_code = write_toc(out_file, (uint8_t *)dedup_runs.data(), dedup_runs.size(), sizeof(struct dedup_run));
+        if (return_code) {
+            goto exit;
+        }
+    }
+
+    if (ecm_data_header.reference_toc_pos) {
+        ecm_data_header.reference_toc_pos = (uint64_t)out_file.tellp() - ecm_block_start_position;
+        return_code = write_toc(out_file, (uint8_t *)reference_runs.data(), reference_runs.size(), sizeof(struct dedup_run));
+        if (return_code) {
+            goto exit;
+        }
+    }
+
+    if (ecm_data_header.dictionary_toc_pos) {
+        ecm_data_header.dictionary_toc_pos = (uint64_t)out_file.tellp() - ecm_block_start_position;
+        return_code = write_toc(out_file, dictionary.data(), dictionary.size(), 1);
+        if (return_code) {
+            goto exit;
+        }
+    }
+
+    if (ecm_data_header.order_toc_pos) {
+        ecm_data_header.order_toc_pos = (uint64_t)out_file.tellp() - ecm_block_start_position;
+        return_code = write_toc(out_file, (uint8_t *)sectors_order.data(), sectors_order.size(), sizeof(struct dedup_run));
+        if (return_code) {
+            goto exit;
+        }
+    }
+
+    // The levels changed inside the streams are not kept, because the streams can be encoded again
+    ecm_data_header.levels_toc_pos = 0;
+
+    // Rewrite the block header and the ECM header with the new sizes and positions
+    ecm_block_header.real_block_size = (uint64_t)out_file.tellp() - ecm_block_start_position;
+    ecm_block_header.block_size = ecm_block_header.real_block_size;
+    out_file.seekp(block_start_position);
+    out_file.write(reinterpret_cast<char*>(&ecm_block_header), sizeof(ecm_block_header));
     out_file.write(reinterpret_cast<char*>(&ecm_data_header), ecm_data_header_size);
+    out_file.seekp(ecm_block_start_position + ecm_block_header.block_size, std::ios_base::beg);
     if (!out_file.good()) {
-        return_code = 1;
+        return_code = ECMTOOL_FILE_WRITE_ERROR;
         goto exit;
     }
-    out_file.seekp(0, std::ios_base::end);
+    transcode_sumary->images++;
 
     exit:
-    // Free the reserved memory for objects
-    if (sTools) {
-        delete sTools;
-    }
-    if (streams_toc) {
-        delete [] streams_toc;
-    }
-    if (streams_toc_c_buffer) {
-        delete [] streams_toc_c_buffer;
-    }
-    if (sectors_toc) {
-        delete [] sectors_toc;
+    for (auto &solid_input : solid_inputs) {
+        if (solid_input.second.decompobj && solid_input.second.primed) {
+            delete solid_input.second.decompobj;
+        }
+        else if (solid_input.second.decompobj) {
+            options->codecs_pool->release(solid_input.second.decompobj);
+        }
     }
-    if (sectors_toc_c_buffer) {
-        delete [] sectors_toc_c_buffer;
+    if (new_streams_toc) {
+        free(new_streams_toc);
     }
+    delete sTools;
 
     return return_code;
 }
 
-int ecm_block_to_image(
-    std::ifstream &in_file,
+
+/**
+ * @brief Compress the transcoded streams in parallel and write them to the output file in order. The streams
+ *        without compression are written as they are.
+ *
+ * @param out_file The output file
+ * @param jobs The streams to write. The vector is cleared after write them.
+ * @param streams_script The new streams, to set their end position
+ * @param dictionary The image compression dictionary
+ * @param options The transcode options
+ * @param ecm_block_start_position The ECM block position in the output file
+ * @return ecmtool_return_code
+ */
+static ecmtool_return_code transcode_jobs_write (
     std::fstream &out_file,
-    ecm_options *options
+    std::vector<transcode_job> &jobs,
+    std::vector<stream_script> &streams_script,
+    std::vector<uint8_t> &dictionary,
+    ecm_options *options,
+    uint64_t ecm_block_start_position
 ) {
-    // CRC calculation to check the decoded stream
-    uint32_t output_edc = 0;
-
-    // Stream script to the encode process
-    std::vector<stream_script> streams_script;
+    uint32_t compressed_jobs = 0;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        if (jobs[i].compression != C_NONE) {
+            compressed_jobs++;
+        }
+    }
+    uint32_t job_threads = std::max(options->threads / std::max(compressed_jobs, 1u), 1u);
 
-    // ECM headers
-    block_header ecm_block_header;
-    ecm_header ecm_data_header;
-    // Struct size without the strings
-    uint32_t ecm_data_header_size = sizeof(ecm_data_header) - sizeof(ecm_data_header.title) - sizeof(ecm_data_header.id);
+    // The pool is not thread safe, so the compressors are taken before start the workers
+    for (size_t i = 0; i < jobs.size(); i++) {
+        audio_segment &segment = jobs[i].segment;
+        if (jobs[i].compression == C_NONE) {
+            continue;
+        }
+        if (jobs[i].primed) {
+            segment.compobj = new compressor(
+                jobs[i].compression,
+                true,
+                segment.compression_level,
+                jobs[i].dictionary.data(),
+                jobs[i].dictionary.size(),
+                job_threads
+            );
+        }
+        else if (jobs[i].compression == C_FLAC) {
+            segment.compobj = options->codecs_pool->get(C_FLAC, true, segment.compression_level);
+        }
+        else {
+            segment.compobj = options->codecs_pool->get(
+                jobs[i].compression,
+                true,
+                segment.compression_level,
+                dictionary.data(),
+                dictionary.size(),
+                job_threads
+            );
+        }
+        segment.comp_buffer = options->codecs_pool->get_buffer(BUFFER_SIZE);
+        if (!segment.comp_buffer) {
+            fprintf(stderr, "Out of memory\n");
+            return ECMTOOL_BUFFER_MEMORY_ERROR;
+        }
+    }
 
-    // Will be setted later
-    uint64_t ecm_block_start_position;
+    std::vector<std::thread> workers(jobs.size());
+    for (size_t i = 0; i < jobs.size(); i++) {
+        if (jobs[i].compression != C_NONE) {
+            workers[i] = std::thread(audio_segment_compress, &jobs[i].segment);
+        }
+    }
+    for (size_t i = 0; i < jobs.size(); i++) {
+        if (workers[i].joinable()) {
+            workers[i].join();
+        }
+    }
 
-    // Sectors TOC
-    sector *sectors_toc = NULL;
-    sec_str_size sectors_toc_header = {C_NONE, 0, 0, 0};
-    uint8_t *sectors_toc_c_buffer;
+    ecmtool_return_code return_code = ECMTOOL_OK;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        audio_segment &segment = jobs[i].segment;
+        if (segment.compobj && jobs[i].primed) {
+            delete segment.compobj;
+        }
+        else if (segment.compobj) {
+            options->codecs_pool->release(segment.compobj);
+        }
+        if (segment.comp_buffer) {
+            options->codecs_pool->release_buffer(segment.comp_buffer);
+        }
+        if (return_code) {
+            continue;
+        }
+        if (segment.result != 0) {
+            fprintf(stderr, "There was an error compressing the stream: %d.\n", segment.result);
+            return_code = ECMTOOL_PROCESSING_ERROR;
+            continue;
+        }
 
-    // Streams TOC
-    stream *streams_toc = NULL;
-    sec_str_size streams_toc_header = {C_NONE, 0, 0, 0};
-    uint8_t *streams_toc_c_buffer;
+        // The streams without compression keep the cleaned data
+        std::vector<uint8_t> &output = jobs[i].compression == C_NONE ? segment.data : segment.output;
+        out_file.write(reinterpret_cast<char*>(output.data()), output.size());
+        if (!out_file.good()) {
+            fprintf(stderr, "\nThere was an error writting the output file");
+            return_code = ECMTOOL_FILE_WRITE_ERROR;
+            continue;
+        }
+        for (size_t j = 0; j < jobs[i].streams.size(); j++) {
+            streams_script[jobs[i].streams[j]].stream_data.out_end_position = (uint64_t)out_file.tellp() - ecm_block_start_position;
+        }
+    }
+    jobs.clear();
 
-    // Sector Tools object
-    sector_tools *sTools = new sector_tools();
+    return return_code;
+}
 
-    // Return code
-    int return_code = 0;
 
-    // Read the block header
-    return_code = read_block_header(in_file, &ecm_block_header);
-    if (return_code) {
-        goto exit;
-    }
+/**
+ * @brief Confirms that a sector is a real copy of the reference sector by reading the reference
+ *        again from the input file and comparing both cleaned sectors byte by byte.
+ *
+ * @param sTools Sector tools object
+ * @param in_file Image file with the reference sector (input or reference image)
+ * @param reference_sector Sector to compare with (base 0)
+ * @param type Mode of the current sector
+ * @param sector_data Cleaned data of the current sector
+ * @param sector_data_size Size of the cleaned data
+ * @param options Encoding options
+ * @return true if both sectors are equal
+ */
+static bool dedup_confirm (
+    sector_tools *sTools,
+    std::istream &in_file,
+    uint64_t reference_sector,
+    sector_tools_types type,
+    uint8_t *sector_data,
+    uint16_t sector_data_size,
+    ecm_options *options
+) {
+    uint8_t reference_in[2352];
+    uint8_t reference_out[2352];
+    uint16_t reference_size = 0;
 
-    // First ECM block byte
-    ecm_block_start_position = in_file.tellg();
+    // Keep the current position to continue the encoding process later
+    std::streampos current_position = in_file.tellg();
 
-    // Read the ECM data header
-    in_file.read(reinterpret_cast<char*>(&ecm_data_header), ecm_data_header_size);
+    in_file.seekg((uint64_t)reference_sector * 2352, std::ios_base::beg);
+    in_file.read(reinterpret_cast<char*>(reference_in), 2352);
+    in_file.seekg(current_position);
     if (!in_file.good()) {
-        return_code = 1;
-        goto exit;
+        return false;
     }
 
-    // Read the title stored in file if exists
-    if (ecm_data_header.title_length) {
-        ecm_data_header.title.resize(ecm_data_header.title_length);
-        in_file.read((char *)ecm_data_header.title.data(), ecm_data_header.title_length);
-        if (!in_file.good()) {
-            return_code = 1;
-            goto exit;
-        }
-    }
+    sTools->clean_sector(reference_out, reference_in, type, reference_size, options->optimizations);
 
-    // Read the ID stored in file if exists
-    if (ecm_data_header.id_length) {
-        ecm_data_header.id.resize(ecm_data_header.id_length);
-        in_file.read((char *)ecm_data_header.id.data(), ecm_data_header.id_length);
-        if (!in_file.good()) {
-            return_code = 1;
-            goto exit;
-        }
+    return reference_size == sector_data_size && memcmp(reference_out, sector_data, sector_data_size) == 0;
+}
+
+
+/**
+ * @brief Search the run which contains a sector. The runs are sorted, so the search continues from the last run.
+ *
+ * @param runs Sorted runs list
+ * @param current_run Current position in the runs list. Will be updated.
+ * @param sector Sector to search
+ * @param reference_sector Output reference sector if the sector is in a run
+ * @return true if the sector is in a run
+ */
+static bool run_lookup (
+    std::vector<dedup_run> &runs,
+    uint64_t &current_run,
+    uint64_t sector,
+    uint64_t &reference_sector
+) {
+    while (current_run < runs.size() && runs[current_run].start_sector + runs[current_run].sector_count <= sector) {
+        current_run++;
+    }
+    if (current_run < runs.size() && runs[current_run].start_sector <= sector) {
+        reference_sector = runs[current_run].reference_sector + (sector - runs[current_run].start_sector);
+        return true;
     }
 
-    // Set the optimization options used in file
-    options->optimizations = (optimization_options)ecm_data_header.optimizations;
+    return false;
+}
 
-    // Reset the counters
-    resetcounter(ecm_block_header.block_size);
 
-    //
-    // Read the streams toc header
-    in_file.seekg(ecm_data_header.streams_toc_pos + ecm_block_start_position, std::ios_base::beg);
-    in_file.read(reinterpret_cast<char*>(&streams_toc_header), sizeof(streams_toc_header));
-    // Read the compressed stream toc data
-    streams_toc_c_buffer = (uint8_t *)malloc(streams_toc_header.compressed_size);
-    if (!streams_toc_c_buffer) {
-        return_code = 1;
-        goto exit;
-    }
-    in_file.read(reinterpret_cast<char*>(streams_toc_c_buffer), streams_toc_header.compressed_size);
-    if (!in_file.good()) {
-        printf("Error reading the in file: %s\n", strerror(errno));
-        return_code = 1;
-        goto exit;
+/**
+ * @brief Decode a reference ECM file to a temporal image next to the output file, and compute its CRC.
+ *
+ * @param options Program options with the reference path
+ * @param base_file Output stream with the decoded reference image
+ * @param base_filename Output temporal image filename. Must be removed when is not needed.
+ * @param base_edc Output reference image CRC
+ * @param base_sectors Output reference image sectors
+ * @return ecmtool_return_code
+ */
+static ecmtool_return_code reference_open (
+    ecm_options *options,
+    std::fstream &base_file,
+    std::string &base_filename,
+    uint32_t &base_edc,
+    uint64_t &base_sectors
+) {
+    std::ifstream reference_file;
+    char file_format[4];
+    uint8_t base_sector[2352];
+
+    reference_file.open(options->reference_path.c_str(), std::ios::binary);
+    reference_file.read(file_format, 4);
+    if (
+        !reference_file.good() || file_format[0] != 'E' || file_format[1] != 'C' || file_format[2] != 'M' ||
+        (file_format[3] != ECM_FILE_VERSION && file_format[3] != ECM_FILE_VERSION_V3)
+    ) {
+        fprintf(stderr, "ERROR: the reference file %s is not a valid ECM file.\n", options->reference_path.c_str());
+        return ECMTOOL_FILE_READ_ERROR;
     }
-    // Decompress the streams toc data
-    streams_toc = (stream *)malloc(streams_toc_header.uncompressed_size);
-    if (decompress_header((uint8_t *)streams_toc, streams_toc_header.uncompressed_size, streams_toc_c_buffer, streams_toc_header.compressed_size)) {
-        fprintf(stderr, "There was an error decompressing the streams header.\n");
-        return_code = ECMTOOL_HEADER_COMPRESSION_ERROR;
-        goto exit;
+
+    base_filename = options->out_filename + ".reference";
+    base_file.open(base_filename.c_str(), std::ios::in|std::ios::out|std::ios::trunc|std::ios::binary);
+    if (!base_file.good()) {
+        fprintf(stderr, "ERROR: the reference temporal file %s cannot be created.\n", base_filename.c_str());
+        return ECMTOOL_FILE_WRITE_ERROR;
     }
-    free(streams_toc_c_buffer);
-    streams_toc_c_buffer = NULL;
 
-    //
-    // Read the sectors toc header
-    in_file.seekg(ecm_data_header.sectors_toc_pos + ecm_block_start_position, std::ios_base::beg);
-    in_file.read(reinterpret_cast<char*>(&sectors_toc_header), sizeof(sectors_toc_header));
-    // Read the compressed stream toc data
-    sectors_toc_c_buffer = (uint8_t *)malloc(sectors_toc_header.compressed_size);
-    if (!sectors_toc_c_buffer) {
-        return_code = 1;
-        goto exit;
+    // The reference is decoded with its own options. A reference of the reference is not supported.
+    ecm_options base_options = *options;
+    base_options.reference_path.clear();
+    if (ecm_file_to_image(reference_file, base_file, &base_options)) {
+        fprintf(stderr, "ERROR: the reference file %s cannot be decoded.\n", options->reference_path.c_str());
+        return ECMTOOL_PROCESSING_ERROR;
     }
-    in_file.read(reinterpret_cast<char*>(sectors_toc_c_buffer), sectors_toc_header.compressed_size);
-    if (!in_file.good()) {
-        return_code = 1;
-        goto exit;
+    base_file.flush();
+
+    // Compute the reference image CRC, to verify that the same reference is used on decoding
+    sector_tools sTools;
+    base_edc = 0;
+    base_file.seekg(0, std::ios_base::end);
+    base_sectors = (uint64_t)base_file.tellg() / 2352;
+    base_file.seekg(0, std::ios_base::beg);
+    for (uint64_t i = 0; i < base_sectors; i++) {
+        base_file.read(reinterpret_cast<char*>(base_sector), 2352);
+        base_edc = sTools.edc_compute(base_edc, base_sector, 2352);
     }
-    // Decompress the strams toc data
-    sectors_toc = (sector *)malloc(sectors_toc_header.uncompressed_size);
-    if (decompress_header((uint8_t *)sectors_toc, sectors_toc_header.uncompressed_size, sectors_toc_c_buffer, sectors_toc_header.compressed_size)) {
-        fprintf(stderr, "There was an error decompressing the sectors header.\n");
-        return_code = ECMTOOL_HEADER_COMPRESSION_ERROR;
-        goto exit;
+    if (!base_file.good()) {
+        fprintf(stderr, "ERROR: there was an error reading the decoded reference image.\n");
+        return ECMTOOL_FILE_READ_ERROR;
     }
-    free(sectors_toc_c_buffer);
-    sectors_toc_c_buffer = NULL;
 
-    // Convert the headers to an script to be followed
-    return_code = task_maker (
-        streams_toc,
-        streams_toc_header,
-        sectors_toc,
-        sectors_toc_header,
-        streams_script
-    );
-    if (return_code) {
-        return_code = ECMTOOL_CORRUPTED_STREAM;
-        goto exit;
-    }
+    return ECMTOOL_OK;
+}
 
-    in_file.seekg(ecm_data_header.ecm_data_pos + ecm_block_start_position, std::ios_base::beg);
-    return_code = disk_decode (
-        sTools,
-        in_file,
-        out_file,
-        streams_script,
-        options,
-        ecm_data_header.ecm_data_pos
-    );
 
-    exit:
-    if (sTools) {
-        delete sTools;
+/**
+ * @brief Compress and write a table of contents (sec_str_size header + zlib data)
+ *
+ * @param out_file Output file, at the position where the toc will be written
+ * @param toc_data Entries data
+ * @param toc_count Number of entries
+ * @param toc_entry_size Size of every entry
+ * @return ecmtool_return_code
+ */
+static ecmtool_return_code write_toc (
+    std::fstream &out_file,
+    uint8_t *toc_data,
+    uint64_t toc_count,
+    uint32_t toc_entry_size
+) {
+    sec_str_size toc_header = {C_ZLIB, 0, 0, 0};
+    toc_header.count = toc_count;
+    toc_header.uncompressed_size = toc_count * toc_entry_size;
+
+    // Compressed size will be the uncompressed size + 6 zlib header bytes + 5 zlib block headers for every 16k (plus two extra for security)
+    uint64_t compressed_size = toc_header.uncompressed_size + 6 + (((toc_header.uncompressed_size / 16384) + 3) * 5);
+    std::vector<uint8_t> toc_c_buffer(compressed_size);
+    if (compress_header(toc_c_buffer.data(), compressed_size, toc_data, toc_header.uncompressed_size, 9)) {
+        fprintf(stderr, "There was an error compressing the toc.\n");
+        return ECMTOOL_HEADER_COMPRESSION_ERROR;
     }
-    if (streams_toc) {
-        delete [] streams_toc;
+    toc_header.compressed_size = compressed_size;
+
+    out_file.write(reinterpret_cast<char*>(&toc_header), sizeof(toc_header));
+    out_file.write(reinterpret_cast<char*>(toc_c_buffer.data()), toc_header.compressed_size);
+    if (!out_file.good()) {
+        fprintf(stderr, "There was an error writting the toc.\n");
+        return ECMTOOL_FILE_WRITE_ERROR;
     }
-    if (streams_toc_c_buffer) {
-        delete [] streams_toc_c_buffer;
+
+    return ECMTOOL_OK;
+}
+
+
+/**
+ * @brief Read and decompress a table of contents written by write_toc
+ *
+ * @param in_file Input file, at the toc position
+ * @param toc_data Output vector with the entries data
+ * @param toc_count Output number of entries
+ * @param toc_entry_size Size of every entry
+ * @param file_version ECM file version. The old version uses a toc header with 32 bits sizes.
+ * @return ecmtool_return_code
+ */
+static ecmtool_return_code read_toc (
+    std::ifstream &in_file,
+    std::vector<uint8_t> &toc_data,
+    uint64_t &toc_count,
+    uint32_t toc_entry_size,
+    uint8_t file_version
+) {
+    sec_str_size toc_header = {C_NONE, 0, 0, 0};
+    if (file_version == ECM_FILE_VERSION_V3) {
+        sec_str_size_v3 toc_header_v3;
+        in_file.read(reinterpret_cast<char*>(&toc_header_v3), sizeof(toc_header_v3));
+        toc_header = {toc_header_v3.compression, toc_header_v3.count, toc_header_v3.uncompressed_size, toc_header_v3.compressed_size};
     }
-    if (sectors_toc) {
-        delete [] sectors_toc;
+    else {
+        in_file.read(reinterpret_cast<char*>(&toc_header), sizeof(toc_header));
     }
-    if (sectors_toc_c_buffer) {
-        delete [] sectors_toc_c_buffer;
+    std::vector<uint8_t> toc_c_buffer(toc_header.compressed_size);
+    in_file.read(reinterpret_cast<char*>(toc_c_buffer.data()), toc_header.compressed_size);
+    if (!in_file.good()) {
+        fprintf(stderr, "There was an error reading the toc.\n");
+        return ECMTOOL_FILE_READ_ERROR;
     }
 
-    return return_code;
+    toc_data.resize(toc_header.uncompressed_size);
+    if (
+        toc_header.uncompressed_size != toc_header.count * toc_entry_size ||
+        decompress_header(toc_data.data(), toc_header.uncompressed_size, toc_c_buffer.data(), toc_header.compressed_size)
+    ) {
+        fprintf(stderr, "There was an error decompressing the toc.\n");
+        return ECMTOOL_HEADER_COMPRESSION_ERROR;
+    }
+    toc_count = toc_header.count;
+
+    return ECMTOOL_OK;
 }
 
 
-int write_block_header(
-    std::fstream &out_file,
-    block_header *block_header_data
+/**
+ * @brief Read the chunks list of an ECM file which uses the chunk store
+ *
+ * @param filename ECM file
+ * @param live_chunks Set where the chunks hashes will be added
+ * @return ecmtool_return_code
+ */
+static ecmtool_return_code read_manifest_chunks (
+    std::string filename,
+    std::unordered_set<std::string, chunk_hash_key> &live_chunks
 ) {
-    if (out_file.good()) {
-        // Write the header data
-        out_file.write(reinterpret_cast<char*>(block_header_data), sizeof(*block_header_data));
+    std::ifstream in_file;
+    uint64_t toc_position = 0;
+    std::vector<blocks_toc> file_blocks_toc;
+    uint8_t file_version = 0;
+
+    in_file.open(filename.c_str(), std::ios::binary);
+    if (!in_file.is_open()) {
+        fprintf(stderr, "ERROR: input file %s cannot be opened.\n", filename.c_str());
+        return ECMTOOL_FILE_READ_ERROR;
+    }
+
+    // Read the file TOC
+    if (read_file_toc(in_file, toc_position, file_blocks_toc, &file_version)) {
+        fprintf(stderr, "ERROR: %s is not a valid ECM file.\n", filename.c_str());
+        return ECMTOOL_FILE_READ_ERROR;
+    }
+    // The old versions doesn't support the chunk store
+    if (file_version != ECM_FILE_VERSION) {
+        return ECMTOOL_OK;
+    }
+
+    for (size_t i = 0; i < file_blocks_toc.size(); i++) {
+        if (file_blocks_toc[i].type != ECMFILE_BLOCK_TYPE_ECM) {
+            continue;
+        }
+
+        // Read the ECM header, which is just after the block header
+        ecm_header ecm_data_header;
+        uint32_t ecm_data_header_size = sizeof(ecm_data_header) - sizeof(ecm_data_header.title) - sizeof(ecm_data_header.id);
+        uint64_t ecm_block_start_position = file_blocks_toc[i].start_position + sizeof(block_header);
+        in_file.seekg(ecm_block_start_position, std::ios_base::beg);
+        in_file.read(reinterpret_cast<char*>(&ecm_data_header), ecm_data_header_size);
+        if (!in_file.good()) {
+            fprintf(stderr, "ERROR: there was an error reading the %s header.\n", filename.c_str());
+            return ECMTOOL_FILE_READ_ERROR;
+        }
+        if (!ecm_data_header.chunks_toc_pos) {
+            continue;
+        }
 
-        if (out_file.good()) {
-            return 0;
+        std::vector<uint8_t> toc_data;
+        uint64_t toc_count = 0;
+        in_file.seekg(ecm_data_header.chunks_toc_pos + ecm_block_start_position, std::ios_base::beg);
+        ecmtool_return_code return_code = read_toc(in_file, toc_data, toc_count, sizeof(struct chunk_ref), file_version);
+        if (return_code) {
+            return return_code;
         }
-        else {
-            return 1;
+
+        chunk_ref *refs = (chunk_ref *)toc_data.data();
+        for (uint64_t j = 0; j < toc_count; j++) {
+            live_chunks.insert(std::string((char *)refs[j].hash, sizeof(refs[j].hash)));
         }
     }
-    else {
-        fprintf(stderr, "Error writting the header because the output file is not correct\n.");
-        return 1;
-    }
 
-    return 0;
+    return ECMTOOL_OK;
 }
 
 
-int read_block_header(
-    std::ifstream &in_file,
-    block_header *block_header_data
+/**
+ * @brief Chunk store maintenance tasks: garbage collector and integrity check
+ *
+ * @param options Program options with the store path and the manifests list
+ * @return int: non zero on error
+ */
+static int store_maintenance(
+    ecm_options *options
 ) {
-    if (in_file.good()) {
-        // Write the header data
-        in_file.read(reinterpret_cast<char*>(block_header_data), sizeof(*block_header_data));
+    // Without any ECM file every chunk would be seen as garbage and removed
+    if (options->store_gc && options->input_files.empty()) {
+        fprintf(stderr, "ERROR: the garbage collector requires all the ECM files which are using the chunk store.\n");
+        return 1;
+    }
 
-        if (in_file.good()) {
-            return 0;
+    chunk_store store(options->store_path, options->compression_level);
+    if (store.open(false)) {
+        fprintf(stderr, "ERROR: the chunk store %s cannot be opened.\n", options->store_path.c_str());
+        return 1;
+    }
+
+    if (options->store_gc) {
+        // Every chunk not referenced by the provided ECM files will be removed
+        std::unordered_set<std::string, chunk_hash_key> live_chunks;
+        for (size_t i = 0; i < options->input_files.size(); i++) {
+            if (read_manifest_chunks(options->input_files[i], live_chunks)) {
+                return 1;
+            }
         }
-        else {
+
+        uint64_t removed_chunks = 0;
+        uint64_t removed_bytes = 0;
+        if (store.garbage_collect(live_chunks, removed_chunks, removed_bytes)) {
+            fprintf(stderr, "ERROR: there was an error collecting the chunk store garbage.\n");
             return 1;
         }
+
+        fprintf(stdout, "Removed chunks ......................... %6" PRIu64 "\n", removed_chunks);
+        fprintf(stdout, "Removed size ........................... %3.2fMB\n", MB(removed_bytes));
     }
-    else {
-        fprintf(stderr, "Error reading the header because the input file is not correct\n.");
-        return 1;
+
+    if (options->store_check) {
+        uint64_t checked_chunks = 0;
+        uint64_t wrong_chunks = 0;
+        if (store.check(checked_chunks, wrong_chunks)) {
+            fprintf(stderr, "ERROR: there was an error checking the chunk store.\n");
+            return 1;
+        }
+
+        fprintf(stdout, "Checked chunks ......................... %6" PRIu64 "\n", checked_chunks);
+        fprintf(stdout, "Wrong chunks ........................... %6" PRIu64 "\n", wrong_chunks);
+        if (wrong_chunks) {
+            return 1;
+        }
     }
 
     return 0;
 }
 
 
-static ecmtool_return_code disk_analyzer (
-    sector_tools *sTools,
-    std::ifstream &in_file,
-    size_t image_file_size,
-    std::vector<stream_script> &streams_script,
-    ecm_header *ecm_data_header,
+/**
+ * @brief Load the compression dictionary file into the options and compute its ID
+ *
+ * @param options Program options with the dictionary path
+ * @return ecmtool_return_code
+ */
+static ecmtool_return_code dictionary_load (
     ecm_options *options
 ) {
-    // Sector count
-    size_t sectors_count = image_file_size / 2352;
-
-    // Sector buffer
-    uint8_t in_sector[2352];
-
-    // Sector counter
-    uint32_t current_sector = 0;
+    std::ifstream dictionary_file(options->dictionary_path.c_str(), std::ios::binary);
+    if (!dictionary_file.is_open()) {
+        fprintf(stderr, "ERROR: the dictionary file %s cannot be opened.\n", options->dictionary_path.c_str());
+        return ECMTOOL_FILE_READ_ERROR;
+    }
 
-    // Seek to the begin
-    in_file.seekg(0, std::ios_base::beg);
+    dictionary_file.seekg(0, std::ios_base::end);
+    options->dictionary.resize(dictionary_file.tellg());
+    dictionary_file.seekg(0, std::ios_base::beg);
+    dictionary_file.read(reinterpret_cast<char*>(options->dictionary.data()), options->dictionary.size());
+    if (!dictionary_file.good() || options->dictionary.empty()) {
+        fprintf(stderr, "ERROR: there was an error reading the dictionary file %s.\n", options->dictionary_path.c_str());
+        return ECMTOOL_FILE_READ_ERROR;
+    }
 
-    // ID Detection
-    std::string id;
-    int id_detection_return = -1;
+    options->dictionary_id = dictionary_get_id(options->dictionary);
 
-    // Loop through all the sectors
-    for (size_t i = 0; i < sectors_count; i++) {
-        // Read a sector
-        in_file.read(reinterpret_cast<char*>(in_sector), 2352);
-        if (in_file.good()) {
-            // Update the input file position
-            setcounter_analyze(in_file.tellg());
+    return ECMTOOL_OK;
+}
 
-            sector_tools_types detected_type = sTools->detect(in_sector);
-            //printf("Current sector: %d -> Type: %d\n", current_sector, detected_type);
 
-            // Try to detect the game ID to add it to header
-            if (id_detection_return != 0) {
-                id_detection_return = detect_id_psx(id, in_sector, 2352);
-                if (id_detection_return == 0) {
-                    ecm_data_header->id = id;
-                    ecm_data_header->id_length = id.length();
-                }
-            }            
+/**
+ * @brief Get the dictionary ID. The trained dictionaries include it, and for the raw dictionaries the CRC is used.
+ *
+ * @param dictionary Dictionary data
+ * @return uint32_t: Dictionary ID (never zero)
+ */
+static uint32_t dictionary_get_id (
+    std::vector<uint8_t> &dictionary
+) {
+    uint32_t id = ZDICT_getDictID(dictionary.data(), dictionary.size());
+    if (!id) {
+        sector_tools sTools;
+        id = sTools.edc_compute(0, dictionary.data(), dictionary.size());
+    }
 
-            //printf("Detected sector type: %d\n", detected_type);
+    return id ? id : 1;
+}
 
-            // Only check the sector info in data sectors
-            if (detected_type != STT_CDDA && detected_type != STT_CDDA_GAP) {
-                // Check if MSF can be regenerated (libcrypt protection)
-                uint8_t time_data[3];
-                sTools->sector_to_time(time_data, current_sector + 0x96);
-                if (
-                    ecm_data_header->optimizations & OO_REMOVE_MSF &&
-                    (time_data[0] != in_sector[0x0C] ||
-                    time_data[1] != in_sector[0x0D] ||
-                    time_data[2] != in_sector[0x0E])
-                ) {
-                    // Sector contains wrong MSF, so it cannot be recovered in a lossless way
-                    // To avoid this problem, we will disable the sector MSF optimization
-                    ecm_data_header->optimizations = (optimization_options)(ecm_data_header->optimizations & ~OO_REMOVE_MSF);
-                    //printf("Disabled MSF optimization. current_sector: %d, %d\n\n", current_sector, ecm_data_header->optimizations);
-                }
 
-                // Check if redundant FLAG can be regenerated (Only Mode 2 XA modes)
-                if (
-                    (
-                        detected_type == STT_MODE2_1 ||
-                        detected_type == STT_MODE2_1_GAP ||
-                        detected_type == STT_MODE2_2 ||
-                        detected_type == STT_MODE2_2_GAP
-                    ) &&
-                    ecm_data_header->optimizations & OO_REMOVE_REDUNDANT_FLAG &&
-                    (
-                        in_sector[0x10] != in_sector[0x14] ||
-                        in_sector[0x11] != in_sector[0x15] ||
-                        in_sector[0x12] != in_sector[0x16] ||
-                        in_sector[0x13] != in_sector[0x17]
-                    )
-                ) {
-                    // Sector contains wrong subheader redundancy, so it cannot be recovered in a lossless way
-                    // To avoid this problem, we will disable the sector redundant FLAG removal
-                    //printf("Disabled redundant FLAG. current_sector: %d\n\n", current_sector);
-                    ecm_data_header->optimizations = (optimization_options)(ecm_data_header->optimizations & ~OO_REMOVE_REDUNDANT_FLAG);
-                }
-            }
+/**
+ * @brief Train a compression dictionary using the cleaned data sectors of the provided images. Every
+ *        seekable block of data sectors is a sample, so the dictionary fits the small blocks data.
+ *
+ * @param options Program options with the dictionary output path and the images list
+ * @return int: non zero on error
+ */
+static int train_dictionary(
+    ecm_options *options
+) {
+    std::vector<std::string> images = options->input_files;
+    std::vector<uint8_t> samples;
+    std::vector<size_t> samples_sizes;
+    std::vector<uint8_t> dictionary(DICTIONARY_SIZE);
+    uint8_t in_sector[2352];
+    uint8_t out_sector[2352];
+    sector_tools sTools;
 
-            // Replace the current optimization options to match the header optimizations
-            options->optimizations = (optimization_options)ecm_data_header->optimizations;
+    if (!options->in_filename.empty()) {
+        images.push_back(options->in_filename);
+    }
+    if (images.empty()) {
+        fprintf(stderr, "ERROR: the dictionary training requires at least one image.\n");
+        print_help();
+        return 1;
+    }
 
-            sector_tools_stream_types stream_type = sTools->detect_stream(detected_type);
-            // If there are no streams or stream type is different, create a new streams entry.
-            if (
-                streams_script.size() == 0 ||
-                streams_script.back().stream_data.type != (stream_type - 1)
-            ) {
-                // Push the new element to the end
-                streams_script.push_back(stream_script());
+    // Every image can add the same amount of samples
+    uint64_t image_max_size = DICTIONARY_MAX_SAMPLES_SIZE / images.size();
 
-                // Set the element data
-                streams_script.back().stream_data.type = stream_type - 1;
-                if (stream_type == STST_AUDIO) {
-                    streams_script.back().stream_data.compression = options->audio_compression;
-                }
-                else {
-                    streams_script.back().stream_data.compression = options->data_compression;
-                }
+    for (size_t i = 0; i < images.size(); i++) {
+        std::ifstream image_file(images[i].c_str(), std::ios::binary);
+        if (!image_file.is_open()) {
+            fprintf(stderr, "ERROR: the image %s cannot be opened.\n", images[i].c_str());
+            return 1;
+        }
 
-                if (streams_script.size() > 1) {
-                    streams_script.back().stream_data.end_sector = streams_script[streams_script.size() - 2].stream_data.end_sector;
-                }
-                else {
-                    streams_script.back().stream_data.end_sector = 0;
-                }
+        uint64_t image_size = 0;
+        uint32_t block_sectors = 0;
+        samples_sizes.push_back(0);
+        while (image_size < image_max_size && image_file.read(reinterpret_cast<char*>(in_sector), 2352)) {
+            sector_tools_types type = sTools.detect(in_sector);
+            if (sTools.detect_stream(type) != STST_DATA) {
+                continue;
             }
 
-            if (
-                streams_script.back().sectors_data.size() == 0 ||
-                streams_script.back().sectors_data.back().mode != detected_type
-            ) {
-                // Push the new element to the end
-                streams_script.back().sectors_data.push_back(sector());
+            uint16_t output_size = 0;
+            sTools.clean_sector(out_sector, in_sector, type, output_size, options->optimizations);
+            samples.insert(samples.end(), out_sector, out_sector + output_size);
+            samples_sizes.back() += output_size;
+            image_size += output_size;
 
-                // Set the element data
-                streams_script.back().sectors_data.back().mode = detected_type;
-                streams_script.back().sectors_data.back().sector_count = 0;
+            // Start a new sample at the seekable blocks boundaries
+            if (++block_sectors == options->sectors_per_block) {
+                samples_sizes.push_back(0);
+                block_sectors = 0;
             }
-
-            streams_script.back().stream_data.end_sector++;
-            streams_script.back().sectors_data.back().sector_count++;
         }
-        else {
-            // There was an eror reading the new sector
-            fprintf(stderr, "There was an error reading the input file.\n");
-            return ECMTOOL_FILE_READ_ERROR;
+
+        if (!samples_sizes.back()) {
+            samples_sizes.pop_back();
         }
+    }
 
-        current_sector++;
+    size_t dictionary_size = ZDICT_trainFromBuffer(
+        dictionary.data(),
+        dictionary.size(),
+        samples.data(),
+        samples_sizes.data(),
+        samples_sizes.size()
+    );
+    if (ZDICT_isError(dictionary_size)) {
+        fprintf(stderr, "ERROR: the dictionary cannot be trained: %s\n", ZDICT_getErrorName(dictionary_size));
+        return 1;
     }
+    dictionary.resize(dictionary_size);
 
-    return ECMTOOL_OK;
+    std::ofstream dictionary_file(options->train_dictionary_path.c_str(), std::ios::binary|std::ios::trunc);
+    dictionary_file.write(reinterpret_cast<char*>(dictionary.data()), dictionary.size());
+    if (!dictionary_file.good()) {
+        fprintf(stderr, "ERROR: the dictionary file %s cannot be written.\n", options->train_dictionary_path.c_str());
+        return 1;
+    }
+
+    fprintf(stdout, "Training samples ....................... %6zu\n", samples_sizes.size());
+    fprintf(stdout, "Training size .......................... %3.2fMB\n", MB(samples.size()));
+    fprintf(stdout, "Dictionary size ........................ %3.2fKB\n", dictionary.size() / 1024.0);
+    fprintf(stdout, "Dictionary ID .......................... %08X\n", dictionary_get_id(dictionary));
+
+    return 0;
 }
 
 
-static ecmtool_return_code disk_encode (
-    sector_tools *sTools,
-    std::ifstream &in_file,
-    std::fstream &out_file,
-    std::vector<stream_script> &streams_script,
-    ecm_options *options,
-    std::vector<uint32_t> *sectors_type,
-    uint64_t ecm_block_start_position
+/**
+ * @brief Compress and decompress a cleaned stream with the provided codec settings, like the encoder and
+ *        decoder would do, measuring the time and the memory used by the codecs.
+ *
+ * @param data The cleaned stream data
+ * @param sectors_size The cleaned size of every sector in the stream
+ * @param result The result with the codec settings to test. The measures are stored on it.
+ * @param threads The threads used by the multithreaded codecs
+ * @return int: non zero on error
+ */
+static int bench_codec(
+    std::vector<uint8_t> &data,
+    std::vector<uint16_t> &sectors_size,
+    bench_result &result,
+    uint32_t threads
 ) {
-    // Sectors buffers
-    uint8_t in_sector[2352];
-    uint8_t out_sector[2352];
+    std::vector<uint8_t> compressed;
+    std::vector<uint8_t> buffer(BUFFER_SIZE);
+    int8_t res = 0;
 
-    // Hash
-    uint32_t input_edc = 0;
-    uint8_t buffer_edc[4];
+    //
+    // Compression
+    //
+    auto start = std::chrono::high_resolution_clock::now();
+    compressor *compobj = new compressor(result.mode, true, result.level, NULL, 0, threads);
+    size_t output_size = BUFFER_SIZE;
+    compobj -> set_output(buffer.data(), output_size);
+
+    size_t position = 0;
+    size_t batch_size = 0;
+    uint32_t batch_sectors = 0;
+    for (size_t i = 0; i < sectors_size.size(); i++) {
+        batch_size += sectors_size[i];
+        batch_sectors++;
+
+        uint8_t flush_mode = Z_NO_FLUSH;
+        if (i + 1 == sectors_size.size()) {
+            flush_mode = Z_FINISH;
+        }
+        else if (result.sectors_per_block && !((i + 1) % result.sectors_per_block)) {
+            flush_mode = Z_FULL_FLUSH;
+        }
+        if (flush_mode == Z_NO_FLUSH && batch_sectors < ENCODE_BATCH_SECTORS) {
+            continue;
+        }
 
-    // Reference to sectors_type
-    std::vector<uint32_t>& sectors_type_ref = *sectors_type;
+        size_t compress_buffer_left = 0;
+        res = compobj -> compress(compress_buffer_left, data.data() + position, batch_size, flush_mode);
+        position += batch_size;
+        batch_size = 0;
+        batch_sectors = 0;
+
+        while (!res && compobj -> flush_pending()) {
+            compressed.insert(compressed.end(), buffer.data(), buffer.data() + BUFFER_SIZE - compress_buffer_left);
+            output_size = BUFFER_SIZE;
+            compobj -> set_output(buffer.data(), output_size);
+            res = compobj -> compress(compress_buffer_left, NULL, 0, flush_mode);
+        }
+        if (res) {
+            break;
+        }
+        // The codecs release part of their memory at the end of the stream, so the peak is kept
+        result.compression_memory = std::max(result.compression_memory, compobj -> memory_usage());
 
-    // Seek to the begin
-    in_file.seekg(0, std::ios_base::beg);
+        if (compress_buffer_left < (BUFFER_SIZE * 0.25) || flush_mode == Z_FINISH) {
+            compressed.insert(compressed.end(), buffer.data(), buffer.data() + BUFFER_SIZE - compress_buffer_left);
+            output_size = BUFFER_SIZE;
+            compobj -> set_output(buffer.data(), output_size);
+        }
+    }
+    delete compobj;
+    result.compression_time = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
 
-    // Stream processing
-    for (uint32_t i = 0; i < streams_script.size(); i++) {
-        // Compressor object
-        compressor *compobj = NULL;
-        // Buffer object
-        uint8_t *comp_buffer = NULL;
+    if (res) {
+        fprintf(stderr, "There was an error compressing the stream: %d.\n", res);
+        return 1;
+    }
+    result.size = data.size();
+    result.compressed_size = compressed.size();
 
-        // Initialize the compressor and the buffer if required
-        if (streams_script[i].stream_data.compression) {
-            // Set compression level with extreme option if compression is LZMA
-            int32_t compression_option = options->compression_level;
-            if (options->extreme_compression) {
-                if ((sector_tools_compression)streams_script[i].stream_data.compression == C_LZMA) {
-                    compression_option |= LZMA_PRESET_EXTREME;
-                }
-                else if ((sector_tools_compression)streams_script[i].stream_data.compression == C_FLAC) {
-                    compression_option |= FLACZLIB_EXTREME_COMPRESSION;
-                }
-            }
-            compobj = new compressor(
-                (sector_tools_compression)streams_script[i].stream_data.compression,
-                true,
-                compression_option
-            );
+    //
+    // Decompression. Every sector is decompressed separately, like in the decoder.
+    //
+    std::vector<uint8_t> restored(data.size());
+    start = std::chrono::high_resolution_clock::now();
+    compressor *decompobj = new compressor(result.mode, false, 0, NULL, 0, threads);
+    size_t input_size = compressed.size();
+    decompobj -> set_input(compressed.data(), input_size);
+
+    position = 0;
+    for (size_t i = 0; i < sectors_size.size(); i++) {
+        if (!sectors_size[i]) {
+            continue;
+        }
+        size_t sector_size = sectors_size[i];
+        size_t decompress_buffer_left = 0;
+        decompobj -> decompress(restored.data() + position, sector_size, decompress_buffer_left, Z_SYNC_FLUSH);
+        position += sectors_size[i];
+        result.decompression_memory = std::max(result.decompression_memory, decompobj -> memory_usage());
+    }
+    delete decompobj;
+    result.decompression_time = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
 
-            // Initialize the compressor buffer
-            comp_buffer = (uint8_t*) malloc(BUFFER_SIZE);
-            if(!comp_buffer) {
-                fprintf(stderr, "Out of memory\n");
-                return ECMTOOL_BUFFER_MEMORY_ERROR;
-            }
+    result.verified = restored == data;
 
-            // Set the compressor buffer as output
-            size_t output_size = BUFFER_SIZE;
-            compobj -> set_output(comp_buffer, output_size);
-        }
+    return 0;
+}
 
-        // Walk through all the sector types in stream
-        for (uint32_t j = 0; j < streams_script[i].sectors_data.size(); j++) {
-            // Process the number of sectors of every type
-            for (uint32_t k = 0; k < streams_script[i].sectors_data[j].sector_count; k++) {
-                if (in_file.eof()){
-                    fprintf(stderr, "Unexpected EOF detected.\n");
-                    return ECMTOOL_FILE_READ_ERROR;
-                }
 
-                in_file.read(reinterpret_cast<char*>(in_sector), 2352);
-                // Compute the crc of the readed data 
-                input_edc = sTools->edc_compute(
-                    input_edc,
-                    in_sector,
-                    2352
-                );
+/**
+ * @brief Benchmark all the compressors and levels over the cleaned audio and data streams of an image,
+ *        with and without seekable blocks. The results are printed as a table and written to a JSON file.
+ *
+ * @param options The program options. The image is the input file or the first argument.
+ * @return int: non zero on error
+ */
+static int bench_codecs(
+    ecm_options *options
+) {
+    const char *codec_names[] = {"none", "zlib", "lzma", "lz4", "flac", "zstd"};
+    const char *stream_names[] = {"audio", "data"};
+    std::string image = options->in_filename;
+    std::vector<stream_script> streams_script;
+    std::vector<uint8_t> streams_data[2];
+    std::vector<uint16_t> streams_sectors_size[2];
+    std::vector<bench_result> results;
+    uint8_t in_sector[2352];
+    sector_tools sTools;
+
+    if (image.empty() && options->input_files.size()) {
+        image = options->input_files[0];
+    }
+    if (image.empty()) {
+        fprintf(stderr, "ERROR: the codecs benchmark requires an image.\n");
+        print_help();
+        return 1;
+    }
+
+    std::ifstream image_file(image.c_str(), std::ios::binary);
+    if (!image_file.is_open()) {
+        fprintf(stderr, "ERROR: the image %s cannot be opened.\n", image.c_str());
+        return 1;
+    }
+    image_file.seekg(0, std::ios_base::end);
+    size_t image_size = image_file.tellg();
+    if (image_size % 2352) {
+        fprintf(stderr, "ERROR: The input file doesn't appear to be a CD-ROM image\n");
+        return 1;
+    }
+
+    // Analyze the image to get the streams and the optimizations which can be used
+    ecm_header ecm_data_header = {options->optimizations, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, "", ""};
+    std::vector<dedup_run> sectors_order;
+    std::vector<float> blocks_entropy;
+    resetcounter(image_size);
+    if (disk_analyzer(&sTools, image_file, image_size, streams_script, sectors_order, blocks_entropy, &ecm_data_header, options)) {
+        return 1;
+    }
+    fprintf(stdout, "\n\n");
 
-                // Current sector
-                uint32_t current_sector = in_file.tellg() / 2352;
+    // Extract the cleaned streams. All the streams of every type are joined.
+    image_file.clear();
+    image_file.seekg(0, std::ios_base::beg);
+    for (size_t i = 0; i < streams_script.size(); i++) {
+        uint8_t type = streams_script[i].stream_data.type == STSC_CDDA ? 0 : 1;
+        for (size_t j = 0; j < streams_script[i].sectors_data.size(); j++) {
+            for (uint64_t k = 0; k < streams_script[i].sectors_data[j].sector_count; k++) {
+                image_file.read(reinterpret_cast<char*>(in_sector), 2352);
+                size_t position = streams_data[type].size();
+                streams_data[type].resize(position + 2352);
 
-                // We will clean the sector to keep only the data that we want
                 uint16_t output_size = 0;
-                int8_t res = sTools->clean_sector(
-                    out_sector,
+                sTools.clean_sector(
+                    streams_data[type].data() + position,
                     in_sector,
                     (sector_tools_types)streams_script[i].sectors_data[j].mode,
                     output_size,
                     options->optimizations
                 );
+                streams_data[type].resize(position + output_size);
+                streams_sectors_size[type].push_back(output_size);
+            }
+        }
+    }
 
-                if (res) {
-                    fprintf(stderr, "There was an error cleaning the sector\n");
-                    return ECMTOOL_PROCESSING_ERROR;
-                }
-
-                sectors_type_ref[streams_script[i].sectors_data[j].mode]++;
+    fprintf(stdout, "Stream  Codec  Level  Blocks   Ratio  Comp MB/s  Decomp MB/s   Comp mem  Decomp mem  Verified\n");
+    for (uint8_t type = 0; type < 2; type++) {
+        if (streams_data[type].empty()) {
+            continue;
+        }
 
-                // Compress the sector using the selected compression (or none)
-                switch (streams_script[i].stream_data.compression) {
-                // No compression
-                case C_NONE:
-                    out_file.write(reinterpret_cast<char*>(out_sector), output_size);
-                    if (!out_file.good()) {
-                        fprintf(stderr, "\nThere was an error writting the output file");
-                        return ECMTOOL_FILE_WRITE_ERROR;
+        for (uint8_t mode = C_ZLIB; mode <= C_ZSTD; mode++) {
+            // FLAC is only for audio
+            if (mode == C_FLAC && type != 0) {
+                continue;
+            }
+            int32_t max_level = mode == C_ZSTD ? 22 : (mode == C_FLAC ? 8 : 9);
+
+            for (int32_t level = 1; level <= max_level; level++) {
+                for (uint8_t seekable = 0; seekable < 2; seekable++) {
+                    bench_result result;
+                    result.stream = stream_names[type];
+                    result.mode = (sector_tools_compression)mode;
+                    result.level = level;
+                    result.sectors_per_block = seekable ? options->sectors_per_block : 0;
+                    if (options->extreme_compression) {
+                        if (mode == C_LZMA) {
+                            result.level |= LZMA_PRESET_EXTREME;
+                        }
+                        else if (mode == C_FLAC) {
+                            result.level |= FLACZLIB_EXTREME_COMPRESSION;
+                        }
+                        else if (mode == C_ZSTD) {
+                            result.level |= COMPRESSOR_ZSTD_EXTREME;
+                        }
                     }
-                    break;
 
-                // Zlib compression
-                case C_ZLIB:
-                case C_LZMA:
-                case C_LZ4:
-                case C_FLAC:
-                    size_t compress_buffer_left = 0;
-                    // Current sector is the last stream sector
-                    if (current_sector == streams_script[i].stream_data.end_sector) {
-                        res = compobj -> compress(compress_buffer_left, out_sector, output_size, Z_FINISH);
-                    }
-                    else if (options->seekable && (options->sectors_per_block == 1 || !((current_sector + 1) % options->sectors_per_block))) {
-                        // A new compressor block is required
-                        res = compobj -> compress(compress_buffer_left, out_sector, output_size, Z_FULL_FLUSH);
-                    }
-                    else {
-                        res = compobj -> compress(compress_buffer_left, out_sector, output_size, Z_NO_FLUSH);
+                    if (bench_codec(streams_data[type], streams_sectors_size[type], result, options->threads)) {
+                        return 1;
                     }
+                    results.push_back(result);
 
-                    if (res != 0) {
-                        fprintf(stderr, "There was an error compressing the stream: %d.\n", res);
-                        return ECMTOOL_PROCESSING_ERROR;
+                    // Some codecs cannot report their memory usage
+                    char compression_memory[16] = "n/a";
+                    char decompression_memory[16] = "n/a";
+                    if (result.compression_memory) {
+                        snprintf(compression_memory, sizeof(compression_memory), "%.2fMB", MB(result.compression_memory));
                     }
-
-                    // If buffer is above 75% or is the last sector, write the data to the output and reset the state
-                    if (compress_buffer_left < (BUFFER_SIZE * 0.25) || (current_sector) == streams_script[i].stream_data.end_sector) {
-                        out_file.write(reinterpret_cast<char*>(comp_buffer), BUFFER_SIZE - compress_buffer_left);
-                        if (!out_file.good()) {
-                            fprintf(stderr, "\nThere was an error writting the output file");
-                            return ECMTOOL_FILE_WRITE_ERROR;
-                        }
-                        size_t output_size = BUFFER_SIZE;
-                        compobj -> set_output(comp_buffer, output_size);
+                    if (result.decompression_memory) {
+                        snprintf(decompression_memory, sizeof(decompression_memory), "%.2fMB", MB(result.decompression_memory));
                     }
-                    break;
-                }
 
-                setcounter_encode(in_file.tellg());
+                    fprintf(
+                        stdout,
+                        "%-6s  %-5s  %5d  %6u  %5.2f%%  %9.2f  %11.2f  %9s  %10s  %s\n",
+                        result.stream.c_str(),
+                        codec_names[mode],
+                        level,
+                        result.sectors_per_block,
+                        result.compressed_size * 100.0 / result.size,
+                        MB(result.size) / std::max(result.compression_time, 1e-9),
+                        MB(result.size) / std::max(result.decompression_time, 1e-9),
+                        compression_memory,
+                        decompression_memory,
+                        result.verified ? "yes" : "NO"
+                    );
+                    fflush(stdout);
+                }
             }
         }
+    }
 
-        if (compobj) {
-            delete  compobj;
-            compobj = NULL;
-        }
-        if (comp_buffer) {
-            free(comp_buffer);
+    // Write the results as JSON
+    std::string image_json;
+    for (size_t i = 0; i < image.size(); i++) {
+        if (image[i] == '"' || image[i] == '\\') {
+            image_json += '\\';
         }
-    
-        streams_script[i].stream_data.out_end_position = (uint64_t)out_file.tellp() - ecm_block_start_position;
+        image_json += image[i];
     }
 
-    // Write the CRC
-    sTools->put32lsb(buffer_edc, input_edc);
-    out_file.write(reinterpret_cast<char*>(buffer_edc), 4);
+    FILE *json_file = fopen(options->bench_codecs_path.c_str(), "w");
+    if (!json_file) {
+        fprintf(stderr, "ERROR: the benchmark file %s cannot be written.\n", options->bench_codecs_path.c_str());
+        return 1;
+    }
+    fprintf(json_file, "{\n");
+    fprintf(json_file, "  \"image\": \"%s\",\n", image_json.c_str());
+    fprintf(json_file, "  \"threads\": %u,\n", options->threads);
+    fprintf(json_file, "  \"extreme\": %s,\n", options->extreme_compression ? "true" : "false");
+    fprintf(json_file, "  \"streams\": {\n");
+    for (uint8_t type = 0; type < 2; type++) {
+        fprintf(
+            json_file,
+            "    \"%s\": {\"sectors\": %zu, \"size\": %zu}%s\n",
+            stream_names[type],
+            streams_sectors_size[type].size(),
+            streams_data[type].size(),
+            type ? "" : ","
+        );
+    }
+    fprintf(json_file, "  },\n");
+    fprintf(json_file, "  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        // The unknown memory usage is written as null
+        std::string compression_memory = results[i].compression_memory ? std::to_string(results[i].compression_memory) : "null";
+        std::string decompression_memory = results[i].decompression_memory ? std::to_string(results[i].decompression_memory) : "null";
+        fprintf(
+            json_file,
+            "    {\"stream\": \"%s\", \"codec\": \"%s\", \"level\": %d, \"sectors_per_block\": %u, "
+            "\"size\": %" PRIu64 ", \"compressed_size\": %" PRIu64 ", \"ratio\": %.4f, "
+            "\"compression_mbps\": %.2f, \"decompression_mbps\": %.2f, "
+            "\"compression_memory\": %s, \"decompression_memory\": %s, \"verified\": %s}%s\n",
+            results[i].stream.c_str(),
+            codec_names[results[i].mode],
+            results[i].level & 0xFF,
+            results[i].sectors_per_block,
+            results[i].size,
+            results[i].compressed_size,
+            (double)results[i].compressed_size / results[i].size,
+            MB(results[i].size) / std::max(results[i].compression_time, 1e-9),
+            MB(results[i].size) / std::max(results[i].decompression_time, 1e-9),
+            compression_memory.c_str(),
+            decompression_memory.c_str(),
+            results[i].verified ? "true" : "false",
+            i + 1 == results.size() ? "" : ","
+        );
+    }
+    fprintf(json_file, "  ]\n");
+    fprintf(json_file, "}\n");
+    fclose(json_file);
 
-    return ECMTOOL_OK;
+    return 0;
 }
 
 
-static ecmtool_return_code disk_decode (
+/**
+ * @brief Chooses the codec and level of every stream class by compressing some evenly spaced sample windows
+ *        of the class with every candidate. The best ratio which keeps the encoding or decoding speed over
+ *        the objective is applied to the class streams, and the streams with the same settings are joined.
+ *
+ * @param sTools Sector tools object used to clean the samples
+ * @param in_file The image file
+ * @param streams_script The streams generated by the analyzer
+ * @param sectors_order Encoding order of the image sectors, if the files are grouped
+ * @param options The encoding options with the objective
+ * @param encode_data The summary data, where the choices and the predicted results are stored
+ * @return ecmtool_return_code
+ */
+static ecmtool_return_code auto_codec_select (
     sector_tools *sTools,
     std::ifstream &in_file,
-    std::fstream &out_file,
     std::vector<stream_script> &streams_script,
+    std::vector<dedup_run> &sectors_order,
     ecm_options *options,
-    uint64_t ecm_block_start_position
+    encode_summary *encode_data
 ) {
-    // Sectors buffers
+    // Candidates tested on every class. FLAC is only used in the CDDA class.
+    const sector_tools_compression candidate_modes[] = {
+        C_LZ4, C_LZ4, C_ZLIB, C_ZLIB, C_ZLIB, C_ZSTD, C_ZSTD, C_ZSTD, C_ZSTD, C_LZMA, C_LZMA, C_LZMA, C_FLAC, C_FLAC
+    };
+    const int32_t candidate_levels[] = {1, 9, 1, 6, 9, 1, 3, 9, 19, 1, 6, 9, 5, 8};
     uint8_t in_sector[2352];
-    uint8_t out_sector[2352];
 
-    // Sector counter
-    uint32_t current_sector = 0;
+    for (uint8_t stream_class = 0; stream_class < STSC_COUNT; stream_class++) {
+        // The classes with their own settings are not changed
+        if (options->class_codecs[stream_class].enabled) {
+            continue;
+        }
 
-    // CRC calculator
-    uint32_t original_edc = 0;
-    uint32_t output_edc = 0;
+        uint64_t class_sectors = 0;
+        for (size_t i = 0; i < streams_script.size(); i++) {
+            if (streams_script[i].stream_data.type == stream_class) {
+                uint64_t stream_start = i ? streams_script[i - 1].stream_data.end_sector : 0;
+                class_sectors += streams_script[i].stream_data.end_sector - stream_start;
+            }
+        }
+        if (!class_sectors) {
+            continue;
+        }
 
-    // Stream processing
-    for (uint32_t i = 0; i < streams_script.size(); i++) {
-        // Compressor object
-        compressor *decompobj = NULL;
-        // Buffer object
-        uint8_t *decomp_buffer = NULL;
+        // Read and clean the sample windows. The small classes are sampled completely.
+        uint64_t window_sectors = AUTO_CODEC_WINDOW_SECTORS;
+        uint64_t window_step = class_sectors / AUTO_CODEC_WINDOWS;
+        if (class_sectors <= AUTO_CODEC_WINDOWS * AUTO_CODEC_WINDOW_SECTORS) {
+            window_sectors = class_sectors;
+            window_step = class_sectors;
+        }
 
-        // Initialize the compressor and the buffer if required
-        if (streams_script[i].stream_data.compression) {
-            // Create the decompression buffer
-            decomp_buffer = (uint8_t*) malloc(BUFFER_SIZE);
-            if(!decomp_buffer) {
-                fprintf(stderr, "Out of memory\n");
-                return ECMTOOL_BUFFER_MEMORY_ERROR;
+        std::vector<uint8_t> samples;
+        std::vector<uint16_t> samples_size;
+        uint64_t class_sector = 0;
+        uint64_t current_order_run = 0;
+        for (size_t i = 0; i < streams_script.size(); i++) {
+            if (streams_script[i].stream_data.type != stream_class) {
+                continue;
             }
-            // Check if stream size is smaller than the buffer size and use the smaller size as "to_read"
-            size_t to_read = BUFFER_SIZE;
-            size_t stream_size = streams_script[i].stream_data.out_end_position - ((uint64_t)in_file.tellg() - ecm_block_start_position);
-            if (to_read > stream_size) {
-                to_read = stream_size;
+
+            uint64_t current_sector = i ? streams_script[i - 1].stream_data.end_sector : 0;
+            uint64_t filter_position = 0;
+            for (size_t j = 0; j < streams_script[i].sectors_data.size(); j++) {
+                for (uint64_t k = 0; k < streams_script[i].sectors_data[j].sector_count; k++, current_sector++, class_sector++) {
+                    if (class_sector % window_step >= window_sectors) {
+                        continue;
+                    }
+
+                    uint64_t image_sector = current_sector;
+                    if (sectors_order.size()) {
+                        run_lookup(sectors_order, current_order_run, current_sector, image_sector);
+                    }
+                    in_file.clear();
+                    in_file.seekg(image_sector * 2352, std::ios_base::beg);
+                    in_file.read(reinterpret_cast<char*>(in_sector), 2352);
+                    if (!in_file.good()) {
+                        fprintf(stderr, "There was an error reading the input file.\n");
+                        return ECMTOOL_FILE_READ_ERROR;
+                    }
+
+                    size_t position = samples.size();
+                    samples.resize(position + 2352);
+                    uint16_t output_size = 0;
+                    sTools->clean_sector(
+                        samples.data() + position,
+                        in_sector,
+                        (sector_tools_types)streams_script[i].sectors_data[j].mode,
+                        output_size,
+                        options->optimizations
+                    );
+                    if (streams_script[i].stream_data.filter) {
+                        sTools->filter_encode(
+                            (sector_tools_filter)streams_script[i].stream_data.filter,
+                            samples.data() + position,
+                            output_size,
+                            filter_position,
+                            options->optimizations
+                        );
+                        filter_position += output_size;
+                    }
+                    samples.resize(position + output_size);
+                    samples_size.push_back(output_size);
+                }
             }
-            // Read the data into the buffer
-            in_file.read(reinterpret_cast<char*>(decomp_buffer), to_read);
-            // Create a new decompressor object
-            decompobj = new compressor((sector_tools_compression)streams_script[i].stream_data.compression, false);
-            // Set the input buffer position as "input" in decompressor object
-            decompobj -> set_input(decomp_buffer, to_read);
         }
 
-        // Walk through all the sector types in stream
-        for (uint32_t j = 0; j < streams_script[i].sectors_data.size(); j++) {
-            // Process the number of sectors of every type
-            for (uint32_t k = 0; k < streams_script[i].sectors_data[j].sector_count; k++) {
-                if (in_file.eof()){
-                    fprintf(stderr, "Unexpected EOF detected.\n");
-                    return ECMTOOL_FILE_READ_ERROR;
-                }
+        // The samples are stored without compression if no candidate reachs the objective speed
+        auto_codec_choice &choice = encode_data->auto_codecs[stream_class];
+        double samples_mb = MB(samples_size.size() * 2352);
+        choice.selected = true;
+        choice.sample_sectors = samples_size.size();
+        choice.compression = C_NONE;
+        choice.level = 0;
+        choice.ratio = (double)samples.size() / (samples_size.size() * 2352);
+        choice.compression_speed = 0;
+        choice.decompression_speed = 0;
+
+        for (uint8_t j = 0; j < sizeof(candidate_modes) / sizeof(candidate_modes[0]); j++) {
+            if ((candidate_modes[j] == C_FLAC) != (stream_class == STSC_CDDA)) {
+                continue;
+            }
 
-                size_t bytes_to_read = 0;
-                // Getting the sector size prior to read, to read the real sector size and avoid to fseek every time
-                sTools->encoded_sector_size(
-                    (sector_tools_types)streams_script[i].sectors_data[j].mode,
-                    bytes_to_read,
-                    options->optimizations
-                );
+            bench_result result;
+            result.mode = candidate_modes[j];
+            result.level = candidate_levels[j];
+            result.sectors_per_block = options->seekable ? options->sectors_per_block : 0;
+            if (options->extreme_compression) {
+                if (result.mode == C_LZMA) {
+                    result.level |= LZMA_PRESET_EXTREME;
+                }
+                else if (result.mode == C_FLAC) {
+                    result.level |= FLACZLIB_EXTREME_COMPRESSION;
+                }
+                else if (result.mode == C_ZSTD) {
+                    result.level |= COMPRESSOR_ZSTD_EXTREME;
+                }
+            }
 
-                size_t decompress_buffer_left = 0;
-                switch (streams_script[i].stream_data.compression) {
-                // No compression
-                case C_NONE:
-                    in_file.read(reinterpret_cast<char*>(in_sector), bytes_to_read);
-                    setcounter_decode((uint64_t)in_file.tellg() - ecm_block_start_position);
-                    break;
+            if (bench_codec(samples, samples_size, result, options->threads)) {
+                return ECMTOOL_PROCESSING_ERROR;
+            }
 
-                // Zlib/LZMA/LZ4 compression
-                case C_ZLIB:
-                case C_LZMA:
-                case C_LZ4:
-                case C_FLAC:
-                    // Decompress the sector data
-                    decompobj -> decompress(in_sector, bytes_to_read, decompress_buffer_left, Z_SYNC_FLUSH);
+            double compression_speed = samples_mb / std::max(result.compression_time, 1e-9);
+            double decompression_speed = samples_mb / std::max(result.decompression_time, 1e-9);
+            if (
+                !result.verified ||
+                (options->auto_codec == ACO_ENCODE_SPEED && compression_speed < options->auto_codec_speed) ||
+                (options->auto_codec == ACO_DECODE_SPEED && decompression_speed < options->auto_codec_speed)
+            ) {
+                continue;
+            }
 
-                    // Set the current position in file
-                    setcounter_decode((uint64_t)in_file.tellg() - decompress_buffer_left - ecm_block_start_position); 
+            double ratio = (double)result.compressed_size / (samples_size.size() * 2352);
+            if (ratio < choice.ratio) {
+                choice.compression = candidate_modes[j];
+                choice.level = candidate_levels[j];
+                choice.ratio = ratio;
+                choice.compression_speed = compression_speed;
+                choice.decompression_speed = decompression_speed;
+            }
+        }
 
-                    // If not in end of stream and buffer is below 25%, read more data
-                    // To keep the buffer always ready
-                    if (streams_script[i].stream_data.out_end_position > (uint64_t)in_file.tellg() && decompress_buffer_left < (BUFFER_SIZE * 0.25)) {
-                        // Move the left data to first bytes
-                        size_t position = BUFFER_SIZE - decompress_buffer_left;
-                        memmove(decomp_buffer, decomp_buffer + position, decompress_buffer_left);
+        // Apply the choice to the class streams. The filters are useless without compression.
+        for (size_t i = 0; i < streams_script.size(); i++) {
+            if (streams_script[i].stream_data.type == stream_class) {
+                streams_script[i].stream_data.compression = choice.compression;
+                streams_script[i].compression_level = choice.level;
+                if (choice.compression == C_NONE || choice.compression == C_FLAC) {
+                    streams_script[i].stream_data.filter = F_NONE;
+                }
+            }
+        }
+    }
 
-                        // Calculate how much data can be readed
-                        size_t to_read = BUFFER_SIZE - decompress_buffer_left;
-                        // If available space is bigger than data in stream, read only the stream data
-                        size_t stream_size = streams_script[i].stream_data.out_end_position - ((uint64_t)in_file.tellg() - ecm_block_start_position);
-                        if (to_read > stream_size) {
-                            to_read = stream_size;  
-                            // If left data is less than buffer space, then end_of_stream is reached
-                        }
-                        // Fill the buffer with the stream data
-                        in_file.read(reinterpret_cast<char*>(decomp_buffer + decompress_buffer_left), to_read);
-                        // Set again the input position to first byte in decomp_buffer and set the buffer size
-                        size_t input_size = decompress_buffer_left + to_read;
-                        decompobj -> set_input(decomp_buffer, input_size);
-                    }
+    // Join the streams which have now the same settings, like the analyzer does. The data classes are mixed
+    // and the CDDA streams are only kept splitted if they are FLAC segments.
+    std::vector<stream_script> joined_streams;
+    for (size_t i = 0; i < streams_script.size(); i++) {
+        stream_script &current = streams_script[i];
+        if (
+            joined_streams.size() &&
+            (joined_streams.back().stream_data.type == STSC_CDDA) == (current.stream_data.type == STSC_CDDA) &&
+            (current.stream_data.type != STSC_CDDA || current.stream_data.compression != C_FLAC) &&
+            joined_streams.back().stream_data.compression == current.stream_data.compression &&
+            joined_streams.back().compression_level == current.compression_level &&
+            joined_streams.back().stream_data.filter == current.stream_data.filter
+        ) {
+            stream_script &previous = joined_streams.back();
+            if (previous.stream_data.type != current.stream_data.type) {
+                previous.stream_data.type = STSC_DATA;
+            }
+            for (size_t j = 0; j < current.sectors_data.size(); j++) {
+                if (previous.sectors_data.back().mode == current.sectors_data[j].mode) {
+                    previous.sectors_data.back().sector_count += current.sectors_data[j].sector_count;
                 }
+                else {
+                    previous.sectors_data.push_back(current.sectors_data[j]);
+                }
+            }
+            previous.stream_data.end_sector = current.stream_data.end_sector;
+        }
+        else {
+            joined_streams.push_back(current);
+        }
+    }
+    streams_script.swap(joined_streams);
 
-                // Regenerating the sector data
-                uint16_t bytes_readed = 0;
-                sTools->regenerate_sector(
-                    out_sector,
-                    in_sector,
-                    (sector_tools_types)streams_script[i].sectors_data[j].mode,
-                    current_sector + 0x96, // 0x96 is the first sector "time", equivalent to 00:02:00
-                    bytes_readed,
-                    options->optimizations
-                );
+    return ECMTOOL_OK;
+}
 
-                // Writting the sector to output file
-                out_file.write(reinterpret_cast<char*>(out_sector), 2352);
-                // Compute the crc of the written data 
-                output_edc = sTools->edc_compute(
-                    output_edc,
-                    out_sector,
-                    2352
-                );
 
-                current_sector++;
-            }
+/**
+ * @brief Parses the per class codecs option. The format is a comma separated list of
+ *        class=codec[:level[:filter]] entries, for example "xa=zstd:19,form1=lzma:9:mips".
+ *
+ * @param argument The option argument
+ * @param options The options struct where the class codecs will be stored
+ * @return int non zero on error
+ */
+static int parse_class_codecs (
+    const char *argument,
+    ecm_options *options
+) {
+    const char *class_names[] = {"cdda", "mode1", "mode2", "form1", "form2", "xa", "video", "raw"};
+    const sector_tools_stream_classes class_ids[] = {STSC_CDDA, STSC_MODE1, STSC_MODE2, STSC_FORM1, STSC_FORM2, STSC_XA_AUDIO, STSC_VIDEO, STSC_RAW};
+    const char *codec_names[] = {"none", "zlib", "lzma", "lz4", "flac", "zstd"};
+    const sector_tools_compression codec_ids[] = {C_NONE, C_ZLIB, C_LZMA, C_LZ4, C_FLAC, C_ZSTD};
+    const char *filter_names[] = {"none", "x86", "mips", "adpcm"};
+    const sector_tools_filter filter_ids[] = {F_NONE, F_X86, F_MIPS, F_XA_ADPCM};
+
+    std::stringstream entries(argument);
+    std::string entry;
+    while (std::getline(entries, entry, ',')) {
+        size_t equal_position = entry.find('=');
+        if (equal_position == std::string::npos) {
+            fprintf(stderr, "ERROR: the class codec \"%s\" is not correct.\n\n", entry.c_str());
+            return 1;
         }
 
-        // Seek to the next stream start position:
-        //fseeko(ecm_in, streams_script[i].stream_data.out_end_position, SEEK_SET);
+        // Split the codec settings
+        std::vector<std::string> fields;
+        std::stringstream settings(entry.substr(equal_position + 1));
+        std::string field;
+        while (std::getline(settings, field, ':')) {
+            fields.push_back(field);
+        }
+        if (fields.size() < 1 || fields.size() > 3) {
+            fprintf(stderr, "ERROR: the class codec \"%s\" is not correct.\n\n", entry.c_str());
+            return 1;
+        }
 
-        if (decompobj) {
-            delete  decompobj;
-            decompobj = NULL;
+        std::string class_name = entry.substr(0, equal_position);
+        int8_t class_index = -1;
+        for (uint8_t i = 0; i < sizeof(class_names) / sizeof(class_names[0]); i++) {
+            if (class_name == class_names[i]) {
+                class_index = class_ids[i];
+            }
         }
-        if (decomp_buffer) {
-            free(decomp_buffer);
+        if (class_index < 0) {
+            fprintf(stderr, "ERROR: Unknown stream class: %s\n\n", class_name.c_str());
+            return 1;
         }
-    }
 
-    // Set the decode position to 100%
-    setcounter_decode((uint64_t)in_file.tellg());
+        class_codec codec;
+        codec.enabled = true;
 
-    // There is no more data in header. Next 4 bytes might be the CRC
-    // Reading it...
-    uint8_t buffer_edc[4];
-    in_file.read(reinterpret_cast<char*>(buffer_edc), 4);
-    original_edc = sTools->get32lsb(buffer_edc);
+        int8_t codec_index = -1;
+        for (uint8_t i = 0; i < sizeof(codec_names) / sizeof(codec_names[0]); i++) {
+            if (fields[0] == codec_names[i]) {
+                codec_index = i;
+            }
+        }
+        if (codec_index < 0 || (codec_ids[codec_index] == C_FLAC && class_index != STSC_CDDA)) {
+            fprintf(stderr, "ERROR: Unknown compression mode for the %s class: %s\n\n", class_name.c_str(), fields[0].c_str());
+            return 1;
+        }
+        codec.compression = codec_ids[codec_index];
 
-    if (original_edc == output_edc) {
-        return ECMTOOL_OK;
-    }
-    else {
-        fprintf(stderr, "\n\nWrong CRC!... Maybe the input file is damaged.\n");
-        return ECMTOOL_PROCESSING_ERROR;
+        if (fields.size() > 1 && !fields[1].empty()) {
+            try {
+                int level = std::stoi(fields[1]);
+                if (level < 0 || level > 22 || (level > 9 && codec.compression != C_ZSTD)) {
+                    fprintf(stderr, "ERROR: the compression level of the %s class is not correct.\n\n", class_name.c_str());
+                    return 1;
+                }
+                codec.level = level;
+            } catch (std::exception const &e) {
+                fprintf(stderr, "ERROR: the compression level of the %s class is not correct.\n\n", class_name.c_str());
+                return 1;
+            }
+        }
+
+        // The "auto" filter keeps the default detection (executables and XA model)
+        if (fields.size() > 2 && fields[2] != "auto") {
+            for (uint8_t i = 0; i < sizeof(filter_names) / sizeof(filter_names[0]); i++) {
+                if (fields[2] == filter_names[i]) {
+                    codec.filter = filter_ids[i];
+                }
+            }
+            if (codec.filter < 0) {
+                fprintf(stderr, "ERROR: Unknown filter for the %s class: %s\n\n", class_name.c_str(), fields[2].c_str());
+                return 1;
+            }
+        }
+
+        options->class_codecs[class_index] = codec;
     }
+
+    return 0;
 }
 
 
@@ -1216,7 +6091,7 @@ int get_options(
     // temporal variables for options parsing
     uint64_t temp_argument = 0;
 
-    while ((ch = getopt_long(argc, argv, "i:o:a:d:c:esp:fk", long_options, NULL)) != -1)
+    while ((ch = getopt_long(argc, argv, "i:o:a:d:c:esp:K:DS:GCr:An:x:ZT:y:Yt:PB:X:Mv:O:U:E:R:w:Lm:Vgfk", long_options, NULL)) != -1)
     {
         // check to see if a single character or long option came through
         switch (ch)
@@ -1246,6 +6121,9 @@ int get_options(
                 else if (strcmp("flac", optarg) == 0) {
                     options->audio_compression = C_FLAC;
                 }
+                else if (strcmp("zstd", optarg) == 0) {
+                    options->audio_compression = C_ZSTD;
+                }
                 else {
                     fprintf(stderr, "ERROR: Unknown data compression mode: %s\n\n", optarg);
                     print_help();
@@ -1265,6 +6143,9 @@ int get_options(
                 else if (strcmp("lz4", optarg) == 0) {
                     options->data_compression = C_LZ4;
                 }
+                else if (strcmp("zstd", optarg) == 0) {
+                    options->data_compression = C_ZSTD;
+                }
                 else {
                     fprintf(stderr, "ERROR: Unknown data compression mode: %s\n\n", optarg);
                     print_help();
@@ -1272,13 +6153,176 @@ int get_options(
                 }
                 break;
 
+            // short option '-X', long option '--xa-compression'
+            // XA-ADPCM audio compression option
+            case 'X':
+                if (strcmp("none", optarg) == 0) {
+                    options->xa_compression = C_NONE;
+                }
+                else if (strcmp("zlib", optarg) == 0) {
+                    options->xa_compression = C_ZLIB;
+                }
+                else if (strcmp("lzma", optarg) == 0) {
+                    options->xa_compression = C_LZMA;
+                }
+                else if (strcmp("lz4", optarg) == 0) {
+                    options->xa_compression = C_LZ4;
+                }
+                else if (strcmp("zstd", optarg) == 0) {
+                    options->xa_compression = C_ZSTD;
+                }
+                else {
+                    fprintf(stderr, "ERROR: Unknown XA audio compression mode: %s\n\n", optarg);
+                    print_help();
+                    return 1;
+                }
+                break;
+
+            // short option '-v', long option '--vcompression'
+            // MDEC video compression option
+            case 'v':
+                if (strcmp("none", optarg) == 0) {
+                    options->video_compression = C_NONE;
+                }
+                else if (strcmp("zlib", optarg) == 0) {
+                    options->video_compression = C_ZLIB;
+                }
+                else if (strcmp("lzma", optarg) == 0) {
+                    options->video_compression = C_LZMA;
+                }
+                else if (strcmp("lz4", optarg) == 0) {
+                    options->video_compression = C_LZ4;
+                }
+                else if (strcmp("zstd", optarg) == 0) {
+                    options->video_compression = C_ZSTD;
+                }
+                else {
+                    fprintf(stderr, "ERROR: Unknown video compression mode: %s\n\n", optarg);
+                    print_help();
+                    return 1;
+                }
+                break;
+
+            // short option '-O', long option "--codec"
+            // Per class compression settings
+            case 'O':
+                if (parse_class_codecs(optarg, options)) {
+                    print_help();
+                    return 1;
+                }
+                break;
+
+            // short option '-U', long option "--auto-codec"
+            // Objective of the automatic codec selection: <encode/decode>:<MB/s>
+            case 'U':
+                {
+                    std::string objective(optarg);
+                    size_t separator = objective.find(':');
+                    std::string objective_type = objective.substr(0, separator);
+                    if (objective_type == "encode") {
+                        options->auto_codec = ACO_ENCODE_SPEED;
+                    }
+                    else if (objective_type == "decode") {
+                        options->auto_codec = ACO_DECODE_SPEED;
+                    }
+                    else {
+                        fprintf(stderr, "ERROR: Unknown automatic codec objective: %s\n\n", optarg);
+                        print_help();
+                        return 1;
+                    }
+
+                    try {
+                        if (separator == std::string::npos) {
+                            throw std::invalid_argument("speed");
+                        }
+                        options->auto_codec_speed = std::stof(objective.substr(separator + 1));
+                        if (options->auto_codec_speed < 0) {
+                            throw std::invalid_argument("speed");
+                        }
+                    } catch (std::exception const &e) {
+                        fprintf(stderr, "ERROR: the automatic codec objective speed is not correct.\n\n");
+                        print_help();
+                        return 1;
+                    }
+                }
+                break;
+
+            // short option '-E', long option "--entropy-threshold"
+            // The blocks with more entropy (bits per byte) are stored without compression
+            case 'E':
+                try {
+                    options->entropy_threshold = std::stof(optarg);
+                    if (options->entropy_threshold <= 0 || options->entropy_threshold > 8) {
+                        throw std::invalid_argument("threshold");
+                    }
+                } catch (std::exception const &e) {
+                    fprintf(stderr, "ERROR: the entropy threshold must be between 0 and 8 bits per byte.\n\n");
+                    print_help();
+                    return 1;
+                }
+                break;
+
+            // short option '-R', long option "--second-pass"
+            // Number of streams compressed again with the strongest settings
+            case 'R':
+                try {
+                    std::string optarg_s(optarg);
+                    temp_argument = std::stoi(optarg_s);
+                    if (temp_argument < 1 || temp_argument > 0xFFFF) {
+                        throw std::invalid_argument("streams");
+                    }
+                    options->second_pass = temp_argument;
+                } catch (std::exception const &e) {
+                    fprintf(stderr, "ERROR: the second pass streams number is not correct.\n\n");
+                    print_help();
+                    return 1;
+                }
+                break;
+
+            // short option '-w', long option "--target-speed"
+            // Encoding speed in MB/s used by the compression level controller
+            case 'w':
+                try {
+                    options->target_speed = std::stof(optarg);
+                    if (options->target_speed <= 0) {
+                        throw std::invalid_argument("speed");
+                    }
+                } catch (std::exception const &e) {
+                    fprintf(stderr, "ERROR: the target speed is not correct.\n\n");
+                    print_help();
+                    return 1;
+                }
+                break;
+
+            // short option '-L', long option "--solid"
+            case 'L':
+                options->solid = true;
+                break;
+
+            // short option '-m', long option "--profile"
+            // Encoder options of an output profile. The profiles are parsed after the main options.
+            case 'm':
+                options->profiles.push_back(optarg);
+                break;
+
+            // short option '-V', long option "--verify"
+            // Decode the transcoded file to check the images CRC
+            case 'V':
+                options->verify = true;
+                break;
+
+            // short option '-M', long option "--xa-model"
+            case 'M':
+                options->xa_model = true;
+                break;
+
             // short option '-c', long option "--clevel"
             case 'c':
                 try {
                     std::string optarg_s(optarg);
                     temp_argument = std::stoi(optarg_s);
 
-                    if (temp_argument > 9 || temp_argument < 0) {
+                    if (temp_argument > 22 || temp_argument < 0) {
                         fprintf(stderr, "ERROR: the provided compression level option is not correct.\n\n");
                         print_help();
                         return 1;
@@ -1325,6 +6369,135 @@ int get_options(
                 }
                 break;
 
+            // short option '-K', long option "--seekable-primer"
+            // Size in KB of the first part of every seekable stream which is used as dictionary of the rest
+            case 'K':
+                try {
+                    std::string optarg_s(optarg);
+                    temp_argument = std::stoi(optarg_s);
+                    if (temp_argument < 1 || temp_argument > 4096) {
+                        throw std::invalid_argument("primer");
+                    }
+                    options->seekable_primer = temp_argument;
+                } catch (std::exception const &e) {
+                    fprintf(stderr, "ERROR: the seekable primer size must be between 1 and 4096 KB.\n\n");
+                    print_help();
+                    return 1;
+                }
+                break;
+
+            // short option '-D', long option "--dedup"
+            case 'D':
+                options->dedup = true;
+                break;
+
+            // short option '-S', long option "--store"
+            case 'S':
+                options->store_path = optarg;
+                break;
+
+            // short option '-G', long option "--store-gc"
+            case 'G':
+                options->store_gc = true;
+                break;
+
+            // short option '-C', long option "--store-check"
+            case 'C':
+                options->store_check = true;
+                break;
+
+            // short option '-r', long option "--reference"
+            case 'r':
+                options->reference_path = optarg;
+                break;
+
+            // short option '-A', long option "--append"
+            case 'A':
+                options->append = true;
+                break;
+
+            // short option '-n', long option "--image"
+            // short option '-x', long option "--delete"
+            case 'n':
+            case 'x':
+                try {
+                    std::string optarg_s(optarg);
+                    temp_argument = std::stoi(optarg_s);
+
+                    if (temp_argument < 0 || temp_argument > INT32_MAX) {
+                        fprintf(stderr, "ERROR: the provided image index is not correct.\n\n");
+                        print_help();
+                        return 1;
+                    }
+                    else if (ch == 'n') {
+                        options->image_index = (int32_t)temp_argument;
+                    }
+                    else {
+                        options->delete_image = (int32_t)temp_argument;
+                    }
+                } catch (std::exception const &e) {
+                    fprintf(stderr, "ERROR: the provided image index is not correct.\n\n");
+                    print_help();
+                    return 1;
+                }
+                break;
+
+            // short option '-Z', long option "--compact"
+            case 'Z':
+                options->compact = true;
+                break;
+
+            // short option '-T', long option "--train-dict"
+            case 'T':
+                options->train_dictionary_path = optarg;
+                break;
+
+            // short option '-y', long option "--dictionary"
+            case 'y':
+                options->dictionary_path = optarg;
+                break;
+
+            // short option '-Y', long option "--external-dictionary"
+            case 'Y':
+                options->dictionary_external = true;
+                break;
+
+            // short option '-B', long option "--bench-codecs"
+            case 'B':
+                options->bench_codecs_path = optarg;
+                break;
+
+            // short option '-P', long option "--stats"
+            case 'P':
+                options->stats = true;
+                break;
+
+            // short option '-t', long option "--threads"
+            case 't':
+                try {
+                    std::string optarg_s(optarg);
+                    temp_argument = std::stoi(optarg_s);
+
+                    if (!temp_argument || temp_argument > 1024) {
+                        fprintf(stderr, "ERROR: the provided threads number is not correct.\n\n");
+                        print_help();
+                        return 1;
+                    }
+                    else {
+                        options->threads = (uint32_t)temp_argument;
+                    }
+                } catch (std::exception const &e) {
+                    fprintf(stderr, "ERROR: the provided threads number is not correct.\n\n");
+                    print_help();
+                    return 1;
+                }
+                break;
+
+            // short option '-g', long option "--group-files"
+            case 'g':
+                options->group_files = true;
+                break;
+
             // short option '-f', long option "--force"
             case 'f':
                 options->force_rewrite = true;
@@ -1342,6 +6515,100 @@ int get_options(
         }
     }
 
+    // The non option arguments are the ECM files (manifests) used by the chunk store garbage collector,
+    // or the images used to train the dictionary
+    for (int i = optind; i < argc; i++) {
+        options->input_files.push_back(argv[i]);
+    }
+
+    // The levels above 9 are only available in zstd. Other compressors will use the level 9.
+    bool class_zstd = false;
+    for (uint8_t i = 0; i < STSC_COUNT; i++) {
+        if (options->class_codecs[i].enabled && options->class_codecs[i].compression == C_ZSTD) {
+            class_zstd = true;
+        }
+    }
+    if (
+        options->compression_level > 9 &&
+        (
+            (
+                options->data_compression != C_ZSTD &&
+                options->audio_compression != C_ZSTD &&
+                options->xa_compression != C_ZSTD &&
+                options->video_compression != C_ZSTD &&
+                !class_zstd
+            ) ||
+            !options->store_path.empty()
+        )
+    ) {
+        fprintf(stderr, "ERROR: the compression levels above 9 are only available with the zstd compression.\n\n");
+        print_help();
+        return 1;
+    }
+
+    // By default all the processor threads are used. This is the budget shared by all the multithreaded tasks.
+    if (!options->threads) {
+        options->threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    if (options->dictionary_external && options->dictionary_path.empty()) {
+        fprintf(stderr, "ERROR: the external dictionary option requires the --dictionary option.\n\n");
+        print_help();
+        return 1;
+    }
+
+    if (options->verify && !options->transcode) {
+        fprintf(stderr, "ERROR: the verification is only available in the transcode command.\n\n");
+        print_help();
+        return 1;
+    }
+
+    if (options->seekable_primer && !options->seekable) {
+        fprintf(stderr, "ERROR: the seekable primer requires the --seekable option.\n\n");
+        print_help();
+        return 1;
+    }
+
+    // The seekable blocks are flushed at sectors positions, which are not known by the second pass
+    if (options->second_pass && options->seekable) {
+        fprintf(stderr, "ERROR: the second pass cannot be used with the --seekable option.\n\n");
+        print_help();
+        return 1;
+    }
+
+    // The second pass time is not controlled, so the target speed cannot be granted
+    if (options->second_pass && options->target_speed > 0) {
+        fprintf(stderr, "ERROR: the second pass cannot be used with the --target-speed option.\n\n");
+        print_help();
+        return 1;
+    }
+
+    // The solid contexts are not splitted in blocks, and their streams are not stored in the file order
+    if (options->solid && (options->seekable || options->second_pass || options->target_speed > 0)) {
+        fprintf(stderr, "ERROR: the solid mode cannot be used with the --seekable, --second-pass or --target-speed options.\n\n");
+        print_help();
+        return 1;
+    }
+
+    if (options->auto_codec && !options->store_path.empty()) {
+        fprintf(stderr, "ERROR: the automatic codec selection cannot be used with the --store option.\n\n");
+        print_help();
+        return 1;
+    }
+
+    if ((options->store_gc || options->store_check) && options->store_path.empty()) {
+        fprintf(stderr, "ERROR: the chunk store maintenance requires the --store option.\n\n");
+        print_help();
+        return 1;
+    }
+
+    // The deduplicated sectors and the seekable blocks use the sectors image position
+    if (options->group_files && (options->dedup || options->seekable)) {
+        fprintf(stderr, "ERROR: the files grouping cannot be used with the --dedup or --seekable options.\n\n");
+        print_help();
+        return 1;
+    }
+
     return 0;
 }
 
@@ -1355,6 +6622,9 @@ static void resetcounter(uint64_t total) {
 
 
 static void encode_progress(void) {
+    if (mycounter_hidden) {
+        return;
+    }
     fprintf(stderr, "Analyze(%02u%%) Encode(%02u%%)\r", mycounter_analyze, mycounter_encode);
 }
 
@@ -1364,6 +6634,11 @@ static void decode_progress(void) {
 }
 
 
+static void transcode_progress(void) {
+    fprintf(stderr, "Transcode(%02u%%)\r", mycounter_encode);
+}
+
+
 static void setcounter_analyze(uint64_t n) {
     uint8_t p = 100 * n / mycounter_total;
     if (p != mycounter_analyze) {
@@ -1391,6 +6666,15 @@ static void setcounter_decode(uint64_t n) {
 }
 
 
+static void setcounter_transcode(uint64_t n) {
+    uint8_t p = 100 * n / mycounter_total;
+    if (p != mycounter_encode) {
+        mycounter_encode = p;
+        transcode_progress();
+    }
+}
+
+
 static ecmtool_return_code task_to_streams_header (
     stream *&streams_toc,
     sec_str_size &streams_toc_count,
@@ -1400,8 +6684,9 @@ static ecmtool_return_code task_to_streams_header (
     streams_toc_count.count = streams_script.size();
     streams_toc_count.uncompressed_size = streams_toc_count.count * sizeof(struct stream);
 
-    // Reserve the required memory. Must be freed later
-    streams_toc = (stream *)malloc(streams_toc_count.uncompressed_size);
+    // Reserve the required memory. Must be freed later. The unused bitfields bits are zeroed, so the
+    // same input will always generate the same output
+    streams_toc = (stream *)calloc(1, streams_toc_count.uncompressed_size);
 
     //
     // Set the data
@@ -1418,6 +6703,10 @@ static ecmtool_return_code task_to_streams_header (
         streams_toc[i].end_sector = streams_script[i].stream_data.end_sector;
         streams_toc[i].out_end_position = streams_script[i].stream_data.out_end_position;
         streams_toc[i].type = streams_script[i].stream_data.type;
+        streams_toc[i].filter = streams_script[i].stream_data.filter;
+        streams_toc[i].level = streams_script[i].stream_data.level;
+        streams_toc[i].solid = streams_script[i].stream_data.solid;
+        streams_toc[i].primed = streams_script[i].stream_data.primed;
     }
 
     return ECMTOOL_OK;
@@ -1437,7 +6726,7 @@ static ecmtool_return_code task_to_sectors_header (
     sectors_toc_count.uncompressed_size = sectors_toc_count.count * sizeof(struct sector);
 
     // Reserve the required memory. Must be freed later
-    sectors_toc = (sector *)malloc(sectors_toc_count.uncompressed_size);
+    sectors_toc = (sector *)calloc(1, sectors_toc_count.uncompressed_size);
 
     //
     // Set the data
@@ -1449,7 +6738,7 @@ static ecmtool_return_code task_to_sectors_header (
         return ECMTOOL_BUFFER_MEMORY_ERROR;
     }
     // Set the data
-    uint32_t current_sector_data = 0;
+    uint64_t current_sector_data = 0;
     for (uint32_t i = 0; i < streams_script.size(); i++) {
         for (uint32_t j = 0; j < streams_script[i].sectors_data.size(); j++) {
             sectors_toc[current_sector_data].mode = streams_script[i].sectors_data[j].mode;
@@ -1481,10 +6770,10 @@ static ecmtool_return_code task_maker (
     sec_str_size &sectors_toc_count,
     std::vector<stream_script> &streams_script
 ) {
-    size_t actual_sector = 0;
-    uint32_t actual_sector_pos = 0;
+    uint64_t actual_sector = 0;
+    uint64_t actual_sector_pos = 0;
 
-    for (uint32_t i = 0; i < streams_toc_count.count; i++) {
+    for (uint64_t i = 0; i < streams_toc_count.count; i++) {
         streams_script.push_back(stream_script());
         streams_script.back().stream_data = streams_toc[i];
 
@@ -1516,32 +6805,42 @@ static ecmtool_return_code task_maker (
 
 int compress_header (
     uint8_t *dest,
-    uint32_t &destLen,
+    uint64_t &destLen,
     uint8_t *source,
-    uint32_t sourceLen,
+    uint64_t sourceLen,
     int level
 ) {
     z_stream strm;
     int err;
+    // zlib sizes are 32 bits, so the data is passed in parts
+    uint64_t dest_left = destLen;
+    uint64_t source_left = sourceLen;
 
     strm.zalloc = Z_NULL;
     strm.zfree = Z_NULL;
     strm.opaque = Z_NULL;
-    err = deflateInit(&strm, 9);
+    err = deflateInit(&strm, level);
     if (err != Z_OK) return err;
 
     strm.next_out = dest;
-    strm.avail_out = destLen;
+    strm.avail_out = 0;
     strm.next_in = source;
-    strm.avail_in = sourceLen;
-    
-    err = deflateInit(&strm, level);
-    if (err != Z_OK) return err;
+    strm.avail_in = 0;
 
-    err = deflate(&strm, Z_FINISH);
+    do {
+        if (!strm.avail_out) {
+            strm.avail_out = (uInt)std::min(dest_left, (uint64_t)UINT_MAX);
+            dest_left -= strm.avail_out;
+        }
+        if (!strm.avail_in) {
+            strm.avail_in = (uInt)std::min(source_left, (uint64_t)UINT_MAX);
+            source_left -= strm.avail_in;
+        }
+        err = deflate(&strm, source_left ? Z_NO_FLUSH : Z_FINISH);
+    } while (err == Z_OK);
     deflateEnd(&strm);
 
-    destLen = strm.total_out;
+    destLen = destLen - dest_left - strm.avail_out;
 
     return err == Z_STREAM_END ? Z_OK : err;
 }
@@ -1549,12 +6848,15 @@ int compress_header (
 
 int decompress_header (
     uint8_t *dest,
-    uint32_t &destLen,
+    uint64_t &destLen,
     uint8_t *source,
-    uint32_t sourceLen
+    uint64_t sourceLen
 ) {
     z_stream strm;
     int err;
+    // zlib sizes are 32 bits, so the data is passed in parts
+    uint64_t dest_left = destLen;
+    uint64_t source_left = sourceLen;
 
     strm.zalloc = Z_NULL;
     strm.zfree = Z_NULL;
@@ -1563,11 +6865,21 @@ int decompress_header (
     if (err != Z_OK) return err;
 
     strm.next_out = (uint8_t *)dest;
-    strm.avail_out = destLen;
+    strm.avail_out = 0;
     strm.next_in = (uint8_t *)source;
-    strm.avail_in = sourceLen;
+    strm.avail_in = 0;
 
-    err = inflate(&strm, Z_NO_FLUSH);
+    do {
+        if (!strm.avail_out) {
+            strm.avail_out = (uInt)std::min(dest_left, (uint64_t)UINT_MAX);
+            dest_left -= strm.avail_out;
+        }
+        if (!strm.avail_in) {
+            strm.avail_in = (uInt)std::min(source_left, (uint64_t)UINT_MAX);
+            source_left -= strm.avail_in;
+        }
+        err = inflate(&strm, Z_NO_FLUSH);
+    } while (err == Z_OK && (strm.avail_in || source_left) && (strm.avail_out || dest_left));
     inflateEnd(&strm);
 
     return err == Z_STREAM_END ? Z_OK :
@@ -1590,20 +6902,115 @@ void print_help() {
         "    ecmtool -i/--input ecmfile\n"
         "    ecmtool -i/--input ecmfile -o/--output cdimagefile\n"
         "\n"
+        "Container maintenance:\n"
+        "    ecmtool -i/--input cdimagefile -A/--append -o/--output ecmfile\n"
+        "    ecmtool -i/--input ecmfile -x/--delete image\n"
+        "    ecmtool -i/--input ecmfile -Z/--compact\n"
+        "\n"
+        "Transcode to other codecs:\n"
+        "    ecmtool transcode -i/--input ecmfile -o/--output ecmfile [codecs options] [-V/--verify]\n"
+        "\n"
+        "Dictionary training:\n"
+        "    ecmtool -T/--train-dict dictfile cdimagefile1 cdimagefile2...\n"
+        "\n"
+        "Chunk store maintenance:\n"
+        "    ecmtool -S/--store directory -G/--store-gc ecmfile1 ecmfile2...\n"
+        "    ecmtool -S/--store directory -C/--store-check\n"
+        "\n"
         "Optional options:\n"
-        "    -a/--acompression <zlib/lzma/lz4/flac>\n"
+        "    -a/--acompression <zlib/lzma/lz4/flac/zstd>\n"
         "           Enable audio compression\n"
-        "    -d/--dcompression <zlib/lzma/lz4>\n"
+        "    -d/--dcompression <zlib/lzma/lz4/zstd>\n"
         "           Enable data compression\n"
-        "    -c/--clevel <0-9>\n"
-        "           Compression level between 0 and 9\n"
+        "    -X/--xa-compression <none/zlib/lzma/lz4/zstd>\n"
+        "           Compression of the XA-ADPCM audio sectors, which are stored in their own streams\n"
+        "           (default: none)\n"
+        "    -v/--vcompression <none/zlib/lzma/lz4/zstd>\n"
+        "           Compression of the MDEC video sectors (STR files), which are stored in their own\n"
+        "           streams (default: none)\n"
+        "    -M/--xa-model\n"
+        "           Group the XA-ADPCM sound parameters and split the samples by channel (using the\n"
+        "           subheader coding byte) before compress them\n"
+        "    -O/--codec <class=codec[:level[:filter]],...>\n"
+        "           Compression of a stream class, overriding the general options. Classes:\n"
+        "           cdda/mode1/mode2/form1/form2/xa/video/raw. Filters: auto/none/x86/mips/adpcm.\n"
+        "           Can be repeated (example: --codec xa=zstd:19,form1=lzma:9:mips)\n"
+        "    -U/--auto-codec <encode/decode>:<MB/s>\n"
+        "           Choose the codec and level of every stream class by compressing some samples. The\n"
+        "           best ratio is used with an encoding or decoding speed over the given MB/s\n"
+        "           (example: --auto-codec decode:200). The --codec classes are not changed.\n"
+        "    -E/--entropy-threshold <bits>\n"
+        "           Store without compression the data blocks with an entropy over the threshold\n"
+        "           (bits per byte, 7.9 is a good value for the already compressed data)\n"
+        "    -R/--second-pass <streams>\n"
+        "           Compress again the streams with the biggest estimated gain with LZMA and zstd\n"
+        "           extreme, and keep the smaller output. Most of the -e gain with a fraction of\n"
+        "           its time.\n"
+        "    -w/--target-speed <MB/s>\n"
+        "           Adjust the compression level of every block to encode the image at the given\n"
+        "           speed (analysis included). LZ4 is used if the fastest level is too slow.\n"
+        "    -L/--solid\n"
+        "           Use a single compression context for all the streams of every class, so the\n"
+        "           discs with many short interleaved data and audio runs keep the history.\n"
+        "    -m/--profile \"<options>\"\n"
+        "           Encode the image with other options to other output file in the same run. Can\n"
+        "           be repeated, and every profile must have its output (example: --profile\n"
+        "           \"-o fast.ecm2 -d lz4 -s\" --profile \"-o small.ecm2 -d lzma -a flac -e\").\n"
+        "           The image is analyzed, read and cleaned once for all the profiles, so they\n"
+        "           cannot change the input or group the files (-i/-g).\n"
+        "    -c/--clevel <0-22>\n"
+        "           Compression level between 0 and 9 (up to 22 with zstd)\n"
         "    -e/--extreme-compression\n"
-        "           Enables extreme compression mode for LZMA/FLAC (can be very slow)\n"
+        "           Enables extreme compression mode for LZMA/FLAC/ZSTD (can be very slow)\n"
         "    -s/--seekable\n"
         "           Create a seekable file. Reduce the compression ratio but\n"
         "           but allow to seek into the stream.\n"
         "    -p/--sectors-per-block <sectors>\n"
         "           Add a end of block mark every X sectors in a seekable file. Max 255.\n"
+        "    -K/--seekable-primer <KB>\n"
+        "           Use the first KB of every zlib or zstd seekable stream as dictionary of its\n"
+        "           blocks. The readers decode it once, and the ratio is close to non seekable.\n"
+        "    -g/--group-files\n"
+        "           Read the ISO9660 filesystem and compress the files grouped by their type. The\n"
+        "           original sectors order is restored when the image is decoded.\n"
+        "    -D/--dedup\n"
+        "           Store only once the sectors which are repeated in the image\n"
+        "    -S/--store <directory>\n"
+        "           Store the sectors data in a chunk store shared by several images.\n"
+        "           The ECM file will only contain the chunks list.\n"
+        "    -G/--store-gc <ecmfiles...>\n"
+        "           Remove from the store the chunks not used by the provided ECM files.\n"
+        "           All the ECM files using the store must be provided.\n"
+        "    -C/--store-check\n"
+        "           Verify the integrity of the chunks in the store\n"
+        "    -r/--reference <ecmfile>\n"
+        "           Store only the sectors which are different from the reference image.\n"
+        "           The same reference is required to decode the file.\n"
+        "    -A/--append\n"
+        "           Append the image to an existing ECM file (output) instead of replace it\n"
+        "    -n/--image <index>\n"
+        "           Decode only the selected image of the ECM file (first image is 0)\n"
+        "    -x/--delete <index>\n"
+        "           Mark the selected image of the ECM file (input) as deleted\n"
+        "    -Z/--compact\n"
+        "           Remove the deleted images space from the ECM file (input)\n"
+        "    -V/--verify\n"
+        "           Decode the transcoded file to check the images CRC (transcode command)\n"
+        "    -T/--train-dict <dictfile> [cdimagefiles...]\n"
+        "           Train a compression dictionary using the data sectors of the images\n"
+        "    -y/--dictionary <dictfile>\n"
+        "           Use the dictionary in the zlib/zstd streams. Improves the compression of\n"
+        "           small seekable blocks. The dictionary is embedded in the ECM file.\n"
+        "    -Y/--external-dictionary\n"
+        "           Don't embed the dictionary. The same dictionary is required to decode the file.\n"
+        "    -t/--threads <threads>\n"
+        "           Max threads used by the multithreaded tasks (default: all the processor threads)\n"
+        "    -P/--stats\n"
+        "           Show the compressors and buffers allocations, and the compressors initialization time\n"
+        "    -B/--bench-codecs <file.json>\n"
+        "           Benchmark all the compressors and levels over the image cleaned streams, with and\n"
+        "           without seekable blocks (-p sectors per block). Use -e to test the extreme modes.\n"
+        "           The results are printed as a table and written to the JSON file.\n"
         "    -f/--force\n"
         "           Force to ovewrite the output file\n"
         "    -k/--keep-output\n"
@@ -1616,13 +7023,14 @@ void print_help() {
 
 
 static void summary(
-    std::vector<uint32_t> *sectors_type,
+    std::vector<uint64_t> *sectors_type,
+    encode_summary *encode_data,
     ecm_options *options,
     size_t compressed_size
 ) {
     uint16_t optimized_sector_sizes[13];
     // Reference to sectors_type
-    std::vector<uint32_t>& sectors_type_ref = *sectors_type;
+    std::vector<uint64_t>& sectors_type_ref = *sectors_type;
 
     // Calculate the size per sector type
     for (uint8_t i = 1; i < 13; i++) {
@@ -1637,7 +7045,7 @@ static void summary(
     }
 
     // Total sectors
-    uint32_t total_sectors = 0;
+    uint64_t total_sectors = 0;
     for (uint8_t i = 1; i < 13; i++) {
         total_sectors += sectors_type_ref[i];
     }
@@ -1660,23 +7068,175 @@ static void summary(
     fprintf(stdout, "------------------------------------------------------------\n");
     fprintf(stdout, " Type               Sectors         In Size        Out Size\n");
     fprintf(stdout, "------------------------------------------------------------\n");
-    fprintf(stdout, "CDDA ............... %6d ...... %6.2fMB ...... %6.2fMB\n", sectors_type_ref[1], MB(sectors_type_ref[1] * 2352), MB(sectors_type_ref[1] * optimized_sector_sizes[1])); 
-    fprintf(stdout, "CDDA Gap ........... %6d ...... %6.2fMB ...... %6.2fMB\n", sectors_type_ref[2], MB(sectors_type_ref[2] * 2352), MB(sectors_type_ref[2] * optimized_sector_sizes[2]));
-    fprintf(stdout, "Mode 1 ............. %6d ...... %6.2fMB ...... %6.2fMB\n", sectors_type_ref[3], MB(sectors_type_ref[3] * 2352), MB(sectors_type_ref[3] * optimized_sector_sizes[3]));
-    fprintf(stdout, "Mode 1 Gap ......... %6d ...... %6.2fMB ...... %6.2fMB\n", sectors_type_ref[4], MB(sectors_type_ref[4] * 2352), MB(sectors_type_ref[4] * optimized_sector_sizes[4]));
-    fprintf(stdout, "Mode 1 RAW ......... %6d ...... %6.2fMB ...... %6.2fMB\n", sectors_type_ref[5], MB(sectors_type_ref[5] * 2352), MB(sectors_type_ref[5] * optimized_sector_sizes[5]));
-    fprintf(stdout, "Mode 2 ............. %6d ...... %6.2fMB ...... %6.2fMB\n", sectors_type_ref[6], MB(sectors_type_ref[6] * 2352), MB(sectors_type_ref[6] * optimized_sector_sizes[6]));
-    fprintf(stdout, "Mode 2 Gap ......... %6d ...... %6.2fMB ...... %6.2fMB\n", sectors_type_ref[7], MB(sectors_type_ref[7] * 2352), MB(sectors_type_ref[7] * optimized_sector_sizes[7]));
-    fprintf(stdout, "Mode 2 XA1 ......... %6d ...... %6.2fMB ...... %6.2fMB\n", sectors_type_ref[8], MB(sectors_type_ref[8] * 2352), MB(sectors_type_ref[8] * optimized_sector_sizes[8]));
-    fprintf(stdout, "Mode 2 XA1 Gap ..... %6d ...... %6.2fMB ...... %6.2fMB\n", sectors_type_ref[9], MB(sectors_type_ref[9] * 2352), MB(sectors_type_ref[9] * optimized_sector_sizes[9]));
-    fprintf(stdout, "Mode 2 XA2 ......... %6d ...... %6.2fMB ...... %6.2fMB\n", sectors_type_ref[10], MB(sectors_type_ref[10] * 2352), MB(sectors_type_ref[10] * optimized_sector_sizes[10]));
-    fprintf(stdout, "Mode 2 XA2 Gap ..... %6d ...... %6.2fMB ...... %6.2fMB\n", sectors_type_ref[11], MB(sectors_type_ref[11] * 2352), MB(sectors_type_ref[11] * optimized_sector_sizes[11]));
-    fprintf(stdout, "Unknown data ....... %6d ...... %6.2fMB ...... %6.2fMB\n", sectors_type_ref[12], MB(sectors_type_ref[12] * 2352), MB(sectors_type_ref[12] * optimized_sector_sizes[12]));
+    fprintf(stdout, "CDDA ............... %6" PRIu64 " ...... %6.2fMB ...... %6.2fMB\n", sectors_type_ref[1], MB(sectors_type_ref[1] * 2352), MB(sectors_type_ref[1] * optimized_sector_sizes[1])); 
+    fprintf(stdout, "CDDA Gap ........... %6" PRIu64 " ...... %6.2fMB ...... %6.2fMB\n", sectors_type_ref[2], MB(sectors_type_ref[2] * 2352), MB(sectors_type_ref[2] * optimized_sector_sizes[2]));
+    fprintf(stdout, "Mode 1 ............. %6" PRIu64 " ...... %6.2fMB ...... %6.2fMB\n", sectors_type_ref[3], MB(sectors_type_ref[3] * 2352), MB(sectors_type_ref[3] * optimized_sector_sizes[3]));
+    fprintf(stdout, "Mode 1 Gap ......... %6" PRIu64 " ...... %6.2fMB ...... %6.2fMB\n", sectors_type_ref[4], MB(sectors_type_ref[4] * 2352), MB(sectors_type_ref[4] * optimized_sector_sizes[4]));
+    fprintf(stdout, "Mode 1 RAW ......... %6" PRIu64 " ...... %6.2fMB ...... %6.2fMB\n", sectors_type_ref[5], MB(sectors_type_ref[5] * 2352), MB(sectors_type_ref[5] * optimized_sector_sizes[5]));
+    fprintf(stdout, "Mode 2 ............. %6" PRIu64 " ...... %6.2fMB ...... %6.2fMB\n", sectors_type_ref[6], MB(sectors_type_ref[6] * 2352), MB(sectors_type_ref[6] * optimized_sector_sizes[6]));
+    fprintf(stdout, "Mode 2 Gap ......... %6" PRIu64 " ...... %6.2fMB ...... %6.2fMB\n", sectors_type_ref[7], MB(sectors_type_ref[7] * 2352), MB(sectors_type_ref[7] * optimized_sector_sizes[7]));
+    fprintf(stdout, "Mode 2 XA1 ......... %6" PRIu64 " ...... %6.2fMB ...... %6.2fMB\n", sectors_type_ref[8], MB(sectors_type_ref[8] * 2352), MB(sectors_type_ref[8] * optimized_sector_sizes[8]));
+    fprintf(stdout, "Mode 2 XA1 Gap ..... %6" PRIu64 " ...... %6.2fMB ...... %6.2fMB\n", sectors_type_ref[9], MB(sectors_type_ref[9] * 2352), MB(sectors_type_ref[9] * optimized_sector_sizes[9]));
+    fprintf(stdout, "Mode 2 XA2 ......... %6" PRIu64 " ...... %6.2fMB ...... %6.2fMB\n", sectors_type_ref[10], MB(sectors_type_ref[10] * 2352), MB(sectors_type_ref[10] * optimized_sector_sizes[10]));
+    fprintf(stdout, "Mode 2 XA2 Gap ..... %6" PRIu64 " ...... %6.2fMB ...... %6.2fMB\n", sectors_type_ref[11], MB(sectors_type_ref[11] * 2352), MB(sectors_type_ref[11] * optimized_sector_sizes[11]));
+    fprintf(stdout, "Unknown data ....... %6" PRIu64 " ...... %6.2fMB ...... %6.2fMB\n", sectors_type_ref[12], MB(sectors_type_ref[12] * 2352), MB(sectors_type_ref[12] * optimized_sector_sizes[12]));
     fprintf(stdout, "-------------------------------------------------------------\n");
-    fprintf(stdout, "Total .............. %6d ...... %6.2fMb ...... %6.2fMb\n", total_sectors, MB(total_size), MB(ecm_size));
+    fprintf(stdout, "Total .............. %6" PRIu64 " ...... %6.2fMb ...... %6.2fMb\n", total_sectors, MB(total_size), MB(ecm_size));
     fprintf(stdout, "ECM reduction (input vs ecm) ..................... %2.2f%%\n", (1.0 - ((float)ecm_size / total_size)) * 100);
     fprintf(stdout, "\n\n");
 
+    if (options->dedup) {
+        fprintf(stdout, " Deduplication Sumary\n");
+        fprintf(stdout, "-------------------------------------------------------------\n");
+        fprintf(stdout, "Deduplicated sectors ................... %6" PRIu64 "\n", encode_data->dedup_sectors);
+        fprintf(stdout, "Deduplicated size ...................... %3.2fMB\n", MB(encode_data->dedup_bytes));
+        fprintf(stdout, "Dedup ratio (ecm vs deduplicated) ...... %2.2f%%\n", ecm_size ? ((float)encode_data->dedup_bytes / ecm_size) * 100 : 0);
+        fprintf(stdout, "\n\n");
+    }
+
+    if (!options->reference_path.empty()) {
+        fprintf(stdout, " Reference Sumary\n");
+        fprintf(stdout, "-------------------------------------------------------------\n");
+        fprintf(stdout, "Sectors from reference ................. %6" PRIu64 "\n", encode_data->reference_sectors);
+        fprintf(stdout, "Size from reference .................... %3.2fMB\n", MB(encode_data->reference_bytes));
+        fprintf(stdout, "Reference ratio (ecm vs reference) ..... %2.2f%%\n", ecm_size ? ((float)encode_data->reference_bytes / ecm_size) * 100 : 0);
+        fprintf(stdout, "\n\n");
+    }
+
+    if (options->entropy_threshold > 0) {
+        fprintf(stdout, " Incompressible Data Sumary\n");
+        fprintf(stdout, "-------------------------------------------------------------\n");
+        fprintf(stdout, "Raw streams ............................ %6" PRIu64 "\n", encode_data->raw_streams);
+        fprintf(stdout, "Raw sectors ............................ %6" PRIu64 "\n", encode_data->raw_sectors);
+        fprintf(stdout, "\n\n");
+    }
+
+    if (options->second_pass) {
+        fprintf(stdout, " Second Pass Sumary\n");
+        fprintf(stdout, "-------------------------------------------------------------\n");
+        fprintf(stdout, "Recompressed streams ................... %6" PRIu64 "\n", encode_data->second_pass_streams);
+        fprintf(stdout, "Saved size ............................. %3.2fMB\n", MB(encode_data->second_pass_bytes));
+        fprintf(stdout, "\n\n");
+    }
+
+    if (options->target_speed > 0) {
+        fprintf(stdout, " Target Speed Sumary\n");
+        fprintf(stdout, "-------------------------------------------------------------\n");
+        fprintf(stdout, "Target speed ........................... %3.2fMB/s\n", options->target_speed);
+        if (encode_data->speed_time > 0) {
+            fprintf(stdout, "Real speed ............................. %3.2fMB/s\n", MB(total_size) / encode_data->speed_time);
+        }
+        fprintf(stdout, "Compressed blocks ...................... %6" PRIu64 "\n", encode_data->speed_blocks);
+        fprintf(stdout, "Level changes .......................... %6" PRIu64 "\n", encode_data->speed_level_changes);
+        fprintf(stdout, "LZ4 fallback blocks .................... %6" PRIu64 "\n", encode_data->speed_fallback_blocks);
+        if (encode_data->speed_blocks) {
+            fprintf(stdout, "Levels used ............................ %2u - %2u\n", encode_data->speed_min_level, encode_data->speed_max_level);
+        }
+        fprintf(stdout, "\n\n");
+    }
+
+    if (options->seekable_primer) {
+        fprintf(stdout, " Seekable Primer Sumary\n");
+        fprintf(stdout, "-------------------------------------------------------------\n");
+        fprintf(stdout, "Primer size ............................ %6" PRIu32 "KB\n", options->seekable_primer);
+        fprintf(stdout, "Primed streams ......................... %6" PRIu64 "\n", encode_data->primed_streams);
+        fprintf(stdout, "\n\n");
+    }
+
+    if (options->solid) {
+        fprintf(stdout, " Solid Compression Sumary\n");
+        fprintf(stdout, "-------------------------------------------------------------\n");
+        fprintf(stdout, "Solid contexts ......................... %6" PRIu64 "\n", encode_data->solid_contexts);
+        fprintf(stdout, "Solid streams .......................... %6" PRIu64 "\n", encode_data->solid_streams);
+        fprintf(stdout, "\n\n");
+    }
+
+    if (options->group_files) {
+        fprintf(stdout, " Files Grouping Sumary\n");
+        fprintf(stdout, "-------------------------------------------------------------\n");
+        fprintf(stdout, "Grouped files .......................... %6" PRIu64 "\n", encode_data->grouped_files);
+        fprintf(stdout, "Sectors order runs ..................... %6" PRIu64 "\n", encode_data->order_runs);
+        fprintf(stdout, "\n\n");
+    }
+
+    if (!options->store_path.empty()) {
+        fprintf(stdout, " Chunk Store Sumary\n");
+        fprintf(stdout, "-------------------------------------------------------------\n");
+        fprintf(stdout, "Chunks (total/new) ..................... %6" PRIu64 "/%" PRIu64 "\n", encode_data->store_chunks, encode_data->store_new_chunks);
+        fprintf(stdout, "Chunks size (total/new) ................ %3.2fMB/%3.2fMB\n", MB(encode_data->store_bytes), MB(encode_data->store_new_bytes));
+        fprintf(stdout, "\n\n");
+    }
+
+    fprintf(stdout, " Stream Classes Sumary\n");
+    fprintf(stdout, "----------------------------------------------------------------------\n");
+    fprintf(stdout, "Class           Sectors      In Size     Out Size     Ratio       Time\n");
+    fprintf(stdout, "----------------------------------------------------------------------\n");
+    const char *class_names[STSC_COUNT] = {"CDDA", "Data", "Mode 1", "Mode 2", "Form 1", "Form 2", "XA audio", "Video", "Raw"};
+    for (uint8_t i = 0; i < STSC_COUNT; i++) {
+        if (!encode_data->class_sectors[i]) {
+            continue;
+        }
+        uint64_t class_size = encode_data->class_sectors[i] * 2352;
+        fprintf(
+            stdout,
+            "%-10s ... %8" PRIu64 " .. %7.2fMB .. %7.2fMB .. %5.2f%% .. %6.2fs\n",
+            class_names[i],
+            encode_data->class_sectors[i],
+            MB(class_size),
+            MB(encode_data->class_bytes[i]),
+            (1.0 - ((float)encode_data->class_bytes[i] / class_size)) * 100,
+            encode_data->class_time[i]
+        );
+    }
+    fprintf(stdout, "\n\n");
+
+    bool auto_codec = false;
+    for (uint8_t i = 0; i < STSC_COUNT; i++) {
+        auto_codec |= encode_data->auto_codecs[i].selected;
+    }
+    if (auto_codec) {
+        const char *codec_names[] = {"none", "zlib", "lzma", "lz4", "flac", "zstd"};
+        fprintf(stdout, " Auto Codec Sumary (predicted/real)\n");
+        fprintf(stdout, "---------------------------------------------------------------------------\n");
+        fprintf(stdout, "Class       Codec  Level  Samples        Ratio        Comp MB/s  Decomp MB/s\n");
+        fprintf(stdout, "---------------------------------------------------------------------------\n");
+        for (uint8_t i = 0; i < STSC_COUNT; i++) {
+            auto_codec_choice &choice = encode_data->auto_codecs[i];
+            if (!choice.selected) {
+                continue;
+            }
+
+            // The real results are only known if the class streams were not mixed with other classes
+            char real_ratio[16] = "-";
+            char real_speed[16] = "-";
+            char predicted_speed[16] = "-";
+            char predicted_decode_speed[16] = "-";
+            if (choice.compression != C_NONE) {
+                snprintf(predicted_speed, sizeof(predicted_speed), "%.1f", choice.compression_speed);
+                snprintf(predicted_decode_speed, sizeof(predicted_decode_speed), "%.1f", choice.decompression_speed);
+            }
+            if (encode_data->class_sectors[i]) {
+                uint64_t class_size = encode_data->class_sectors[i] * 2352;
+                snprintf(real_ratio, sizeof(real_ratio), "%.2f%%", (1.0 - ((double)encode_data->class_bytes[i] / class_size)) * 100);
+                snprintf(real_speed, sizeof(real_speed), "%.1f", MB(class_size) / std::max(encode_data->class_time[i], 1e-9));
+            }
+            fprintf(
+                stdout,
+                "%-10s  %-5s  %5d  %7" PRIu64 "  %5.2f%%/%-7s  %6s/%-6s  %11s\n",
+                class_names[i],
+                codec_names[choice.compression],
+                choice.level,
+                choice.sample_sectors,
+                (1.0 - choice.ratio) * 100,
+                real_ratio,
+                predicted_speed,
+                real_speed,
+                predicted_decode_speed
+            );
+        }
+        fprintf(stdout, "\n\n");
+    }
+
     fprintf(stdout, " Compression Sumary\n");
     fprintf(stdout, "-------------------------------------------------------------\n");
     fprintf(stdout, "Compressed size (output) ............... %3.2fMB\n", MB(compressed_size));
@@ -2,7 +2,7 @@
  */
 #define TITLE "ecmtool - Encoder/decoder for Error Code Modeler format, with advanced features"
 #define COPYR "Copyright (C) 2021 Daniel Carrasco"
-#define VERSI "3.0.0-alpha"
+#define VERSI "3.1.0-alpha"
 /* 
  * This program is free software: you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -21,11 +21,15 @@
 
 #include "banner.h"
 #include "sector_tools.h"
+#include "chunk_store.h"
+#include "iso9660.h"
+#include "zdict.h"
 #include <getopt.h>
 //#include <stdbool.h>
 #include <algorithm>
 //#include <stdexcept>
 #include <stdio.h>
+#include <cinttypes>
 //#include <stdlib.h>
 //#include <errno.h>
 //#include <time.h>
@@ -35,12 +39,58 @@
 #include <fstream>
 #include <iostream>
 #include <iomanip>
+#include <cmath>
+#include <sstream>
 #include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <filesystem>
 
 
 // Configurations
 #define SECTORS_PER_BLOCK 100
 #define BUFFER_SIZE 0x500000lu
+// Sectors sent to the compressor in every call. The batch must fit in the free output buffer space (25%)
+#define ENCODE_BATCH_SECTORS 256
+
+// Chunk store sectors per chunk. The chunks are cutted at content defined points
+#define STORE_CHUNK_MIN_SECTORS 16
+#define STORE_CHUNK_MAX_SECTORS 256
+#define STORE_CHUNK_CUT_MASK 0x3F
+
+// Compression dictionaries size and the max size of the samples used to train them
+#define DICTIONARY_SIZE 112640
+#define DICTIONARY_MAX_SAMPLES_SIZE 0x8000000
+
+// FLAC audio streams are splitted in segments which are compressed in parallel. A new segment is
+// started at the audio gaps after the min size, or at the max size if there are no gaps
+#define AUDIO_SEGMENT_MIN_SECTORS 2250
+#define AUDIO_SEGMENT_MAX_SECTORS 9000
+
+// The XA audio streams shorter than this are joined to the video or data streams around them, to avoid a lot of
+// tiny streams when the XA audio is interleaved with other data (like the STR videos)
+#define XA_STREAM_MIN_SECTORS 32
+
+// The automatic codec selection compress these sample windows of every stream class with every candidate
+#define AUTO_CODEC_WINDOWS 8
+#define AUTO_CODEC_WINDOW_SECTORS 256
+
+// The data entropy is estimated in blocks of this size. The blocks over the entropy threshold are stored without
+// compression, if there are enough of them together to be worth a new stream.
+#define ENTROPY_BLOCK_SECTORS 16
+#define ENTROPY_MIN_SECTORS 64
+
+// With a target speed the compression level is adjusted after every block of this size, using the speed
+// measured in the previous blocks
+#define TARGET_SPEED_BLOCK_SECTORS 2048
+
+// Batches of cleaned sectors waiting in the queue of every profile. The shared reader waits for the slowest
+// profile when its queue is full.
+#define PROFILE_QUEUE_BATCHES 8
 
 // MB Macro
 #define MB(x) ((float)(x) / 1024 / 1024)
@@ -76,15 +126,23 @@ typedef unsigned __int32 uint32_t;
 // Streams and sectors structs
 #pragma pack(push, 1)
 struct stream {
-    uint8_t type : 1;
+    uint8_t type;
     uint8_t compression : 3;
-    uint32_t end_sector = 0;
-    uint32_t out_end_position = 0;
+    uint8_t filter : 2;
+    // The stream continues the compression context of the previous streams with the same class and codec
+    uint8_t solid : 1;
+    // The stream compression dictionary is the data of the previous stream (the primer), so every seekable block
+    // starts with that history. It's decoded once and kept by the readers.
+    uint8_t primed : 1;
+    uint64_t end_sector = 0;
+    uint64_t out_end_position = 0;
+    // Compression level used at the stream start. It's not required to decode it.
+    uint8_t level = 0;
 };
 
 struct sector {
     uint8_t mode : 4;
-    uint32_t sector_count = 0;
+    uint64_t sector_count = 0;
 };
 
 struct block_header {
@@ -106,6 +164,15 @@ struct ecm_header {
     uint64_t streams_toc_pos;
     uint64_t sectors_toc_pos;
     uint64_t ecm_data_pos;
+    uint64_t dedup_toc_pos;
+    uint64_t chunks_toc_pos;
+    uint64_t reference_toc_pos;
+    uint32_t reference_edc;
+    uint64_t reference_sectors;
+    uint32_t dictionary_id;
+    uint64_t dictionary_toc_pos;
+    uint64_t order_toc_pos;
+    uint64_t levels_toc_pos;
     uint8_t title_length;
     uint8_t id_length;
     std::string title;
@@ -113,6 +180,52 @@ struct ecm_header {
 };
 
 struct sec_str_size {
+    sector_tools_compression compression;
+    uint64_t count;
+    uint64_t uncompressed_size;
+    uint64_t compressed_size;
+};
+
+// Run of sectors which are a copy of a previous run of the same image (or of the reference image).
+// Also used by the files grouping, where the reference is the sector position in the image.
+struct dedup_run {
+    uint64_t start_sector;
+    uint64_t sector_count;
+    uint64_t reference_sector;
+};
+
+// Compression level changed by the target speed controller in the middle of a stream. The first sector
+// is in the encoding order. It's not required to decode the stream.
+struct level_change {
+    uint64_t start_sector;
+    uint8_t level;
+};
+
+// ECM2v3 structs with 32 bits sizes. Only used to read the old files.
+struct stream_v3 {
+    uint8_t type : 1;
+    uint8_t compression : 3;
+    uint32_t end_sector = 0;
+    uint32_t out_end_position = 0;
+};
+
+struct sector_v3 {
+    uint8_t mode : 4;
+    uint32_t sector_count = 0;
+};
+
+struct ecm_header_v3 {
+    uint8_t optimizations;
+    uint8_t sectors_per_block;
+    uint64_t crc_mode;
+    uint64_t streams_toc_pos;
+    uint64_t sectors_toc_pos;
+    uint64_t ecm_data_pos;
+    uint8_t title_length;
+    uint8_t id_length;
+};
+
+struct sec_str_size_v3 {
     sector_tools_compression compression;
     uint32_t count;
     uint32_t uncompressed_size;
@@ -120,10 +233,152 @@ struct sec_str_size {
 };
 #pragma pack(pop)
 
+// Codec chosen by the automatic selection for a stream class, and the results predicted by the samples
+struct auto_codec_choice {
+    bool selected = false;
+    sector_tools_compression compression = C_NONE;
+    int32_t level = 0;
+    uint64_t sample_sectors = 0;
+    double ratio = 0;
+    double compression_speed = 0;
+    double decompression_speed = 0;
+};
+
+// Encoding counters used in the summary
+struct encode_summary {
+    uint64_t dedup_sectors = 0;
+    uint64_t dedup_bytes = 0;
+    uint64_t store_chunks = 0;
+    uint64_t store_new_chunks = 0;
+    uint64_t store_bytes = 0;
+    uint64_t store_new_bytes = 0;
+    uint64_t reference_sectors = 0;
+    uint64_t reference_bytes = 0;
+    uint64_t grouped_files = 0;
+    uint64_t order_runs = 0;
+    uint64_t raw_streams = 0;
+    uint64_t raw_sectors = 0;
+    uint64_t second_pass_streams = 0;
+    uint64_t second_pass_bytes = 0;
+    uint64_t speed_blocks = 0;
+    uint64_t speed_level_changes = 0;
+    uint64_t speed_fallback_blocks = 0;
+    uint8_t speed_min_level = 0xFF;
+    uint8_t speed_max_level = 0;
+    double speed_time = 0;
+    uint64_t solid_contexts = 0;
+    uint64_t solid_streams = 0;
+    uint64_t primed_streams = 0;
+    // Input sectors, output size and encoding time of every stream class
+    uint64_t class_sectors[STSC_COUNT] = {};
+    uint64_t class_bytes[STSC_COUNT] = {};
+    double class_time[STSC_COUNT] = {};
+    auto_codec_choice auto_codecs[STSC_COUNT];
+};
+
 // Struct for script vector
 struct stream_script {
     stream stream_data;
     std::vector<sector> sectors_data;
+    uint8_t compression_level = 0;
+    // Cleaned bytes sent to the compressor, used by the second pass to decompress the stream
+    uint64_t data_size = 0;
+};
+
+// Objective of the automatic codec selection: the best ratio with a minimum encoding or decoding speed
+enum auto_codec_objectives : uint8_t {
+    ACO_NONE = 0,
+    ACO_ENCODE_SPEED,
+    ACO_DECODE_SPEED
+};
+
+// Compression context shared by all the streams of a class in solid mode. The encoder keeps the compressed data
+// in memory and writes it after the other streams, so every context is stored as one logical stream. The decoder
+// keeps its own input buffer and read position for every context.
+struct solid_context {
+    compressor *compobj = NULL;
+    uint8_t *buffer = NULL;
+    uint8_t level = 0;
+    uint32_t last_stream = 0;
+    std::vector<uint8_t> output;
+    uint64_t position = 0;
+};
+
+// State of the compression level controller used with a target speed. The level of every codec is adjusted
+// after every block, comparing its speed with the speed required to encode the rest of the image in time.
+struct speed_controller {
+    float target_speed = 0;
+    uint64_t total_bytes = 0;
+    uint64_t done_bytes = 0;
+    std::chrono::high_resolution_clock::time_point start_time;
+    int8_t level[8] = {-1, -1, -1, -1, -1, -1, -1, -1};
+    // The codec is replaced by LZ4 when it's too slow even with its fastest level
+    bool fallback[8] = {};
+    // Levels changed in the middle of the streams
+    std::vector<level_change> level_changes;
+};
+
+// Compression of a stream class. The classes without their own settings use the general options.
+struct class_codec {
+    bool enabled = false;
+    sector_tools_compression compression = C_NONE;
+    int16_t level = -1;     // -1 to use the general compression level
+    int8_t filter = -1;     // -1 to detect the executables (or use the XA model with --xa-model)
+};
+
+// Cleaned data of an audio segment waiting to be compressed, and its compressed output
+struct audio_segment {
+    uint32_t stream_index = 0;
+    int32_t compression_level = 0;
+    std::vector<uint8_t> data;
+    // Data shared with other segments, used instead of the own data when it's set (the second pass candidates)
+    const uint8_t *input = NULL;
+    std::vector<uint16_t> sectors_size;
+    std::vector<uint8_t> flush_modes;
+    std::vector<uint8_t> output;
+    compressor *compobj = NULL;
+    uint8_t *comp_buffer = NULL;
+    int8_t result = 0;
+};
+
+// Stream (or solid context) waiting to be compressed by the transcoder. The segment keeps the cleaned data, the
+// flush points and the output. The primed streams use their own dictionary, so their compressors are not shared.
+struct transcode_job {
+    audio_segment segment;
+    sector_tools_compression compression = C_NONE;
+    std::vector<uint32_t> streams;
+    bool primed = false;
+    std::vector<uint8_t> dictionary;
+};
+
+// Compressed data of a transcoded stream (or of a solid context) and its decompressor
+struct transcode_input {
+    compressor *decompobj = NULL;
+    bool primed = false;
+    std::vector<uint8_t> data;
+};
+
+// Transcoded images and streams, and the streams data size before and after
+struct transcode_summary {
+    uint64_t images = 0;
+    uint64_t streams = 0;
+    uint64_t in_size = 0;
+    uint64_t out_size = 0;
+};
+
+// Codec settings tested by the codecs benchmark and the results
+struct bench_result {
+    std::string stream;
+    sector_tools_compression mode = C_NONE;
+    int32_t level = 0;
+    uint8_t sectors_per_block = 0;
+    uint64_t size = 0;
+    uint64_t compressed_size = 0;
+    double compression_time = 0;
+    double decompression_time = 0;
+    size_t compression_memory = 0;
+    size_t decompression_memory = 0;
+    bool verified = false;
 };
 
 // Ecmify options struct
@@ -132,13 +387,47 @@ struct ecm_options {
     bool keep_output = false;
     sector_tools_compression data_compression = C_NONE;
     sector_tools_compression audio_compression = C_NONE;
+    sector_tools_compression xa_compression = C_NONE;
+    sector_tools_compression video_compression = C_NONE;
+    bool xa_model = false;
+    class_codec class_codecs[STSC_COUNT];
+    auto_codec_objectives auto_codec = ACO_NONE;
+    float auto_codec_speed = 0;
+    float entropy_threshold = 0;
+    uint32_t second_pass = 0;
+    float target_speed = 0;
+    bool solid = false;
+    bool group_files = false;
     uint8_t compression_level = 5;
     bool extreme_compression = false;
     bool seekable = false;
+    uint32_t seekable_primer = 0;
+    bool dedup = false;
     uint8_t sectors_per_block = SECTORS_PER_BLOCK;
     std::string in_filename;
     std::string out_filename;
     std::string image_title;
+    std::string store_path;
+    bool store_gc = false;
+    bool store_check = false;
+    std::vector<std::string> input_files;
+    std::string reference_path;
+    bool append = false;
+    int32_t image_index = -1;
+    int32_t delete_image = -1;
+    bool compact = false;
+    std::string dictionary_path;
+    bool dictionary_external = false;
+    std::string train_dictionary_path;
+    std::vector<uint8_t> dictionary;
+    uint32_t dictionary_id = 0;
+    uint32_t threads = 0;
+    bool stats = false;
+    std::string bench_codecs_path;
+    std::vector<std::string> profiles;
+    bool transcode = false;
+    bool verify = false;
+    compressor_pool *codecs_pool = NULL;
     optimization_options optimizations = (
         OO_REMOVE_SYNC |
         OO_REMOVE_MSF |
@@ -151,6 +440,57 @@ struct ecm_options {
     );
 };
 
+// Executable detected by the analyzer, and the sector where it ends. The executables are only detected in the
+// compressed streams, so every profile of a multi-profile encode keeps its own.
+struct executable_tracker {
+    sector_tools_filter filter = F_NONE;
+    uint64_t end_sector = 0;
+};
+
+// Batch of sectors cleaned by the shared reader of the profiles. It's shared by the queues of all the profiles,
+// so it's not modified after it's sent.
+struct sector_batch {
+    std::vector<uint8_t> data;
+    std::vector<uint16_t> sectors_size;
+    // Input CRC up to the last sector of the batch
+    uint32_t input_edc = 0;
+};
+
+// Bounded queue of cleaned batches between the shared reader and the encoder of a profile. The reader marks it
+// as finished (or failed) after the last batch, and the encoder marks it as stopped when it returns, so the
+// reader doesn't wait for it anymore.
+struct sector_queue {
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<std::shared_ptr<const sector_batch>> batches;
+    bool finished = false;
+    bool failed = false;
+    bool stopped = false;
+    // Batch which is being read by the encoder, and the position of the next sector
+    std::shared_ptr<const sector_batch> current;
+    size_t sector_index = 0;
+    size_t data_position = 0;
+};
+
+// Output profile of a multi-profile encode. Every profile has its own options, compressors and output
+struct profile_job {
+    ecm_options options;
+    compressor_pool codecs_pool;
+    // Streams built by the shared analyzer with the profile codecs, and the analysis data shared by all the
+    // profiles (the entropy of the blocks and the game ID)
+    std::vector<stream_script> streams_script;
+    executable_tracker executable;
+    const std::vector<float> *blocks_entropy = NULL;
+    const std::string *id = NULL;
+    // Cleaned sectors sent by the shared reader
+    sector_queue queue;
+    std::vector<uint64_t> sectors_type_sumary = std::vector<uint64_t>(13);
+    encode_summary encode_sumary;
+    uint64_t block_size = 0;
+    bool show_progress = false;
+    int return_code = 0;
+};
+
 // Return codes
 enum ecmtool_return_code {
     ECMTOOL_OK = 0,
@@ -184,13 +524,98 @@ int image_to_ecm_block(
     std::ifstream &in_file,
     std::fstream &out_file,
     ecm_options *options,
-    std::vector<uint32_t> *sectors_type_sumary
+    std::vector<uint64_t> *sectors_type_sumary,
+    encode_summary *encode_sumary,
+    profile_job *job = NULL
 );
 int ecm_block_to_image(
     std::ifstream &in_file,
     std::fstream &out_file,
+    ecm_options *options,
+    uint8_t file_version
+);
+int ecm_file_to_image(
+    std::ifstream &in_file,
+    std::fstream &out_file,
+    ecm_options *options
+);
+static ecmtool_return_code read_file_toc (
+    std::istream &in_file,
+    uint64_t &toc_position,
+    std::vector<blocks_toc> &file_blocks_toc,
+    uint8_t *file_version = NULL
+);
+static ecmtool_return_code write_file_toc (
+    std::iostream &out_file,
+    std::vector<blocks_toc> &file_blocks_toc
+);
+static int container_maintenance(
+    ecm_options *options
+);
+static int image_to_ecm_file(
+    std::ifstream &in_file,
+    std::fstream &out_file,
+    ecm_options *options,
+    std::vector<uint64_t> *sectors_type_sumary,
+    encode_summary *encode_sumary,
+    uint64_t &block_size,
+    profile_job *job = NULL
+);
+static int profiles_encode(
+    ecm_options *options
+);
+static ecmtool_return_code profiles_read (
+    sector_tools *sTools,
+    std::ifstream &in_file,
+    std::vector<stream_script> &streams_script,
+    std::vector<profile_job> &jobs,
     ecm_options *options
 );
+static void sector_queue_push(
+    sector_queue &queue,
+    std::shared_ptr<const sector_batch> batch
+);
+static ecmtool_return_code sector_queue_pop(
+    sector_queue &queue,
+    uint8_t *sector_data,
+    uint16_t &output_size,
+    uint32_t &input_edc,
+    std::chrono::high_resolution_clock::duration &waited
+);
+static void sector_queue_close(
+    sector_queue &queue,
+    bool failed
+);
+static void sector_queue_stop(
+    sector_queue &queue
+);
+static int transcode_file(
+    ecm_options *options
+);
+static ecmtool_return_code transcode_block (
+    std::ifstream &in_file,
+    std::fstream &out_file,
+    ecm_options *options,
+    transcode_summary *transcode_sumary
+);
+static ecmtool_return_code transcode_jobs_write (
+    std::fstream &out_file,
+    std::vector<transcode_job> &jobs,
+    std::vector<stream_script> &streams_script,
+    std::vector<uint8_t> &dictionary,
+    ecm_options *options,
+    uint64_t ecm_block_start_position
+);
+static void profile_encode(
+    profile_job *job
+);
+static ecmtool_return_code reference_open (
+    ecm_options *options,
+    std::fstream &base_file,
+    std::string &base_filename,
+    uint32_t &base_edc,
+    uint64_t &base_sectors
+);
 int write_block_header(
     std::fstream &out_file,
     block_header *block_header
@@ -204,21 +629,144 @@ static ecmtool_return_code disk_analyzer (
     std::ifstream &in_file,
     size_t image_file_size,
     std::vector<stream_script> &streams_script,
+    std::vector<dedup_run> &sectors_order,
+    std::vector<float> &blocks_entropy,
     ecm_header *ecm_data_header,
+    ecm_options *options,
+    std::vector<profile_job> *jobs = NULL
+);
+static void analyzer_sector_add (
+    sector_tools *sTools,
+    std::vector<stream_script> &streams_script,
+    executable_tracker &executable,
+    uint8_t *in_sector,
+    sector_tools_types detected_type,
+    sector_tools_stream_classes sector_class,
+    uint64_t current_sector,
+    ecm_options *options
+);
+static void analyzer_streams_join (
+    std::vector<stream_script> &streams_script,
+    ecm_options *options
+);
+static void entropy_split (
+    std::vector<stream_script> &streams_script,
+    std::vector<float> &blocks_entropy,
+    ecm_options *options,
+    encode_summary *encode_data
+);
+static void primer_split (
+    std::vector<stream_script> &streams_script,
+    ecm_options *options,
+    encode_summary *encode_data
+);
+static void speed_level_range (
+    sector_tools_compression compression,
+    int8_t &min_level,
+    int8_t &max_level
+);
+static void speed_control_level (
+    speed_controller *controller,
+    sector_tools_compression compression,
+    uint8_t configured_level,
+    sector_tools_compression &block_compression,
+    uint8_t &block_level
+);
+static void speed_control_count (
+    encode_summary *encode_data,
+    bool fallback,
+    uint8_t level
+);
+static void speed_control_update (
+    speed_controller *controller,
+    sector_tools_compression compression,
+    uint64_t block_bytes,
+    double block_time,
+    encode_summary *encode_data
+);
+static ecmtool_return_code second_pass (
+    std::fstream &out_file,
+    std::vector<stream_script> &streams_script,
+    ecm_options *options,
+    encode_summary *encode_data,
+    uint64_t ecm_block_start_position,
+    uint64_t streams_start_position
+);
+static ecmtool_return_code files_order (
+    std::ifstream &in_file,
+    uint64_t sectors_count,
+    std::vector<dedup_run> &sectors_order,
+    encode_summary *encode_data
+);
+static uint8_t summary_class (
+    stream &stream_data
+);
+static class_codec class_policy (
+    sector_tools_stream_classes stream_class,
+    ecm_options *options
+);
+static ecmtool_return_code auto_codec_select (
+    sector_tools *sTools,
+    std::ifstream &in_file,
+    std::vector<stream_script> &streams_script,
+    std::vector<dedup_run> &sectors_order,
+    ecm_options *options,
+    encode_summary *encode_data
+);
+static int parse_class_codecs (
+    const char *argument,
+    ecm_options *options
+);
+static ecmtool_return_code write_toc (
+    std::fstream &out_file,
+    uint8_t *toc_data,
+    uint64_t toc_count,
+    uint32_t toc_entry_size
+);
+static ecmtool_return_code read_toc (
+    std::ifstream &in_file,
+    std::vector<uint8_t> &toc_data,
+    uint64_t &toc_count,
+    uint32_t toc_entry_size,
+    uint8_t file_version
+);
+static ecmtool_return_code read_manifest_chunks (
+    std::string filename,
+    std::unordered_set<std::string, chunk_hash_key> &live_chunks
+);
+static int store_maintenance(
+    ecm_options *options
+);
+static ecmtool_return_code dictionary_load (
+    ecm_options *options
+);
+static uint32_t dictionary_get_id (
+    std::vector<uint8_t> &dictionary
+);
+static int bench_codec(
+    std::vector<uint8_t> &data,
+    std::vector<uint16_t> &sectors_size,
+    bench_result &result,
+    uint32_t threads
+);
+static int bench_codecs(
+    ecm_options *options
+);
+static int train_dictionary(
     ecm_options *options
 );
 int compress_header (
     uint8_t *dest,
-    uint32_t &destLen,
+    uint64_t &destLen,
     uint8_t *source,
-    uint32_t sourceLen,
+    uint64_t sourceLen,
     int level
 );
 int decompress_header (
     uint8_t *dest,
-    uint32_t &destLen,
+    uint64_t &destLen,
     uint8_t *source,
-    uint32_t sourceLen
+    uint64_t sourceLen
 );
 static ecmtool_return_code task_maker (
     stream *streams_toc,
@@ -238,32 +786,82 @@ static ecmtool_return_code task_to_sectors_header (
     std::vector<stream_script> &streams_script
 );
 
+static ecmtool_return_code compress_flush (
+    compressor *compobj,
+    uint8_t *comp_buffer,
+    std::fstream &out_file,
+    uint8_t flush_mode
+);
 static ecmtool_return_code disk_encode (
     sector_tools *sTools,
     std::ifstream &in_file,
     std::fstream &out_file,
     std::vector<stream_script> &streams_script,
+    std::vector<dedup_run> &dedup_runs,
+    std::vector<chunk_ref> &chunk_refs,
+    chunk_store *store,
+    std::vector<dedup_run> &reference_runs,
+    std::vector<dedup_run> &sectors_order,
+    std::fstream *base_file,
+    uint64_t base_sectors,
     ecm_options *options,
-    std::vector<uint32_t> *sectors_type,
-    uint64_t ecm_block_start_position
+    std::vector<uint64_t> *sectors_type,
+    encode_summary *encode_data,
+    speed_controller *controller,
+    uint64_t ecm_block_start_position,
+    sector_queue *queue
 );
 static ecmtool_return_code disk_decode (
     sector_tools *sTools,
     std::ifstream &in_file,
     std::fstream &out_file,
     std::vector<stream_script> &streams_script,
+    std::vector<dedup_run> &dedup_runs,
+    chunk_reader *store_reader,
+    std::vector<dedup_run> &reference_runs,
+    std::vector<dedup_run> &sectors_order,
+    std::fstream *base_file,
+    std::vector<uint8_t> &dictionary,
     ecm_options *options,
     uint64_t ecm_block_start_position
 );
+static void audio_segment_compress (
+    audio_segment *segment
+);
+static ecmtool_return_code audio_segments_write (
+    std::fstream &out_file,
+    std::vector<audio_segment> &segments,
+    std::vector<stream_script> &streams_script,
+    compressor_pool *codecs_pool,
+    uint64_t ecm_block_start_position
+);
+static bool dedup_confirm (
+    sector_tools *sTools,
+    std::istream &in_file,
+    uint64_t reference_sector,
+    sector_tools_types type,
+    uint8_t *sector_data,
+    uint16_t sector_data_size,
+    ecm_options *options
+);
+static bool run_lookup (
+    std::vector<dedup_run> &runs,
+    uint64_t &current_run,
+    uint64_t sector,
+    uint64_t &reference_sector
+);
 static void resetcounter(uint64_t total);
 static void encode_progress(void);
 static void decode_progress(void);
+static void transcode_progress(void);
 static void setcounter_analyze(uint64_t n);
 static void setcounter_encode(uint64_t n);
 static void setcounter_decode(uint64_t n);
+static void setcounter_transcode(uint64_t n);
 
 static void summary (
-    std::vector<uint32_t> *sectors_type,
+    std::vector<uint64_t> *sectors_type,
+    encode_summary *encode_data,
     ecm_options *options,
     size_t compressed_size
 );
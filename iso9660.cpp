@@ -0,0 +1,179 @@
+/*******************************************************************************
+ *
+ * Created by Daniel Carrasco at https://www.electrosoftcloud.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+
+#include <algorithm>
+#include "iso9660.h"
+
+iso9660::iso9660(std::ifstream &image_file, uint64_t image_sectors) : image(image_file) {
+    sectors_count = image_sectors;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Read the directory tree starting at the primary volume descriptor
+//
+// Returns nonzero on error or if the image doesn't contain an ISO9660 filesystem
+//
+int8_t iso9660::read() {
+    uint8_t data[0x800];
+
+    files.clear();
+    visited_directories.clear();
+
+    if (sectors_count <= ISO9660_PVD_SECTOR || read_sector(ISO9660_PVD_SECTOR, data)) {
+        return IR_NOT_ISO9660;
+    }
+
+    // Primary volume descriptor type and identifier
+    if (data[0] != 1 || memcmp(data + 1, "CD001", 5) != 0) {
+        return IR_NOT_ISO9660;
+    }
+
+    // Root directory record
+    uint8_t* root = data + 0x9C;
+    uint64_t root_sector = (uint64_t)root[2] | ((uint64_t)root[3] << 8) | ((uint64_t)root[4] << 16) | ((uint64_t)root[5] << 24);
+    uint64_t root_size = (uint64_t)root[10] | ((uint64_t)root[11] << 8) | ((uint64_t)root[12] << 16) | ((uint64_t)root[13] << 24);
+
+    int8_t return_code = read_directory(root_sector, root_size, "", 0);
+
+    // The image is restored to the first sector for the next processes
+    image.clear();
+    image.seekg(0, std::ios_base::beg);
+
+    return return_code;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Read the user data of a Mode 1 or Mode 2 Form 1 sector
+//
+// Returns nonzero on error
+//
+int8_t iso9660::read_sector(uint64_t sector, uint8_t* data) {
+    uint8_t raw_sector[2352];
+
+    if (sector >= sectors_count) {
+        return IR_READ_ERROR;
+    }
+
+    image.seekg(sector * 2352, std::ios_base::beg);
+    image.read(reinterpret_cast<char*>(raw_sector), 2352);
+    if (!image.good()) {
+        return IR_READ_ERROR;
+    }
+
+    // The sync bytes are checked to discard the audio sectors
+    if (memcmp(raw_sector, "\x00\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF\x00", 12) != 0) {
+        return IR_READ_ERROR;
+    }
+
+    switch (raw_sector[0x0F]) {
+        case 1:
+            memcpy(data, raw_sector + 0x10, 0x800);
+            break;
+
+        case 2:
+            memcpy(data, raw_sector + 0x18, 0x800);
+            break;
+
+        default:
+            return IR_READ_ERROR;
+    }
+
+    return IR_OK;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Read the records of a directory and all its subdirectories
+//
+// Returns nonzero on error
+//
+int8_t iso9660::read_directory(uint64_t sector, uint64_t size, std::string path, uint32_t depth) {
+    uint8_t data[0x800];
+
+    // The damaged images can contain loops in the directory tree
+    if (depth > ISO9660_MAX_DEPTH || !visited_directories.insert(sector).second) {
+        return IR_OK;
+    }
+
+    uint64_t directory_sectors = (size + 0x7FF) / 0x800;
+    for (uint64_t i = 0; i < directory_sectors; i++) {
+        if (read_sector(sector + i, data)) {
+            return IR_READ_ERROR;
+        }
+
+        // The records don't cross the sectors boundaries. The rest of the sector is zeroed.
+        uint16_t position = 0;
+        while (position + 0x21 <= 0x800 && data[position]) {
+            uint8_t* record = data + position;
+            uint8_t record_length = record[0];
+            uint8_t name_length = record[0x20];
+            if (record_length < 0x21 || position + record_length > 0x800 || 0x21 + name_length > record_length) {
+                break;
+            }
+            position += record_length;
+
+            // Current and parent directories
+            if (name_length == 1 && (record[0x21] == 0 || record[0x21] == 1)) {
+                continue;
+            }
+
+            uint64_t file_sector = (uint64_t)record[2] | ((uint64_t)record[3] << 8) | ((uint64_t)record[4] << 16) | ((uint64_t)record[5] << 24);
+            uint64_t file_size = (uint64_t)record[10] | ((uint64_t)record[11] << 8) | ((uint64_t)record[12] << 16) | ((uint64_t)record[13] << 24);
+            std::string name(reinterpret_cast<char*>(record + 0x21), name_length);
+
+            if (record[0x19] & 0x02) {
+                if (read_directory(file_sector, file_size, path + name + "/", depth + 1)) {
+                    return IR_READ_ERROR;
+                }
+                continue;
+            }
+
+            // The file version is not part of the name
+            size_t version_position = name.find(';');
+            if (version_position != std::string::npos) {
+                name.resize(version_position);
+            }
+
+            iso9660_file file;
+            file.path = path + name;
+            size_t extension_position = name.rfind('.');
+            if (extension_position != std::string::npos) {
+                file.extension = name.substr(extension_position + 1);
+                std::transform(file.extension.begin(), file.extension.end(), file.extension.begin(), ::toupper);
+            }
+            // The files outside the image (or in other sessions) are ignored
+            file.start_sector = file_sector;
+            file.sector_count = (file_size + 0x7FF) / 0x800;
+            if (!file.sector_count || file.start_sector >= sectors_count) {
+                continue;
+            }
+            file.sector_count = std::min(file.sector_count, sectors_count - file.start_sector);
+
+            files.push_back(file);
+        }
+    }
+
+    return IR_OK;
+}
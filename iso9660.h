@@ -0,0 +1,82 @@
+/*******************************************************************************
+ *
+ * Created by Daniel Carrasco at https://www.electrosoftcloud.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ ******************************************************************************/
+
+
+
+//////////////////////////////////////////////////////////////////
+//
+// ISO9660 reader class
+//
+// Reads the ISO9660 (and CD-XA) directory tree of a CD image to know which sectors
+// belong to every file. Only the directories are read, never the files data.
+//
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <unordered_set>
+
+// Primary volume descriptor sector
+#define ISO9660_PVD_SECTOR 16
+// Max directories depth, to avoid loops in damaged images
+#define ISO9660_MAX_DEPTH 64
+
+//
+// Return codes of the class methods
+//
+enum iso9660_returns : int8_t {
+    IR_OK = 0,
+    IR_READ_ERROR = -1,
+    IR_NOT_ISO9660 = -2
+};
+
+// File extent in the image
+struct iso9660_file {
+    std::string path;
+    std::string extension;
+    uint64_t start_sector = 0;
+    uint64_t sector_count = 0;
+};
+
+//
+// iso9660 Class
+//
+class iso9660 {
+    public:
+        // Public methods
+        iso9660(std::ifstream &image_file, uint64_t image_sectors);
+
+        int8_t read();
+
+        // Public attributes
+        std::vector<iso9660_file> files;
+
+    private:
+        // Private methods
+        int8_t read_sector(uint64_t sector, uint8_t* data);
+        int8_t read_directory(uint64_t sector, uint64_t size, std::string path, uint32_t depth);
+
+        // Private attributes
+        std::ifstream &image;
+        uint64_t sectors_count;
+        std::unordered_set<uint64_t> visited_directories;
+};
@@ -17,6 +17,7 @@
  *
  ******************************************************************************/
 
+#include <algorithm>
 #include "sector_tools.h"
 
 sector_tools::sector_tools() {
@@ -151,6 +152,110 @@ sector_tools_stream_types sector_tools::detect_stream(sector_tools_types type) {
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+// Detects the stream class using the sector type and the Mode 2 subheader
+sector_tools_stream_classes sector_tools::detect_stream_class(uint8_t* sector, sector_tools_types type) {
+    // XA-ADPCM audio sectors are Form 2 sectors with the audio bit set in the submode
+    // (the real time bit is not checked because some discs don't set it)
+    if (
+        (type == STT_MODE2_2 || type == STT_MODE2_2_GAP) &&
+        (sector[0x12] & 0x24) == 0x24 &&
+        !(sector[0x12] & 0x0A)
+    ) {
+        return STSC_XA_AUDIO;
+    }
+
+    // MDEC video sectors (STR files) have the video bit set in the submode, or start with the
+    // video chunk header (0x0160 status and 0x8001 MDEC chunk type)
+    if (
+        (
+            type == STT_MODE2_1 ||
+            type == STT_MODE2_1_GAP ||
+            type == STT_MODE2_2 ||
+            type == STT_MODE2_2_GAP
+        ) &&
+        (
+            (sector[0x12] & 0x02) ||
+            memcmp(sector + 0x18, "\x60\x01\x01\x80", 4) == 0
+        )
+    ) {
+        return STSC_VIDEO;
+    }
+
+    switch (type) {
+        case STT_CDDA:
+        case STT_CDDA_GAP:
+            return STSC_CDDA;
+
+        case STT_MODE1:
+        case STT_MODE1_GAP:
+            return STSC_MODE1;
+
+        case STT_MODE2:
+        case STT_MODE2_GAP:
+            return STSC_MODE2;
+
+        case STT_MODE2_1:
+        case STT_MODE2_1_GAP:
+            return STSC_FORM1;
+
+        case STT_MODE2_2:
+        case STT_MODE2_2_GAP:
+            return STSC_FORM2;
+
+        // Mode 1 sectors with wrong EDC/ECC and unknown modes
+        default:
+            return STSC_RAW;
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Adds the user data bytes of the sector to a bytes histogram, used to estimate the data entropy.
+// The sync, header, subheader and EDC/ECC are not counted because they are removed by the encoder.
+uint16_t sector_tools::payload_histogram(uint8_t* sector, sector_tools_types type, uint32_t* histogram) {
+    uint16_t offset = 0;
+    uint16_t size = 0;
+
+    switch (type) {
+        case STT_CDDA:
+            size = 2352;
+            break;
+
+        case STT_MODE1:
+        case STT_MODE1_RAW:
+            offset = 0x10;
+            size = 0x800;
+            break;
+
+        case STT_MODE2:
+            offset = 0x10;
+            size = 0x920;
+            break;
+
+        case STT_MODE2_1:
+            offset = 0x18;
+            size = 0x800;
+            break;
+
+        case STT_MODE2_2:
+            offset = 0x18;
+            size = 0x914;
+            break;
+
+        // The gaps are removed and the unknown sectors are stored as they are
+        default:
+            return 0;
+    }
+
+    for (uint16_t i = 0; i < size; i++) {
+        histogram[sector[offset + i]]++;
+    }
+
+    return size;
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 // Detects if sectors are zeroed (GAP)
 bool sector_tools::is_gap(uint8_t *sector, uint16_t length) {
@@ -1230,4 +1335,336 @@ int8_t sector_tools::encoded_sector_size(
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Executables detection and branch filters
+//
+// The executables are detected by their header at the start of a sector (the ISO9660 files are
+// sector aligned). The branch filters convert the relative branches addresses to absolute, so
+// repeated calls to the same function are the same bytes. Every filtered block is processed
+// separately and only the instructions fully inside the block are converted, so the encoder and
+// the decoder must use the same blocks and positions.
+//
+
+// Max executable size. Bigger sizes are considered wrong headers.
+#define EXECUTABLE_MAX_SIZE 0x4000000
+
+static uint16_t get16lsb(const uint8_t* src) {
+    return (((uint16_t)(src[0])) << 0) | (((uint16_t)(src[1])) << 8);
+}
+
+sector_tools_filter sector_tools::detect_executable(
+    uint8_t* sector,
+    sector_tools_types type,
+    uint64_t& executable_size
+) {
+    uint8_t* data;
+    executable_size = 0;
+
+    // Only the sectors with 2048 bytes of user data can contain a file header
+    switch (type) {
+        case STT_MODE1:
+            data = sector + 0x10;
+            break;
+
+        case STT_MODE2_1:
+            data = sector + 0x18;
+            break;
+
+        default:
+            return F_NONE;
+    }
+
+    // PlayStation executable. The text size doesn't include the 2048 bytes header.
+    if (memcmp(data, "PS-X EXE", 8) == 0) {
+        executable_size = 0x800 + (uint64_t)get32lsb(data + 0x1C);
+        if (executable_size > 0x800 && executable_size <= EXECUTABLE_MAX_SIZE) {
+            return F_MIPS;
+        }
+        return F_NONE;
+    }
+
+    // Little endian ELF executables. The size is the end of the farthest segment or sections table.
+    if (memcmp(data, "\x7F" "ELF", 4) == 0 && data[5] == 1) {
+        uint16_t machine = get16lsb(data + 0x12);
+        sector_tools_filter filter = F_NONE;
+        if (machine == 8 || machine == 10) {
+            filter = F_MIPS;
+        }
+        else if (machine == 3 || machine == 62) {
+            filter = F_X86;
+        }
+        else {
+            return F_NONE;
+        }
+
+        bool elf64 = data[4] == 2;
+        uint64_t program_offset = elf64 ? get32lsb(data + 0x20) : get32lsb(data + 0x1C);
+        uint64_t sections_offset = elf64 ? get32lsb(data + 0x28) : get32lsb(data + 0x20);
+        uint16_t program_entry = get16lsb(data + (elf64 ? 0x36 : 0x2A));
+        uint16_t program_count = get16lsb(data + (elf64 ? 0x38 : 0x2C));
+        uint16_t section_entry = get16lsb(data + (elf64 ? 0x3A : 0x2E));
+        uint16_t section_count = get16lsb(data + (elf64 ? 0x3C : 0x30));
+
+        executable_size = sections_offset + (uint64_t)section_entry * section_count;
+        for (uint16_t i = 0; i < program_count; i++) {
+            uint64_t entry = program_offset + (uint64_t)i * program_entry;
+            if (entry + (elf64 ? 0x28 : 0x14) > 0x800) {
+                break;
+            }
+            uint64_t segment_end = elf64 ?
+                (uint64_t)get32lsb(data + entry + 0x08) + get32lsb(data + entry + 0x20) :
+                (uint64_t)get32lsb(data + entry + 0x04) + get32lsb(data + entry + 0x10);
+            executable_size = std::max(executable_size, segment_end);
+        }
+
+        if (executable_size && executable_size <= EXECUTABLE_MAX_SIZE) {
+            return filter;
+        }
+        executable_size = 0;
+        return F_NONE;
+    }
+
+    // PE executables. The size is the end of the farthest section.
+    if (data[0] == 'M' && data[1] == 'Z') {
+        uint32_t pe_offset = get32lsb(data + 0x3C);
+        if (pe_offset > 0x800 - 0x18 || memcmp(data + pe_offset, "PE\0\0", 4) != 0) {
+            return F_NONE;
+        }
+
+        uint16_t machine = get16lsb(data + pe_offset + 0x04);
+        sector_tools_filter filter = F_NONE;
+        if (machine == 0x14C || machine == 0x8664) {
+            filter = F_X86;
+        }
+        else if (machine == 0x162 || machine == 0x166) {
+            filter = F_MIPS;
+        }
+        else {
+            return F_NONE;
+        }
+
+        uint16_t section_count = get16lsb(data + pe_offset + 0x06);
+        uint64_t sections_offset = pe_offset + 0x18 + get16lsb(data + pe_offset + 0x14);
+        for (uint16_t i = 0; i < section_count; i++) {
+            uint64_t entry = sections_offset + (uint64_t)i * 0x28;
+            if (entry + 0x28 > 0x800) {
+                break;
+            }
+            uint64_t section_end = (uint64_t)get32lsb(data + entry + 0x14) + get32lsb(data + entry + 0x10);
+            executable_size = std::max(executable_size, section_end);
+        }
+
+        if (executable_size && executable_size <= EXECUTABLE_MAX_SIZE) {
+            return filter;
+        }
+        executable_size = 0;
+        return F_NONE;
+    }
+
+    return F_NONE;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// x86 filter. The CALL and JMP addresses are converted to absolute if they look like a near
+// address (first byte 0x00 or 0xFF). The result is kept in the same range, so the decoder
+// converts exactly the same instructions.
+static void filter_x86(uint8_t* data, size_t size, uint64_t position, bool encode) {
+    if (size < 5) {
+        return;
+    }
+
+    for (size_t i = 0; i < size - 4; i++) {
+        if ((data[i] & 0xFE) != 0xE8) {
+            continue;
+        }
+        if (data[i + 4] == 0x00 || data[i + 4] == 0xFF) {
+            uint32_t address = sector_tools::get32lsb(data + i + 1);
+            uint32_t offset = (uint32_t)(position + i + 5);
+            address = encode ? address + offset : address - offset;
+            // Sign extension of the 25 bits address
+            address &= 0x01FFFFFF;
+            if (address & 0x01000000) {
+                address |= 0xFF000000;
+            }
+            sector_tools::put32lsb(data + i + 1, address);
+        }
+        i += 4;
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// MIPS filter. The jumps (J/JAL) are already absolute, so the relative conditional branches
+// (REGIMM, BEQ, BNE, BLEZ and BGTZ) are converted to absolute word addresses. The opcode is
+// not modified, so the decoder converts exactly the same instructions.
+static void filter_mips(uint8_t* data, size_t size, uint64_t position, bool encode) {
+    // The instructions are aligned to 4 bytes in the stream
+    size_t i = (4 - (position & 3)) & 3;
+
+    for (; i + 4 <= size; i += 4) {
+        uint32_t instruction = sector_tools::get32lsb(data + i);
+        uint8_t opcode = instruction >> 26;
+        if (opcode != 1 && (opcode < 4 || opcode > 7)) {
+            continue;
+        }
+
+        uint16_t word = (uint16_t)((position + i) >> 2) + 1;
+        uint16_t address = instruction & 0xFFFF;
+        address = encode ? address + word : address - word;
+        sector_tools::put32lsb(data + i, (instruction & 0xFFFF0000) | address);
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// XA-ADPCM model. Every Form 2 audio sector contains 18 sound groups of 128 bytes: 16 bytes with
+// the sound units parameters and 112 bytes of samples, with the sound units interleaved every 4
+// bytes. The parameters of all the groups are moved to the start of the sector, and the samples
+// are splitted by channel using the coding byte of the subheader: in the stereo sectors the even
+// sound units are the left channel and the odd ones the right channel (the two nibbles of every
+// byte with 4 bits samples), so the samples of every channel are stored together. The mono
+// samples are de-interleaved by sound unit in every group. It's just a permutation, and the
+// coding byte is not modified, so any sector can be converted and restored. The channel number
+// of the subheader is not used, because the channels are interleaved by sector and the filter
+// can't move the sectors.
+#define XA_ADPCM_GROUPS 18
+#define XA_ADPCM_GROUP_SIZE 0x80
+#define XA_ADPCM_PARAMETERS_SIZE 0x10
+#define XA_ADPCM_WORDS 28
+#define XA_ADPCM_CHANNEL_SIZE ((XA_ADPCM_GROUP_SIZE - XA_ADPCM_PARAMETERS_SIZE) / 2)
+
+static void filter_xa_adpcm(uint8_t* data, size_t size, optimization_options options, bool encode) {
+    // Position of the sector user data. Any other sector size (gaps) is not converted.
+    size_t header_size = (options & OO_REMOVE_SYNC ? 0 : 0x0C) +
+                         (options & OO_REMOVE_MSF ? 0 : 0x03) +
+                         (options & OO_REMOVE_MODE ? 0 : 0x01) +
+                         (options & OO_REMOVE_REDUNDANT_FLAG ? 0x04 : 0x08);
+    if (size != header_size + 0x914 + (options & OO_REMOVE_EDC ? 0 : 0x04)) {
+        return;
+    }
+
+    // The coding byte is the last subheader byte (or its copy), just before the sound groups
+    uint8_t coding = data[header_size - 1];
+    bool stereo = (coding & 0x03) == 0x01;
+    bool eight_bits = (coding & 0x30) == 0x10;
+
+    uint8_t* groups = data + header_size;
+    uint8_t converted[XA_ADPCM_GROUPS * XA_ADPCM_GROUP_SIZE];
+    // Sound groups in the sector order and in the model order
+    uint8_t* sector_groups = encode ? groups : converted;
+    uint8_t* model_groups = encode ? converted : groups;
+    uint8_t* model_samples = model_groups + XA_ADPCM_GROUPS * XA_ADPCM_PARAMETERS_SIZE;
+
+    for (uint8_t g = 0; g < XA_ADPCM_GROUPS; g++) {
+        uint8_t* parameters = sector_groups + g * XA_ADPCM_GROUP_SIZE;
+        uint8_t* words = parameters + XA_ADPCM_PARAMETERS_SIZE;
+        uint8_t* model_parameters = model_groups + g * XA_ADPCM_PARAMETERS_SIZE;
+        uint8_t* group_samples = model_samples + g * (XA_ADPCM_GROUP_SIZE - XA_ADPCM_PARAMETERS_SIZE);
+        uint8_t* left = model_samples + g * XA_ADPCM_CHANNEL_SIZE;
+        uint8_t* right = model_samples + (XA_ADPCM_GROUPS + g) * XA_ADPCM_CHANNEL_SIZE;
+
+        if (encode) {
+            memcpy(model_parameters, parameters, XA_ADPCM_PARAMETERS_SIZE);
+        }
+        else {
+            memcpy(parameters, model_parameters, XA_ADPCM_PARAMETERS_SIZE);
+        }
+
+        if (stereo && !eight_bits) {
+            // Every byte has a sample of the left (low nibble) and the right (high nibble) channels. Two
+            // consecutive samples of every channel are packed in a byte.
+            for (uint8_t b = 0; b < 4; b++) {
+                for (uint8_t w = 0; w < XA_ADPCM_WORDS; w += 2) {
+                    uint8_t &first = words[w * 4 + b];
+                    uint8_t &second = words[(w + 1) * 4 + b];
+                    uint8_t &left_pair = left[b * (XA_ADPCM_WORDS / 2) + w / 2];
+                    uint8_t &right_pair = right[b * (XA_ADPCM_WORDS / 2) + w / 2];
+                    if (encode) {
+                        left_pair = (first & 0x0F) | (second << 4);
+                        right_pair = (first >> 4) | (second & 0xF0);
+                    }
+                    else {
+                        first = (left_pair & 0x0F) | (right_pair << 4);
+                        second = (left_pair >> 4) | (right_pair & 0xF0);
+                    }
+                }
+            }
+            continue;
+        }
+
+        for (uint8_t b = 0; b < 4; b++) {
+            // The 8 bits stereo sound units alternate the left and the right channels
+            uint8_t* unit = group_samples + b * XA_ADPCM_WORDS;
+            if (stereo) {
+                unit = (b & 1 ? right : left) + (b >> 1) * XA_ADPCM_WORDS;
+            }
+            for (uint8_t w = 0; w < XA_ADPCM_WORDS; w++) {
+                if (encode) {
+                    unit[w] = words[w * 4 + b];
+                }
+                else {
+                    words[w * 4 + b] = unit[w];
+                }
+            }
+        }
+    }
+
+    memcpy(groups, converted, sizeof(converted));
+}
+
+
+void sector_tools::filter_encode(
+    sector_tools_filter filter,
+    uint8_t* data,
+    size_t size,
+    uint64_t position,
+    optimization_options options
+) {
+    switch (filter) {
+        case F_X86:
+            filter_x86(data, size, position, true);
+            break;
+
+        case F_MIPS:
+            filter_mips(data, size, position, true);
+            break;
+
+        case F_XA_ADPCM:
+            filter_xa_adpcm(data, size, options, true);
+            break;
+
+        default:
+            break;
+    }
+}
+
+
+void sector_tools::filter_decode(
+    sector_tools_filter filter,
+    uint8_t* data,
+    size_t size,
+    uint64_t position,
+    optimization_options options
+) {
+    switch (filter) {
+        case F_X86:
+            filter_x86(data, size, position, false);
+            break;
+
+        case F_MIPS:
+            filter_mips(data, size, position, false);
+            break;
+
+        case F_XA_ADPCM:
+            filter_xa_adpcm(data, size, options, false);
+            break;
+
+        default:
+            break;
+    }
+}
@@ -132,6 +132,33 @@ enum sector_tools_stream_types : uint8_t {
     STST_DATA
 };
 
+//
+// Stream classes. Every class can use its own compression, and the data classes with the same
+// compression are stored together in mixed data streams.
+//
+enum sector_tools_stream_classes : uint8_t {
+    STSC_CDDA = 0,
+    STSC_DATA,
+    STSC_MODE1,
+    STSC_MODE2,
+    STSC_FORM1,
+    STSC_FORM2,
+    STSC_XA_AUDIO,
+    STSC_VIDEO,
+    STSC_RAW,
+    STSC_COUNT
+};
+
+//
+// Branch filters applied to the executables before compress them
+//
+enum sector_tools_filter : uint8_t {
+    F_NONE = 0,
+    F_X86,
+    F_MIPS,
+    F_XA_ADPCM
+};
+
 //
 // Optimization options available
 //
@@ -163,6 +190,8 @@ class sector_tools {
         static void put32lsb(uint8_t* dest, uint32_t value);
         sector_tools_types detect(uint8_t* sector);
         static sector_tools_stream_types detect_stream(sector_tools_types type);
+        static sector_tools_stream_classes detect_stream_class(uint8_t* sector, sector_tools_types type);
+        static uint16_t payload_histogram(uint8_t* sector, sector_tools_types type, uint32_t* histogram);
         uint32_t edc_compute(
             uint32_t edc,
             const uint8_t* src,
@@ -321,6 +350,25 @@ class sector_tools {
             uint8_t* out,
             uint32_t sector_number
         );
+        static sector_tools_filter detect_executable(
+            uint8_t* sector,
+            sector_tools_types type,
+            uint64_t& executable_size
+        );
+        static void filter_encode(
+            sector_tools_filter filter,
+            uint8_t* data,
+            size_t size,
+            uint64_t position,
+            optimization_options options
+        );
+        static void filter_decode(
+            sector_tools_filter filter,
+            uint8_t* data,
+            size_t size,
+            uint64_t position,
+            optimization_options options
+        );
 
         // Public attributes
         int8_t last_sector_type = -1; 